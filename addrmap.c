@@ -208,6 +208,81 @@ static uint32_t hash_ip6(const struct in6_addr *addr6)
 	return h >> (32 - gcfg.hash_bits);
 }
 
+static uint32_t neg_hash4(const struct in_addr *addr4)
+{
+	return ((uint32_t)(addr4->s_addr *
+				gcfg.rand[4])) >> (32 - NEG_CACHE_BITS);
+}
+
+static uint32_t neg_hash6(const struct in6_addr *addr6)
+{
+	uint32_t h;
+	h = addr6->s6_addr32[0] + gcfg.rand[4];
+	h ^= addr6->s6_addr32[1] + gcfg.rand[5];
+	h ^= addr6->s6_addr32[2] + gcfg.rand[6];
+	h ^= addr6->s6_addr32[3] + gcfg.rand[7];
+	return (h * 0x9e3779b1U) >> (32 - NEG_CACHE_BITS);
+}
+
+/* Forget every negative cache entry. Called with map_mutex held. */
+static void neg_flush(void)
+{
+	__atomic_add_fetch(&gcfg.neg_gen, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Check the negative cache for a recent IPv4 miss
+ *
+ * Called with cache_mutex held.
+ */
+static int neg_find4(const struct in_addr *addr4)
+{
+	struct neg_entry4 *n = &gcfg.neg_table4[neg_hash4(addr4)];
+
+	return n->addr4.s_addr == addr4->s_addr && n->expires >= now &&
+		n->gen == __atomic_load_n(&gcfg.neg_gen, __ATOMIC_ACQUIRE);
+}
+
+static int neg_find6(const struct in6_addr *addr6, int dyn_alloc)
+{
+	struct neg_entry6 *n = &gcfg.neg_table6[neg_hash6(addr6)];
+
+	return IN6_ARE_ADDR_EQUAL(&n->addr6, addr6) && n->expires >= now &&
+		n->dyn_alloc >= dyn_alloc &&
+		n->gen == __atomic_load_n(&gcfg.neg_gen, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Remember a failed IPv4 lookup
+ *
+ * @param addr4 Address no map was found for
+ * @param gen gcfg.neg_gen from before the lookup, so an entry for a
+ * lookup which raced with a map change is already stale
+ */
+static void neg_insert4(const struct in_addr *addr4, uint32_t gen)
+{
+	struct neg_entry4 *n = &gcfg.neg_table4[neg_hash4(addr4)];
+
+	LOCK(&gcfg.cache_mutex);
+	n->addr4 = *addr4;
+	n->gen = gen;
+	n->expires = now + NEG_CACHE_TTL;
+	UNLOCK(&gcfg.cache_mutex);
+}
+
+static void neg_insert6(const struct in6_addr *addr6, int dyn_alloc,
+		uint32_t gen)
+{
+	struct neg_entry6 *n = &gcfg.neg_table6[neg_hash6(addr6)];
+
+	LOCK(&gcfg.cache_mutex);
+	n->addr6 = *addr6;
+	n->gen = gen;
+	n->dyn_alloc = dyn_alloc;
+	n->expires = now + NEG_CACHE_TTL;
+	UNLOCK(&gcfg.cache_mutex);
+}
+
 static void add_to_hash_table(struct cache_entry *c, uint32_t hash4,
 		uint32_t hash6)
 {
@@ -243,6 +318,8 @@ void create_cache(void)
 	if (gcfg.hash_table4) {
 		free(gcfg.hash_table4);
 		free(gcfg.hash_table6);
+		free(gcfg.neg_table4);
+		free(gcfg.neg_table6);
 	}
 
 	gcfg.hash_table4 = (struct list_head *)
@@ -254,6 +331,14 @@ void create_cache(void)
 				hash_size * sizeof(struct list_head));
 		exit(1);
 	}
+	gcfg.neg_table4 = (struct neg_entry4 *)
+		calloc(1 << NEG_CACHE_BITS, sizeof(struct neg_entry4));
+	gcfg.neg_table6 = (struct neg_entry6 *)
+		calloc(1 << NEG_CACHE_BITS, sizeof(struct neg_entry6));
+	if (!gcfg.neg_table4 || !gcfg.neg_table6) {
+		slog(LOG_CRIT, "Unable to allocate negative cache\n");
+		exit(1);
+	}
 	for (i = 0; i < hash_size; ++i) {
 		INIT_LIST_HEAD(&gcfg.hash_table4[i]);
 		INIT_LIST_HEAD(&gcfg.hash_table6[i]);
@@ -293,7 +378,6 @@ static struct cache_entry *cache_insert(const struct in_addr *addr4,
 	c->addr6 = *addr6;
 	c->last_use = now;
 	c->flags = 0;
-	c->ip4_ident = 1;
 	list_add(&c->list, &gcfg.cache_active);
 	add_to_hash_table(c, hash4, hash6);
 	return c;
@@ -359,6 +443,7 @@ int insert_map4(struct map4 *m, struct map4 **conflict)
 		}
 	}
 	list_add_tail(&m->list, entry);
+	neg_flush();
 	return 0;
 }
 /**
@@ -387,6 +472,7 @@ int insert_map6(struct map6 *m, struct map6 **conflict)
 		}
 	}
 	list_add_tail(&m->list, insert_pos ? insert_pos : &gcfg.map6_list);
+	neg_flush();
 	return 0;
 
 conflict:
@@ -408,70 +494,16 @@ int append_to_prefix(struct in6_addr *addr6, const struct in_addr *addr4,
 {
 	/* Do not allow invalid addresses to be appended to prefix */
 	if(validate_ip4_addr(addr4)) return ERROR_DROP;
-	switch (prefix_len) {
-	case 32:
-		addr6->s6_addr32[0] = prefix->s6_addr32[0];
-		addr6->s6_addr32[1] = addr4->s_addr;
-		addr6->s6_addr32[2] = 0;
-		addr6->s6_addr32[3] = 0;
-		return ERROR_NONE;
-	case 40:
-		addr6->s6_addr32[0] = prefix->s6_addr32[0];
-        addr6->s6_addr32[1] = BIG_LITTLE(
-                prefix->s6_addr32[1] | (addr4->s_addr >> 8),
-                prefix->s6_addr32[1] | (addr4->s_addr << 8));
-        addr6->s6_addr32[2] = BIG_LITTLE(
-                (addr4->s_addr << 16) & 0x00ff0000,
-                (addr4->s_addr >> 16) & 0x0000ff00);
-		addr6->s6_addr32[3] = 0;
-		return ERROR_NONE;
-	case 48:
-		addr6->s6_addr32[0] = prefix->s6_addr32[0];
-		addr6->s6_addr32[1] = BIG_LITTLE(
-                prefix->s6_addr32[1] | (addr4->s_addr >> 16),
-                prefix->s6_addr32[1] | (addr4->s_addr << 16));
-		addr6->s6_addr32[2] = BIG_LITTLE(
-                (addr4->s_addr << 8) & 0x00ffff00,
-                (addr4->s_addr >> 8) & 0x00ffff00);
-		addr6->s6_addr32[3] = 0;
-		return ERROR_NONE;
-	case 56:
-		addr6->s6_addr32[0] = prefix->s6_addr32[0];
-		addr6->s6_addr32[1] = BIG_LITTLE(
-                prefix->s6_addr32[1] | (addr4->s_addr >> 24),
-                prefix->s6_addr32[1] | (addr4->s_addr << 24));
-		addr6->s6_addr32[2] = BIG_LITTLE(
-                addr4->s_addr & 0x00ffffff,
-                addr4->s_addr & 0xffffff00);
-		addr6->s6_addr32[3] = 0;
-		return ERROR_NONE;
-	case 64:
-		addr6->s6_addr32[0] = prefix->s6_addr32[0];
-		addr6->s6_addr32[1] = prefix->s6_addr32[1];
-		addr6->s6_addr32[2] = BIG_LITTLE(
-                addr4->s_addr >> 8,
-                addr4->s_addr << 8);
-		addr6->s6_addr32[3] = BIG_LITTLE(
-                addr4->s_addr << 24,
-                addr4->s_addr >> 24);
-		return ERROR_NONE;
-	case 96:
-		//Do not allow translation of well-known prefix
-		//But still allow local-use prefix
-		if (prefix->s6_addr32[0] == WKPF &&
-			!prefix->s6_addr32[1] &&
-			!prefix->s6_addr32[2] &&
-			gcfg.wkpf_strict &&
-			is_private_ip4_addr(addr4))
-			return ERROR_REJECT;
-		addr6->s6_addr32[0] = prefix->s6_addr32[0];
-		addr6->s6_addr32[1] = prefix->s6_addr32[1];
-		addr6->s6_addr32[2] = prefix->s6_addr32[2];
-		addr6->s6_addr32[3] = addr4->s_addr;
-		return ERROR_NONE;
-	default:
-		return ERROR_DROP;
-	}
+	//Do not allow translation of well-known prefix
+	//But still allow local-use prefix
+	if (prefix_len == 96 &&
+		prefix->s6_addr32[0] == WKPF &&
+		!prefix->s6_addr32[1] &&
+		!prefix->s6_addr32[2] &&
+		gcfg.wkpf_strict &&
+		is_private_ip4_addr(addr4))
+		return ERROR_REJECT;
+	return rfc6052_embed(addr6, addr4, prefix, prefix_len);
 }
 
 /**
@@ -480,11 +512,13 @@ int append_to_prefix(struct in6_addr *addr6, const struct in_addr *addr4,
  * @param[out] addr6 Return IPv6 address
  * @param[in] addr4 IPv4 address
  * @param[out] c_ptr Cache entry
- * @returns ERROR_REJECT or ERROR_DROP on error
+ * @returns ERROR_REJECT or ERROR_DROP on error. A miss is remembered
+ * for NEG_CACHE_TTL, and further packets to the address are dropped
+ * without another lookup or ICMP error.
  */
 int map_ip4_to_ip6(struct in6_addr *addr6, const struct in_addr *addr4)
 {
-	uint32_t hash = 0;
+	uint32_t hash = 0, gen;
 	int ret;
 	struct list_head *entry;
 	struct cache_entry *c;
@@ -495,26 +529,37 @@ int map_ip4_to_ip6(struct in6_addr *addr6, const struct in_addr *addr4)
 	if (gcfg.cache_size) {
 		hash = hash_ip4(addr4);
 
-		pthread_mutex_lock(&gcfg.cache_mutex);
+		LOCK(&gcfg.cache_mutex);
 		list_for_each(entry, &gcfg.hash_table4[hash]) {
 			c = list_entry(entry, struct cache_entry, hash4);
 			if (addr4->s_addr == c->addr4.s_addr) {
 				*addr6 = c->addr6;
 				c->last_use = now;
-				pthread_mutex_unlock(&gcfg.cache_mutex);
+				UNLOCK(&gcfg.cache_mutex);
+				STAT_INC(cache_hit);
+				LAT_CACHE(1);
+				TRACE3(map4to6, addr4->s_addr, addr6, 1);
 				return 0;
 			}
 		}
-		pthread_mutex_unlock(&gcfg.cache_mutex);
+		if (neg_find4(addr4)) {
+			UNLOCK(&gcfg.cache_mutex);
+			STAT_INC(neg_hit);
+			return ERROR_DROP;
+		}
+		UNLOCK(&gcfg.cache_mutex);
+		STAT_INC(cache_miss);
+		LAT_CACHE(0);
 	}
 
 
-	pthread_mutex_lock(&gcfg.map_mutex);
+	LOCK(&gcfg.map_mutex);
+	gen = __atomic_load_n(&gcfg.neg_gen, __ATOMIC_RELAXED);
 	map4 = find_map4(addr4);
 
 	if (!map4) {
-		pthread_mutex_unlock(&gcfg.map_mutex);
-		return ERROR_REJECT;
+		ret = ERROR_REJECT;
+		goto miss;
 	}
 
 	switch (map4->type) {
@@ -528,15 +573,13 @@ int map_ip4_to_ip6(struct in6_addr *addr6, const struct in_addr *addr4)
 	case MAP_TYPE_RFC6052:
 		s = container_of(map4, struct map_static, map4);
 		ret = append_to_prefix(addr6, addr4, &s->map6.addr,s->map6.prefix_len);
-		if (ret < 0) {
-			pthread_mutex_unlock(&gcfg.map_mutex);
-			return ret;
-		}
+		if (ret < 0)
+			goto miss;
 		break;
 	case MAP_TYPE_DYNAMIC_POOL:
 		slog(LOG_DEBUG,"%s:%d Address map is dynamic pool\n",__FUNCTION__,__LINE__);
-		pthread_mutex_unlock(&gcfg.map_mutex);
-		return ERROR_REJECT;
+		ret = ERROR_REJECT;
+		goto miss;
 	case MAP_TYPE_DYNAMIC_HOST:
 		d = container_of(map4, struct map_dynamic, map4);
 		*addr6 = d->map6.addr;
@@ -544,13 +587,13 @@ int map_ip4_to_ip6(struct in6_addr *addr6, const struct in_addr *addr4)
 		break;
 	default:
 		slog(LOG_DEBUG,"%s:%d Hit default case\n",__FUNCTION__,__LINE__);
-		pthread_mutex_unlock(&gcfg.map_mutex);
-		return ERROR_DROP;
+		ret = ERROR_DROP;
+		goto miss;
 	}
-	pthread_mutex_unlock(&gcfg.map_mutex);
+	UNLOCK(&gcfg.map_mutex);
 
 	if (gcfg.cache_size) {		
-		pthread_mutex_lock(&gcfg.cache_mutex);
+		LOCK(&gcfg.cache_mutex);
 		c = cache_insert(addr4, addr6, hash, hash_ip6(addr6));
 
 		/* Alloc Dynamic */
@@ -559,58 +602,24 @@ int map_ip4_to_ip6(struct in6_addr *addr6, const struct in_addr *addr4)
 			if (c)
 				c->flags |= CACHE_F_REP_AGEOUT;
 		}
-		pthread_mutex_unlock(&gcfg.cache_mutex);
+		UNLOCK(&gcfg.cache_mutex);
 	}
 
+	TRACE3(map4to6, addr4->s_addr, addr6, 0);
 	return ERROR_NONE;
+
+miss:
+	UNLOCK(&gcfg.map_mutex);
+	if (gcfg.cache_size && (ret == ERROR_REJECT || ret == ERROR_DROP))
+		neg_insert4(addr4, gen);
+	return ret;
 }
 
 static int extract_from_prefix(struct in_addr *addr4,
 		const struct in6_addr *addr6, int prefix_len)
 {
-	switch (prefix_len) {
-	case 32:
-		if (addr6->s6_addr32[2] || addr6->s6_addr32[3])
-			return ERROR_DROP;
-		addr4->s_addr = addr6->s6_addr32[1];
-		break;
-	case 40:
-		if (addr6->s6_addr32[2] & htonl(0xff00ffff) ||
-				addr6->s6_addr32[3])
-			return ERROR_DROP;
-		addr4->s_addr = BIG_LITTLE(
-                (addr6->s6_addr32[1] << 8) | addr6->s6_addr[9],
-                (addr6->s6_addr32[1] >> 8) | (addr6->s6_addr32[2] << 16));
-		break;
-	case 48:
-		if (addr6->s6_addr32[2] & htonl(0xff0000ff) ||
-				addr6->s6_addr32[3])
-			return ERROR_DROP;
-		addr4->s_addr = BIG_LITTLE(
-            (addr6->s6_addr16[3] << 16) | (addr6->s6_addr32[2] >> 8),
-            (addr6->s6_addr16[3]      ) | (addr6->s6_addr32[2] << 8));
-		break;
-	case 56:
-		if (addr6->s6_addr[8] || addr6->s6_addr32[3])
-			return ERROR_DROP;
-		addr4->s_addr = BIG_LITTLE(
-                (addr6->s6_addr[7] << 24) | addr6->s6_addr32[2],
-		        addr6->s6_addr[7] | addr6->s6_addr32[2]);
-		break;
-	case 64:
-		if (addr6->s6_addr[8] ||
-				addr6->s6_addr32[3] & htonl(0x00ffffff))
-			return ERROR_DROP;
-		addr4->s_addr = BIG_LITTLE(
-                (addr6->s6_addr32[2] << 8) | addr6->s6_addr[12],
-		        (addr6->s6_addr32[2] >> 8) | (addr6->s6_addr32[3] << 24));
-		break;
-	case 96:
-		addr4->s_addr = addr6->s6_addr32[3];
-		break;
-	default:
+	if (rfc6052_extract(addr4, addr6, prefix_len))
 		return ERROR_DROP;
-	}
 	/* This function may return ERROR_LOCAL or ERROR_DROP */
 	return validate_ip4_addr(addr4);
 }
@@ -620,11 +629,13 @@ static int extract_from_prefix(struct in_addr *addr4,
  * @param[out] addr4 Return IPv6 address
  * @param[in] addr6 IPv4 address
  * @param[in] dyn_allow Allow dynamic allocation for this mapping
- * @returns ERROR_REJECT or ERROR_DROP on error
+ * @returns ERROR_REJECT or ERROR_DROP on error. Misses are remembered as
+ * in map_ip4_to_ip6(); one made without dyn_alloc does not stop a later
+ * lookup from assigning a dynamic map.
  */
 int map_ip6_to_ip4(struct in_addr *addr4, const struct in6_addr *addr6, int dyn_alloc)
 {
-	uint32_t hash = 0;
+	uint32_t hash = 0, gen;
 	int ret = 0;
 	struct list_head *entry;
 	struct cache_entry *c;
@@ -635,27 +646,47 @@ int map_ip6_to_ip4(struct in_addr *addr4, const struct in6_addr *addr6, int dyn_
 	if (gcfg.cache_size) {
 		hash = hash_ip6(addr6);
 
-		pthread_mutex_lock(&gcfg.cache_mutex);
+		LOCK(&gcfg.cache_mutex);
 		list_for_each(entry, &gcfg.hash_table6[hash]) {
 			c = list_entry(entry, struct cache_entry, hash6);
 			if (IN6_ARE_ADDR_EQUAL(addr6, &c->addr6)) {
 				*addr4 = c->addr4;
 				c->last_use = now;
-				pthread_mutex_unlock(&gcfg.cache_mutex);
+				UNLOCK(&gcfg.cache_mutex);
+				STAT_INC(cache_hit);
+				LAT_CACHE(1);
+				TRACE3(map6to4, addr6, addr4->s_addr, 1);
 				return 0;
 			}
 		}
-		pthread_mutex_unlock(&gcfg.cache_mutex);
+		if (neg_find6(addr6, dyn_alloc)) {
+			UNLOCK(&gcfg.cache_mutex);
+			STAT_INC(neg_hit);
+			return ERROR_DROP;
+		}
+		UNLOCK(&gcfg.cache_mutex);
+		STAT_INC(cache_miss);
+		LAT_CACHE(0);
 	}
-	pthread_mutex_lock(&gcfg.map_mutex);
+	LOCK(&gcfg.map_mutex);
+	gen = __atomic_load_n(&gcfg.neg_gen, __ATOMIC_RELAXED);
 	map6 = find_map6(addr6);
 
 	if (!map6) {
-		if (dyn_alloc)
+		/* Assignment takes its pool's mutex first */
+		if (dyn_alloc) {
+			UNLOCK(&gcfg.map_mutex);
+			/* The host is mapped by the time it retries */
+			if (gcfg.dyn_assign_mode == DYN_ASSIGN_ASYNC &&
+					gcfg.dyn_pool_count) {
+				dynamic_enqueue(addr6);
+				return ERROR_DROP;
+			}
 			map6 = assign_dynamic(addr6);
+		}
 		if (!map6) {
-			pthread_mutex_unlock(&gcfg.map_mutex);
-			return ERROR_REJECT; //TODO what's the right behavior here
+			ret = ERROR_REJECT; //TODO what's the right behavior here
+			goto miss;
 		}
 	}
 
@@ -673,22 +704,22 @@ int map_ip6_to_ip4(struct in_addr *addr4, const struct in6_addr *addr6, int dyn_
 	case MAP_TYPE_RFC6052:
 		ret = extract_from_prefix(addr4, addr6, map6->prefix_len);
 		if (ret < 0) {
-			pthread_mutex_unlock(&gcfg.map_mutex);
-			return ERROR_DROP;
+			ret = ERROR_DROP;
+			goto miss;
 		}
 		if (map6->addr.s6_addr32[0] == WKPF &&
 			map6->addr.s6_addr32[1] == 0 &&
 			map6->addr.s6_addr32[2] == 0 &&
 			gcfg.wkpf_strict &&
 				is_private_ip4_addr(addr4)) {
-			pthread_mutex_unlock(&gcfg.map_mutex);
-			return ERROR_REJECT;
+			ret = ERROR_REJECT;
+			goto miss;
 		}
 		s = container_of(map6, struct map_static, map6);
 		if (find_map4(addr4) != &s->map4){
 			slog(LOG_DEBUG,"%s:%d Dropping packet due to hairpin condition",__FUNCTION__,__LINE__);
-			pthread_mutex_unlock(&gcfg.map_mutex);
-			return ERROR_DROP;
+			ret = ERROR_DROP;
+			goto miss;
 		}
 		break;
 	case MAP_TYPE_DYNAMIC_HOST:
@@ -698,13 +729,13 @@ int map_ip6_to_ip4(struct in_addr *addr4, const struct in6_addr *addr6, int dyn_
 		break;
 	default:
 		slog(LOG_DEBUG,"%s:%d Dropping packet due to default case",__FUNCTION__,__LINE__);
-		pthread_mutex_unlock(&gcfg.map_mutex);
-		return ERROR_DROP;
+		ret = ERROR_DROP;
+		goto miss;
 	}
-	pthread_mutex_unlock(&gcfg.map_mutex);
+	UNLOCK(&gcfg.map_mutex);
 
 	if (gcfg.cache_size) {
-		pthread_mutex_lock(&gcfg.cache_mutex);
+		LOCK(&gcfg.cache_mutex);
 		c = cache_insert(addr4, addr6, hash_ip4(addr4), hash);
 
 		/* Is Dynamic */
@@ -713,10 +744,17 @@ int map_ip6_to_ip4(struct in_addr *addr4, const struct in6_addr *addr6, int dyn_
 			if (c)
 				c->flags |= CACHE_F_REP_AGEOUT;
 		}
-		pthread_mutex_unlock(&gcfg.cache_mutex);
+		UNLOCK(&gcfg.cache_mutex);
 	}
 
+	TRACE3(map6to4, addr6, addr4->s_addr, 0);
 	return ERROR_NONE;
+
+miss:
+	UNLOCK(&gcfg.map_mutex);
+	if (gcfg.cache_size)
+		neg_insert6(addr6, dyn_alloc, gen);
+	return ret;
 }
 
 static void report_ageout(struct cache_entry *c)
@@ -744,8 +782,8 @@ void addrmap_maint(void)
 	/* report_ageout will need map mutex
 	 * and we must acquire map before cache if both are required 
 	 * to avoid any deadlock */
-    pthread_mutex_lock(&gcfg.map_mutex);
-	pthread_mutex_lock(&gcfg.cache_mutex);
+    LOCK(&gcfg.map_mutex);
+	LOCK(&gcfg.cache_mutex);
 
 	list_for_each_safe(entry, next, &gcfg.cache_active) {
 		c = list_entry(entry, struct cache_entry, list);
@@ -755,10 +793,12 @@ void addrmap_maint(void)
 			list_add(&c->list, &gcfg.cache_pool);
 			list_del(&c->hash4);
 			list_del(&c->hash6);
+			STAT_INC(cache_evict);
+			TRACE2(cache_evict, c->addr4.s_addr, &c->addr6);
 		}
 	}
-	pthread_mutex_unlock(&gcfg.cache_mutex);
-	pthread_mutex_unlock(&gcfg.map_mutex);
+	UNLOCK(&gcfg.cache_mutex);
+	UNLOCK(&gcfg.map_mutex);
 }
 
 
@@ -772,16 +812,18 @@ static void cache_evict_map4(const struct map4 *m4)
     struct list_head *entry, *next;
     struct cache_entry *c;
 
-    pthread_mutex_lock(&gcfg.cache_mutex);
+    LOCK(&gcfg.cache_mutex);
     list_for_each_safe(entry, next, &gcfg.cache_active) {
         c = list_entry(entry, struct cache_entry, list);
         if (m4->addr.s_addr == (m4->mask.s_addr & c->addr4.s_addr)) {
             list_del(&c->hash4);
             list_del(&c->hash6);
             list_add(&c->list, &gcfg.cache_pool);
+            STAT_INC(cache_evict);
+            TRACE2(cache_evict, c->addr4.s_addr, &c->addr6);
         }
     }
-    pthread_mutex_unlock(&gcfg.cache_mutex);
+    UNLOCK(&gcfg.cache_mutex);
 }
 
 /**
@@ -794,16 +836,18 @@ static void cache_evict_map6(const struct map6 *m6)
     struct list_head *entry, *next;
     struct cache_entry *c;
 
-    pthread_mutex_lock(&gcfg.cache_mutex);
+    LOCK(&gcfg.cache_mutex);
     list_for_each_safe(entry, next, &gcfg.cache_active) {
         c = list_entry(entry, struct cache_entry, list);
 		if (IN6_IS_IN_NET(&c->addr6, &m6->addr, &m6->mask)){
             list_del(&c->hash4);
             list_del(&c->hash6);
             list_add(&c->list, &gcfg.cache_pool);
+            STAT_INC(cache_evict);
+            TRACE2(cache_evict, c->addr4.s_addr, &c->addr6);
         }
     }
-    pthread_mutex_unlock(&gcfg.cache_mutex);
+    UNLOCK(&gcfg.cache_mutex);
 }
 
 /**
@@ -824,6 +868,7 @@ static void addrmap_delete4(struct map4 *m4)
         /* Evict matching cache entries */
         cache_evict_map4(&m->map4);
         cache_evict_map6(&m->map6);
+        neg_flush();
 		free(m);
     }
 }
@@ -845,6 +890,7 @@ static void addrmap_delete6(struct map6 *m6)
         /* Evict matching cache entries */
         cache_evict_map4(&m->map4);
         cache_evict_map6(&m->map6);
+        neg_flush();
 		free(m);
     }
 }
@@ -949,7 +995,7 @@ static int addrmap_entry(int ln, char **args)
 	}
 
 	/* Lock map to insert into v4/v6 */
-	pthread_mutex_lock(&gcfg.map_mutex);
+	LOCK(&gcfg.map_mutex);
 
 	/*
 	 * Attempt to insert both sides.  insert_map4/6 returns -1 and sets
@@ -982,7 +1028,7 @@ static int addrmap_entry(int ln, char **args)
 			     "map entry found for mapping on line %d "
 			     "(m4 type %d, m6 type %d)\n", ln, m4->type, m6->type);
 			free(m);
-			pthread_mutex_unlock(&gcfg.map_mutex);
+			UNLOCK(&gcfg.map_mutex);
 			return ERROR_REJECT;
 		}
 
@@ -995,7 +1041,7 @@ static int addrmap_entry(int ln, char **args)
 			slog(LOG_ERR, "MAP-FILE: Existing fixed map entry found with non-writable"
 				" origin on line %d (m4 orgin %d, m6 origin %d)\n", ln, n1->origin, n2->origin);
 			free(m);
-			pthread_mutex_unlock(&gcfg.map_mutex);
+			UNLOCK(&gcfg.map_mutex);
 			return ERROR_REJECT;
 		} else if (n1 == n2) {
 			/*
@@ -1030,7 +1076,7 @@ static int addrmap_entry(int ln, char **args)
 			/* Remove the IPv6 half we just inserted */
 			list_del(&m->map6.list);
 			free(m);
-			pthread_mutex_unlock(&gcfg.map_mutex);
+			UNLOCK(&gcfg.map_mutex);
 			return ERROR_REJECT;
 		}
 		/* Get parent static map entry */
@@ -1043,7 +1089,7 @@ static int addrmap_entry(int ln, char **args)
 			/* Remove the IPv6 half we just inserted */
 			list_del(&m->map6.list);
 			free(m);
-			pthread_mutex_unlock(&gcfg.map_mutex);
+			UNLOCK(&gcfg.map_mutex);
 			return ERROR_REJECT;
 		}
 		addrmap_delete4(m4);
@@ -1061,7 +1107,7 @@ static int addrmap_entry(int ln, char **args)
 			/* Remove the IPv4 half we just inserted */
 			list_del(&m->map4.list);
 			free(m);
-			pthread_mutex_unlock(&gcfg.map_mutex);
+			UNLOCK(&gcfg.map_mutex);
 			return ERROR_REJECT;
 		}
 		/* Get parent static map entry */
@@ -1074,7 +1120,7 @@ static int addrmap_entry(int ln, char **args)
 			/* Remove the IPv4 half we just inserted */
 			list_del(&m->map4.list);
 			free(m);
-			pthread_mutex_unlock(&gcfg.map_mutex);
+			UNLOCK(&gcfg.map_mutex);
 			return ERROR_REJECT;
 		}
 		addrmap_delete6(m6);
@@ -1085,7 +1131,7 @@ static int addrmap_entry(int ln, char **args)
 	}
 
 	/* Finished without error */
-	pthread_mutex_unlock(&gcfg.map_mutex);
+	UNLOCK(&gcfg.map_mutex);
 	return ERROR_NONE;
 }
 
@@ -1131,7 +1177,7 @@ int addrmap_reload(void)
 	}
 
 	/* Step 2 - mark existing entries in the map list */
-	pthread_mutex_lock(&gcfg.map_mutex);
+	LOCK(&gcfg.map_mutex);
 	list_for_each(entry, &gcfg.map4_list) {
 		m4 = list_entry(entry, struct map4, list);
 		if (m4->type == MAP_TYPE_STATIC) {
@@ -1141,7 +1187,7 @@ int addrmap_reload(void)
 			}
 		}
 	}
-	pthread_mutex_unlock(&gcfg.map_mutex);
+	UNLOCK(&gcfg.map_mutex);
 
 	/* Step 3 - parse the file */
 	while (fgets(line, sizeof(line), in)) {
@@ -1194,7 +1240,7 @@ int addrmap_reload(void)
 	fclose(in);
 
 	/* Step 4 - delete entries not reloaded */
-	pthread_mutex_lock(&gcfg.map_mutex);
+	LOCK(&gcfg.map_mutex);
 	list_for_each_safe(entry, next, &gcfg.map4_list) {
 		m4 = list_entry(entry, struct map4, list);
 		if (m4->type == MAP_TYPE_STATIC) {
@@ -1204,7 +1250,7 @@ int addrmap_reload(void)
 			}
 		}
 	}
-	pthread_mutex_unlock(&gcfg.map_mutex);
+	UNLOCK(&gcfg.map_mutex);
 	/* Only file access errors are returned as errors */
 	return ERROR_NONE;
 }
\ No newline at end of file
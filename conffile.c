@@ -17,6 +17,7 @@
  */
 
 #include "tayga.h"
+#include <sys/un.h>
 
 /* Global config */
 struct config gcfg;
@@ -230,6 +231,28 @@ static int config_wkpf_strict(int ln, int arg_count, char **args)
 	return ERROR_NONE;
 }
 
+static int config_tcp_mss_clamp(int ln, int arg_count, char **args)
+{
+	//arg_count unused
+	(void)arg_count;
+
+	if (!strcasecmp(args[0], "true") ||
+	    !strcasecmp(args[0], "on") ||
+	    !strcasecmp(args[0], "yes") ||
+		!strcasecmp(args[0], "1")) {
+		gcfg.tcp_mss_clamp = 1;
+	} else if (!strcasecmp(args[0], "false") ||
+			   !strcasecmp(args[0], "off") ||
+			   !strcasecmp(args[0], "no") ||
+			   !strcasecmp(args[0], "0")) {
+		gcfg.tcp_mss_clamp = 0;
+	} else {
+		slog(LOG_CRIT, "Error: invalid value for tcp-mss-clamp on line %d\n",ln);
+		return ERROR_REJECT;
+	}
+	return ERROR_NONE;
+}
+
 static int config_udp_cksum_mode(int ln, int arg_count, char **args)
 {
 	//arg_count unused
@@ -498,41 +521,117 @@ static int config_map(int ln, int arg_count, char **args)
 	return ERROR_NONE;
 }
 
-static int config_dynamic_pool(int ln, int arg_count, char **args)
+/**
+ * @brief Allocate one dynamic pool, or one shard of a pool
+ *
+ * @param ln Line number, for messages
+ * @param addr First address of the pool
+ * @param prefix_len Prefix length of the pool
+ * @param reserve Nonzero to keep the first address from being assigned
+ * @returns new pool, or NULL on error
+ */
+static struct dynamic_pool *new_dynamic_pool(int ln,
+		const struct in_addr *addr, int prefix_len, int reserve)
 {
-	//arg_count unused
-	(void)arg_count;
-
 	struct dynamic_pool *pool;
 	struct map4 *m4;
-
-	if (gcfg.dynamic_pool) {
-		slog(LOG_CRIT, "Error: duplicate dynamic-pool directive on "
-				"line %d\n", ln);
-		return ERROR_REJECT;
-	}
+	uint32_t words, i;
 
 	pool = (struct dynamic_pool *)malloc(sizeof(struct dynamic_pool));
 	if (!pool) {
 		slog(LOG_CRIT, "Unable to allocate config memory\n");
-		return ERROR_REJECT;
+		return NULL;
 	}
 	memset(pool, 0, sizeof(struct dynamic_pool));
-	INIT_LIST_HEAD(&pool->mapped_list);
-	INIT_LIST_HEAD(&pool->dormant_list);
-	INIT_LIST_HEAD(&pool->free_list);
+	pthread_mutex_init(&pool->mutex, NULL);
 
 	m4 = &pool->map4;
 	m4->type = MAP_TYPE_DYNAMIC_POOL;
+	m4->addr = *addr;
+	m4->prefix_len = prefix_len;
+	calc_ip4_mask(&m4->mask, NULL, prefix_len);
 	INIT_LIST_HEAD(&m4->list);
+	if (insert_map4(&pool->map4, &m4) < 0) {
+		abort_on_conflict4("Error: IPv4 prefix in dynamic-pool "
+				"directive", ln, m4);
+		return NULL;
+	}
+
+	/* One bit per address; the network address is never assigned,
+	 * and the padding bits of the last word are never free */
+	pool->size = 1U << (32 - prefix_len);
+	pool->free_count = pool->size - (reserve ? 1 : 0);
+	words = (pool->size + 31) / 32;
+	pool->in_use = (uint32_t *)calloc(words, sizeof(uint32_t));
+	/* Hash buckets for up to one lease per address, within reason */
+	pool->hash_bits = 32 - prefix_len;
+	if (pool->hash_bits < 4)
+		pool->hash_bits = 4;
+	if (pool->hash_bits > 18)
+		pool->hash_bits = 18;
+	pool->hash_table4 = (struct list_head *)
+		malloc((1U << pool->hash_bits) * sizeof(struct list_head));
+	pool->hash_table6 = (struct list_head *)
+		malloc((1U << pool->hash_bits) * sizeof(struct list_head));
+	if (!pool->in_use || !pool->hash_table4 || !pool->hash_table6) {
+		slog(LOG_CRIT, "Unable to allocate config memory\n");
+		return NULL;
+	}
+	if (reserve)
+		pool->in_use[0] = 1;
+	if (pool->size % 32)
+		pool->in_use[words - 1] |= ~0U << (pool->size % 32);
+	for (i = 0; i < (1U << pool->hash_bits); ++i) {
+		INIT_LIST_HEAD(&pool->hash_table4[i]);
+		INIT_LIST_HEAD(&pool->hash_table6[i]);
+	}
+	INIT_LIST_HEAD(&pool->retired);
+	return pool;
+}
+
+static int dynamic_pool_cmp(const void *a, const void *b)
+{
+	const struct dynamic_pool *pa = *(struct dynamic_pool * const *)a;
+	const struct dynamic_pool *pb = *(struct dynamic_pool * const *)b;
+	uint32_t x = ntohl(pa->map4.addr.s_addr);
+	uint32_t y = ntohl(pb->map4.addr.s_addr);
+
+	return x < y ? -1 : x > y;
+}
+
+static int config_dynamic_pool(int ln, int arg_count, char **args)
+{
+	struct dynamic_pool **pools, *pool;
+	struct in_addr addr, mask;
+	char addrbuf[INET_ADDRSTRLEN];
+	int prefix_len, shard_bits, i;
+	uint32_t base;
+	long shards = 1;
+	char *endptr;
+
+	if (arg_count == 3 && !strcasecmp(args[1], "shards")) {
+		shards = strtol(args[2], &endptr, 10);
+		if (*endptr != '\0' || shards < 1 ||
+				shards > MAX_DYN_SHARDS ||
+				(shards & (shards - 1))) {
+			slog(LOG_CRIT, "Error: shards must be a power of two "
+					"from 1 to %d on line %d\n",
+					MAX_DYN_SHARDS, ln);
+			return ERROR_REJECT;
+		}
+	} else if (arg_count != 1) {
+		slog(LOG_CRIT, "Incorrect number of arguments on line %d\n",
+				ln);
+		return ERROR_REJECT;
+	}
 
-	if (parse_prefix(AF_INET, args[0], &m4->addr, &m4->prefix_len) ||
-			calc_ip4_mask(&m4->mask, &m4->addr, m4->prefix_len)) {
+	if (parse_prefix(AF_INET, args[0], &addr, &prefix_len) ||
+			calc_ip4_mask(&mask, &addr, prefix_len)) {
 		slog(LOG_CRIT, "Expected an IPv4 prefix but found \"%s\" on "
 				"line %d\n", args[0], ln);
 		return ERROR_REJECT;
 	}
-	int ret = validate_ip4_addr(&m4->addr);
+	int ret = validate_ip4_addr(&addr);
 	if (ret == ERROR_LOCAL) {
 		slog(LOG_WARNING, "Using link-local address %s in dynamic-pool "
 			"directive, use with caution\n", args[0]);
@@ -541,23 +640,219 @@ static int config_dynamic_pool(int ln, int arg_count, char **args)
 				"directive, aborting...\n", args[0]);
 		return ERROR_REJECT;
 	}
-	if (m4->prefix_len > 31) {
+	for (shard_bits = 0; (1L << shard_bits) < shards; ++shard_bits)
+		;
+	if (prefix_len > 31) {
 		slog(LOG_CRIT, "Cannot use a prefix longer than /31 in "
 			       "dynamic-pool directive, aborting...\n");
 		return ERROR_REJECT;
 	}
-	if (insert_map4(&pool->map4, &m4) < 0) {
-		abort_on_conflict4("Error: IPv4 prefix in dynamic-pool "
-				"directive", ln, m4);
+	if (prefix_len + shard_bits > 31) {
+		slog(LOG_CRIT, "Cannot split %s into %ld shards on line %d, "
+				"each needs at least two addresses\n",
+				args[0], shards, ln);
+		return ERROR_REJECT;
+	}
+
+	/* Pools may not nest, or a lease could belong to either */
+	for (i = 0; i < gcfg.dyn_pool_count; ++i) {
+		pool = gcfg.dyn_pools[i];
+		if ((addr.s_addr & pool->map4.mask.s_addr) !=
+				pool->map4.addr.s_addr &&
+				(pool->map4.addr.s_addr & mask.s_addr) !=
+				addr.s_addr)
+			continue;
+		inet_ntop(AF_INET, &pool->map4.addr, addrbuf, sizeof(addrbuf));
+		slog(LOG_CRIT, "Error: dynamic-pool on line %d overlaps "
+				"earlier dynamic-pool containing %s/%d\n", ln,
+				addrbuf, pool->map4.prefix_len);
+		return ERROR_REJECT;
+	}
+
+	pools = (struct dynamic_pool **)realloc(gcfg.dyn_pools,
+			(gcfg.dyn_pool_count + shards) * sizeof(*pools));
+	if (!pools) {
+		slog(LOG_CRIT, "Unable to allocate config memory\n");
 		return ERROR_REJECT;
 	}
+	gcfg.dyn_pools = pools;
+
+	/* Each shard is a pool of its own, only the first keeps the
+	 * network address back */
+	base = ntohl(addr.s_addr);
+	for (i = 0; i < shards; ++i) {
+		addr.s_addr = htonl(base +
+				((uint32_t)i << (32 - prefix_len - shard_bits)));
+		pool = new_dynamic_pool(ln, &addr, prefix_len + shard_bits,
+				i == 0);
+		if (!pool)
+			return ERROR_REJECT;
+		gcfg.dyn_pools[gcfg.dyn_pool_count++] = pool;
+	}
+	/* Kept in address order, to find the pool holding a lease */
+	qsort(gcfg.dyn_pools, gcfg.dyn_pool_count, sizeof(*gcfg.dyn_pools),
+			dynamic_pool_cmp);
+	return ERROR_NONE;
+}
 
-	pool->free_head.addr = ntohl(m4->addr.s_addr);
-	pool->free_head.count = (1 << (32 - m4->prefix_len)) - 1;
-	INIT_LIST_HEAD(&pool->free_head.list);
-	list_add(&pool->free_head.list, &pool->free_list);
+static int config_dynamic_fsync(int ln, int arg_count, char **args)
+{
+	//arg_count unused
+	(void)arg_count;
 
-	gcfg.dynamic_pool = pool;
+	if (!strcasecmp(args[0], "interval")) {
+		gcfg.dyn_fsync = DYN_FSYNC_INTERVAL;
+	} else if (!strcasecmp(args[0], "always")) {
+		gcfg.dyn_fsync = DYN_FSYNC_ALWAYS;
+	} else if (!strcasecmp(args[0], "never")) {
+		gcfg.dyn_fsync = DYN_FSYNC_NEVER;
+	} else {
+		slog(LOG_CRIT, "Error: invalid value for dynamic-fsync on line %d\n",ln);
+		return ERROR_REJECT;
+	}
+	return ERROR_NONE;
+}
+
+static int config_dynamic_assign(int ln, int arg_count, char **args)
+{
+	//arg_count unused
+	(void)arg_count;
+
+	if (!strcasecmp(args[0], "inline")) {
+		gcfg.dyn_assign_mode = DYN_ASSIGN_INLINE;
+	} else if (!strcasecmp(args[0], "async")) {
+		gcfg.dyn_assign_mode = DYN_ASSIGN_ASYNC;
+	} else {
+		slog(LOG_CRIT, "Error: invalid value for dynamic-assign on line %d\n",ln);
+		return ERROR_REJECT;
+	}
+	return ERROR_NONE;
+}
+
+/* Parse "address port" into a socket address */
+static int parse_sockaddr(int ln, const char *name, char **args,
+		struct sockaddr_storage *ss, socklen_t *len)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+	char *end;
+	long port;
+
+	if (*len) {
+		slog(LOG_CRIT, "Error: duplicate %s directive on line %d\n",
+				name, ln);
+		return ERROR_REJECT;
+	}
+	port = strtol(args[1], &end, 10);
+	if (*end || port < 1 || port > 65535) {
+		slog(LOG_CRIT, "Error: invalid port for %s on line %d\n",
+				name, ln);
+		return ERROR_REJECT;
+	}
+	memset(ss, 0, sizeof(*ss));
+	if (inet_pton(AF_INET, args[0], &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		*len = sizeof(*sin);
+	} else if (inet_pton(AF_INET6, args[0], &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		*len = sizeof(*sin6);
+	} else {
+		slog(LOG_CRIT, "Error: invalid address for %s on line %d\n",
+				name, ln);
+		return ERROR_REJECT;
+	}
+	return ERROR_NONE;
+}
+
+static int config_dynamic_replica(int ln, int arg_count, char **args)
+{
+	//arg_count unused
+	(void)arg_count;
+
+	return parse_sockaddr(ln, "dynamic-replica", args, &gcfg.dyn_replica,
+			&gcfg.dyn_replica_len);
+}
+
+static int config_dynamic_replica_listen(int ln, int arg_count, char **args)
+{
+	//arg_count unused
+	(void)arg_count;
+
+	return parse_sockaddr(ln, "dynamic-replica-listen", args,
+			&gcfg.dyn_replica_listen, &gcfg.dyn_replica_listen_len);
+}
+
+static int config_dynamic_replica_peer(int ln, int arg_count, char **args)
+{
+	struct in_addr addr4;
+
+	//arg_count unused
+	(void)arg_count;
+
+	if (!IN6_IS_ADDR_UNSPECIFIED(&gcfg.dyn_replica_peer)) {
+		slog(LOG_CRIT, "Error: duplicate dynamic-replica-peer directive "
+				"on line %d\n", ln);
+		return ERROR_REJECT;
+	}
+	/* IPv4 is kept as it appears on a dual-stack socket */
+	if (inet_pton(AF_INET, args[0], &addr4) == 1) {
+		gcfg.dyn_replica_peer.s6_addr16[5] = 0xffff;
+		gcfg.dyn_replica_peer.s6_addr32[3] = addr4.s_addr;
+	} else if (inet_pton(AF_INET6, args[0], &gcfg.dyn_replica_peer) != 1 ||
+			IN6_IS_ADDR_UNSPECIFIED(&gcfg.dyn_replica_peer)) {
+		slog(LOG_CRIT, "Error: invalid address for dynamic-replica-peer "
+				"on line %d\n", ln);
+		return ERROR_REJECT;
+	}
+	return ERROR_NONE;
+}
+
+static int config_dynamic_replica_key(int ln, int arg_count, char **args)
+{
+	unsigned int i, hi, lo;
+	char *s = args[0];
+
+	//arg_count unused
+	(void)arg_count;
+
+	if (gcfg.dyn_replica_key_set) {
+		slog(LOG_CRIT, "Error: duplicate dynamic-replica-key directive "
+				"on line %d\n", ln);
+		return ERROR_REJECT;
+	}
+	if (strlen(s) != 2 * sizeof(gcfg.dyn_replica_key)) {
+		slog(LOG_CRIT, "Error: dynamic-replica-key on line %d must be "
+				"%d hex digits\n", ln,
+				(int)(2 * sizeof(gcfg.dyn_replica_key)));
+		return ERROR_REJECT;
+	}
+	for (i = 0; i < sizeof(gcfg.dyn_replica_key); ++i) {
+		if (sscanf(&s[2 * i], "%1x%1x", &hi, &lo) != 2) {
+			slog(LOG_CRIT, "Error: invalid hex digit in "
+					"dynamic-replica-key on line %d\n", ln);
+			return ERROR_REJECT;
+		}
+		gcfg.dyn_replica_key[i] = hi << 4 | lo;
+	}
+	gcfg.dyn_replica_key_set = 1;
+	return ERROR_NONE;
+}
+
+static int config_dynamic_format(int ln, int arg_count, char **args)
+{
+	//arg_count unused
+	(void)arg_count;
+
+	if (!strcasecmp(args[0], "text")) {
+		gcfg.dyn_format = DYN_FORMAT_TEXT;
+	} else if (!strcasecmp(args[0], "binary")) {
+		gcfg.dyn_format = DYN_FORMAT_BINARY;
+	} else {
+		slog(LOG_CRIT, "Error: invalid value for dynamic-format on line %d\n",ln);
+		return ERROR_REJECT;
+	}
 	return ERROR_NONE;
 }
 
@@ -593,6 +888,56 @@ static int config_map_file(int ln, int arg_count, char **args)
 	return ERROR_NONE;
 }
 
+static int config_stats_socket(int ln, int arg_count, char **args)
+{
+	//arg_count unused
+	(void)arg_count;
+
+	if (gcfg.stats_socket[0]) {
+		slog(LOG_CRIT, "Error: duplicate stats-socket directive on line "
+				"%d\n", ln);
+		return ERROR_REJECT;
+	}
+	if (args[0][0] != '/') {
+		slog(LOG_CRIT, "Error: stats-socket must be an absolute path\n");
+		return ERROR_REJECT;
+	}
+	if (strlen(args[0]) + 1 > sizeof(gcfg.stats_socket) ||
+			strlen(args[0]) + 1 >
+			sizeof(((struct sockaddr_un *)0)->sun_path)) {
+		slog(LOG_CRIT, "Error: stats-socket path on line %d is too "
+				"long\n", ln);
+		return ERROR_REJECT;
+	}
+	strcpy(gcfg.stats_socket, args[0]);
+	return ERROR_NONE;
+}
+
+static int config_stats_shm(int ln, int arg_count, char **args)
+{
+	//arg_count unused
+	(void)arg_count;
+
+	if (gcfg.stats_shm[0]) {
+		slog(LOG_CRIT, "Error: duplicate stats-shm directive on line "
+				"%d\n", ln);
+		return ERROR_REJECT;
+	}
+	/* POSIX shared memory names are a single component after a '/' */
+	if (args[0][0] != '/' || !args[0][1] || strchr(args[0] + 1, '/')) {
+		slog(LOG_CRIT, "Error: stats-shm on line %d must be a name "
+				"like /tayga\n", ln);
+		return ERROR_REJECT;
+	}
+	if (strlen(args[0]) + 1 > sizeof(gcfg.stats_shm)) {
+		slog(LOG_CRIT, "Error: stats-shm name on line %d is too "
+				"long\n", ln);
+		return ERROR_REJECT;
+	}
+	strcpy(gcfg.stats_shm, args[0]);
+	return ERROR_NONE;
+}
+
 static int config_strict_fh(int ln, int arg_count, char **args)
 {
 	//unused
@@ -661,6 +1006,65 @@ static int config_offlink_mtu(int ln, int arg_count, char **args)
 	return ERROR_NONE;
 }
 
+static int config_icmp_ratelimit(int ln, int arg_count, char **args)
+{
+	struct rl_conf *c;
+	enum rl_class cls;
+	enum rl_scope scope;
+	unsigned long rate, burst;
+	char *endptr;
+
+	if (arg_count < 3 || arg_count > 4) {
+		slog(LOG_CRIT, "Error: icmp-ratelimit on line %d requires a "
+				"class, scope, rate and optional burst\n", ln);
+		return ERROR_REJECT;
+	}
+	if (!strcasecmp(args[0], "errors"))
+		cls = RL_ERRORS;
+	else if (!strcasecmp(args[0], "echo"))
+		cls = RL_ECHO;
+	else {
+		slog(LOG_CRIT, "Error: invalid class for icmp-ratelimit on line "
+				"%d\n", ln);
+		return ERROR_REJECT;
+	}
+	if (!strcasecmp(args[1], "global"))
+		scope = RL_GLOBAL;
+	else if (!strcasecmp(args[1], "source"))
+		scope = RL_SOURCE;
+	else {
+		slog(LOG_CRIT, "Error: invalid scope for icmp-ratelimit on line "
+				"%d\n", ln);
+		return ERROR_REJECT;
+	}
+	c = &gcfg.icmp_rl[cls][scope];
+	if (c->set) {
+		slog(LOG_CRIT, "Error: duplicate icmp-ratelimit %s %s directive "
+				"on line %d\n", args[0], args[1], ln);
+		return ERROR_REJECT;
+	}
+	rate = strtoul(args[2], &endptr, 10);
+	if (*endptr != '\0' || args[2][0] == '-' || rate > 1000000) {
+		slog(LOG_CRIT, "Error: invalid rate for icmp-ratelimit on line "
+				"%d (must be 0 to 1000000)\n", ln);
+		return ERROR_REJECT;
+	}
+	burst = rate;
+	if (arg_count == 4) {
+		burst = strtoul(args[3], &endptr, 10);
+		if (*endptr != '\0' || args[3][0] == '-' || burst < 1 ||
+				burst > 1000000) {
+			slog(LOG_CRIT, "Error: invalid burst for icmp-ratelimit on "
+					"line %d (must be 1 to 1000000)\n", ln);
+			return ERROR_REJECT;
+		}
+	}
+	c->rate = rate;
+	c->burst = burst;
+	c->set = 1;
+	return ERROR_NONE;
+}
+
 static int config_workers(int ln, int arg_count, char **args)
 {
 	//arg_count unused
@@ -717,18 +1121,29 @@ struct {
 	{ "prefix", 		config_prefix, 			1 },
 	{ "wkpf-strict", 	config_wkpf_strict, 	1 },
 	{ "udp-cksum-mode", config_udp_cksum_mode, 	1 },
+	{ "tcp-mss-clamp", 	config_tcp_mss_clamp, 	1 },
 	{ "tun-up", 		config_tun_up, 			1 },
 	{ "tun-ip", 		config_tun_ip, 			1 },
 	{ "tun-route", 		config_tun_route, 		1 },
 	{ "tun-device", 	config_tun_device, 		1 },
 	{ "map", 			config_map, 			2 },
-	{ "dynamic-pool", 	config_dynamic_pool,	1 },
+	{ "dynamic-pool", 	config_dynamic_pool,   -1 },
 	{ "data-dir", 		config_data_dir, 		1 },
+	{ "dynamic-fsync", 	config_dynamic_fsync, 	1 },
+	{ "dynamic-format", 	config_dynamic_format, 	1 },
+	{ "dynamic-assign", 	config_dynamic_assign, 	1 },
+	{ "dynamic-replica", 	config_dynamic_replica, 	2 },
+	{ "dynamic-replica-listen", config_dynamic_replica_listen, 2 },
+	{ "dynamic-replica-peer", config_dynamic_replica_peer, 1 },
+	{ "dynamic-replica-key", config_dynamic_replica_key, 1 },
 	{ "map-file", 		config_map_file, 		1 },
+	{ "stats-socket", 	config_stats_socket, 	1 },
+	{ "stats-shm", 		config_stats_shm, 		1 },
 	{ "strict-frag-hdr",config_strict_fh, 		1 },
 	{ "log"	,			config_log, 		   -1 },
 	{ "offlink-mtu"	,  	config_offlink_mtu,		1 },
 	{ "workers"	,  		config_workers,			1 },
+	{ "icmp-ratelimit",	config_icmp_ratelimit,	-1 },
 	{ NULL, NULL, 0 }
 };
 
@@ -748,6 +1163,12 @@ int config_init(void)
 	gcfg.wkpf_strict = 1;
 	gcfg.udp_cksum_mode = UDP_CKSUM_DROP;
 	gcfg.workers = -1;
+	for (int i = 0; i < RL_CLASS_MAX; i++) {
+		gcfg.icmp_rl[i][RL_GLOBAL].rate = ICMP_RL_GLOBAL_RATE;
+		gcfg.icmp_rl[i][RL_GLOBAL].burst = ICMP_RL_GLOBAL_BURST;
+		gcfg.icmp_rl[i][RL_SOURCE].rate = ICMP_RL_SOURCE_RATE;
+		gcfg.icmp_rl[i][RL_SOURCE].burst = ICMP_RL_SOURCE_BURST;
+	}
 	INIT_LIST_HEAD(&gcfg.tun_ip4_list);
 	INIT_LIST_HEAD(&gcfg.tun_ip6_list);
 	INIT_LIST_HEAD(&gcfg.tun_rt4_list);
@@ -945,6 +1366,23 @@ int config_validate(void)
 	/* Offlink MTU defaults to 1280 if not set */
 	if (gcfg.ipv6_offlink_mtu <= MTU_MIN) gcfg.ipv6_offlink_mtu = MTU_MIN;
 
+	/* Leases are only replicated between dynamic pools */
+	if ((gcfg.dyn_replica_len || gcfg.dyn_replica_listen_len) &&
+			!gcfg.dyn_pool_count) {
+		slog(LOG_CRIT, "Error: dynamic-replica and "
+				"dynamic-replica-listen require a "
+				"dynamic-pool\n");
+		return ERROR_REJECT;
+	}
+
+	/* A standby only takes leases from the active */
+	if (gcfg.dyn_replica_listen_len &&
+			IN6_IS_ADDR_UNSPECIFIED(&gcfg.dyn_replica_peer)) {
+		slog(LOG_CRIT, "Error: dynamic-replica-listen requires "
+				"dynamic-replica-peer\n");
+		return ERROR_REJECT;
+	}
+
 	/* Tundev must be provided */
 	if(strlen(gcfg.tundev) < 1) {
 		slog(LOG_CRIT, "Error: no tun-device directive found\n");
@@ -19,23 +19,437 @@
 #include "tayga.h"
 #include <inttypes.h>
 #include <limits.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 
-#define MAP_FILE	"dynamic.map"
-#define TMP_MAP_FILE	"dynamic.map~~"
+#define TEXT_FILE	"dynamic.map"
+#define TMP_TEXT_FILE	"dynamic.map~~"
+#define JOURNAL_FILE	"dynamic.journal"
+#define OLD_JOURNAL_FILE	"dynamic.journal~"
+#define DB_FILE		"dynamic.db"
+#define TMP_DB_FILE	"dynamic.db~~"
+#define BAD_DB_FILE	"dynamic.db.bad"
 
-static struct map_dynamic *alloc_map_dynamic(const struct in6_addr *addr6,
-		const struct in_addr *addr4, struct free_addr *f)
+#define DB_MAGIC	"TAYGALDB"
+#define DB_VERSION	1
+
+/* Compact once the journal holds this many records, or one per lease */
+#define JOURNAL_MIN_RECORDS	1024
+
+/* Hosts waiting for the assignment thread, and how many it takes at once */
+#define ASSIGN_QUEUE_LEN	1024
+#define ASSIGN_BATCH		64
+
+#define REPL_MAGIC	"TYRL"
+#define REPL_VERSION	2
+
+/* Lease changes waiting to be sent to the standby, and how many go in
+ * one datagram. 32 + 36 * 32 bytes and a tag fit the IPv6 minimum MTU. */
+#define REPL_QUEUE_LEN	4096
+#define REPL_BATCH	36
+
+/* How long a part-filled batch waits for more changes, in ms */
+#define REPL_DELAY_MS	50
+
+/* Every lease is sent again this often, in seconds */
+#define REPL_SYNC_INTERVAL	300
+
+/* A lease as stored in the map file or the journal */
+struct lease_rec {
+	struct in_addr addr4;
+	struct in6_addr addr6;
+	time_t last_use;
+	uint32_t seq;	/* position in the files, for replay order */
+	uint32_t flags;	/* DB_F_* */
+	char type;	/* 'S' from the map file, 'A'ssign or 'E'xpire */
+};
+
+/* The binary lease database is this header followed by count records,
+ * sorted by IPv4 address. Every field is in network byte order. */
+struct lease_db_header {
+	char magic[8];		/* DB_MAGIC, not terminated */
+	uint32_t version;	/* DB_VERSION */
+	uint32_t record_size;	/* may grow, new fields go at the end */
+	uint32_t count;
+	uint32_t crc;		/* CRC-32 of the file with this field zero */
+	uint32_t written[2];	/* time_t, high word first */
+};
+
+struct lease_db_record {
+	uint32_t last_use[2];	/* time_t, high word first */
+	struct in_addr addr4;
+	struct in6_addr addr6;
+	uint32_t flags;
+};
+
+static_assert(sizeof(struct lease_db_header) == 32,
+		"Lease database header must be 32 bytes long");
+static_assert(sizeof(struct lease_db_record) == 32,
+		"Lease database record must be 32 bytes long");
+
+/* Replication datagrams are this header followed by count records in
+ * the lease database format. Every field is in network byte order. */
+struct repl_header {
+	char magic[4];		/* REPL_MAGIC, not terminated */
+	uint16_t version;	/* REPL_VERSION */
+	uint16_t record_size;	/* may grow, new fields go at the end */
+	uint16_t count;
+	uint16_t flags;		/* REPL_F_* */
+	uint32_t seq;		/* one more than the last datagram's */
+	uint32_t session[2];	/* random, picked as the active starts */
+	uint32_t started[2];	/* when it started, 64 bit seconds */
+};
+
+static_assert(sizeof(struct repl_header) == 32,
+		"Replication header must be 32 bytes long");
+
+/* Replication header flags */
+#define REPL_F_SYNC	(1<<0)	/* part of a full copy of the leases */
+#define REPL_F_MAC	(1<<1)	/* followed by a REPL_MAC_LEN byte tag */
+
+/* SipHash-2-4 tag of the header and records, with dynamic-replica-key */
+#define REPL_MAC_LEN	8
+
+/* Lease record flags */
+#define DB_F_MAPPED	(1<<0)	/* active when the database was written */
+#define DB_F_EXPIRED	(1<<1)	/* replication only, the lease has ended */
+
+struct lease_list {
+	struct lease_rec *v;
+	uint32_t len;
+	uint32_t cap;
+};
+
+/* Address ranges of the maps a loaded lease must not fall inside */
+struct range4 {
+	uint32_t lo, hi;	/* host byte order */
+};
+
+struct range6 {
+	struct in6_addr lo, hi;
+};
+
+struct lease_index {
+	struct range4 *r4;
+	uint32_t n4;
+	uint32_t pos4;	/* leases are checked in IPv4 order */
+	struct range6 *r6;
+	uint32_t n6;
+	int ok;		/* zero to fall back to find_map4/find_map6 */
+};
+
+/* File leases are being loaded from, for messages */
+static const char *lease_src = TEXT_FILE;
+
+/* Journal of lease changes since the map file was last written, shared
+ * by every pool. journal_mutex is taken after any pool mutex and
+ * map_mutex, and only around the file itself. */
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int journal_fd = -1;
+static uint32_t journal_records;
+static int journal_dirty;
+
+/* Map file rewrite running in the background */
+static struct {
+	pthread_t thread;
+	int running;	/* started and not yet joined */
+	int done;	/* set by the thread as it finishes */
+	struct lease_list leases;
+	time_t when;
+} compact;
+
+/* Hosts queued by dynamic_enqueue() for the assignment thread. The
+ * mutex is taken directly rather than with LOCK(), as the thread sleeps
+ * on it in pthread_cond_wait(). */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct in6_addr v[ASSIGN_QUEUE_LEN];
+	uint32_t head, tail;	/* free running, tail - head are queued */
+	pthread_t thread;
+	int running;
+	int stop;
+} assign_queue = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Lease changes queued for the standby by repl_push(), and the sockets
+ * either end. As with assign_queue, the mutex is taken directly. */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct lease_db_record v[REPL_QUEUE_LEN];
+	uint32_t head, tail;	/* free running, tail - head are queued */
+	uint32_t seq;		/* of the next datagram sent */
+	uint32_t session[2];
+	time_t started;
+	int sync;		/* a full copy is wanted */
+	time_t last_sync;
+	int fd;
+	pthread_t thread;
+	int running;
+	int stop;
+	int listen_fd;
+	uint32_t next_seq;	/* expected from the active */
+	int have_seq;
+	uint32_t peer_session[2]; /* of the datagrams from the active */
+	time_t peer_started;
+} repl = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.fd = -1,
+	.listen_fd = -1,
+};
+
+static uint32_t host_hash6(const struct in6_addr *addr6)
 {
-	struct map_dynamic *d;
+	uint32_t h;
+
+	/* Multiply after each word, so equal words cannot cancel out */
+	h = (addr6->s6_addr32[0] ^ gcfg.rand[4]) * 0x9e3779b1U;
+	h = (h ^ addr6->s6_addr32[1] ^ gcfg.rand[5]) * 0x9e3779b1U;
+	h = (h ^ addr6->s6_addr32[2] ^ gcfg.rand[6]) * 0x9e3779b1U;
+	h = (h ^ addr6->s6_addr32[3] ^ gcfg.rand[7]) * 0x9e3779b1U;
+	return h;
+}
+
+/* The top bits of host_hash6() pick the pool, so mix them into the rest
+ * before picking a bucket */
+static uint32_t dyn_hash6(const struct dynamic_pool *pool,
+		const struct in6_addr *addr6)
+{
+	return (host_hash6(addr6) * 0x85ebca6bU) >> (32 - pool->hash_bits);
+}
+
+/* Pool addresses are consecutive, so their offsets spread evenly */
+static uint32_t dyn_hash4(const struct dynamic_pool *pool,
+		const struct in_addr *addr4)
+{
+	return (ntohl(addr4->s_addr) - ntohl(pool->map4.addr.s_addr)) &
+		((1U << pool->hash_bits) - 1);
+}
+
+/* Pool a host is assigned from first, and looked up in first */
+static struct dynamic_pool *home_pool(const struct in6_addr *addr6)
+{
+	return gcfg.dyn_pools[(uint64_t)host_hash6(addr6) *
+		gcfg.dyn_pool_count >> 32];
+}
+
+/**
+ * @brief Find the dynamic pool containing an IPv4 address
+ *
+ * gcfg.dyn_pools is kept sorted by address, and pools never overlap.
+ */
+static struct dynamic_pool *find_pool(const struct in_addr *addr4)
+{
+	struct dynamic_pool *pool;
 	uint32_t a = ntohl(addr4->s_addr);
+	int lo = 0, hi = gcfg.dyn_pool_count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ntohl(gcfg.dyn_pools[mid]->map4.addr.s_addr) <= a)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return NULL;
+	pool = gcfg.dyn_pools[lo - 1];
+	if ((addr4->s_addr & pool->map4.mask.s_addr) != pool->map4.addr.s_addr)
+		return NULL;
+	return pool;
+}
+
+static int in_use(const struct dynamic_pool *pool, uint32_t off)
+{
+	return (pool->in_use[off / 32] >> (off % 32)) & 1;
+}
+
+static void set_in_use(struct dynamic_pool *pool, uint32_t off, int used)
+{
+	if (used) {
+		pool->in_use[off / 32] |= 1U << (off % 32);
+		--pool->free_count;
+	} else {
+		pool->in_use[off / 32] &= ~(1U << (off % 32));
+		++pool->free_count;
+	}
+}
+
+/**
+ * @brief Find the first free offset in the pool bitmap
+ *
+ * @param pool Dynamic pool
+ * @param off First offset to consider
+ * @param end Offset to stop before
+ * @returns free offset, or end if there is none
+ */
+static uint32_t next_free(const struct dynamic_pool *pool, uint32_t off,
+		uint32_t end)
+{
+	uint32_t w;
+
+	while (off < end) {
+		w = ~pool->in_use[off / 32] & (~0U << (off % 32));
+		if (w) {
+			off = (off & ~31U) + __builtin_ctz(w);
+			return off < end ? off : end;
+		}
+		off = (off & ~31U) + 32;
+	}
+	return end;
+}
+
+static struct map_dynamic *find_dynamic(const struct dynamic_pool *pool,
+		const struct in6_addr *addr6)
+{
+	struct list_head *entry, *bucket;
+	struct map_dynamic *d;
+
+	bucket = &pool->hash_table6[dyn_hash6(pool, addr6)];
+	list_for_each(entry, bucket) {
+		d = list_entry(entry, struct map_dynamic, hash6);
+		if (IN6_ARE_ADDR_EQUAL(addr6, &d->map6.addr))
+			return d;
+	}
+	return NULL;
+}
+
+/* Add a map to the pool's IPv6 hash, called with the pool mutex held */
+static void link_host(struct dynamic_pool *pool, struct map_dynamic *d)
+{
+	list_add(&d->hash6, &pool->hash_table6[dyn_hash6(pool,
+				&d->map6.addr)]);
+	if (home_pool(&d->map6.addr) != pool)
+		__atomic_add_fetch(&pool->foreign, 1, __ATOMIC_RELEASE);
+}
+
+static void unlink_host(struct dynamic_pool *pool, struct map_dynamic *d)
+{
+	list_del(&d->hash6);
+	if (home_pool(&d->map6.addr) != pool)
+		__atomic_sub_fetch(&pool->foreign, 1, __ATOMIC_RELEASE);
+}
+
+static void heap_set(struct dyn_heap *h, uint32_t i, struct map_dynamic *d)
+{
+	h->v[i] = d;
+	d->heap_idx = i;
+}
+
+static void heap_sift_up(struct dyn_heap *h, uint32_t i)
+{
+	struct map_dynamic *d = h->v[i];
+	uint32_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (h->v[parent]->expires <= d->expires)
+			break;
+		heap_set(h, i, h->v[parent]);
+		i = parent;
+	}
+	heap_set(h, i, d);
+}
+
+static void heap_sift_down(struct dyn_heap *h, uint32_t i)
+{
+	struct map_dynamic *d = h->v[i];
+	uint32_t child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= h->len)
+			break;
+		if (child + 1 < h->len &&
+				h->v[child + 1]->expires < h->v[child]->expires)
+			++child;
+		if (d->expires <= h->v[child]->expires)
+			break;
+		heap_set(h, i, h->v[child]);
+		i = child;
+	}
+	heap_set(h, i, d);
+}
+
+/**
+ * @brief Make room in a heap for every map in the pool plus one
+ *
+ * Each map sits in exactly one of the pool's heaps, so reserving this
+ * when a map is allocated means heap_insert() cannot fail later.
+ *
+ * @returns 0, or -1 if out of memory
+ */
+static int heap_reserve(struct dyn_heap *h, uint32_t n)
+{
+	struct map_dynamic **v;
+	uint32_t cap;
+
+	if (n <= h->cap)
+		return 0;
+	cap = h->cap ? h->cap : 64;
+	while (cap < n)
+		cap *= 2;
+	v = (struct map_dynamic **)realloc(h->v, cap * sizeof(*v));
+	if (!v)
+		return -1;
+	h->v = v;
+	h->cap = cap;
+	return 0;
+}
+
+static void heap_insert(struct dyn_heap *h, struct map_dynamic *d)
+{
+	h->v[h->len] = d;
+	heap_sift_up(h, h->len++);
+}
+
+static void heap_remove(struct dyn_heap *h, struct map_dynamic *d)
+{
+	uint32_t i = d->heap_idx;
+
+	d->heap_idx = -1;
+	if (i == --h->len)
+		return;
+	h->v[i] = h->v[h->len];
+	h->v[i]->heap_idx = i;
+	if (i > 0 && h->v[i]->expires < h->v[(i - 1) / 2]->expires)
+		heap_sift_up(h, i);
+	else
+		heap_sift_down(h, i);
+}
+
+/* Restore heap order over the whole array at once */
+static void heap_build(struct dyn_heap *h)
+{
+	uint32_t i;
+
+	for (i = 0; i < h->len; ++i)
+		h->v[i]->heap_idx = i;
+	for (i = h->len / 2; i-- > 0; )
+		heap_sift_down(h, i);
+}
+
+static struct map_dynamic *alloc_map_dynamic(struct dynamic_pool *pool,
+		const struct in6_addr *addr6, const struct in_addr *addr4)
+{
+	struct map_dynamic *d;
+	uint32_t n = pool->mapped.len + pool->dormant.len + 1;
 
 	d = (struct map_dynamic *)malloc(sizeof(struct map_dynamic));
-	if (!d) {
+	if (!d || heap_reserve(&pool->mapped, n) ||
+			heap_reserve(&pool->dormant, n)) {
 		slog(LOG_CRIT, "Unable to allocate memory\n");
+		free(d);
 		return NULL;
 	}
 	memset(d, 0, sizeof(struct map_dynamic));
-	INIT_LIST_HEAD(&d->list);
+	d->heap_idx = -1;
+	INIT_LIST_HEAD(&d->hash4);
+	INIT_LIST_HEAD(&d->hash6);
 
 	d->map4.type = MAP_TYPE_DYNAMIC_HOST;
 	d->map4.addr = *addr4;
@@ -49,47 +463,95 @@ static struct map_dynamic *alloc_map_dynamic(const struct in6_addr *addr6,
 	calc_ip6_mask(&d->map6.mask, NULL, 128);
 	INIT_LIST_HEAD(&d->map6.list);
 
-	d->free.addr = a;
-	d->free.count = f->count - (a - f->addr);
-	f->count = a - f->addr - 1;
-	INIT_LIST_HEAD(&d->free.list);
-	list_add(&d->free.list, &f->list);
+	set_in_use(pool, ntohl(addr4->s_addr) - ntohl(pool->map4.addr.s_addr),
+			1);
+	list_add(&d->hash4, &pool->hash_table4[dyn_hash4(pool, addr4)]);
+	link_host(pool, d);
 
 	return d;
 }
 
+/**
+ * @brief Activate a new or dormant map
+ *
+ * The map is scheduled for when its minimum lease would run out if it
+ * saw no more traffic. Later use only updates last_use, and
+ * dynamic_maint() reschedules the map if it finds it still in use.
+ */
 static void move_to_mapped(struct map_dynamic *d, struct dynamic_pool *pool)
 {
+	if (d->heap_idx >= 0)
+		heap_remove(&pool->dormant, d);
 	insert_map4(&d->map4, NULL);
 	insert_map6(&d->map6, NULL);
-	list_add(&d->list, &pool->mapped_list);
+	d->expires = d->last_use + gcfg.dyn_min_lease;
+	heap_insert(&pool->mapped, d);
 }
 
 static void move_to_dormant(struct map_dynamic *d, struct dynamic_pool *pool)
 {
-	struct list_head *entry;
-	struct map_dynamic *s;
-
 	list_del(&d->map4.list);
 	list_del(&d->map6.list);
+	d->expires = d->last_use + gcfg.dyn_max_lease;
+	heap_insert(&pool->dormant, d);
+}
+
+static time_t get_time64(const uint32_t *v)
+{
+	return (time_t)(((uint64_t)ntohl(v[0]) << 32) | ntohl(v[1]));
+}
+
+static void put_time64(uint32_t *v, time_t t)
+{
+	v[0] = htonl((uint64_t)t >> 32);
+	v[1] = htonl((uint32_t)t);
+}
+
+/**
+ * @brief Append a lease change to the journal
+ *
+ * Called with the mutex of the map's pool held, which keeps the records
+ * for each address in order.
+ *
+ * @param type 'A' for an assignment or reactivation, 'E' for expiry
+ * @param d Dynamic map
+ * @param last_use Time to record for an assignment
+ */
+static void journal_write(char type, const struct map_dynamic *d,
+		time_t last_use)
+{
+	char addrbuf4[INET_ADDRSTRLEN];
+	char addrbuf6[INET6_ADDRSTRLEN];
+	char buf[128];
+	int len;
 
-	if (list_empty(&pool->dormant_list)) {
-		list_add_tail(&d->list, &pool->dormant_list);
+	if (!gcfg.data_dir[0])
 		return;
+	inet_ntop(AF_INET, &d->map4.addr, addrbuf4, sizeof(addrbuf4));
+	if (type == 'A') {
+		inet_ntop(AF_INET6, &d->map6.addr, addrbuf6, sizeof(addrbuf6));
+		len = snprintf(buf, sizeof(buf), "A\t%s\t%s\t%" PRId64 "\n",
+				addrbuf4, addrbuf6, (int64_t)last_use);
+	} else {
+		len = snprintf(buf, sizeof(buf), "E\t%s\n", addrbuf4);
 	}
-
-	s = list_entry(pool->dormant_list.prev, struct map_dynamic, list);
-	if (s->last_use >= d->last_use) {
-		list_add_tail(&d->list, &pool->dormant_list);
+	LOCK(&journal_mutex);
+	if (journal_fd < 0) {
+		UNLOCK(&journal_mutex);
 		return;
 	}
-
-	list_for_each(entry, &pool->dormant_list) {
-		s = list_entry(entry, struct map_dynamic, list);
-		if (s->last_use < d->last_use)
-			break;
+	if (write(journal_fd, buf, len) != len) {
+		slog(LOG_ERR, "Unable to write %s/%s: %s\n", gcfg.data_dir,
+				JOURNAL_FILE, strerror(errno));
+		UNLOCK(&journal_mutex);
+		return;
 	}
-	list_add_tail(&d->list, entry);
+	if (gcfg.dyn_fsync == DYN_FSYNC_ALWAYS)
+		fdatasync(journal_fd);
+	else
+		journal_dirty = 1;
+	++journal_records;
+	UNLOCK(&journal_mutex);
 }
 
 static void print_dyn_change(char *str, struct map_dynamic *d)
@@ -97,38 +559,119 @@ static void print_dyn_change(char *str, struct map_dynamic *d)
 	char addrbuf4[INET_ADDRSTRLEN];
 	char addrbuf6[INET6_ADDRSTRLEN];
 
-	inet_ntop(AF_INET, &d->map4.addr, addrbuf4, sizeof(addrbuf4));
-	inet_ntop(AF_INET6, &d->map6.addr, addrbuf6, sizeof(addrbuf6));
 	/* Log dynamic assignment changes */
 	if(gcfg.log_opts & LOG_OPT_DYN) {
+		inet_ntop(AF_INET, &d->map4.addr, addrbuf4, sizeof(addrbuf4));
+		inet_ntop(AF_INET6, &d->map6.addr, addrbuf6, sizeof(addrbuf6));
 		slog(LOG_INFO, "DYN: [%s] [%s]->[%s]\n",str,addrbuf4, addrbuf6);
 	}
 }
 
-struct map6 *assign_dynamic(const struct in6_addr *addr6)
+/**
+ * @brief Queue a lease change for the standby
+ *
+ * Called with the mutex of the lease's pool held, like journal_write(),
+ * so the changes to each address are sent in order. A change which does
+ * not fit is left for the next full copy.
+ *
+ * @param addr4 Address of the lease
+ * @param addr6 Host holding it
+ * @param last_use Last use of the lease
+ * @param flags DB_F_MAPPED for an assignment, DB_F_EXPIRED for expiry
+ */
+static void repl_push(const struct in_addr *addr4,
+		const struct in6_addr *addr6, time_t last_use, uint32_t flags)
 {
-	struct dynamic_pool *pool;
-	struct list_head *entry;
-	struct free_addr *f;
-	uint32_t i, addr, base, max;
+	struct lease_db_record *rec;
+	uint32_t n;
+
+	if (!gcfg.dyn_replica_len)
+		return;
+	pthread_mutex_lock(&repl.mutex);
+	n = repl.tail - repl.head;
+	if (repl.fd < 0) {
+		pthread_mutex_unlock(&repl.mutex);
+		return;
+	}
+	if (n == REPL_QUEUE_LEN) {
+		pthread_mutex_unlock(&repl.mutex);
+		STAT_INC(dyn_repl_dropped);
+		return;
+	}
+	rec = &repl.v[repl.tail++ % REPL_QUEUE_LEN];
+	put_time64(rec->last_use, last_use);
+	rec->addr4 = *addr4;
+	rec->addr6 = *addr6;
+	rec->flags = htonl(flags);
+	/* Wake the thread for the first change, and again once a batch
+	 * is full */
+	if (n == 0 || n + 1 == REPL_BATCH)
+		pthread_cond_signal(&repl.cond);
+	pthread_mutex_unlock(&repl.mutex);
+}
+
+/**
+ * @brief Try to assign a free pool address to an IPv6 host
+ *
+ * Free addresses come from the in_use bitmap. One which turns out to be
+ * covered by a more specific map is skipped together with the rest of
+ * that map's range.
+ *
+ * @param pool Dynamic pool
+ * @param addr6 IPv6 address of the host
+ * @param off First offset to try
+ * @param end Offset to stop before
+ * @returns new dynamic map, or NULL if none was free
+ */
+static struct map_dynamic *assign_free(struct dynamic_pool *pool,
+		const struct in6_addr *addr6, uint32_t off, uint32_t end)
+{
+	uint32_t base = ntohl(pool->map4.addr.s_addr);
 	struct in_addr addr4;
 	struct map4 *m4;
-	struct map_dynamic *d;
 
-	pool = gcfg.dynamic_pool;
-	if (!pool)
-		return NULL;
+	for (;;) {
+		off = next_free(pool, off, end);
+		if (off >= end)
+			return NULL;
+		addr4.s_addr = htonl(base + off);
+		m4 = find_map4(&addr4);
+		if (m4 == &pool->map4)
+			return alloc_map_dynamic(pool, addr6, &addr4);
+		if (!m4 || m4->prefix_len < pool->map4.prefix_len)
+			return NULL;
+		off = (ntohl(m4->addr.s_addr) | ~ntohl(m4->mask.s_addr)) -
+			base + 1;
+	}
+}
 
-	list_for_each(entry, &pool->dormant_list) {
-		d = list_entry(entry, struct map_dynamic, list);
-		if (IN6_ARE_ADDR_EQUAL(addr6, &d->map6.addr)) {
-			print_dyn_change("reactivated", d);
-			goto activate;
-		}
+/**
+ * @brief Pick a map for an IPv6 host from one pool
+ *
+ * Called with the pool mutex and map_mutex held.
+ *
+ * @param pool Dynamic pool
+ * @param addr6 IPv6 address of the host
+ * @param d Dormant map the host already holds in this pool, or NULL
+ * @param reassign Nonzero to take over the oldest dormant map if no
+ * address is free
+ * @param[out] prev Set to the host which held a map taken over
+ * @returns activated map, or NULL if the pool had nothing to give
+ */
+static struct map_dynamic *assign_pool(struct dynamic_pool *pool,
+		const struct in6_addr *addr6, struct map_dynamic *d,
+		int reassign, struct in6_addr *prev)
+{
+	uint32_t i, base, max;
+
+	if (d) {
+		print_dyn_change("reactivated", d);
+		TRACE2(dyn_reactivate, d->map4.addr.s_addr, &d->map6.addr);
+		goto activate;
 	}
 
 	base = 0;
-	max = (1 << (32 - pool->map4.prefix_len)) - 1;
+	max = pool->size - 1;
 
 	for (i = 0; i < 4; ++i) {
 		base += addr6->s6_addr32[i];
@@ -137,278 +680,1960 @@ struct map6 *assign_dynamic(const struct in6_addr *addr6)
 				(base >> (32 - pool->map4.prefix_len));
 	}
 
-	for (i = 0, entry = NULL; i <= max; ++i) {
-		addr = pool->free_head.addr | ((base + i) & max);
-		if (!entry || addr == pool->free_head.addr)
-			entry = pool->free_list.next;
-		for (;;) {
-			f = list_entry(entry, struct free_addr, list);
-			if (f->addr + f->count >= addr)
-				break;
-			entry = entry->next;
-		}
-		if (f->addr >= addr)
-			continue;
-		addr4.s_addr = htonl(addr);
-		m4 = find_map4(&addr4);
-		if (m4 == &pool->map4) {
-			d = alloc_map_dynamic(addr6, &addr4, f);
-			if (!d)
-				return NULL;
-			print_dyn_change("assigned", d);
-			gcfg.map_write_pending = 1;
-			goto activate;
-		}
+	/* Prefer the address hashed from the host, then the next free one */
+	if (pool->free_count) {
+		d = assign_free(pool, addr6, base, pool->size);
+		if (!d)
+			d = assign_free(pool, addr6, 0, base);
+	}
+	if (d) {
+		print_dyn_change("assigned", d);
+		TRACE2(dyn_assign, d->map4.addr.s_addr, &d->map6.addr);
+		goto activate;
 	}
 
-	if (list_empty(&pool->dormant_list))
+	if (!reassign || !pool->dormant.len)
 		return NULL;
 
-	d = list_entry(pool->dormant_list.prev, struct map_dynamic, list);
+	d = pool->dormant.v[0];
+	unlink_host(pool, d);
+	*prev = d->map6.addr;
 	d->map6.addr = *addr6;
+	link_host(pool, d);
 	print_dyn_change("reassigned", d);
-	gcfg.map_write_pending = 1;
+	TRACE2(dyn_reassign, d->map4.addr.s_addr, &d->map6.addr);
 
 activate:
+	d->last_use = now;
 	move_to_mapped(d, pool);
-	return &d->map6;
+	return d;
 }
 
-static void load_map(struct dynamic_pool *pool, const struct in6_addr *addr6,
-		const struct in_addr *addr4, time_t last_use)
+/**
+ * @brief Assign a dynamic map to an IPv6 host with no map
+ *
+ * Called without map_mutex, and returns with it held. Each host starts
+ * at its home pool, picked by a hash of its address, so hosts arriving
+ * together mostly take different pool mutexes. A host keeps a lease it
+ * already holds in any pool; otherwise it gets a free address from the
+ * first pool with one, or else the oldest dormant lease. Other pools
+ * are only searched for the host's lease if they hold leases of hosts
+ * homed elsewhere, so while no pool has filled up, only the home pool
+ * mutex is taken.
+ *
+ * The journal is written with only the pool mutex held, so translation
+ * goes on while it is written. Another thread may have mapped the same
+ * host by the time map_mutex is taken, in which case that map is
+ * returned.
+ *
+ * @param addr6 IPv6 address of the host
+ * @returns map for the host, or NULL if every pool is exhausted
+ */
+struct map6 *assign_dynamic(const struct in6_addr *addr6)
 {
-	struct list_head *entry;
-	struct free_addr *f;
-	uint32_t addr;
-	struct map4 *m4;
+	struct dynamic_pool *pool;
 	struct map_dynamic *d;
-	char addrbuf4[INET_ADDRSTRLEN];
-	char addrbuf6[INET6_ADDRSTRLEN];
+	struct map6 *m6;
+	struct in6_addr prev;
+	uint32_t first;
+	int pass, i, n = gcfg.dyn_pool_count;
 
-	if (pool->map4.addr.s_addr != (addr4->s_addr &
-					pool->map4.mask.s_addr)) {
-		inet_ntop(AF_INET, addr4, addrbuf4, sizeof(addrbuf4));
-		slog(LOG_NOTICE, "Ignoring map for %s from %s/%s that lies "
-				"outside dynamic pool prefix\n", addrbuf4,
-				gcfg.data_dir, MAP_FILE);
-		return;
-	}
-	m4 = find_map4(addr4);
-	if (m4 != &pool->map4) {
-		inet_ntop(AF_INET, addr4, addrbuf4, sizeof(addrbuf4));
-		slog(LOG_NOTICE, "Ignoring map for %s from %s/%s that "
-				"conflicts with statically-configured map\n",
-				addrbuf4, gcfg.data_dir, MAP_FILE);
-		return;
-	}
-	if (validate_ip6_addr(addr6) < 0) {
-		inet_ntop(AF_INET, addr4, addrbuf4, sizeof(addrbuf4));
-		inet_ntop(AF_INET6, addr6, addrbuf6, sizeof(addrbuf6));
-		slog(LOG_NOTICE, "Ignoring map for %s from %s/%s with "
-				"invalid IPv6 address %s\n", addrbuf4,
-				gcfg.data_dir, MAP_FILE, addrbuf6);
-		return;
+	if (!n) {
+		LOCK(&gcfg.map_mutex);
+		return NULL;
 	}
-	if (find_map6(addr6)) {
-		inet_ntop(AF_INET6, addr6, addrbuf6, sizeof(addrbuf6));
-		slog(LOG_NOTICE, "Ignoring map for %s from %s/%s that "
-				"conflicts with statically-configured map\n",
-				addrbuf6, gcfg.data_dir, MAP_FILE);
-		return;
+	first = (uint64_t)host_hash6(addr6) * n >> 32;
+
+	/* Pass 0 looks for the host's lease away from home, then free
+	 * addresses anywhere are used before dormant leases. The home
+	 * pool is searched for the host's own lease along the way. */
+	for (pass = 0; pass < 3; ++pass) {
+		for (i = pass ? 0 : 1; i < n; ++i) {
+			pool = gcfg.dyn_pools[(first + i) % n];
+			if (!pass && !__atomic_load_n(&pool->foreign,
+						__ATOMIC_ACQUIRE))
+				continue;
+			LOCK(&pool->mutex);
+			d = find_dynamic(pool, addr6);
+			if (!d && (pass == 0 || (pass == 1 &&
+						!pool->free_count) ||
+					(pass == 2 && !pool->dormant.len))) {
+				UNLOCK(&pool->mutex);
+				continue;
+			}
+			LOCK(&gcfg.map_mutex);
+			m6 = find_map6(addr6);
+			if (m6) {
+				UNLOCK(&pool->mutex);
+				return m6;
+			}
+			memset(&prev, 0, sizeof(prev));
+			d = assign_pool(pool, addr6, d, pass == 2, &prev);
+			if (d) {
+				UNLOCK(&gcfg.map_mutex);
+				journal_write('A', d, d->last_use);
+				/* The standby drops the previous host's lease
+				 * by its IPv6 address */
+				if (!IN6_IS_ADDR_UNSPECIFIED(&prev))
+					repl_push(&d->map4.addr, &prev, 0,
+							DB_F_EXPIRED);
+				repl_push(&d->map4.addr, &d->map6.addr,
+						d->last_use, DB_F_MAPPED);
+				LOCK(&gcfg.map_mutex);
+				UNLOCK(&pool->mutex);
+				STAT_INC(dyn_assign);
+				return &d->map6;
+			}
+			UNLOCK(&gcfg.map_mutex);
+			UNLOCK(&pool->mutex);
+		}
 	}
-	addr = ntohl(addr4->s_addr);
-	list_for_each(entry, &pool->free_list) {
-		f = list_entry(entry, struct free_addr, list);
-		if (f->addr + f->count >= addr)
-			break;
+	LOCK(&gcfg.map_mutex);
+	return NULL;
+}
+
+/**
+ * @brief Queue an IPv6 host for the assignment thread
+ *
+ * Called from the packet path with dynamic-assign async, in place of
+ * assign_dynamic(). A host usually sends several packets before its map
+ * is in place, so one already among the last few queued is not queued
+ * again.
+ *
+ * @param addr6 IPv6 address of the host
+ * @returns 0 if the host is queued, -1 if the queue is full
+ */
+int dynamic_enqueue(const struct in6_addr *addr6)
+{
+	struct in6_addr *v = assign_queue.v;
+	uint32_t i;
+
+	pthread_mutex_lock(&assign_queue.mutex);
+	for (i = assign_queue.tail; i != assign_queue.head &&
+			assign_queue.tail - i < 8; --i) {
+		if (IN6_ARE_ADDR_EQUAL(addr6,
+					&v[(i - 1) % ASSIGN_QUEUE_LEN])) {
+			pthread_mutex_unlock(&assign_queue.mutex);
+			return 0;
+		}
 	}
-	if (entry == &pool->free_list || f->addr >= addr) {
-		inet_ntop(AF_INET, addr4, addrbuf4, sizeof(addrbuf4));
-		slog(LOG_NOTICE, "Ignoring duplicate map for %s from %s/%s\n",
-				addrbuf4, gcfg.data_dir, MAP_FILE);
-		return;
+	if (assign_queue.tail - assign_queue.head == ASSIGN_QUEUE_LEN) {
+		pthread_mutex_unlock(&assign_queue.mutex);
+		STAT_INC(dyn_queue_full);
+		return -1;
 	}
-	d = alloc_map_dynamic(addr6, addr4, f);
-	if (!d)
-		return;
-	d->last_use = last_use;
-	move_to_dormant(d, pool);
+	if (assign_queue.tail == assign_queue.head)
+		pthread_cond_signal(&assign_queue.cond);
+	v[assign_queue.tail++ % ASSIGN_QUEUE_LEN] = *addr6;
+	pthread_mutex_unlock(&assign_queue.mutex);
+	STAT_INC(dyn_queued);
+	return 0;
 }
 
-void load_dynamic(struct dynamic_pool *pool)
+/* Take queued hosts a batch at a time and assign them */
+static void *assign_thread(void *arg)
 {
-	FILE *in;
-	char line[512];
-	char *s4, *s6, *stime, *end, *tokptr;
-	struct in_addr addr4;
-	struct in6_addr addr6;
-	time_t last_use;
-	struct list_head *entry;
-	struct map_dynamic *d;
-	int count = 0;
+	struct in6_addr batch[ASSIGN_BATCH];
+	uint32_t i, n;
 
-	in = fopen(MAP_FILE, "r");
-	if (!in) {
-		if (errno != ENOENT)
-			slog(LOG_ERR, "Unable to open %s/%s, ignoring: %s\n",
-					gcfg.data_dir, MAP_FILE,
-					strerror(errno));
-		return;
-	}
-	while (fgets(line, sizeof(line), in)) {
-		if (strlen(line) + 1 == sizeof(line)) {
-			slog(LOG_ERR, "Ignoring oversized line in %s/%s\n",
-					gcfg.data_dir, MAP_FILE);
+	(void)arg;
+	pthread_mutex_lock(&assign_queue.mutex);
+	while (!assign_queue.stop) {
+		n = assign_queue.tail - assign_queue.head;
+		if (!n) {
+			pthread_cond_wait(&assign_queue.cond,
+					&assign_queue.mutex);
 			continue;
 		}
-		s4 = strtok_r(line, DELIM, &tokptr);
-		if (!s4 || *s4 == '#')
-			continue;
-		s6 = strtok_r(NULL, DELIM, &tokptr);
-		if (!s6)
-			goto malformed;
-		stime = strtok_r(NULL, DELIM, &tokptr);
-		if (!stime)
-			goto malformed;
-		end = strtok_r(NULL, DELIM, &tokptr);
-		if (end)
-			goto malformed;
-		if (!inet_pton(AF_INET, s4, &addr4) ||
-				!inet_pton(AF_INET6, s6, &addr6))
-			goto malformed;
-#if LONG_MAX == INT64_MAX
-		last_use = strtol(stime, &end, 10);
-#elif LLONG_MAX == INT64_MAX
-		last_use = strtoll(stime, &end, 10);
-#else
-#  error Either long or long long must be 64 bits
-#endif
-		if (last_use <= 0 || *end)
-			goto malformed;
-		load_map(pool, &addr6, &addr4, last_use);
-		continue;
-malformed:
-		slog(LOG_ERR, "Ignoring malformed line in %s/%s\n",
-				gcfg.data_dir, MAP_FILE);
-	}
-	fclose(in);
+		if (n > ASSIGN_BATCH)
+			n = ASSIGN_BATCH;
+		for (i = 0; i < n; ++i)
+			batch[i] = assign_queue.v[assign_queue.head++ %
+				ASSIGN_QUEUE_LEN];
+		pthread_mutex_unlock(&assign_queue.mutex);
 
-	time(&now);
-	last_use = 0;
-	list_for_each(entry, &pool->dormant_list) {
-		d = list_entry(entry, struct map_dynamic, list);
-		if (d->last_use > last_use)
-			last_use = d->last_use;
-		print_dyn_change("loaded",d);
-		++count;
-	}
-	slog(LOG_INFO, "Loaded %d dynamic %s from %s/%s\n", count,
-			count == 1 ? "map" : "maps",
-			gcfg.data_dir, MAP_FILE);
-	if (last_use > now) {
-		slog(LOG_NOTICE, "Note: maps in %s/%s are dated in the future\n",
-				gcfg.data_dir, MAP_FILE);
-		list_for_each(entry, &pool->dormant_list) {
-			d = list_entry(entry, struct map_dynamic, list);
-			d->last_use = now - gcfg.dyn_min_lease;
-		}
-	} else {
-		while (!list_empty(&pool->dormant_list)) {
-			d = list_entry(pool->dormant_list.next,
-					struct map_dynamic, list);
-			if (d->last_use + gcfg.dyn_min_lease < now)
-				break;
-			move_to_mapped(d, pool);
+		/* Hosts queued twice, or mapped meanwhile, are only looked
+		 * up. A full pool leaves the host to be queued again by its
+		 * next packet. */
+		for (i = 0; i < n; ++i) {
+			assign_dynamic(&batch[i]);
+			UNLOCK(&gcfg.map_mutex);
 		}
+		pthread_mutex_lock(&assign_queue.mutex);
 	}
+	pthread_mutex_unlock(&assign_queue.mutex);
+	return NULL;
 }
 
-static void write_to_file(struct dynamic_pool *pool)
+/**
+ * @brief Start the thread assigning hosts queued by dynamic_enqueue()
+ *
+ * Its assignments are counted in the main thread's statistics, which
+ * never assigns itself when the thread is in use.
+ *
+ * @returns 0 on success, -1 if the thread could not be started
+ */
+int dynamic_async_start(void)
 {
-	FILE *out;
+	int ret;
+
+	if (assign_queue.running)
+		return 0;
+	assign_queue.stop = 0;
+	ret = pthread_create(&assign_queue.thread, NULL, assign_thread, NULL);
+	if (ret) {
+		slog(LOG_CRIT, "Unable to start dynamic assignment thread: "
+				"%s\n", strerror(ret));
+		return -1;
+	}
+	assign_queue.running = 1;
+	return 0;
+}
+
+/* Stop the assignment thread, dropping any hosts still queued */
+void dynamic_async_stop(void)
+{
+	if (!assign_queue.running)
+		return;
+	pthread_mutex_lock(&assign_queue.mutex);
+	assign_queue.stop = 1;
+	pthread_cond_signal(&assign_queue.cond);
+	pthread_mutex_unlock(&assign_queue.mutex);
+	pthread_join(assign_queue.thread, NULL);
+	assign_queue.running = 0;
+	assign_queue.head = assign_queue.tail = 0;
+}
+
+static int range4_cmp(const void *a, const void *b)
+{
+	const struct range4 *ra = a, *rb = b;
+
+	return ra->lo < rb->lo ? -1 : ra->lo > rb->lo;
+}
+
+static int range6_cmp(const void *a, const void *b)
+{
+	const struct range6 *ra = a, *rb = b;
+
+	return memcmp(&ra->lo, &rb->lo, sizeof(ra->lo));
+}
+
+/**
+ * @brief Index the static maps for checking loaded leases
+ *
+ * Collects the ranges of the IPv4 maps more specific than a pool and
+ * lying inside it, and of every IPv6 map, each sorted and merged so no
+ * two overlap. Prefixes either nest or are disjoint, so merging only
+ * ever drops ranges inside another.
+ */
+static void build_lease_index(struct lease_index *idx)
+{
+	struct dynamic_pool *pool;
 	struct list_head *entry;
+	struct map4 *m4;
+	struct map6 *m6;
+	uint32_t n, i, k;
+
+	memset(idx, 0, sizeof(*idx));
+	n = 0;
+	list_for_each(entry, &gcfg.map4_list)
+		++n;
+	idx->r4 = (struct range4 *)malloc((n + 1) * sizeof(*idx->r4));
+	n = 0;
+	list_for_each(entry, &gcfg.map6_list)
+		++n;
+	idx->r6 = (struct range6 *)malloc((n + 1) * sizeof(*idx->r6));
+	if (!idx->r4 || !idx->r6) {
+		slog(LOG_WARNING, "Unable to allocate memory, loading dynamic "
+				"maps slowly\n");
+		return;
+	}
+
+	n = 0;
+	list_for_each(entry, &gcfg.map4_list) {
+		m4 = list_entry(entry, struct map4, list);
+		pool = find_pool(&m4->addr);
+		if (!pool || m4->prefix_len <= pool->map4.prefix_len)
+			continue;
+		idx->r4[n].lo = ntohl(m4->addr.s_addr);
+		idx->r4[n].hi = idx->r4[n].lo | ~ntohl(m4->mask.s_addr);
+		++n;
+	}
+	if (n)
+		qsort(idx->r4, n, sizeof(*idx->r4), range4_cmp);
+	for (i = k = 0; i < n; ++i) {
+		if (k && idx->r4[i].lo <= idx->r4[k - 1].hi) {
+			if (idx->r4[i].hi > idx->r4[k - 1].hi)
+				idx->r4[k - 1].hi = idx->r4[i].hi;
+		} else {
+			idx->r4[k++] = idx->r4[i];
+		}
+	}
+	idx->n4 = k;
+
+	n = 0;
+	list_for_each(entry, &gcfg.map6_list) {
+		m6 = list_entry(entry, struct map6, list);
+		for (i = 0; i < 4; ++i) {
+			idx->r6[n].lo.s6_addr32[i] = m6->addr.s6_addr32[i] &
+				m6->mask.s6_addr32[i];
+			idx->r6[n].hi.s6_addr32[i] = m6->addr.s6_addr32[i] |
+				~m6->mask.s6_addr32[i];
+		}
+		++n;
+	}
+	if (n)
+		qsort(idx->r6, n, sizeof(*idx->r6), range6_cmp);
+	for (i = k = 0; i < n; ++i) {
+		if (k && memcmp(&idx->r6[i].lo, &idx->r6[k - 1].hi,
+					sizeof(struct in6_addr)) <= 0) {
+			if (memcmp(&idx->r6[i].hi, &idx->r6[k - 1].hi,
+						sizeof(struct in6_addr)) > 0)
+				idx->r6[k - 1].hi = idx->r6[i].hi;
+		} else {
+			idx->r6[k++] = idx->r6[i];
+		}
+	}
+	idx->n6 = k;
+	idx->ok = 1;
+}
+
+/* Called with addresses in ascending order */
+static int index_has_ip4(struct lease_index *idx, const struct in_addr *addr4,
+		const struct dynamic_pool *pool)
+{
+	uint32_t a = ntohl(addr4->s_addr);
+
+	if (!idx->ok)
+		return find_map4(addr4) != &pool->map4;
+	while (idx->pos4 < idx->n4 && idx->r4[idx->pos4].hi < a)
+		++idx->pos4;
+	return idx->pos4 < idx->n4 && idx->r4[idx->pos4].lo <= a;
+}
+
+static int index_has_ip6(const struct lease_index *idx,
+		const struct in6_addr *addr6)
+{
+	uint32_t lo = 0, hi, mid;
+
+	if (!idx->ok)
+		return find_map6(addr6) != NULL;
+	/* Find the last range starting at or below addr6 */
+	hi = idx->n6;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(&idx->r6[mid].lo, addr6, sizeof(*addr6)) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo > 0 && memcmp(addr6, &idx->r6[lo - 1].hi,
+			sizeof(*addr6)) <= 0;
+}
+
+/**
+ * @brief Add a lease from the map file to its pool
+ *
+ * The map is left at the end of the dormant heap without restoring
+ * heap order; load_dynamic() builds both heaps once every lease is in.
+ */
+static void load_map(struct dynamic_pool *pool, const struct lease_rec *r,
+		struct lease_index *idx)
+{
+	const struct in_addr *addr4 = &r->addr4;
+	const struct in6_addr *addr6 = &r->addr6;
 	struct map_dynamic *d;
 	char addrbuf4[INET_ADDRSTRLEN];
 	char addrbuf6[INET6_ADDRSTRLEN];
 
-	out = fopen(TMP_MAP_FILE, "w");
+	if (!pool) {
+		inet_ntop(AF_INET, addr4, addrbuf4, sizeof(addrbuf4));
+		slog(LOG_NOTICE, "Ignoring map for %s from %s/%s that lies "
+				"outside dynamic pool prefix\n", addrbuf4,
+				gcfg.data_dir, lease_src);
+		return;
+	}
+	if (index_has_ip4(idx, addr4, pool)) {
+		inet_ntop(AF_INET, addr4, addrbuf4, sizeof(addrbuf4));
+		slog(LOG_NOTICE, "Ignoring map for %s from %s/%s that "
+				"conflicts with statically-configured map\n",
+				addrbuf4, gcfg.data_dir, lease_src);
+		return;
+	}
+	if (validate_ip6_addr(addr6) < 0) {
+		inet_ntop(AF_INET, addr4, addrbuf4, sizeof(addrbuf4));
+		inet_ntop(AF_INET6, addr6, addrbuf6, sizeof(addrbuf6));
+		slog(LOG_NOTICE, "Ignoring map for %s from %s/%s with "
+				"invalid IPv6 address %s\n", addrbuf4,
+				gcfg.data_dir, lease_src, addrbuf6);
+		return;
+	}
+	if (index_has_ip6(idx, addr6)) {
+		inet_ntop(AF_INET6, addr6, addrbuf6, sizeof(addrbuf6));
+		slog(LOG_NOTICE, "Ignoring map for %s from %s/%s that "
+				"conflicts with statically-configured map\n",
+				addrbuf6, gcfg.data_dir, lease_src);
+		return;
+	}
+	if (in_use(pool, ntohl(addr4->s_addr) -
+				ntohl(pool->map4.addr.s_addr))) {
+		inet_ntop(AF_INET, addr4, addrbuf4, sizeof(addrbuf4));
+		slog(LOG_NOTICE, "Ignoring duplicate map for %s from %s/%s\n",
+				addrbuf4, gcfg.data_dir, lease_src);
+		return;
+	}
+	if (find_dynamic(pool, addr6)) {
+		inet_ntop(AF_INET6, addr6, addrbuf6, sizeof(addrbuf6));
+		slog(LOG_NOTICE, "Ignoring duplicate map for %s from %s/%s\n",
+				addrbuf6, gcfg.data_dir, lease_src);
+		return;
+	}
+	d = alloc_map_dynamic(pool, addr6, addr4);
+	if (!d)
+		return;
+	d->last_use = r->last_use;
+	d->expires = d->last_use + gcfg.dyn_max_lease;
+	heap_set(&pool->dormant, pool->dormant.len++, d);
+}
+
+static int lease_push(struct lease_list *l, const struct lease_rec *r)
+{
+	struct lease_rec *v;
+	uint32_t cap;
+
+	if (l->len == l->cap) {
+		cap = l->cap ? l->cap * 2 : 256;
+		v = (struct lease_rec *)realloc(l->v, cap * sizeof(*v));
+		if (!v) {
+			slog(LOG_CRIT, "Unable to allocate memory\n");
+			return -1;
+		}
+		l->v = v;
+		l->cap = cap;
+	}
+	l->v[l->len++] = *r;
+	return 0;
+}
+
+/* Split off the next whitespace-separated field of a line */
+static char *next_field(char **line)
+{
+	char *s = *line, *start;
+
+	while (*s == ' ' || *s == '\t' || *s == '\r')
+		++s;
+	if (!*s)
+		return NULL;
+	start = s;
+	while (*s && *s != ' ' && *s != '\t' && *s != '\r')
+		++s;
+	if (*s)
+		*s++ = 0;
+	*line = s;
+	return start;
+}
+
+/* Parse a dotted quad, strictly as inet_pton() does */
+static int parse_lease_ip4(const char *s, struct in_addr *addr4)
+{
+	uint32_t a = 0, octet;
+	int i, digits;
+
+	for (i = 0; i < 4; ++i) {
+		if (i && *s++ != '.')
+			return -1;
+		octet = 0;
+		for (digits = 0; *s >= '0' && *s <= '9'; ++digits) {
+			if (digits && !octet)
+				return -1;
+			octet = octet * 10 + *s++ - '0';
+			if (octet > 255)
+				return -1;
+		}
+		if (!digits)
+			return -1;
+		a = a << 8 | octet;
+	}
+	if (*s)
+		return -1;
+	addr4->s_addr = htonl(a);
+	return 0;
+}
+
+static int parse_lease_time(const char *s, time_t *t)
+{
+	int64_t v = 0;
+
+	if (!*s)
+		return -1;
+	for (; *s >= '0' && *s <= '9'; ++s) {
+		if (v > (INT64_MAX - 9) / 10)
+			return -1;
+		v = v * 10 + *s - '0';
+	}
+	if (*s || v <= 0 || (int64_t)(time_t)v != v)
+		return -1;
+	*t = (time_t)v;
+	return 0;
+}
+
+/**
+ * @brief Read the map file or a journal into a lease list
+ *
+ * Map file lines are "ipv4 ipv6 last_use". Journal lines carry a type
+ * first, "A ipv4 ipv6 last_use" or "E ipv4". The file is read whole
+ * and split in place.
+ *
+ * @param file File name, relative to the data-dir
+ * @param journal Nonzero if the file is a journal
+ * @param l List to append to
+ * @returns 0, or -1 if the file could not be read
+ */
+static int read_leases(const char *file, int journal, struct lease_list *l)
+{
+	struct stat st;
+	char *buf, *line, *next, *eol, *s4, *s6, *stime, *type;
+	struct lease_rec r;
+	size_t len;
+	ssize_t ret;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			slog(LOG_ERR, "Unable to open %s/%s, ignoring: %s\n",
+					gcfg.data_dir, file, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		slog(LOG_ERR, "Unable to read %s/%s, ignoring: %s\n",
+				gcfg.data_dir, file, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	buf = (char *)malloc(st.st_size + 1);
+	if (!buf) {
+		slog(LOG_CRIT, "Unable to allocate memory\n");
+		close(fd);
+		return -1;
+	}
+	for (len = 0; len < (size_t)st.st_size; len += ret) {
+		ret = read(fd, buf + len, st.st_size - len);
+		if (ret < 0 && errno == EINTR) {
+			ret = 0;
+			continue;
+		}
+		if (ret < 0)
+			slog(LOG_ERR, "Unable to read %s/%s: %s\n",
+					gcfg.data_dir, file, strerror(errno));
+		if (ret <= 0)
+			break;
+	}
+	close(fd);
+	buf[len] = 0;
+
+	for (line = buf; line < buf + len; line = next) {
+		eol = (char *)memchr(line, '\n', buf + len - line);
+		if (eol) {
+			*eol = 0;
+			next = eol + 1;
+		} else {
+			next = buf + len;
+		}
+		memset(&r, 0, sizeof(r));
+		r.type = 'S';
+		s4 = next_field(&line);
+		if (!s4 || *s4 == '#')
+			continue;
+		if (journal) {
+			type = s4;
+			if ((*type != 'A' && *type != 'E') || type[1])
+				goto malformed;
+			r.type = *type;
+			s4 = next_field(&line);
+			if (!s4)
+				goto malformed;
+		}
+		if (parse_lease_ip4(s4, &r.addr4) < 0)
+			goto malformed;
+		if (r.type != 'E') {
+			s6 = next_field(&line);
+			if (!s6)
+				goto malformed;
+			stime = next_field(&line);
+			if (!stime)
+				goto malformed;
+			if (!inet_pton(AF_INET6, s6, &r.addr6))
+				goto malformed;
+			if (parse_lease_time(stime, &r.last_use) < 0)
+				goto malformed;
+		}
+		if (next_field(&line))
+			goto malformed;
+		r.seq = l->len;
+		if (lease_push(l, &r) < 0)
+			break;
+		continue;
+malformed:
+		slog(LOG_ERR, "Ignoring malformed line in %s/%s\n",
+				gcfg.data_dir, file);
+	}
+	free(buf);
+	return 0;
+}
+
+/* CRC-32 (IEEE 802.3) lookup table, built on first use */
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; ++i) {
+		c = i;
+		for (k = 0; k < 8; ++k)
+			c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+/* Continue a CRC-32, starting from 0 */
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	pthread_once(&crc_once, crc_init);
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/**
+ * @brief Read the binary lease database into a lease list
+ *
+ * The file is mapped rather than read, and its records copied straight
+ * into the list. A database which fails its checks is renamed aside,
+ * so the next rewrite cannot lose it.
+ *
+ * @param l List to append to
+ * @returns 0, or -1 if there is no usable database
+ */
+static int read_lease_db(struct lease_list *l)
+{
+	struct lease_db_header hdr;
+	const struct lease_db_record *rec;
+	const uint8_t *base;
+	struct lease_rec r;
+	struct stat st;
+	uint32_t crc, count, size, i;
+	const char *why = NULL;
+	int fd;
+
+	fd = open(DB_FILE, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			slog(LOG_ERR, "Unable to open %s/%s, ignoring: %s\n",
+					gcfg.data_dir, DB_FILE, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		slog(LOG_ERR, "Unable to read %s/%s, ignoring: %s\n",
+				gcfg.data_dir, DB_FILE, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < (off_t)sizeof(hdr)) {
+		close(fd);
+		why = "truncated header";
+		goto bad;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		slog(LOG_ERR, "Unable to map %s/%s, ignoring: %s\n",
+				gcfg.data_dir, DB_FILE, strerror(errno));
+		return -1;
+	}
+
+	memcpy(&hdr, base, sizeof(hdr));
+	count = ntohl(hdr.count);
+	size = ntohl(hdr.record_size);
+	if (memcmp(hdr.magic, DB_MAGIC, sizeof(hdr.magic))) {
+		why = "bad magic";
+	} else if (ntohl(hdr.version) != DB_VERSION) {
+		why = "unknown version";
+	} else if (size < sizeof(*rec) || size % 8) {
+		why = "bad record size";
+	} else if ((uint64_t)st.st_size != sizeof(hdr) +
+			(uint64_t)count * size) {
+		why = "wrong length";
+	} else {
+		crc = hdr.crc;
+		hdr.crc = 0;
+		if (ntohl(crc) != crc32_update(crc32_update(0, &hdr,
+						sizeof(hdr)), base + sizeof(hdr),
+					st.st_size - sizeof(hdr)))
+			why = "checksum mismatch";
+	}
+	if (why) {
+		munmap((void *)base, st.st_size);
+		goto bad;
+	}
+
+	madvise((void *)base, st.st_size, MADV_SEQUENTIAL);
+	memset(&r, 0, sizeof(r));
+	r.type = 'S';
+	for (i = 0; i < count; ++i) {
+		rec = (const struct lease_db_record *)(base + sizeof(hdr) +
+				(size_t)i * size);
+		r.addr4 = rec->addr4;
+		r.addr6 = rec->addr6;
+		r.last_use = get_time64(rec->last_use);
+		r.flags = ntohl(rec->flags);
+		r.seq = l->len;
+		if (lease_push(l, &r) < 0)
+			break;
+	}
+	munmap((void *)base, st.st_size);
+	return 0;
+
+bad:
+	slog(LOG_ERR, "Ignoring corrupt %s/%s (%s), moved to %s/%s\n",
+			gcfg.data_dir, DB_FILE, why, gcfg.data_dir,
+			BAD_DB_FILE);
+	rename(DB_FILE, BAD_DB_FILE);
+	return -1;
+}
+
+static int lease_cmp(const void *a, const void *b)
+{
+	const struct lease_rec *ra = a, *rb = b;
+	uint32_t a4 = ntohl(ra->addr4.s_addr), b4 = ntohl(rb->addr4.s_addr);
+
+	if (a4 != b4)
+		return a4 < b4 ? -1 : 1;
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+/**
+ * @brief Sort a lease list, the first n of which came from the map file
+ *
+ * Map files are written in order, so usually only the journal records
+ * after them need sorting before the two runs are merged.
+ */
+static void sort_leases(struct lease_list *l, uint32_t n)
+{
+	struct lease_rec *v;
+	uint32_t i, j, k;
+
+	for (i = 1; i < n; ++i)
+		if (lease_cmp(&l->v[i - 1], &l->v[i]) > 0)
+			break;
+	if (i >= n && n == l->len)
+		return;
+	v = i >= n && n ? (struct lease_rec *)malloc(l->len * sizeof(*v)) :
+		NULL;
+	if (!v) {
+		qsort(l->v, l->len, sizeof(*l->v), lease_cmp);
+		return;
+	}
+	qsort(l->v + n, l->len - n, sizeof(*l->v), lease_cmp);
+	for (i = k = 0, j = n; i < n || j < l->len; ++k) {
+		if (j == l->len || (i < n &&
+					lease_cmp(&l->v[i], &l->v[j]) <= 0))
+			v[k] = l->v[i++];
+		else
+			v[k] = l->v[j++];
+	}
+	free(l->v);
+	l->v = v;
+	l->cap = l->len;
+}
+
+/**
+ * @brief Replay the map file and journals into the pools
+ *
+ * The map file and journal are shared by every pool, each lease going
+ * to the pool holding its IPv4 address.
+ * The last record for each IPv4 address wins. Journal records may
+ * repeat changes the map file already holds, if tayga stopped part way
+ * through a rewrite, so an assignment matching the map file keeps the
+ * later of the two last-use times.
+ *
+ * Leases are read from the map file in the configured dynamic-format,
+ * or from the other format's file if there is none, which converts it
+ * at the next rewrite.
+ *
+ * @returns nonzero if the map file already holds exactly the leases
+ * loaded, so it need not be rewritten
+ */
+static int replay_leases(void)
+{
+	struct lease_list l = { NULL, 0, 0 };
+	struct lease_rec *r, *snap, *cur;
+	struct lease_index idx;
+	struct dynamic_pool *pool;
+	char addrbuf4[INET_ADDRSTRLEN];
+	uint32_t i, nmap, before, loaded;
+	int found, k;
+
+	if (gcfg.dyn_format == DYN_FORMAT_BINARY) {
+		lease_src = DB_FILE;
+		found = !read_lease_db(&l);
+		if (!found && !read_leases(TEXT_FILE, 0, &l))
+			lease_src = TEXT_FILE;
+	} else {
+		lease_src = TEXT_FILE;
+		found = !read_leases(TEXT_FILE, 0, &l);
+		if (!found && !read_lease_db(&l))
+			lease_src = DB_FILE;
+	}
+	nmap = l.len;
+	read_leases(OLD_JOURNAL_FILE, 1, &l);
+	read_leases(JOURNAL_FILE, 1, &l);
+	if (!l.len)
+		return found;
+	sort_leases(&l, nmap);
+	before = 0;
+	for (k = 0; k < gcfg.dyn_pool_count; ++k) {
+		pool = gcfg.dyn_pools[k];
+		before += pool->mapped.len + pool->dormant.len;
+	}
+
+	/* Failure here is only slower, alloc_map_dynamic() tries again */
+	if (gcfg.dyn_pool_count == 1) {
+		pool = gcfg.dyn_pools[0];
+		i = pool->mapped.len + pool->dormant.len + l.len;
+		heap_reserve(&pool->mapped, i);
+		heap_reserve(&pool->dormant, i);
+	}
+	build_lease_index(&idx);
+
+	for (i = 0; i < l.len; ) {
+		snap = cur = NULL;
+		do {
+			r = &l.v[i];
+			if (r->type == 'S' && snap) {
+				inet_ntop(AF_INET, &r->addr4, addrbuf4,
+						sizeof(addrbuf4));
+				slog(LOG_NOTICE, "Ignoring duplicate map for "
+						"%s from %s/%s\n", addrbuf4,
+						gcfg.data_dir, lease_src);
+			} else if (r->type == 'S') {
+				snap = cur = r;
+			} else if (r->type == 'A') {
+				if (snap && IN6_ARE_ADDR_EQUAL(&snap->addr6,
+							&r->addr6) &&
+						snap->last_use > r->last_use)
+					r->last_use = snap->last_use;
+				cur = r;
+			} else {
+				cur = NULL;
+			}
+			++i;
+		} while (i < l.len && l.v[i].addr4.s_addr == r->addr4.s_addr);
+		if (cur)
+			load_map(find_pool(&cur->addr4), cur, &idx);
+	}
+	free(idx.r4);
+	free(idx.r6);
+	free(l.v);
+	loaded = 0;
+	for (k = 0; k < gcfg.dyn_pool_count; ++k) {
+		pool = gcfg.dyn_pools[k];
+		loaded += pool->mapped.len + pool->dormant.len;
+	}
+	return found && l.len == nmap && loaded - before == nmap;
+}
+
+/**
+ * @brief Copy every lease into a lease list
+ *
+ * The pools are locked one at a time. Active leases carry DB_F_MAPPED
+ * and the last use seen by the address cache.
+ *
+ * @param l List to append to
+ * @returns 0, or -1 if the list could not grow
+ */
+static int copy_leases(struct lease_list *l)
+{
+	struct dynamic_pool *pool;
+	struct lease_rec r;
+	struct dyn_heap *h;
+	struct map_dynamic *d;
+	uint32_t i;
+	int k;
+
+	memset(&r, 0, sizeof(r));
+	for (k = 0; k < gcfg.dyn_pool_count; ++k) {
+		pool = gcfg.dyn_pools[k];
+		LOCK(&pool->mutex);
+		LOCK(&gcfg.map_mutex);
+		for (h = &pool->mapped; h; h = h == &pool->mapped ?
+				&pool->dormant : NULL) {
+			for (i = 0; i < h->len; ++i) {
+				d = h->v[i];
+				r.addr4 = d->map4.addr;
+				r.addr6 = d->map6.addr;
+				r.last_use = d->cache_entry ?
+					d->cache_entry->last_use :
+					d->last_use;
+				r.flags = h == &pool->mapped ?
+					DB_F_MAPPED : 0;
+				if (lease_push(l, &r) < 0) {
+					UNLOCK(&gcfg.map_mutex);
+					UNLOCK(&pool->mutex);
+					return -1;
+				}
+			}
+		}
+		UNLOCK(&gcfg.map_mutex);
+		UNLOCK(&pool->mutex);
+	}
+	return 0;
+}
+
+/**
+ * @brief Start a new journal and copy the leases for a map file rewrite
+ *
+ * Called without any lock held. The journal is renamed aside first, so
+ * changes made from then on go to a fresh one, and the pools are copied
+ * one at a time afterwards. A change made between the two is in both
+ * the copy and the fresh journal, and replaying records already in the
+ * map file is harmless. The old journal is removed once the map file is
+ * safely on disk. If an old journal is still there from a rewrite which
+ * failed, the current one is kept instead. At startup the journal just
+ * replayed is moved aside the same way, before any is open.
+ */
+static int compact_begin(void)
+{
+	LOCK(&journal_mutex);
+	if (access(OLD_JOURNAL_FILE, F_OK) < 0) {
+		if (journal_fd >= 0)
+			close(journal_fd);
+		if (rename(JOURNAL_FILE, OLD_JOURNAL_FILE) < 0 &&
+				errno != ENOENT)
+			slog(LOG_ERR, "Unable to rename %s/%s: %s\n",
+					gcfg.data_dir, JOURNAL_FILE,
+					strerror(errno));
+		/* Not truncated, in case the rename failed */
+		journal_fd = open(JOURNAL_FILE,
+				O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (journal_fd < 0)
+			slog(LOG_ERR, "Unable to open %s/%s: %s\n",
+					gcfg.data_dir, JOURNAL_FILE,
+					strerror(errno));
+		journal_records = 0;
+	}
+	UNLOCK(&journal_mutex);
+
+	compact.leases.len = 0;
+	compact.when = now;
+	return copy_leases(&compact.leases);
+}
+
+static char *put_ip4(char *p, const struct in_addr *addr4)
+{
+	uint32_t a = ntohl(addr4->s_addr), octet;
+	int i;
+
+	for (i = 24; i >= 0; i -= 8) {
+		octet = (a >> i) & 0xff;
+		if (octet >= 100)
+			*p++ = '0' + octet / 100;
+		if (octet >= 10)
+			*p++ = '0' + octet / 10 % 10;
+		*p++ = '0' + octet % 10;
+		*p++ = i ? '.' : 0;
+	}
+	return p - 1;
+}
+
+/* Format an IPv6 address as RFC 5952 recommends, which is also what
+ * inet_ntop() gives for any address a dynamic map can hold */
+static char *put_ip6(char *p, const struct in6_addr *addr6)
+{
+	static const char hex[] = "0123456789abcdef";
+	int best = -1, best_len = 1, i, j, shift;
+	uint16_t g;
+
+	for (i = 0; i < 8; i = j + 1) {
+		for (j = i; j < 8 && !addr6->s6_addr16[j]; ++j)
+			;
+		if (j - i > best_len) {
+			best = i;
+			best_len = j - i;
+		}
+	}
+	for (i = 0; i < 8; ) {
+		if (i == best) {
+			*p++ = ':';
+			*p++ = ':';
+			i += best_len;
+			continue;
+		}
+		if (i && i != best + best_len)
+			*p++ = ':';
+		g = ntohs(addr6->s6_addr16[i++]);
+		for (shift = 12; shift > 0 && !(g >> shift); shift -= 4)
+			;
+		for (; shift >= 0; shift -= 4)
+			*p++ = hex[(g >> shift) & 0xf];
+	}
+	*p = 0;
+	return p;
+}
+
+static char *put_time(char *p, time_t t)
+{
+	char digits[24];
+	uint64_t v = t > 0 ? (uint64_t)t : 0;
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n)
+		*p++ = digits[--n];
+	*p = 0;
+	return p;
+}
+
+/* Write the leases copied by compact_begin() as a text map file */
+static int write_map_text(void)
+{
+	FILE *out;
+	struct lease_rec *r;
+	struct tm tm;
+	char line[INET_ADDRSTRLEN + INET6_ADDRSTRLEN + 32], *p;
+	char date[32];
+	uint32_t i;
+
+	out = fopen(TMP_TEXT_FILE, "w");
 	if (!out) {
 		slog(LOG_ERR, "Unable to open %s/%s for writing: %s\n",
-				gcfg.data_dir, TMP_MAP_FILE,
+				gcfg.data_dir, TMP_TEXT_FILE,
 				strerror(errno));
-		return;
+		return -1;
 	}
 	fprintf(out, "###\n###\n### tayga dynamic map database\n###\n"
 			"### You can edit this (carefully!) as long as "
 			"you shut down tayga first\n###\n###\n"
 			"### Last written: %s###\n###\n\n",
-			asctime(gmtime(&now)));
-	entry = pool->mapped_list.next;
-	while (entry != &pool->dormant_list) {
-		if (entry == &pool->mapped_list) {
-			entry = pool->dormant_list.next;
-			continue;
-		}
-		d = list_entry(entry, struct map_dynamic, list);
-		inet_ntop(AF_INET, &d->map4.addr, addrbuf4, sizeof(addrbuf4));
-		inet_ntop(AF_INET6, &d->map6.addr, addrbuf6, sizeof(addrbuf6));
-		fprintf(out, "%s\t%s\t%" PRId64 "\n", addrbuf4, addrbuf6,
-				d->cache_entry ?
-					d->cache_entry->last_use : d->last_use);
-		entry = entry->next;
+			asctime_r(gmtime_r(&compact.when, &tm), date));
+	for (i = 0; i < compact.leases.len; ++i) {
+		r = &compact.leases.v[i];
+		/* inet_ntop() and fprintf() dominate a large rewrite */
+		p = put_ip4(line, &r->addr4);
+		*p++ = '\t';
+		p = put_ip6(p, &r->addr6);
+		*p++ = '\t';
+		p = put_time(p, r->last_use);
+		*p++ = '\n';
+		fwrite(line, 1, p - line, out);
+	}
+	if (fflush(out) || fsync(fileno(out)) < 0) {
+		slog(LOG_ERR, "Unable to write %s/%s: %s\n",
+				gcfg.data_dir, TMP_TEXT_FILE,
+				strerror(errno));
+		fclose(out);
+		return -1;
 	}
 	fclose(out);
-	if (rename(TMP_MAP_FILE, MAP_FILE) < 0) {
+	return 0;
+}
+
+/* Write the leases copied by compact_begin() as a binary database */
+static int write_map_db(void)
+{
+	struct lease_db_header *hdr;
+	struct lease_db_record *rec;
+	struct lease_rec *r;
+	size_t len, off;
+	ssize_t ret;
+	uint32_t i;
+	char *buf;
+	int fd;
+
+	len = sizeof(*hdr) + (size_t)compact.leases.len * sizeof(*rec);
+	buf = (char *)calloc(1, len);
+	if (!buf) {
+		slog(LOG_CRIT, "Unable to allocate memory\n");
+		return -1;
+	}
+	hdr = (struct lease_db_header *)buf;
+	memcpy(hdr->magic, DB_MAGIC, sizeof(hdr->magic));
+	hdr->version = htonl(DB_VERSION);
+	hdr->record_size = htonl(sizeof(*rec));
+	hdr->count = htonl(compact.leases.len);
+	put_time64(hdr->written, compact.when);
+	rec = (struct lease_db_record *)(hdr + 1);
+	for (i = 0; i < compact.leases.len; ++i) {
+		r = &compact.leases.v[i];
+		put_time64(rec[i].last_use, r->last_use);
+		rec[i].addr4 = r->addr4;
+		rec[i].addr6 = r->addr6;
+		rec[i].flags = htonl(r->flags);
+	}
+	hdr->crc = htonl(crc32_update(0, buf, len));
+
+	fd = open(TMP_DB_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		slog(LOG_ERR, "Unable to open %s/%s for writing: %s\n",
+				gcfg.data_dir, TMP_DB_FILE,
+				strerror(errno));
+		free(buf);
+		return -1;
+	}
+	for (off = 0; off < len; off += ret) {
+		ret = write(fd, buf + off, len - off);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret < 0)
+			break;
+	}
+	free(buf);
+	if (off < len || fsync(fd) < 0) {
+		slog(LOG_ERR, "Unable to write %s/%s: %s\n",
+				gcfg.data_dir, TMP_DB_FILE,
+				strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/**
+ * @brief Write the leases copied by compact_begin() to the map file
+ *
+ * Needs no lock, so it can run in the background. Leases are written
+ * in IPv4 order, which lets the next load skip most of its sorting.
+ * Once the map file in the configured format is in place, one left in
+ * the other format has been converted and is removed.
+ */
+static void compact_write(void)
+{
+	const char *tmp, *file, *other;
+	int ret;
+
+	if (compact.leases.len)
+		qsort(compact.leases.v, compact.leases.len,
+				sizeof(*compact.leases.v), lease_cmp);
+	if (gcfg.dyn_format == DYN_FORMAT_BINARY) {
+		tmp = TMP_DB_FILE;
+		file = DB_FILE;
+		other = TEXT_FILE;
+		ret = write_map_db();
+	} else {
+		tmp = TMP_TEXT_FILE;
+		file = TEXT_FILE;
+		other = DB_FILE;
+		ret = write_map_text();
+	}
+	if (ret < 0) {
+		unlink(tmp);
+		return;
+	}
+	if (rename(tmp, file) < 0) {
 		slog(LOG_ERR, "Unable to rename %s/%s to %s/%s: %s\n",
-				gcfg.data_dir, TMP_MAP_FILE,
-				gcfg.data_dir, MAP_FILE,
+				gcfg.data_dir, tmp, gcfg.data_dir, file,
 				strerror(errno));
-		unlink(TMP_MAP_FILE);
+		unlink(tmp);
+		return;
+	}
+	unlink(other);
+	unlink(OLD_JOURNAL_FILE);
+}
+
+static void *compact_thread(void *arg)
+{
+	(void)arg;
+	compact_write();
+	__atomic_store_n(&compact.done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * @brief Wait for a background map file rewrite
+ *
+ * @param wait Nonzero to block until it finishes
+ * @returns nonzero if one is still running
+ */
+static int compact_reap(int wait)
+{
+	if (!compact.running)
+		return 0;
+	if (!wait && !__atomic_load_n(&compact.done, __ATOMIC_ACQUIRE))
+		return 1;
+	pthread_join(compact.thread, NULL);
+	compact.running = 0;
+	return 0;
+}
+
+/**
+ * @brief Activate the leases of a pool which were in use recently
+ *
+ * @param pool Dynamic pool, holding only the dormant leases just loaded
+ * @param future Nonzero if the leases were dated in the future
+ */
+static void activate_loaded(struct dynamic_pool *pool, int future)
+{
+	struct map_dynamic *d;
+	uint32_t i, count = pool->dormant.len;
+
+	if (future) {
+		for (i = 0; i < count; ++i) {
+			d = pool->dormant.v[i];
+			d->last_use = now - gcfg.dyn_min_lease;
+			d->expires = d->last_use + gcfg.dyn_max_lease;
+		}
+	} else {
+		/* Activate maps used within the minimum lease. They were
+		 * checked against every map as they were loaded, so they go
+		 * straight to the head of the lists, where the most specific
+		 * entries belong. Entries are only ever written below the one
+		 * being read. */
+		pool->dormant.len = 0;
+		for (i = 0; i < count; ++i) {
+			d = pool->dormant.v[i];
+			if (d->last_use + gcfg.dyn_min_lease < now) {
+				pool->dormant.v[pool->dormant.len++] = d;
+				continue;
+			}
+			list_add(&d->map4.list, &gcfg.map4_list);
+			list_add(&d->map6.list, &gcfg.map6_list);
+			d->expires = d->last_use + gcfg.dyn_min_lease;
+			pool->mapped.v[pool->mapped.len++] = d;
+		}
+	}
+	heap_build(&pool->dormant);
+	heap_build(&pool->mapped);
+}
+
+void load_dynamic(void)
+{
+	struct dynamic_pool *pool;
+	time_t last_use;
+	struct map_dynamic *d;
+	uint32_t i, count;
+	int current, k;
+
+	compact_reap(1);
+	if (journal_fd >= 0) {
+		close(journal_fd);
+		journal_fd = -1;
+	}
+	current = replay_leases();
+
+	time(&now);
+	last_use = 0;
+	count = 0;
+	for (k = 0; k < gcfg.dyn_pool_count; ++k) {
+		pool = gcfg.dyn_pools[k];
+		for (i = 0; i < pool->dormant.len; ++i) {
+			d = pool->dormant.v[i];
+			if (d->last_use > last_use)
+				last_use = d->last_use;
+			print_dyn_change("loaded",d);
+		}
+		count += pool->dormant.len;
+	}
+	slog(LOG_INFO, "Loaded %u dynamic %s from %s/%s\n", count,
+			count == 1 ? "map" : "maps",
+			gcfg.data_dir, lease_src);
+	if (last_use > now) {
+		slog(LOG_NOTICE, "Note: maps in %s/%s are dated in the future\n",
+				gcfg.data_dir, lease_src);
+		current = 0;
 	}
+	for (k = 0; k < gcfg.dyn_pool_count; ++k)
+		activate_loaded(gcfg.dyn_pools[k], last_use > now);
+
+	/* Fold the journals into the map file, unless it is already up to
+	 * date. compact_begin() starts a new journal unless an old one is
+	 * still waiting to be folded, in which case the one just replayed
+	 * is kept and appended to, so nothing is lost if the fold fails. */
+	if (current)
+		unlink(OLD_JOURNAL_FILE);
+	else if (!compact_begin())
+		compact_write();
+	gcfg.last_map_write = now;
+	if (journal_fd < 0) {
+		journal_fd = open(JOURNAL_FILE, O_WRONLY | O_CREAT | O_APPEND,
+				0644);
+		if (journal_fd < 0)
+			slog(LOG_ERR, "Unable to open %s/%s: %s\n",
+					gcfg.data_dir, JOURNAL_FILE,
+					strerror(errno));
+	}
+	journal_records = 0;
 }
 
-void dynamic_maint(struct dynamic_pool *pool, int shutdown)
+/**
+ * @brief Expire the leases of one pool
+ *
+ * @returns leases left in the pool
+ */
+static uint32_t pool_maint(struct dynamic_pool *pool)
 {
 	struct list_head *entry, *next;
 	struct map_dynamic *d;
-	struct free_addr *f;
+	time_t last_use;
+	uint32_t leases;
 
-	/* Acquire map mutex */
-	pthread_mutex_lock(&gcfg.map_mutex);
+	LOCK(&pool->mutex);
 
-	list_for_each_safe(entry, next, &pool->mapped_list) {
-		d = list_entry(entry, struct map_dynamic, list);
-		if (d->cache_entry)
+	/* Workers have long finished with maps the standby dropped */
+	list_for_each_safe(entry, next, &pool->retired) {
+		d = list_entry(entry, struct map_dynamic, map4.list);
+		list_del(&d->map4.list);
+		free(d);
+	}
+	LOCK(&gcfg.map_mutex);
+
+	/* Only maps whose lease could have run out are looked at. One
+	 * still in use is pushed back to when it next could. */
+	while (pool->mapped.len && pool->mapped.v[0]->expires < now) {
+		d = pool->mapped.v[0];
+		last_use = d->last_use;
+		if (d->cache_entry && d->cache_entry->last_use > last_use)
+			last_use = d->cache_entry->last_use;
+		if (d->cache_entry || last_use + gcfg.dyn_min_lease >= now) {
+			d->expires = last_use + gcfg.dyn_min_lease;
+			/* Cached maps wait until the cache entry ages out */
+			if (d->expires < now)
+				d->expires = now;
+			heap_sift_down(&pool->mapped, 0);
 			continue;
-		if (d->last_use + gcfg.dyn_min_lease < now) {
-			print_dyn_change("dormant", d);
-			move_to_dormant(d, pool);
 		}
+		heap_remove(&pool->mapped, d);
+		print_dyn_change("dormant", d);
+		TRACE2(dyn_dormant, d->map4.addr.s_addr, &d->map6.addr);
+		move_to_dormant(d, pool);
 	}
-	while (!list_empty(&pool->dormant_list)) {
-		d = list_entry(pool->dormant_list.prev,
-				struct map_dynamic, list);
-		if (d->last_use + gcfg.dyn_max_lease >= now)
-			break;
-		f = list_entry(d->free.list.prev, struct free_addr, list);
-		f->count += d->free.count + 1;
-		list_del(&d->free.list);
-		list_del(&d->list);
+	UNLOCK(&gcfg.map_mutex);
+
+	/* Dormant maps are off the map lists */
+	while (pool->dormant.len && pool->dormant.v[0]->expires < now) {
+		d = pool->dormant.v[0];
+		TRACE2(dyn_expire, d->map4.addr.s_addr, &d->map6.addr);
+		journal_write('E', d, 0);
+		repl_push(&d->map4.addr, &d->map6.addr, d->last_use,
+				DB_F_EXPIRED);
+		set_in_use(pool, ntohl(d->map4.addr.s_addr) -
+				ntohl(pool->map4.addr.s_addr), 0);
+		list_del(&d->hash4);
+		unlink_host(pool, d);
+		heap_remove(&pool->dormant, d);
 		free(d);
 	}
+	leases = pool->mapped.len + pool->dormant.len;
+	UNLOCK(&pool->mutex);
+	return leases;
+}
+
+void dynamic_maint(int shutdown)
+{
+	uint32_t leases = 0, records;
+	int write_now = 0, k;
+
+	/* Each pool is locked on its own, so assignment from the others
+	 * carries on */
+	for (k = 0; k < gcfg.dyn_pool_count; ++k)
+		leases += pool_maint(gcfg.dyn_pools[k]);
+
+	LOCK(&journal_mutex);
+	records = journal_records;
+	UNLOCK(&journal_mutex);
 
-	/* Write file if we have a data-dir */
-	if (gcfg.data_dir[0]) {
-		if (shutdown || gcfg.map_write_pending ||
+	/* Rewrite the map file once the journal has grown, and now and
+	 * then to record the last use of active leases */
+	if (gcfg.data_dir[0] && !compact_reap(shutdown)) {
+		if (shutdown || (records >= JOURNAL_MIN_RECORDS &&
+					records > leases) ||
 				gcfg.last_map_write +
 					gcfg.max_commit_delay < now ||
 				gcfg.last_map_write > now) {
-			write_to_file(pool);
+			if (!compact_begin()) {
+				compact.done = 0;
+				if (shutdown || pthread_create(&compact.thread,
+							NULL, compact_thread,
+							NULL))
+					write_now = 1;
+				else
+					compact.running = 1;
+			}
 			gcfg.last_map_write = now;
-			gcfg.map_write_pending = 0;
 		}
 	}
 
-	/* Release map mutex when done */
-	pthread_mutex_unlock(&gcfg.map_mutex);
+	/* Send the standby every lease now and then, which makes up for
+	 * lost datagrams and brings it the last use of active leases */
+	pthread_mutex_lock(&repl.mutex);
+	if (repl.running && (repl.last_sync + REPL_SYNC_INTERVAL <= now ||
+				repl.last_sync > now)) {
+		repl.last_sync = now;
+		repl.sync = 1;
+		pthread_cond_signal(&repl.cond);
+	}
+	pthread_mutex_unlock(&repl.mutex);
+
+	if (write_now)
+		compact_write();
+	LOCK(&journal_mutex);
+	if (journal_dirty && gcfg.dyn_fsync == DYN_FSYNC_INTERVAL &&
+			journal_fd >= 0) {
+		journal_dirty = 0;
+		fdatasync(journal_fd);
+	}
+	UNLOCK(&journal_mutex);
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 7; i >= 0; --i)
+		v = v << 8 | p[i];
+	return v;
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; ++i, v >>= 8)
+		p[i] = (uint8_t)v;
+}
+
+/* SipHash-2-4 of a datagram, keyed with dynamic-replica-key */
+static uint64_t repl_mac(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t k0 = get_le64(gcfg.dyn_replica_key);
+	uint64_t k1 = get_le64(gcfg.dyn_replica_key + 8);
+	uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+	uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+	uint64_t v3 = 0x7465646279746573ULL ^ k1;
+	uint64_t m;
+	size_t i, j;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		m = get_le64(p + i);
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	/* The last word holds the remaining bytes and the length */
+	m = (uint64_t)len << 56;
+	for (j = 0; i + j < len; ++j)
+		m |= (uint64_t)p[i + j] << (8 * j);
+	v3 ^= m;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= m;
+	v2 ^= 0xff;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Send one datagram of lease records to the standby */
+static void repl_send(const struct lease_db_record *v, uint32_t n,
+		uint16_t flags)
+{
+	struct {
+		struct repl_header hdr;
+		struct lease_db_record rec[REPL_BATCH];
+		uint8_t mac[REPL_MAC_LEN];
+	} buf;
+	size_t len = sizeof(buf.hdr) + n * sizeof(*v);
+
+	memcpy(buf.hdr.magic, REPL_MAGIC, sizeof(buf.hdr.magic));
+	buf.hdr.version = htons(REPL_VERSION);
+	buf.hdr.record_size = htons(sizeof(*v));
+	buf.hdr.count = htons(n);
+	buf.hdr.flags = htons(flags);
+	put_time64(buf.hdr.started, repl.started);
+	memcpy(buf.hdr.session, repl.session, sizeof(buf.hdr.session));
+	pthread_mutex_lock(&repl.mutex);
+	buf.hdr.seq = htonl(repl.seq++);
+	pthread_mutex_unlock(&repl.mutex);
+	memcpy(buf.rec, v, n * sizeof(*v));
+	if (gcfg.dyn_replica_key_set) {
+		buf.hdr.flags = htons(flags | REPL_F_MAC);
+		put_le64((uint8_t *)&buf + len, repl_mac(&buf, len));
+		len += REPL_MAC_LEN;
+	}
+
+	/* A standby which is down is no reason to complain each time */
+	if (send(repl.fd, &buf, len, 0) < 0 && errno != ECONNREFUSED)
+		slog(LOG_DEBUG, "Unable to send leases to the standby: %s\n",
+				strerror(errno));
+	STAT_ADD(dyn_repl_sent, n);
+}
+
+/**
+ * @brief Send every lease to the standby
+ *
+ * A copy is sent in full batches, pausing now and then so as not to
+ * overrun the standby's receive buffer.
+ */
+static void repl_sync(void)
+{
+	struct lease_list l = { NULL, 0, 0 };
+	struct lease_db_record v[REPL_BATCH];
+	struct timespec pause = { 0, 1000000 };
+	uint32_t i, n, sent = 0;
+
+	if (copy_leases(&l) < 0) {
+		free(l.v);
+		return;
+	}
+	for (i = 0; i < l.len; i += n) {
+		for (n = 0; n < REPL_BATCH && i + n < l.len; ++n) {
+			put_time64(v[n].last_use, l.v[i + n].last_use);
+			v[n].addr4 = l.v[i + n].addr4;
+			v[n].addr6 = l.v[i + n].addr6;
+			v[n].flags = htonl(l.v[i + n].flags);
+		}
+		repl_send(v, n, REPL_F_SYNC);
+		if (++sent % 32 == 0)
+			nanosleep(&pause, NULL);
+	}
+	free(l.v);
+}
+
+/* Send queued lease changes a batch at a time */
+static void *repl_thread(void *arg)
+{
+	struct lease_db_record batch[REPL_BATCH];
+	struct timespec ts;
+	uint32_t i, n;
+	int waited = 0;
+
+	(void)arg;
+	pthread_mutex_lock(&repl.mutex);
+	for (;;) {
+		if (repl.sync) {
+			repl.sync = 0;
+			pthread_mutex_unlock(&repl.mutex);
+			repl_sync();
+			pthread_mutex_lock(&repl.mutex);
+			continue;
+		}
+		n = repl.tail - repl.head;
+		if (!n && repl.stop)
+			break;
+		if (!n) {
+			pthread_cond_wait(&repl.cond, &repl.mutex);
+			continue;
+		}
+		/* Give a part-filled batch a moment to fill */
+		if (n < REPL_BATCH && !waited && !repl.stop) {
+			waited = 1;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += REPL_DELAY_MS * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_nsec -= 1000000000L;
+				++ts.tv_sec;
+			}
+			pthread_cond_timedwait(&repl.cond, &repl.mutex, &ts);
+			continue;
+		}
+		waited = 0;
+		if (n > REPL_BATCH)
+			n = REPL_BATCH;
+		for (i = 0; i < n; ++i)
+			batch[i] = repl.v[repl.head++ % REPL_QUEUE_LEN];
+		pthread_mutex_unlock(&repl.mutex);
+		repl_send(batch, n, 0);
+		pthread_mutex_lock(&repl.mutex);
+	}
+	pthread_mutex_unlock(&repl.mutex);
+	return NULL;
+}
+
+/**
+ * @brief Start sending lease changes to the dynamic-replica
+ *
+ * Changes are sent over UDP from a thread of their own, with a full
+ * copy of the leases first and every REPL_SYNC_INTERVAL after.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int dynamic_repl_start(void)
+{
+	int fd, ret;
+
+	if (!gcfg.dyn_replica_len || repl.running)
+		return 0;
+	/* Tells the standby our datagrams from those of an earlier run */
+	if (getrandom(repl.session, sizeof(repl.session), 0) !=
+			sizeof(repl.session)) {
+		slog(LOG_CRIT, "Unable to pick a replication session: %s\n",
+				strerror(errno));
+		return -1;
+	}
+	repl.started = now;
+	fd = socket(gcfg.dyn_replica.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&gcfg.dyn_replica,
+				gcfg.dyn_replica_len) < 0) {
+		slog(LOG_CRIT, "Unable to open socket to dynamic-replica: "
+				"%s\n", strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	pthread_mutex_lock(&repl.mutex);
+	repl.fd = fd;
+	repl.stop = 0;
+	repl.sync = 1;
+	repl.last_sync = now;
+	pthread_mutex_unlock(&repl.mutex);
+	ret = pthread_create(&repl.thread, NULL, repl_thread, NULL);
+	if (ret) {
+		slog(LOG_CRIT, "Unable to start replication thread: %s\n",
+				strerror(ret));
+		pthread_mutex_lock(&repl.mutex);
+		repl.fd = -1;
+		pthread_mutex_unlock(&repl.mutex);
+		close(fd);
+		return -1;
+	}
+	repl.running = 1;
+	return 0;
+}
+
+/* Send what is still queued, then stop the replication thread */
+void dynamic_repl_stop(void)
+{
+	int fd;
+
+	if (repl.running) {
+		pthread_mutex_lock(&repl.mutex);
+		repl.stop = 1;
+		repl.sync = 0;
+		pthread_cond_signal(&repl.cond);
+		pthread_mutex_unlock(&repl.mutex);
+		pthread_join(repl.thread, NULL);
+		repl.running = 0;
+		pthread_mutex_lock(&repl.mutex);
+		fd = repl.fd;
+		repl.fd = -1;
+		repl.head = repl.tail = 0;
+		pthread_mutex_unlock(&repl.mutex);
+		close(fd);
+	}
+	if (repl.listen_fd >= 0) {
+		close(repl.listen_fd);
+		repl.listen_fd = -1;
+		repl.have_seq = 0;
+	}
+}
+
+/**
+ * @brief Open the socket lease changes are received on
+ *
+ * @returns socket to poll for dynamic_repl_read(), or -1 on error
+ */
+int dynamic_repl_listen(void)
+{
+	int fd, size = 4 << 20;
+
+	fd = socket(gcfg.dyn_replica_listen.ss_family,
+			SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&gcfg.dyn_replica_listen,
+				gcfg.dyn_replica_listen_len) < 0) {
+		slog(LOG_CRIT, "Unable to listen on dynamic-replica-listen: "
+				"%s\n", strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	/* Full copies arrive in bursts; the kernel caps this at rmem_max */
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	repl.listen_fd = fd;
+	return fd;
+}
+
+/* Find the lease of a pool on an IPv4 address, active or dormant */
+static struct map_dynamic *find_lease4(const struct dynamic_pool *pool,
+		const struct in_addr *addr4)
+{
+	struct list_head *entry, *bucket;
+	struct map_dynamic *d;
+
+	bucket = &pool->hash_table4[dyn_hash4(pool, addr4)];
+	list_for_each(entry, bucket) {
+		d = list_entry(entry, struct map_dynamic, hash4);
+		if (d->map4.addr.s_addr == addr4->s_addr)
+			return d;
+	}
+	return NULL;
+}
+
+/* Check for an address cache entry, which a worker sets holding only
+ * cache_mutex */
+static int lease_cached(const struct map_dynamic *d)
+{
+	int cached;
+
+	LOCK(&gcfg.cache_mutex);
+	cached = d->cache_entry != NULL;
+	UNLOCK(&gcfg.cache_mutex);
+	return cached;
+}
+
+/**
+ * @brief Remove a lease the active no longer has
+ *
+ * Called with the pool mutex and map_mutex held. A worker which found
+ * an active map may still be about to set its cache_entry, having
+ * dropped map_mutex, so an active map is only taken off the lists here
+ * and freed by the next dynamic_maint(). Its address is free at once.
+ *
+ * @returns 0, or -1 if an address cache entry still refers to it
+ */
+static int drop_lease(struct dynamic_pool *pool, struct map_dynamic *d)
+{
+	if (lease_cached(d))
+		return -1;
+	set_in_use(pool, ntohl(d->map4.addr.s_addr) -
+			ntohl(pool->map4.addr.s_addr), 0);
+	list_del(&d->hash4);
+	unlink_host(pool, d);
+	if (!list_empty(&d->map4.list)) {
+		list_del(&d->map4.list);
+		list_del(&d->map6.list);
+		heap_remove(&pool->mapped, d);
+		list_add(&d->map4.list, &pool->retired);
+	} else {
+		heap_remove(&pool->dormant, d);
+		free(d);
+	}
+	return 0;
+}
+
+/**
+ * @brief Apply one lease change from the active
+ *
+ * Leases are checked as they are when loaded from the map file. One
+ * used within the minimum lease is made active, so the standby
+ * translates for its host as soon as it takes over. Changes applied are
+ * journaled, but not sent on to any dynamic-replica of our own.
+ *
+ * @returns 0, or -1 if the change was not applied
+ */
+static int repl_apply(const struct lease_db_record *rec)
+{
+	struct in_addr addr4 = rec->addr4;
+	struct in6_addr addr6 = rec->addr6;
+	time_t last_use = get_time64(rec->last_use);
+	uint32_t flags = ntohl(rec->flags);
+	struct dynamic_pool *pool;
+	struct map_dynamic *d, *old;
+
+	pool = find_pool(&addr4);
+	if (!pool || validate_ip6_addr(&addr6) < 0)
+		return -1;
+	LOCK(&pool->mutex);
+	LOCK(&gcfg.map_mutex);
+
+	/* A host which has moved address loses its old lease */
+	d = find_dynamic(pool, &addr6);
+	if (d && d->map4.addr.s_addr != addr4.s_addr) {
+		if (drop_lease(pool, d) < 0)
+			goto fail;
+		d = NULL;
+	}
+	if (flags & DB_F_EXPIRED) {
+		if (d) {
+			if (lease_cached(d))
+				goto fail;
+			journal_write('E', d, 0);
+			drop_lease(pool, d);
+		}
+		goto done;
+	}
+
+	if (d) {
+		/* Full copies mostly repeat what the standby already has,
+		 * which need not be journaled again */
+		if (last_use <= d->last_use && (!list_empty(&d->map4.list) ||
+					d->last_use + gcfg.dyn_min_lease < now))
+			goto done;
+		if (last_use > d->last_use)
+			d->last_use = last_use;
+		if (!list_empty(&d->map4.list))
+			goto journal;
+		heap_remove(&pool->dormant, d);
+	} else {
+		if (in_use(pool, ntohl(addr4.s_addr) -
+					ntohl(pool->map4.addr.s_addr))) {
+			old = find_lease4(pool, &addr4);
+			if (!old || drop_lease(pool, old) < 0)
+				goto fail;
+		}
+		if (find_map4(&addr4) != &pool->map4 || find_map6(&addr6))
+			goto fail;
+		d = alloc_map_dynamic(pool, &addr6, &addr4);
+		if (!d)
+			goto fail;
+		d->last_use = last_use;
+	}
+	if (d->last_use + gcfg.dyn_min_lease >= now) {
+		move_to_mapped(d, pool);
+	} else {
+		d->expires = d->last_use + gcfg.dyn_max_lease;
+		heap_insert(&pool->dormant, d);
+	}
+journal:
+	journal_write('A', d, d->last_use);
+done:
+	UNLOCK(&gcfg.map_mutex);
+	UNLOCK(&pool->mutex);
+	return 0;
+fail:
+	UNLOCK(&gcfg.map_mutex);
+	UNLOCK(&pool->mutex);
+	return -1;
+}
+
+/* Check a datagram came from the dynamic-replica-peer */
+static int repl_from_peer(const struct sockaddr_storage *ss)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)ss;
+	struct in6_addr addr6;
+
+	if (ss->ss_family == AF_INET6)
+		return IN6_ARE_ADDR_EQUAL(&sin6->sin6_addr,
+				&gcfg.dyn_replica_peer);
+	if (ss->ss_family != AF_INET)
+		return 0;
+	memset(&addr6, 0, sizeof(addr6));
+	addr6.s6_addr16[5] = 0xffff;
+	addr6.s6_addr32[3] = sin->sin_addr.s_addr;
+	return IN6_ARE_ADDR_EQUAL(&addr6, &gcfg.dyn_replica_peer);
+}
+
+/* Check and strip the tag of a datagram, if a key is configured */
+static int repl_check_mac(const struct repl_header *hdr, ssize_t *len)
+{
+	const uint8_t *tag;
+	uint64_t want;
+
+	if (!gcfg.dyn_replica_key_set)
+		return 0;
+	if (!(ntohs(hdr->flags) & REPL_F_MAC) ||
+			*len < (ssize_t)(sizeof(*hdr) + REPL_MAC_LEN))
+		return -1;
+	*len -= REPL_MAC_LEN;
+	tag = (const uint8_t *)hdr + *len;
+	want = repl_mac(hdr, *len);
+	return get_le64(tag) == want ? 0 : -1;
+}
+
+/**
+ * @brief Apply the lease changes waiting on the dynamic-replica-listen
+ * socket
+ *
+ * Datagrams from any address but the dynamic-replica-peer, or without
+ * a valid tag when a dynamic-replica-key is set, are counted and
+ * dropped, as are ones not ahead of the last from the same run of the
+ * active. With a key, so are ones from a run which started earlier,
+ * which could otherwise bring back leases the active has since
+ * dropped.
+ */
+void dynamic_repl_read(void)
+{
+	union {
+		struct repl_header hdr;
+		uint8_t b[65536];
+	} *buf;
+	struct lease_db_record rec;
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	uint32_t seq, gap, i, count, size;
+	time_t started;
+	ssize_t len;
+	int same;
+
+	buf = malloc(sizeof(*buf));
+	if (!buf) {
+		slog(LOG_CRIT, "Unable to allocate memory\n");
+		return;
+	}
+	for (;;) {
+		from_len = sizeof(from);
+		len = recvfrom(repl.listen_fd, buf, sizeof(*buf), 0,
+				(struct sockaddr *)&from, &from_len);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				slog(LOG_ERR, "Unable to receive leases: %s\n",
+						strerror(errno));
+			break;
+		}
+		if (!repl_from_peer(&from)) {
+			STAT_INC(dyn_repl_rejected);
+			continue;
+		}
+		if ((size_t)len < sizeof(buf->hdr) ||
+				memcmp(buf->hdr.magic, REPL_MAGIC,
+					sizeof(buf->hdr.magic)) ||
+				ntohs(buf->hdr.version) != REPL_VERSION)
+			continue;
+		if (repl_check_mac(&buf->hdr, &len) < 0) {
+			STAT_INC(dyn_repl_rejected);
+			continue;
+		}
+		count = ntohs(buf->hdr.count);
+		size = ntohs(buf->hdr.record_size);
+		if (size < sizeof(rec) ||
+				len - sizeof(buf->hdr) < (size_t)count * size)
+			continue;
+
+		/* Drop replays, and count datagrams skipped, not ones from
+		 * a restarted active */
+		seq = ntohl(buf->hdr.seq);
+		gap = seq - repl.next_seq;
+		started = get_time64(buf->hdr.started);
+		same = repl.have_seq && !memcmp(buf->hdr.session,
+				repl.peer_session, sizeof(repl.peer_session));
+		if ((same && (int32_t)gap < 0) || (repl.have_seq && !same &&
+					gcfg.dyn_replica_key_set &&
+					started < repl.peer_started)) {
+			STAT_INC(dyn_repl_rejected);
+			continue;
+		}
+		if (same && gap && gap < 0x10000)
+			STAT_ADD(dyn_repl_lost, gap);
+		memcpy(repl.peer_session, buf->hdr.session,
+				sizeof(repl.peer_session));
+		repl.peer_started = started;
+		repl.next_seq = seq + 1;
+		repl.have_seq = 1;
+
+		for (i = 0; i < count; ++i) {
+			memcpy(&rec, buf->b + sizeof(buf->hdr) + i * size,
+					sizeof(rec));
+			STAT_INC(dyn_repl_recv);
+			if (repl_apply(&rec) < 0)
+				STAT_INC(dyn_repl_ignored);
+		}
+	}
+	free(buf);
 }
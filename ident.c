@@ -0,0 +1,135 @@
+/*
+ *  ident.c -- IPv4 identification generation
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2010  Nathan Lutchansky <lutchann@litech.org>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "tayga.h"
+#include <sys/random.h>
+
+/* Number of counters per thread, must be a power of two */
+#define IDENT_TABLE_BITS	11
+#define IDENT_TABLE_SIZE	(1 << IDENT_TABLE_BITS)
+
+/* Cache line size used to pad the per-thread state */
+#define CACHE_LINE		64
+
+/**
+ * Identification state, one per thread
+ *
+ * This implements the hash-based algorithm from RFC 7739 section 5.3:
+ * a keyed hash of (src, dest, proto) selects a counter bucket and an
+ * offset, and the identification is the sum of the two. Each thread
+ * owns its own key and counter table, so generating an ident never
+ * writes to memory shared with another thread.
+ */
+struct ident_state {
+	uint64_t key[2];
+	int seeded;
+	uint16_t table[IDENT_TABLE_SIZE];
+} __attribute__((aligned(CACHE_LINE)));
+
+static _Thread_local struct ident_state ident_state;
+
+/* SipHash-1-3 of two 64-bit words */
+static uint64_t ident_hash(const uint64_t key[2], uint64_t a, uint64_t b)
+{
+	uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+	uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+	uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+	uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+	uint64_t m[3] = { a, b, (uint64_t)16 << 56 };
+	int i;
+
+	for (i = 0; i < 3; ++i) {
+		v3 ^= m[i];
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m[i];
+	}
+	v2 ^= 0xff;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static void ident_seed(struct ident_state *s)
+{
+	uint8_t *k = (uint8_t *)s->key;
+	size_t len = 0;
+	ssize_t ret;
+
+	while (len < sizeof(s->key)) {
+		ret = getrandom(k + len, sizeof(s->key) - len, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			slog(LOG_CRIT, "Unable to seed IPv4 ident generator: %s\n",
+					strerror(errno));
+			exit(1);
+		}
+		len += ret;
+	}
+	/* The counters start at random values too */
+	for (len = 0; len < IDENT_TABLE_SIZE; len += 4) {
+		uint64_t r = ident_hash(s->key, len, 1);
+		memcpy(&s->table[len], &r, sizeof(r));
+	}
+	s->seeded = 1;
+}
+
+/**
+ * @brief Generate an IPv4 identification value
+ *
+ * RFC 7739 compliant: values for the same (src, dest, proto) form a
+ * sequence which does not repeat for 65536 datagrams, while values for
+ * different tuples are unpredictable from each other. The state is
+ * thread-local, so this is safe to call from any worker without locks.
+ *
+ * @param src IPv4 source address
+ * @param dest IPv4 destination address
+ * @param proto IPv4 protocol
+ * @returns identification in network byte order
+ */
+uint16_t ip4_ident(const struct in_addr *src, const struct in_addr *dest,
+		uint8_t proto)
+{
+	struct ident_state *s = &ident_state;
+	uint64_t h;
+	uint16_t *ctr;
+
+	if (__builtin_expect(!s->seeded, 0))
+		ident_seed(s);
+
+	h = ident_hash(s->key,
+			((uint64_t)src->s_addr << 32) | dest->s_addr, proto);
+	ctr = &s->table[h & (IDENT_TABLE_SIZE - 1)];
+	++*ctr;
+	return htons((uint16_t)(h >> 48) + *ctr);
+}
+
+/**
+ * @brief Locate the calling thread's identification state
+ *
+ * Used by the unit tests to verify that no two threads share state.
+ *
+ * @param[out] len Size of the state in bytes
+ * @returns pointer to the state
+ */
+const void *ip4_ident_state(size_t *len)
+{
+	*len = sizeof(ident_state);
+	return &ident_state;
+}
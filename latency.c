@@ -0,0 +1,191 @@
+/*
+ *  latency.c -- per-packet latency histograms
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2010  Nathan Lutchansky <lutchann@litech.org>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "tayga.h"
+
+#ifdef WITH_LATENCY
+
+/* Slot 0 belongs to the main thread, slot n to worker n-1 */
+struct lat_worker lat_workers[MAX_WORKERS + 1];
+
+_Thread_local struct lat_pkt lat_pkt;
+
+/* Conversion from lat_now() ticks, measured by lat_init() */
+double lat_ns_per_tick = 1.0;
+
+/* Aggregate histograms at the last reset, only touched by the main thread */
+static struct {
+	uint64_t count[LAT_HIST_MAX][LAT_BUCKETS];
+	uint64_t sum[LAT_HIST_MAX];
+} lat_baseline;
+
+static const char *lat_names[LAT_HIST_MAX] = {
+#define X(name, label) label,
+	LAT_HIST_LIST
+#undef X
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t lat_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+/**
+ * @brief Calibrate the cycle counter against the monotonic clock
+ *
+ * Takes about 20ms, so this is done once at startup.
+ */
+void lat_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec delay = { .tv_nsec = 20000000 };
+	uint64_t t0, t1, c0, c1;
+
+	t0 = lat_clock_ns();
+	c0 = lat_now();
+	nanosleep(&delay, NULL);
+	t1 = lat_clock_ns();
+	c1 = lat_now();
+	if (c1 > c0 && t1 > t0)
+		lat_ns_per_tick = (double)(t1 - t0) / (c1 - c0);
+	slog(LOG_DEBUG, "Latency timer runs at %.3f GHz\n",
+			1.0 / lat_ns_per_tick);
+#endif
+}
+
+/**
+ * @brief Find the smallest latency which falls in a bucket
+ *
+ * @param b bucket index
+ * @returns latency in ticks
+ */
+uint64_t lat_bucket_value(int b)
+{
+	int shift;
+
+	if (b < (1 << LAT_SUB_BITS))
+		return b;
+	shift = (b >> LAT_SUB_BITS) - 1;
+	return (uint64_t)((b & ((1 << LAT_SUB_BITS) - 1)) +
+			(1 << LAT_SUB_BITS)) << shift;
+}
+
+/**
+ * @brief Aggregate one histogram over every thread
+ *
+ * @param hist lat_hist to read
+ * @param[out] count LAT_BUCKETS counts since the last lat_reset()
+ * @param[out] sum Total latency in ticks, may be NULL
+ */
+void lat_read(int hist, uint64_t *count, uint64_t *sum)
+{
+	uint64_t s = 0;
+	int i, b;
+
+	memset(count, 0, LAT_BUCKETS * sizeof(*count));
+	for (i = 0; i <= MAX_WORKERS; ++i) {
+		for (b = 0; b < LAT_BUCKETS; ++b)
+			count[b] += __atomic_load_n(&lat_workers[i].count[hist][b],
+					__ATOMIC_RELAXED);
+		s += __atomic_load_n(&lat_workers[i].sum[hist],
+				__ATOMIC_RELAXED);
+	}
+	for (b = 0; b < LAT_BUCKETS; ++b)
+		count[b] -= lat_baseline.count[hist][b];
+	if (sum)
+		*sum = s - lat_baseline.sum[hist];
+}
+
+/**
+ * @brief Estimate a quantile from a histogram
+ *
+ * The result is the midpoint of the bucket holding the quantile, which
+ * is within 1/2^(LAT_SUB_BITS+1) of the true value.
+ *
+ * @param count LAT_BUCKETS counts
+ * @param q Quantile between 0 and 1
+ * @returns latency in nanoseconds, or 0 for an empty histogram
+ */
+double lat_quantile(const uint64_t *count, double q)
+{
+	uint64_t total = 0, rank, seen = 0;
+	int b;
+
+	for (b = 0; b < LAT_BUCKETS; ++b)
+		total += count[b];
+	if (!total)
+		return 0.0;
+	rank = (uint64_t)(q * total);
+	if (rank >= total)
+		rank = total - 1;
+	for (b = 0; b < LAT_BUCKETS - 1; ++b) {
+		seen += count[b];
+		if (seen > rank)
+			break;
+	}
+	return (lat_bucket_value(b) + lat_bucket_value(b + 1)) / 2.0 *
+		lat_ns_per_tick;
+}
+
+/**
+ * @brief Reset the histograms to zero
+ *
+ * As with stats_reset(), the workers' histograms are left alone and the
+ * current totals are subtracted from later reads.
+ */
+void lat_reset(void)
+{
+	uint64_t count[LAT_BUCKETS], sum;
+	int h, b;
+
+	for (h = 0; h < LAT_HIST_MAX; ++h) {
+		lat_read(h, count, &sum);
+		for (b = 0; b < LAT_BUCKETS; ++b)
+			lat_baseline.count[h][b] += count[b];
+		lat_baseline.sum[h] += sum;
+	}
+}
+
+/**
+ * @brief Write the latency quantiles to the log
+ */
+void lat_dump(void)
+{
+	uint64_t count[LAT_BUCKETS], n;
+	int h, b;
+
+	for (h = 0; h < LAT_HIST_MAX; ++h) {
+		lat_read(h, count, NULL);
+		for (n = 0, b = 0; b < LAT_BUCKETS; ++b)
+			n += count[b];
+		if (!n)
+			continue;
+		slog(LOG_NOTICE, "  latency %-10s n=%llu p50=%.0fns p99=%.0fns "
+				"p999=%.0fns\n", lat_names[h],
+				(unsigned long long)n, lat_quantile(count, 0.5),
+				lat_quantile(count, 0.99),
+				lat_quantile(count, 0.999));
+	}
+}
+
+#endif /* WITH_LATENCY */
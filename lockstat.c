@@ -0,0 +1,200 @@
+/*
+ *  lockstat.c -- mutex contention statistics
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2010  Nathan Lutchansky <lutchann@litech.org>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "tayga.h"
+
+#ifdef WITH_LOCK_STATS
+
+/* Deepest nesting of LOCK() in one thread (map_mutex, then cache_mutex) */
+#define LOCK_DEPTH	4
+
+/* Every call site seen so far, newest first */
+static struct lock_site *lock_site_list;
+
+/* Locks held by this thread, to find the site and start of each hold */
+static _Thread_local struct {
+	pthread_mutex_t *mutex;
+	struct lock_site *site;
+	uint64_t since;
+} lock_held[LOCK_DEPTH];
+static _Thread_local int lock_depth;
+
+static uint64_t lock_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Acquire a mutex, recording contention against a call site
+ *
+ * One site may serve several mutexes (every dynamic pool has its own),
+ * so the counters are updated atomically and the site is registered by
+ * whichever thread first claims it. The wait is only timed when the
+ * first attempt finds the mutex busy.
+ *
+ * @param site Statistics of the calling LOCK()
+ * @param m Mutex to acquire
+ */
+void lock_site_lock(struct lock_site *site, pthread_mutex_t *m)
+{
+	uint64_t t0, t1;
+
+	if (pthread_mutex_trylock(m)) {
+		t0 = lock_clock();
+		pthread_mutex_lock(m);
+		t1 = lock_clock();
+		__atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&site->wait_ns, t1 - t0, __ATOMIC_RELAXED);
+	} else {
+		t1 = lock_clock();
+	}
+	__atomic_fetch_add(&site->acquired, 1, __ATOMIC_RELAXED);
+
+	if (!__atomic_load_n(&site->registered, __ATOMIC_RELAXED) &&
+			!__atomic_exchange_n(&site->registered, 1,
+				__ATOMIC_ACQUIRE)) {
+		site->mutex = m;
+		site->next = __atomic_load_n(&lock_site_list, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&lock_site_list,
+					&site->next, site, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	if (lock_depth < LOCK_DEPTH) {
+		lock_held[lock_depth].mutex = m;
+		lock_held[lock_depth].site = site;
+		lock_held[lock_depth].since = t1;
+	}
+	++lock_depth;
+}
+
+/**
+ * @brief Release a mutex taken by lock_site_lock()
+ *
+ * The hold time is charged to the site which acquired the mutex, which
+ * need not be the function releasing it.
+ *
+ * @param m Mutex to release
+ */
+void lock_site_unlock(pthread_mutex_t *m)
+{
+	struct lock_site *site;
+	uint64_t hold, max;
+	int i;
+
+	for (i = (lock_depth < LOCK_DEPTH ? lock_depth : LOCK_DEPTH) - 1;
+			i >= 0; --i)
+		if (lock_held[i].mutex == m)
+			break;
+	if (i >= 0) {
+		site = lock_held[i].site;
+		hold = lock_clock() - lock_held[i].since;
+		__atomic_fetch_add(&site->hold_ns, hold, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&site->max_hold_ns, __ATOMIC_RELAXED);
+		while (hold > max && !__atomic_compare_exchange_n(
+					&site->max_hold_ns, &max, hold, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+		for (; i < lock_depth - 1 && i < LOCK_DEPTH - 1; ++i)
+			lock_held[i] = lock_held[i + 1];
+	}
+	if (lock_depth > 0)
+		--lock_depth;
+	pthread_mutex_unlock(m);
+}
+
+/**
+ * @brief Name a mutex for reporting
+ *
+ * @param m Mutex
+ * @returns name of the gcfg field, or "other"
+ */
+const char *lock_name(const pthread_mutex_t *m)
+{
+	int i;
+
+	if (m == &gcfg.map_mutex)
+		return "map_mutex";
+	if (m == &gcfg.cache_mutex)
+		return "cache_mutex";
+	for (i = 0; i < gcfg.dyn_pool_count; ++i)
+		if (m == &gcfg.dyn_pools[i]->mutex)
+			return "pool_mutex";
+	return "other";
+}
+
+/**
+ * @brief Get the list of call sites which have taken a lock
+ *
+ * @returns first site, follow ->next for the rest
+ */
+struct lock_site *lock_sites(void)
+{
+	return __atomic_load_n(&lock_site_list, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Zero the statistics of every call site
+ *
+ * An acquisition racing with the reset may be counted on either side.
+ */
+void lockstat_reset(void)
+{
+	struct lock_site *site;
+
+	for (site = lock_sites(); site; site = site->next) {
+		__atomic_store_n(&site->acquired, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->contended, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->wait_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->hold_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->max_hold_ns, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * @brief Write the lock statistics to the log
+ */
+void lockstat_dump(void)
+{
+	struct lock_site *site;
+	uint64_t n;
+
+	for (site = lock_sites(); site; site = site->next) {
+		n = __atomic_load_n(&site->acquired, __ATOMIC_RELAXED);
+		if (!n)
+			continue;
+		slog(LOG_NOTICE, "  lock %-11s %s:%d n=%llu contended=%llu "
+				"wait=%lluus hold=%lluus max_hold=%lluus\n",
+				lock_name(site->mutex), site->func, site->line,
+				(unsigned long long)n,
+				(unsigned long long)__atomic_load_n(
+					&site->contended, __ATOMIC_RELAXED),
+				(unsigned long long)__atomic_load_n(
+					&site->wait_ns, __ATOMIC_RELAXED) / 1000,
+				(unsigned long long)__atomic_load_n(
+					&site->hold_ns, __ATOMIC_RELAXED) / 1000,
+				(unsigned long long)__atomic_load_n(
+					&site->max_hold_ns, __ATOMIC_RELAXED) / 1000);
+	}
+}
+
+#endif /* WITH_LOCK_STATS */
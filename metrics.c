@@ -0,0 +1,394 @@
+/*
+ *  metrics.c -- statistics endpoint in Prometheus text format
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2010  Nathan Lutchansky <lutchann@litech.org>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "tayga.h"
+#include <sys/un.h>
+
+/* How long to wait for a client to send its request, in ms */
+#define METRICS_REQUEST_TIMEOUT	100
+
+/* How long a client may take to read the response, in seconds */
+#define METRICS_SEND_TIMEOUT	1
+
+/* How often the serving thread checks whether it should stop, in ms */
+#define METRICS_STOP_POLL	250
+
+static int metrics_fd = -1;
+static int metrics_running;
+static pthread_t metrics_thread;
+
+static void metrics_header(FILE *f, const char *name, const char *type,
+		const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Counters from stats.c, as an aggregate and per thread */
+static void metrics_write_counters(FILE *f)
+{
+	struct stats_counters total, w[MAX_WORKERS + 1];
+	int i, nworkers = gcfg.workers > 0 ? gcfg.workers : 0;
+
+	stats_read(&total);
+	for (i = 0; i <= nworkers; ++i)
+		stats_read_worker(i, &w[i]);
+
+#define X(name, desc) \
+	metrics_header(f, "tayga_" #name "_total", "counter", desc); \
+	fprintf(f, "tayga_" #name "_total %llu\n", \
+			(unsigned long long)total.name); \
+	metrics_header(f, "tayga_worker_" #name "_total", "counter", \
+			desc " per thread"); \
+	for (i = 0; i <= nworkers; ++i) \
+		fprintf(f, "tayga_worker_" #name "_total{worker=\"%d\"} %llu\n", \
+				i, (unsigned long long)w[i].name);
+	STATS_COUNTER_LIST
+#undef X
+
+	metrics_header(f, "tayga_packet_events_total", "counter",
+			"Packets dropped, rejected or answered locally, by reason");
+	for (i = 0; i < PKT_REASON_MAX; ++i)
+		fprintf(f, "tayga_packet_events_total{family=\"ipv%d\","
+				"reason=\"%s\"} %llu\n", pkt_reasons[i].family,
+				pkt_reasons[i].name,
+				(unsigned long long)total.reason[i]);
+
+	metrics_header(f, "tayga_cache_hit_ratio", "gauge",
+			"Fraction of address cache lookups which hit");
+	fprintf(f, "tayga_cache_hit_ratio %g\n",
+			total.cache_hit + total.cache_miss ?
+			(double)total.cache_hit /
+			(total.cache_hit + total.cache_miss) : 0.0);
+}
+
+/* Address cache occupancy */
+static void metrics_write_cache(FILE *f)
+{
+	struct list_head *entry;
+	unsigned long active = 0;
+
+	if (gcfg.cache_size) {
+		pthread_mutex_lock(&gcfg.cache_mutex);
+		list_for_each(entry, &gcfg.cache_active)
+			++active;
+		pthread_mutex_unlock(&gcfg.cache_mutex);
+	}
+	metrics_header(f, "tayga_cache_entries", "gauge",
+			"Address cache entries in use");
+	fprintf(f, "tayga_cache_entries %lu\n", active);
+	metrics_header(f, "tayga_cache_capacity", "gauge",
+			"Address cache size");
+	fprintf(f, "tayga_cache_capacity %d\n", gcfg.cache_size);
+}
+
+/* Dynamic pool utilization and map counts */
+static void metrics_write_maps(FILE *f)
+{
+	static const char *type_names[] = MAP_TYPE_LIST;
+	static const char *origin_names[] = MAP_ORIGIN_LIST;
+	unsigned long maps[MAP_TYPE_MAX][MAP_ORIGIN_MAX + 1];
+	unsigned long mapped = 0, dormant = 0, free_addrs = 0;
+	struct dynamic_pool *pool;
+	struct list_head *entry;
+	struct map4 *m;
+	int t, o, k;
+
+	memset(maps, 0, sizeof(maps));
+	pthread_mutex_lock(&gcfg.map_mutex);
+	list_for_each(entry, &gcfg.map4_list) {
+		m = list_entry(entry, struct map4, list);
+		if (m->type < 0 || m->type >= MAP_TYPE_MAX)
+			continue;
+		/* Only static and RFC6052 maps record where they came from */
+		o = MAP_ORIGIN_MAX;
+		if (m->type == MAP_TYPE_STATIC || m->type == MAP_TYPE_RFC6052)
+			o = container_of(m, struct map_static, map4)->origin;
+		if (o < 0 || o > MAP_ORIGIN_MAX)
+			o = MAP_ORIGIN_MAX;
+		maps[m->type][o]++;
+	}
+	pthread_mutex_unlock(&gcfg.map_mutex);
+	/* Pool mutexes come before map_mutex, so these are taken after */
+	for (k = 0; k < gcfg.dyn_pool_count; ++k) {
+		pool = gcfg.dyn_pools[k];
+		pthread_mutex_lock(&pool->mutex);
+		mapped += pool->mapped.len;
+		dormant += pool->dormant.len;
+		free_addrs += pool->free_count;
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	metrics_header(f, "tayga_maps", "gauge",
+			"Address maps by type and origin");
+	for (t = 0; t < MAP_TYPE_MAX; ++t)
+		for (o = 0; o <= MAP_ORIGIN_MAX; ++o)
+			if (maps[t][o])
+				fprintf(f, "tayga_maps{type=\"%s\",origin=\"%s\"} "
+						"%lu\n", type_names[t],
+						origin_names[o], maps[t][o]);
+
+	if (!gcfg.dyn_pool_count)
+		return;
+	metrics_header(f, "tayga_dynamic_pool_addresses", "gauge",
+			"Dynamic pool addresses by state");
+	fprintf(f, "tayga_dynamic_pool_addresses{state=\"mapped\"} %lu\n",
+			mapped);
+	fprintf(f, "tayga_dynamic_pool_addresses{state=\"dormant\"} %lu\n",
+			dormant);
+	fprintf(f, "tayga_dynamic_pool_addresses{state=\"free\"} %lu\n",
+			free_addrs);
+}
+
+#ifdef WITH_LATENCY
+/* Latency quantiles as a Prometheus summary */
+static void metrics_write_latency(FILE *f)
+{
+	static const char *names[LAT_HIST_MAX] = {
+#define X(name, label) label,
+		LAT_HIST_LIST
+#undef X
+	};
+	static const char *qname[] = { "0.5", "0.99", "0.999" };
+	static const double q[] = { 0.5, 0.99, 0.999 };
+	uint64_t count[LAT_BUCKETS], n, sum;
+	int h, b, i;
+
+	metrics_header(f, "tayga_latency_seconds", "summary",
+			"Time from tun read to the last tun write, by path");
+	for (h = 0; h < LAT_HIST_MAX; ++h) {
+		lat_read(h, count, &sum);
+		for (n = 0, b = 0; b < LAT_BUCKETS; ++b)
+			n += count[b];
+		for (i = 0; i < 3; ++i)
+			fprintf(f, "tayga_latency_seconds{path=\"%s\","
+					"quantile=\"%s\"} %.9f\n", names[h],
+					qname[i], lat_quantile(count, q[i]) / 1e9);
+		fprintf(f, "tayga_latency_seconds_sum{path=\"%s\"} %.9f\n",
+				names[h], sum * lat_ns_per_tick / 1e9);
+		fprintf(f, "tayga_latency_seconds_count{path=\"%s\"} %llu\n",
+				names[h], (unsigned long long)n);
+	}
+}
+#endif
+
+#ifdef WITH_LOCK_STATS
+/* Mutex contention by call site */
+static void metrics_write_locks(FILE *f)
+{
+	struct lock_site *site;
+
+#define LOCK_METRIC(name, type, help, field, scale) \
+	metrics_header(f, "tayga_lock_" name, type, help); \
+	for (site = lock_sites(); site; site = site->next) \
+		fprintf(f, "tayga_lock_" name "{lock=\"%s\",site=\"%s:%d\"} " \
+				"%.9g\n", lock_name(site->mutex), site->func, \
+				site->line, __atomic_load_n(&site->field, \
+					__ATOMIC_RELAXED) * (scale));
+	LOCK_METRIC("acquisitions_total", "counter",
+			"Mutex acquisitions by call site", acquired, 1.0);
+	LOCK_METRIC("contended_total", "counter",
+			"Mutex acquisitions which had to wait", contended, 1.0);
+	LOCK_METRIC("wait_seconds_total", "counter",
+			"Time spent waiting for the mutex", wait_ns, 1e-9);
+	LOCK_METRIC("hold_seconds_total", "counter",
+			"Time the mutex was held after this site took it",
+			hold_ns, 1e-9);
+	LOCK_METRIC("hold_max_seconds", "gauge",
+			"Longest single hold since the last reset", max_hold_ns,
+			1e-9);
+#undef LOCK_METRIC
+}
+#endif
+
+/**
+ * @brief Write every metric in Prometheus text exposition format
+ *
+ * @param f Stream to write to
+ */
+void metrics_write(FILE *f)
+{
+	metrics_write_counters(f);
+	metrics_write_cache(f);
+	metrics_write_maps(f);
+#ifdef WITH_LATENCY
+	metrics_write_latency(f);
+#endif
+#ifdef WITH_LOCK_STATS
+	metrics_write_locks(f);
+#endif
+}
+
+/**
+ * @brief Open the stats-socket listener
+ *
+ * Called before dropping privileges, so the socket is created outside
+ * of any chroot. A stale socket left by a previous run is replaced.
+ *
+ * @returns listening fd, or -1 on error
+ */
+int metrics_open(void)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, gcfg.stats_socket);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		slog(LOG_CRIT, "Unable to create stats-socket: %s\n",
+				strerror(errno));
+		return -1;
+	}
+	unlink(gcfg.stats_socket);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+			listen(fd, 8) < 0 ||
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		slog(LOG_CRIT, "Unable to listen on stats-socket %s: %s\n",
+				gcfg.stats_socket, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	metrics_fd = fd;
+	return fd;
+}
+
+/**
+ * @brief Stop serving and remove the stats-socket on exit
+ */
+void metrics_close(void)
+{
+	if (__atomic_load_n(&metrics_running, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&metrics_running, 0, __ATOMIC_RELEASE);
+		pthread_join(metrics_thread, NULL);
+	}
+	if (metrics_fd < 0)
+		return;
+	close(metrics_fd);
+	unlink(gcfg.stats_socket);
+	metrics_fd = -1;
+}
+
+/* Send all of buf, giving up if the client stalls or goes away */
+static int metrics_send(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Serve one pending stats-socket client. A client which starts with
+ * "GET" is treated as an HTTP scraper and gets a response header,
+ * anything else (or nothing at all within METRICS_REQUEST_TIMEOUT) gets
+ * the bare text. */
+static void metrics_accept(void)
+{
+	struct timeval tv = { .tv_sec = METRICS_SEND_TIMEOUT };
+	struct pollfd pfd;
+	char req[256], *buf = NULL;
+	size_t len = 0;
+	ssize_t ret;
+	FILE *f;
+	int fd, http = 0;
+
+	fd = accept(metrics_fd, NULL, NULL);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			slog(LOG_WARNING, "stats-socket accept failed: %s\n",
+					strerror(errno));
+		return;
+	}
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT) > 0) {
+		ret = recv(fd, req, sizeof(req), MSG_DONTWAIT);
+		http = ret >= 3 && !memcmp(req, "GET", 3);
+	}
+
+	f = open_memstream(&buf, &len);
+	if (!f) {
+		close(fd);
+		return;
+	}
+	metrics_write(f);
+	fclose(f);
+
+	/* The listener is non-blocking, but replies are sent with a timeout */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (http) {
+		snprintf(req, sizeof(req), "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %zu\r\n"
+				"Connection: close\r\n\r\n", len);
+		ret = metrics_send(fd, req, strlen(req));
+	} else {
+		ret = 0;
+	}
+	if (!ret)
+		metrics_send(fd, buf, len);
+	free(buf);
+	close(fd);
+}
+
+/* Clients are served one at a time on this thread, so a slow one only
+ * delays other scrapers, never the packet path */
+static void *metrics_worker(void *arg)
+{
+	struct pollfd pfd = { .fd = metrics_fd, .events = POLLIN };
+	(void)arg;
+
+	while (__atomic_load_n(&metrics_running, __ATOMIC_ACQUIRE)) {
+		if (poll(&pfd, 1, METRICS_STOP_POLL) > 0)
+			metrics_accept();
+	}
+	return NULL;
+}
+
+/**
+ * @brief Start the thread serving the stats-socket
+ *
+ * @returns ERROR_NONE on success, ERROR_REJECT on failure
+ */
+int metrics_start(void)
+{
+	int ret;
+
+	if (metrics_fd < 0)
+		return ERROR_NONE;
+	metrics_running = 1;
+	ret = pthread_create(&metrics_thread, NULL, metrics_worker, NULL);
+	if (ret) {
+		slog(LOG_CRIT, "Failed to create stats-socket thread: %s\n",
+				strerror(ret));
+		metrics_running = 0;
+		return ERROR_REJECT;
+	}
+	return ERROR_NONE;
+}
@@ -56,75 +56,95 @@ struct ip4_error {
     struct ip4 ip4_em;
 };
 
+/* Upper bound on IPv6 fragments per IPv4 datagram: a maximum size datagram
+ * split at the smallest fragment payload the minimum IPv6 MTU permits */
+#define FRAG_MAX (65535 / ((MTU_MIN - sizeof(struct ip6) - \
+				sizeof(struct ip6_frag)) & ~7) + 1)
+
+/**
+ * @brief MTU to use towards an IPv6 destination
+ *
+ * Bounded by the tun MTU, the configured offlink-mtu, and any path MTU
+ * learned from a Packet Too Big for this destination.
+ *
+ * @param dest IPv6 destination address
+ * @returns MTU in bytes, including the IPv6 header
+ */
+static inline uint32_t ip6_path_mtu(const struct in6_addr *dest)
+{
+	uint32_t mtu = gcfg.mtu;
+	uint32_t pmtu = pmtu_get(dest);
+
+	if (gcfg.ipv6_offlink_mtu < mtu)
+		mtu = gcfg.ipv6_offlink_mtu;
+	if (pmtu && pmtu < mtu)
+		mtu = pmtu;
+	return mtu;
+}
+
+/* Translator variants
+ *
+ * The data path is specialized at compile time for each configuration
+ * shape (see XLATE_VARIANT below), and the variant is chosen once at
+ * startup by nat64_select_variant()
+ */
+enum {
+	XLATE_RFC6052,	//Only a NAT64 prefix, fixed prefix length
+	XLATE_STATIC,	//Static / EAM maps, no dynamic allocation
+	XLATE_DYNAMIC,	//Dynamic pool, may allocate on the 6to4 path
+};
+
+/// Parameters of the pure RFC6052 variants
+static struct {
+	struct in6_addr prefix;
+	struct in6_addr mask;
+	int wkpf_strict;	/* prefix is 64:ff9b::/96 and wkpf-strict set */
+	int self6;		/* ipv6-addr has its own map entry */
+} rfc6052;
+
 /**
- * @brief Print an IPv4 packet to the log
+ * @brief Pick the LOG_OPT bit an event is reported under
+ *
+ * @param err Bitmask of LOG_OPT to report this packet
+ * @returns the enabled LOG_OPT bit, or 0 if the event is not logged
+ */
+static inline int log_pkt_type(int err)
+{
+	if	   (gcfg.log_opts & err & LOG_OPT_SELF) 	return LOG_OPT_SELF;
+	else if(gcfg.log_opts & err & LOG_OPT_DROP) 	return LOG_OPT_DROP;
+	else if(gcfg.log_opts & err & LOG_OPT_REJECT) 	return LOG_OPT_REJECT;
+	else if(gcfg.log_opts & err & LOG_OPT_ICMP) 	return LOG_OPT_ICMP;
+	return 0;
+}
+
+/**
+ * @brief Count and log a packet event with a numeric argument
  *
  * @param err Bitmask of LOG_OPT to report this packet
  * @param p   struct pkt which encountered the error
- * @param msg string message to include in the log
+ * @param reason pkt_reason describing the event, which also tells
+ *               whether p is an IPv4 or IPv6 packet
+ * @param arg number appended to the description
  */
-static void log_pkt4(int err, struct pkt *p, const char *msg)
+static void log_pkt_arg(int err, struct pkt *p, int reason, int arg)
 {
-	const char * type = "";
-	if	   (gcfg.log_opts & err & LOG_OPT_SELF) 	type = "SELF";
-	else if(gcfg.log_opts & err & LOG_OPT_DROP) 	type = "DROP";
-	else if(gcfg.log_opts & err & LOG_OPT_REJECT) 	type = "REJECT";
-	else if(gcfg.log_opts & err & LOG_OPT_ICMP) 	type = "ICMP";
-	else return;
-
-	/* Convert the src / dest IPv4 to strings */
-	char saddr[INET_ADDRSTRLEN],daddr[INET_ADDRSTRLEN];
-	const char * ret;
-	ret = inet_ntop(AF_INET,&p->ip4->src,saddr,sizeof(saddr));
-	if(!ret) {
-		/* ntop got an error */
-		sprintf(saddr,"ERROR:%d",errno);
-	}
-	ret = inet_ntop(AF_INET,&p->ip4->dest,daddr,sizeof(daddr));
-	if(!ret) {
-		/* ntop got an error */
-		sprintf(daddr,"ERROR:%d",errno);
-	}
-	/* Build final string */
-	int sev = LOG_INFO;
-	if(err & (LOG_OPT_DROP | LOG_OPT_REJECT)) sev = LOG_NOTICE;
-	slog(sev,"%s: [v4] [%s]->[%s] (%d bytes) (proto %d) %s\n",
-		type, saddr, daddr, (p->header_len + p->data_len),p->data_proto,msg);
+	int type = log_pkt_type(err);
+
+	stats_pkt_event(err, reason);
+	if (type)
+		pktlog(type, err, p, reason, arg);
 }
 
 /**
- * @brief Print an IPv6 packet to the log
+ * @brief Count and log a packet event
  *
  * @param err Bitmask of LOG_OPT to report this packet
  * @param p   struct pkt which encountered the error
- * @param msg string message to include in the log
+ * @param reason pkt_reason describing the event
  */
-static void log_pkt6(int err, struct pkt *p, const char *msg)
+static void log_pkt(int err, struct pkt *p, int reason)
 {
-	const char * type = "";
-	if	   (gcfg.log_opts & err & LOG_OPT_SELF) 	type = "SELF";
-	else if(gcfg.log_opts & err & LOG_OPT_DROP) 	type = "DROP";
-	else if(gcfg.log_opts & err & LOG_OPT_REJECT) 	type = "REJECT";
-	else if(gcfg.log_opts & err & LOG_OPT_ICMP) 	type = "ICMP";
-	else return;
-
-	/* Convert the src / dest IPv6 to strings */
-	char saddr[INET6_ADDRSTRLEN],daddr[INET6_ADDRSTRLEN];
-	const char * ret = inet_ntop(AF_INET6,&p->ip6->src,saddr,sizeof(saddr));
-	if(!ret) {
-		/* ntop got an error */
-		sprintf(saddr,"ERROR:%d",errno);
-	}
-	ret = inet_ntop(AF_INET6,&p->ip6->dest,daddr,sizeof(daddr));
-	if(!ret) {
-		/* ntop got an error */
-		sprintf(daddr,"ERROR:%d",errno);
-	}
-	/* Build final string */
-	int sev = LOG_INFO;
-	if(err & (LOG_OPT_DROP | LOG_OPT_REJECT)) sev = LOG_NOTICE;
-	slog(sev,"%s: [v6] [%s]->[%s] (%d bytes) (proto %d) %s\n",
-		type, saddr, daddr, (p->header_len + p->data_len),p->data_proto,msg);
+	log_pkt_arg(err, p, reason, PKTLOG_NO_ARG);
 }
 
 static uint16_t ip_checksum(void *d, uint32_t c)
@@ -241,9 +261,10 @@ static void host_send_icmp4(uint8_t tos, struct in_addr *src,
 	iov[0].iov_len = sizeof(header);
 	iov[1].iov_base = data;
 	iov[1].iov_len = data_len;
-	if (writev(gcfg.tun_fd, iov, data_len ? 2 : 1) < 0)
-		slog(LOG_WARNING, "error writing packet to tun device: %s\n",
-			strerror(errno));
+	LAT_PATH(LAT_SELF);
+	TRACE3(icmp_gen, 4, icmp->type, icmp->code);
+	if (tun_write(iov, data_len ? 2 : 1) == ERROR_NONE)
+		STAT_INC(icmp_gen);
 }
 
 static void host_send_icmp4_error(uint8_t type, uint8_t code, uint32_t word,
@@ -256,6 +277,9 @@ static void host_send_icmp4_error(uint8_t type, uint8_t code, uint32_t word,
 	   echo request */
 	if (orig->data_proto == 1 && orig->icmp->type != 8)
 		return;
+	/* Don't let a flood of bad packets turn us into a reflector */
+	if (!icmp_ratelimit4(RL_ERRORS, &orig->ip4->src))
+		return;
 
 	orig_len = orig->header_len + orig->data_len;
 	if (orig_len > 576 - sizeof(struct ip4) - sizeof(struct icmp))
@@ -269,20 +293,21 @@ static void host_send_icmp4_error(uint8_t type, uint8_t code, uint32_t word,
 
 static void host_handle_icmp4(struct pkt *p)
 {
-	char temp[32];
 	p->data += sizeof(struct icmp);
 	p->data_len -= sizeof(struct icmp);
 
 	switch (p->icmp->type) {
 	case 8:
+		log_pkt(LOG_OPT_SELF,p,R4_ECHO_REQUEST);
+		if (!icmp_ratelimit4(RL_ECHO, &p->ip4->src))
+			break;
 		p->icmp->type = 0;
-		log_pkt4(LOG_OPT_SELF,p,"Echo Request");
 		host_send_icmp4(p->ip4->tos, &p->ip4->dest, &p->ip4->src,
 				p->icmp, p->data, p->data_len);
 		break;
 	default:
-		sprintf(temp,"ICMP Unknown Type %d",p->icmp->type);
-		log_pkt4(LOG_OPT_SELF | LOG_OPT_DROP,p,temp);
+		log_pkt_arg(LOG_OPT_SELF | LOG_OPT_DROP,p,R4_ICMP_UNKNOWN_TYPE_TO_SELF,
+				p->icmp->type);
 	}
 }
 
@@ -296,6 +321,53 @@ static void xlate_header_4to6(struct pkt *p, struct ip6 *ip6,
 	ip6->hop_limit = p->ip4->ttl;
 }
 
+/**
+ * @brief Clamp the MSS option of a TCP SYN segment
+ *
+ * The checksum is updated incrementally (RFC 1624). The option may start
+ * at an odd offset, in which case the old and new values straddle two
+ * checksum words and take part in the sum byte-swapped.
+ *
+ * @param p Packet, with data pointing to the TCP header
+ * @param tck TCP checksum field
+ * @param max_mss Largest MSS which fits the translated path
+ */
+static void tcp_mss_clamp(struct pkt *p, uint16_t *tck, uint16_t max_mss)
+{
+	uint8_t *opt = p->data + 20;
+	uint8_t *end = p->data + ((p->data[12] >> 4) * 4);
+	uint16_t old_mss, new_mss;
+
+	/* SYN only, and the option list must be within the packet */
+	if (!(p->data[13] & 0x02) || end > p->data + p->data_len)
+		return;
+
+	while (opt < end && *opt != 0) {
+		if (*opt == 1) {
+			++opt;
+			continue;
+		}
+		if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+			return;
+		if (*opt == 2 && opt[1] == 4) {
+			old_mss = (opt[2] << 8) | opt[3];
+			if (old_mss <= max_mss)
+				return;
+			opt[2] = max_mss >> 8;
+			opt[3] = max_mss & 0xff;
+			old_mss = htons(old_mss);
+			new_mss = htons(max_mss);
+			if ((opt + 2 - p->data) & 1) {
+				old_mss = (old_mss >> 8) | (old_mss << 8);
+				new_mss = (new_mss >> 8) | (new_mss << 8);
+			}
+			*tck = ones_add(ones_add(*tck, old_mss), ~new_mss);
+			return;
+		}
+		opt += opt[1];
+	}
+}
+
 static int xlate_payload_4to6(struct pkt *p, struct ip6 *ip6, int em)
 {
 	uint16_t *tck;
@@ -322,7 +394,7 @@ static int xlate_payload_4to6(struct pkt *p, struct ip6 *ip6, int em)
 	/* UDP */
 	case 17:
 		if (p->data_len < 8) {
-			if (!em) log_pkt4(LOG_OPT_DROP,p,"Insufficient payload length for UDP Header");
+			if (!em) log_pkt(LOG_OPT_DROP,p,R4_INSUFFICIENT_PAYLOAD_LENGTH_FOR_UDP_HEADER);
 			return ERROR_DROP;
 		}
 		tck = (uint16_t *)(p->data + 6);
@@ -332,7 +404,7 @@ static int xlate_payload_4to6(struct pkt *p, struct ip6 *ip6, int em)
 			default:
 			case UDP_CKSUM_DROP:
 				/* Do not handle zero checksum packets */
-				if (!em) log_pkt4(LOG_OPT_DROP,p,"Not configured to handle Zero UDP Checksum");
+				if (!em) log_pkt(LOG_OPT_DROP,p,R4_NOT_CONFIGURED_TO_HANDLE_ZERO_UDP_CHECKSUM);
 				return ERROR_DROP;
 			case UDP_CKSUM_FWD:
 				/* Ignore the lack of checksum and forward anyway */
@@ -348,10 +420,13 @@ static int xlate_payload_4to6(struct pkt *p, struct ip6 *ip6, int em)
 	/* TCP */
 	case 6:
 		if (p->data_len < 20) {
-			if (!em) log_pkt4(LOG_OPT_DROP,p,"Insufficient payload length for TCP Header");
+			if (!em) log_pkt(LOG_OPT_DROP,p,R4_INSUFFICIENT_PAYLOAD_LENGTH_FOR_TCP_HEADER);
 			return ERROR_DROP;
 		}
 		tck = (uint16_t *)(p->data + 16);
+		if (gcfg.tcp_mss_clamp && !em)
+			tcp_mss_clamp(p, tck, ip6_path_mtu(&ip6->dest) - MTU_ADJ -
+					sizeof(struct ip4) - 20);
 		break;
 	/* Any other protocol */
 	default:
@@ -362,43 +437,108 @@ static int xlate_payload_4to6(struct pkt *p, struct ip6 *ip6, int em)
 	return ERROR_NONE;
 }
 
-static void xlate_4to6_data(struct pkt *p)
+/**
+ * @brief Map IPv4 to IPv6 for a translator variant
+ *
+ * In the pure RFC6052 variants, this is equivalent to map_ip4_to_ip6
+ * with only the self map and the NAT64 prefix configured, without
+ * taking any locks. The map4to6 probe fires with hit = 2 there, as no
+ * cache is involved.
+ */
+static ALWAYS_INLINE int xmap_ip4_to_ip6(const int mode, const int plen,
+		struct in6_addr *addr6, const struct in_addr *addr4)
+{
+	if (mode != XLATE_RFC6052)
+		return map_ip4_to_ip6(addr6, addr4);
+
+	if (addr4->s_addr == gcfg.local_addr4.s_addr) {
+		*addr6 = gcfg.local_addr6;
+		TRACE3(map4to6, addr4->s_addr, addr6, 2);
+		return ERROR_NONE;
+	}
+	if (validate_ip4_addr(addr4))
+		return ERROR_DROP;
+	if (plen == 96 && rfc6052.wkpf_strict && is_private_ip4_addr(addr4))
+		return ERROR_REJECT;
+	if (rfc6052_embed(addr6, addr4, &rfc6052.prefix, plen))
+		return ERROR_DROP;
+	TRACE3(map4to6, addr4->s_addr, addr6, 2);
+	return ERROR_NONE;
+}
+
+/**
+ * @brief Map IPv6 to IPv4 for a translator variant
+ *
+ * In the pure RFC6052 variants, this is equivalent to map_ip6_to_ip4
+ * with only the self map and the NAT64 prefix configured, without
+ * taking any locks. The map6to4 probe fires with hit = 2 there.
+ */
+static ALWAYS_INLINE int xmap_ip6_to_ip4(const int mode, const int plen,
+		struct in_addr *addr4, const struct in6_addr *addr6,
+		int dyn_alloc)
+{
+	if (mode == XLATE_STATIC)
+		return map_ip6_to_ip4(addr4, addr6, 0);
+	if (mode == XLATE_DYNAMIC)
+		return map_ip6_to_ip4(addr4, addr6, dyn_alloc);
+
+	if (rfc6052.self6 && IN6_ARE_ADDR_EQUAL(addr6, &gcfg.local_addr6)) {
+		*addr4 = gcfg.local_addr4;
+		TRACE3(map6to4, addr6, addr4->s_addr, 2);
+		return ERROR_NONE;
+	}
+	if (!IN6_IS_IN_NET(addr6, &rfc6052.prefix, &rfc6052.mask))
+		return ERROR_REJECT;
+	if (rfc6052_extract(addr4, addr6, plen) || validate_ip4_addr(addr4))
+		return ERROR_DROP;
+	if (plen == 96 && rfc6052.wkpf_strict && is_private_ip4_addr(addr4))
+		return ERROR_REJECT;
+	if (addr4->s_addr == gcfg.local_addr4.s_addr) {
+		slog(LOG_DEBUG,"%s:%d Dropping packet due to hairpin condition",__FUNCTION__,__LINE__);
+		return ERROR_DROP;
+	}
+	TRACE3(map6to4, addr6, addr4->s_addr, 2);
+	return ERROR_NONE;
+}
+
+static ALWAYS_INLINE void xlate_4to6_data(struct pkt *p,
+		const int mode, const int plen)
 {
 	struct ip6_data header;
+	struct ip6_data frags[FRAG_MAX];
 	struct iovec iov[2];
+	struct iovec frag_iov[FRAG_MAX][2];
 	int no_frag_hdr = 0;
 	uint16_t off = ntohs(p->ip4->flags_offset);
-	uint32_t frag_size;
+	uint32_t frag_size, mtu;
+	int nfrag;
 	int ret;
 
-	frag_size = gcfg.ipv6_offlink_mtu;
-	if (frag_size > gcfg.mtu)
-		frag_size = gcfg.mtu;
-	frag_size -= sizeof(struct ip6);
-
-	ret = map_ip4_to_ip6(&header.ip6.dest, &p->ip4->dest);
+	ret = xmap_ip4_to_ip6(mode, plen, &header.ip6.dest, &p->ip4->dest);
 	if (ret == ERROR_REJECT) {
-		log_pkt4(LOG_OPT_REJECT,p,"Unable to map destination address");
+		log_pkt(LOG_OPT_REJECT,p,R4_UNABLE_TO_MAP_DESTINATION_ADDRESS_REJECT);
 		host_send_icmp4_error(3, 1, 0, p);
 
 		return;
 	}
 	else if(ret == ERROR_DROP) {
-		log_pkt4(LOG_OPT_DROP,p,"Unable to map destination address");
+		log_pkt(LOG_OPT_DROP,p,R4_UNABLE_TO_MAP_DESTINATION_ADDRESS_DROP);
 		return;
 	}
 
-	ret = map_ip4_to_ip6(&header.ip6.src, &p->ip4->src);
+	ret = xmap_ip4_to_ip6(mode, plen, &header.ip6.src, &p->ip4->src);
 	if (ret == ERROR_REJECT) {
-		log_pkt4(LOG_OPT_REJECT,p,"Unable to map source address");
+		log_pkt(LOG_OPT_REJECT,p,R4_UNABLE_TO_MAP_SOURCE_ADDRESS_REJECT);
 		host_send_icmp4_error(3, 10, 0, p);
 		return;
 	}
 	else if(ret == ERROR_DROP) {
-		log_pkt4(LOG_OPT_DROP,p,"Unable to map source address");
+		log_pkt(LOG_OPT_DROP,p,R4_UNABLE_TO_MAP_SOURCE_ADDRESS_DROP);
 		return;
 	}
 
+	frag_size = ip6_path_mtu(&header.ip6.dest) - sizeof(struct ip6);
+
 	/* We do not respect the DF flag for IP4 packets that are already
 	   fragmented, because the IP6 fragmentation header takes an extra
 	   eight bytes, which we don't have space for because the IP4 source
@@ -410,9 +550,14 @@ static void xlate_4to6_data(struct pkt *p)
 	   1456 bytes of payload == 1504 bytes.) */
 	if ((off & (IP4_F_MASK | IP4_F_MF)) == 0) {
 		if (off & IP4_F_DF) {
-			if (gcfg.mtu - MTU_ADJ < p->header_len + p->data_len) {
-				log_pkt4(LOG_OPT_ICMP,p,"Packet Too Big");
-				host_send_icmp4_error(3, 4, gcfg.mtu - MTU_ADJ, p);
+			/* Answer from the learned path MTU right away rather
+			   than waiting for the IPv6 network to complain */
+			mtu = pmtu_get(&header.ip6.dest);
+			if (!mtu || mtu > gcfg.mtu)
+				mtu = gcfg.mtu;
+			if (mtu - MTU_ADJ < p->header_len + p->data_len) {
+				log_pkt(LOG_OPT_ICMP,p,R4_PACKET_TOO_BIG);
+				host_send_icmp4_error(3, 4, mtu - MTU_ADJ, p);
 				return;
 			}
 			no_frag_hdr = 1;
@@ -435,9 +580,8 @@ static void xlate_4to6_data(struct pkt *p)
 		iov[1].iov_base = p->data;
 		iov[1].iov_len = p->data_len;
 
-		if (writev(gcfg.tun_fd, iov, 2) < 0)
-			slog(LOG_WARNING, "error writing packet to tun "
-					"device: %s\n", strerror(errno));
+		LAT_PATH(LAT_4TO6);
+		tun_write(iov, 2);
 	} else {
 		header.ip6_frag.next_header = header.ip6.next_header;
 		header.ip6_frag.reserved = 0;
@@ -445,22 +589,30 @@ static void xlate_4to6_data(struct pkt *p)
 
 		header.ip6.next_header = 44;
 
-		iov[0].iov_base = &header;
-		iov[0].iov_len = sizeof(header);
-
 		off = (off & IP4_F_MASK) * 8;
 		frag_size = (frag_size - sizeof(header.ip6_frag)) & ~7;
 
-		while (p->data_len > 0) {
+		/* Stamp out one copy of the header per fragment, then hand
+		 * the whole datagram to the tun device in one batch */
+		for (nfrag = 0; p->data_len > 0; ++nfrag) {
+			/* Only reachable with a tun MTU below the IPv6 minimum */
+			if (nfrag == FRAG_MAX) {
+				log_pkt(LOG_OPT_DROP,p,R4_TOO_MANY_FRAGMENTS);
+				return;
+			}
 			if (p->data_len < frag_size)
 				frag_size = p->data_len;
 
-			header.ip6.payload_length =
+			frags[nfrag] = header;
+			frags[nfrag].ip6.payload_length =
 				htons(sizeof(struct ip6_frag) + frag_size);
-			header.ip6_frag.offset_flags = htons(off);
+			frags[nfrag].ip6_frag.offset_flags = htons(off);
 
-			iov[1].iov_base = p->data;
-			iov[1].iov_len = frag_size;
+			frag_iov[nfrag][0].iov_base = &frags[nfrag];
+			frag_iov[nfrag][0].iov_len = sizeof(header);
+			frag_iov[nfrag][1].iov_base = p->data;
+			frag_iov[nfrag][1].iov_len = frag_size;
+			TRACE3(frag, ntohs(p->ip4->ident), off, frag_size);
 
 			p->data += frag_size;
 			p->data_len -= frag_size;
@@ -468,15 +620,11 @@ static void xlate_4to6_data(struct pkt *p)
 
 			if (p->data_len || (p->ip4->flags_offset &
 							htons(IP4_F_MF)))
-				header.ip6_frag.offset_flags |= htons(IP6_F_MF);
-
-			if (writev(gcfg.tun_fd, iov, 2) < 0) {
-				slog(LOG_WARNING, "error writing packet to "
-						"tun device: %s\n",
-						strerror(errno));
-				return;
-			}
+				frags[nfrag].ip6_frag.offset_flags |=
+							htons(IP6_F_MF);
 		}
+		LAT_PATH(LAT_4TO6);
+		STAT_ADD(frags, tun_write_batch(&frag_iov[0][0], 2, nfrag));
 	}
 }
 
@@ -486,7 +634,7 @@ static int parse_ip4(struct pkt *p)
 
 	/* Not long enough for IPv4 header */
 	if (p->data_len < sizeof(struct ip4)) {
-		log_pkt4(LOG_OPT_DROP,p,"IP Header Length");
+		log_pkt(LOG_OPT_DROP,p,R4_IP_HEADER_LENGTH);
 		return ERROR_DROP;
 	}
 
@@ -498,7 +646,7 @@ static int parse_ip4(struct pkt *p)
 			ntohs(p->ip4->length) < p->header_len ||
 			(validate_ip4_addr(&p->ip4->src) == ERROR_DROP) ||
 			(validate_ip4_addr(&p->ip4->dest) == ERROR_DROP)) {
-		log_pkt4(LOG_OPT_DROP,p,"IP Header Invalid");
+		log_pkt(LOG_OPT_DROP,p,R4_IP_HEADER_INVALID);
 		return ERROR_DROP;
 	}
 
@@ -511,11 +659,11 @@ static int parse_ip4(struct pkt *p)
 
 	if (p->data_proto == 1) { /* ICMPv4 */
 		if (p->ip4->flags_offset & htons(IP4_F_MASK | IP4_F_MF)) {
-			log_pkt4(LOG_OPT_DROP,p,"ICMP Fragmented");
+			log_pkt(LOG_OPT_DROP,p,R4_ICMP_FRAGMENTED);
 			return ERROR_DROP;
 		}
 		if (p->data_len < sizeof(struct icmp)) {
-			log_pkt4(LOG_OPT_DROP,p,"ICMP Header Length");
+			log_pkt(LOG_OPT_DROP,p,R4_ICMP_HEADER_LENGTH);
 			return ERROR_DROP;
 		}
 		p->icmp = (struct icmp *)(p->data);
@@ -524,18 +672,18 @@ static int parse_ip4(struct pkt *p)
 		      p->data_proto == 44 || /* IPv6 Fragment Header */
 		      p->data_proto == 58 || /* IPv6 ICMPv6 */
 			  p->data_proto == 60) { /* IPv6 Destination Options Header */
-		log_pkt4(LOG_OPT_DROP,p,"IPv4 Packet with IPv6-Only Proto");
+		log_pkt(LOG_OPT_DROP,p,R4_IPV4_PACKET_WITH_IPV6_ONLY_PROTO);
 		return ERROR_DROP;
 	} else {
 		if ((p->ip4->flags_offset & htons(IP4_F_MF)) &&
 				(p->data_len & 0x7)) {
-			log_pkt4(LOG_OPT_DROP,p,"Fragment Misalignment");
+			log_pkt(LOG_OPT_DROP,p,R4_FRAGMENT_MISALIGNMENT);
 			return ERROR_DROP;
 		}
 
 		if ((uint32_t)((ntohs(p->ip4->flags_offset) & IP4_F_MASK) * 8) +
 				p->data_len > 65535) {
-			log_pkt4(LOG_OPT_DROP,p,"Fragment Exceeds Max Length");
+			log_pkt(LOG_OPT_DROP,p,R4_FRAGMENT_EXCEEDS_MAX_LENGTH);
 			return ERROR_DROP;
 		}
 	}
@@ -565,7 +713,6 @@ static void xlate_4to6_icmp_error(struct pkt *p)
 	struct pkt p_em;
 	uint32_t mtu;
 	uint16_t em_len;
-	char temp[64];
 
 	memset(&p_em, 0, sizeof(p_em));
 	p_em.data = p->data + sizeof(struct icmp);
@@ -575,7 +722,7 @@ static void xlate_4to6_icmp_error(struct pkt *p)
 		em_len = (ntohl(p->icmp->word) >> 14) & 0x3fc;
 		if (em_len) {
 			if (p_em.data_len < em_len) {
-				log_pkt4(LOG_OPT_DROP,p,"ICMP Option Length and Packet Too Short");
+				log_pkt(LOG_OPT_DROP,p,R4_ICMP_OPTION_LENGTH_AND_PACKET_TOO_SHORT);
 				return;
 			}
 			p_em.data_len = em_len;
@@ -583,12 +730,12 @@ static void xlate_4to6_icmp_error(struct pkt *p)
 	}
 
 	if (parse_ip4(&p_em) < 0) {
-		log_pkt4(LOG_OPT_DROP,p,"Failed to parse em packet");
+		log_pkt(LOG_OPT_DROP,p,R4_FAILED_TO_PARSE_EM_PACKET);
 		return;
 	}
 
 	if (p_em.data_proto == 1 && p_em.icmp->type != 8) {
-		log_pkt4(LOG_OPT_DROP,p,"ICMP Error of ICMP Error");
+		log_pkt(LOG_OPT_DROP,p,R4_ICMP_ERROR_OF_ICMP_ERROR);
 		return;
 	}
 
@@ -599,7 +746,7 @@ static void xlate_4to6_icmp_error(struct pkt *p)
 	if (map_ip4_to_ip6(&header.ip6_em.src, &p_em.ip4->src) ||
 			map_ip4_to_ip6(&header.ip6_em.dest,
 					&p_em.ip4->dest)) {
-		log_pkt4(LOG_OPT_DROP,p,"ICMP Failed to map em src or em dest");
+		log_pkt(LOG_OPT_DROP,p,R4_ICMP_FAILED_TO_MAP_EM_SRC_OR_EM_DEST);
 		return;
 	}
 
@@ -651,6 +798,9 @@ static void xlate_4to6_icmp_error(struct pkt *p)
 				mtu = MTU_MIN;
 			}
 			header.icmp.word = htonl(mtu);
+			/* Further IPv6 packets towards this destination get a
+			   Packet Too Big from us without crossing the IPv4 path */
+			pmtu_set(&header.ip6_em.dest, mtu);
 			break;
 		case 9:
 			dummy();
@@ -662,8 +812,8 @@ static void xlate_4to6_icmp_error(struct pkt *p)
 			header.icmp.code = 1; /* Administratively prohibited */
 			break;
 		default:
-			sprintf(temp,"ICMP Unknown Dest Unreach Code %d",p->icmp->code);
-			log_pkt4(LOG_OPT_DROP,p,temp);
+			log_pkt_arg(LOG_OPT_DROP,p,R4_ICMP_UNKNOWN_DEST_UNREACH_CODE,
+					p->icmp->code);
 			return;
 		}
 		break;
@@ -674,17 +824,17 @@ static void xlate_4to6_icmp_error(struct pkt *p)
 		break;
 	case 12: /* Parameter Problem */
 		if (p->icmp->code != 0 && p->icmp->code != 2) {
-			log_pkt4(LOG_OPT_DROP,p,"Parameter Problem Invalid Code");
+			log_pkt(LOG_OPT_DROP,p,R4_PARAMETER_PROBLEM_INVALID_CODE);
 			return;
 		}
 		static const int32_t new_ptr_tbl[] = {0,1,4,4,-1,-1,-1,-1,7,6,-1,-1,8,8,8,8,24,24,24,24};
 		int32_t old_ptr = (ntohl(p->icmp->word) >> 24);
 		if(old_ptr > 19) {
-			log_pkt4(LOG_OPT_DROP,p,"Parameter Problem Invalid Pointer");
+			log_pkt(LOG_OPT_DROP,p,R4_PARAMETER_PROBLEM_INVALID_POINTER);
 			return;
 		}
 		if(new_ptr_tbl[old_ptr] < 0) {
-			log_pkt4(LOG_OPT_DROP,p,"Parameter Problem Not Translatable");
+			log_pkt(LOG_OPT_DROP,p,R4_PARAMETER_PROBLEM_NOT_TRANSLATABLE);
 			return;
 		}
 		header.icmp.type = 4;
@@ -692,24 +842,23 @@ static void xlate_4to6_icmp_error(struct pkt *p)
 		header.icmp.word = htonl(new_ptr_tbl[old_ptr]);
 		break;
 	default:
-		sprintf(temp,"ICMP Unknown Type %d",p->icmp->type);
-		log_pkt4(LOG_OPT_DROP,p,temp);
+		log_pkt_arg(LOG_OPT_DROP,p,R4_ICMP_UNKNOWN_TYPE,p->icmp->type);
 		return;
 	}
 
 	if (xlate_payload_4to6(&p_em, &header.ip6_em,1) < 0) {
-		log_pkt4(LOG_OPT_DROP,p,"Unable to translate ICMP embedded payload");
+		log_pkt(LOG_OPT_DROP,p,R4_UNABLE_TO_TRANSLATE_ICMP_EMBEDDED_PAYLOAD);
 		return;
 	}
 
 	if (map_ip4_to_ip6(&header.ip6.src, &p->ip4->src)) {
-		log_pkt4(LOG_OPT_DROP,p,"Need to rely on fake source");
+		log_pkt(LOG_OPT_DROP,p,R4_NEED_TO_RELY_ON_FAKE_SOURCE);
 		//Fake source IP is our own IP
 		header.ip6.src = gcfg.local_addr6;
 	}
 
 	if (map_ip4_to_ip6(&header.ip6.dest, &p->ip4->dest)) {
-		log_pkt4(LOG_OPT_DROP,p,"Unable to map destination address");
+		log_pkt(LOG_OPT_DROP,p,R4_ICMP_UNABLE_TO_MAP_DESTINATION_ADDRESS);
 		return;
 	}
 
@@ -732,23 +881,23 @@ static void xlate_4to6_icmp_error(struct pkt *p)
 	iov[1].iov_base = p_em.data;
 	iov[1].iov_len = p_em.data_len;
 
-	if (writev(gcfg.tun_fd, iov, 2) < 0)
-		slog(LOG_WARNING, "error writing packet to tun device: %s\n",
-			strerror(errno));
+	LAT_PATH(LAT_ICMP_ERR);
+	tun_write(iov, 2);
 }
 
-void handle_ip4(struct pkt *p)
+static ALWAYS_INLINE void xlate_ip4(struct pkt *p,
+		const int mode, const int plen)
 {
 	if (parse_ip4(p) < 0) return; //error already logged
 	if (p->ip4->ttl == 0 ||
 			ip_checksum(p->ip4, p->header_len) ||
 			p->header_len + p->data_len != ntohs(p->ip4->length)) {
-		log_pkt4(LOG_OPT_DROP,p,"IP Header Invalid");
+		log_pkt(LOG_OPT_DROP,p,R4_IP_HEADER_TTL_OR_CHECKSUM);
 		return;
 	}
 
 	if (p->icmp && ip_checksum(p->data, p->data_len)) {
-		log_pkt4(LOG_OPT_DROP,p,"ICMP Checksum is invalid");
+		log_pkt(LOG_OPT_DROP,p,R4_ICMP_CHECKSUM_IS_INVALID);
 		return;
 	}
 
@@ -757,19 +906,19 @@ void handle_ip4(struct pkt *p)
 		if (p->data_proto == 1)
 			host_handle_icmp4(p);
 		else {
-			log_pkt4(LOG_OPT_SELF | LOG_OPT_REJECT,p,"Self-Assigned Packet w/ Invalid Proto");
+			log_pkt(LOG_OPT_SELF | LOG_OPT_REJECT,p,R4_SELF_ASSIGNED_PACKET_W_INVALID_PROTO);
 			host_send_icmp4_error(3, 2, 0, p);
 		}
 	} else {
 		/* Time Exceeded*/
 		if (p->ip4->ttl == 1) {
-			log_pkt4(LOG_OPT_ICMP,p,"Time Exceeded");
+			log_pkt(LOG_OPT_ICMP,p,R4_TIME_EXCEEDED);
 			host_send_icmp4_error(11, 0, 0, p);
 			return;
 		}
 		if (p->data_proto != 1 || p->icmp->type == 8 ||
 				p->icmp->type == 0)
-			xlate_4to6_data(p);
+			xlate_4to6_data(p, mode, plen);
 		else
 			xlate_4to6_icmp_error(p);
 	}
@@ -800,9 +949,10 @@ static void host_send_icmp6(uint8_t tc, struct in6_addr *src,
 	iov[0].iov_len = sizeof(header);
 	iov[1].iov_base = data;
 	iov[1].iov_len = data_len;
-	if (writev(gcfg.tun_fd, iov, data_len ? 2 : 1) < 0)
-		slog(LOG_WARNING, "error writing packet to tun device: %s\n",
-			strerror(errno));
+	LAT_PATH(LAT_SELF);
+	TRACE3(icmp_gen, 6, icmp->type, icmp->code);
+	if (tun_write(iov, data_len ? 2 : 1) == ERROR_NONE)
+		STAT_INC(icmp_gen);
 }
 
 static void host_send_icmp6_error(uint8_t type, uint8_t code, uint32_t word,
@@ -815,6 +965,9 @@ static void host_send_icmp6_error(uint8_t type, uint8_t code, uint32_t word,
 	   echo request */
 	if (orig->data_proto == 58 && orig->icmp->type != 128)
 		return;
+	/* Don't let a flood of bad packets turn us into a reflector */
+	if (!icmp_ratelimit6(RL_ERRORS, &orig->ip6->src))
+		return;
 
 	orig_len = sizeof(struct ip6) + orig->header_len + orig->data_len;
 	if (orig_len > MTU_MIN - sizeof(struct ip6) - sizeof(struct icmp))
@@ -828,21 +981,22 @@ static void host_send_icmp6_error(uint8_t type, uint8_t code, uint32_t word,
 
 static void host_handle_icmp6(struct pkt *p)
 {
-	char temp[32];
 	p->data += sizeof(struct icmp);
 	p->data_len -= sizeof(struct icmp);
 
 	switch (p->icmp->type) {
 	case 128:
+		log_pkt(LOG_OPT_SELF,p,R6_ECHO_REQUEST);
+		if (!icmp_ratelimit6(RL_ECHO, &p->ip6->src))
+			break;
 		p->icmp->type = 129;
-		log_pkt6(LOG_OPT_SELF,p,"Echo Request");
 		host_send_icmp6((ntohl(p->ip6->ver_tc_fl) >> 20) & 0xff,
 				&p->ip6->dest, &p->ip6->src,
 				p->icmp, p->data, p->data_len);
 		break;
 	default:
-		sprintf(temp,"ICMP Unknown Type %d",p->icmp->type);
-		log_pkt6(LOG_OPT_SELF | LOG_OPT_DROP,p,temp);
+		log_pkt_arg(LOG_OPT_SELF | LOG_OPT_DROP,p,R6_ICMP_UNKNOWN_TYPE_TO_SELF,
+				p->icmp->type);
 		break;
 	}
 }
@@ -853,6 +1007,7 @@ static void xlate_header_6to4(struct pkt *p, struct ip4 *ip4,
 	ip4->ver_ihl = 0x45;
 	ip4->tos = (ntohl(p->ip6->ver_tc_fl) >> 20) & 0xff;
 	ip4->length = htons(sizeof(struct ip4) + payload_length);
+	ip4->proto = p->data_proto == 58 ? 1 : p->data_proto;
 	/* Have an IPv6 fragment header, translate to a v4 fragment */
 	if (p->ip6_frag) {
 		ip4->ident = htons(ntohl(p->ip6_frag->ident) & 0xffff);
@@ -864,15 +1019,10 @@ static void xlate_header_6to4(struct pkt *p, struct ip4 *ip4,
 		ip4->flags_offset &= ~htons(IP4_F_DF);
 	/* Smol packets can be fragmented downstream */
 	} else if (p->header_len + payload_length <= MTU_MIN) {
-		/* Need to generate a psuedo-random ident value
+		/* Need to generate a unique ident value per RFC 7739
 		 * A simple counter is not secure enough
-		 * However, it doesn't actually seem to be that random in practice
-		 * ref. https://datatracker.ietf.org/doc/html/rfc7739#appendix-B
 		 * */
-		static uint32_t ident = 0xb00b;
-		if(ident & 0x1) ident ^= 0x6464beef;
-		ident >>= 1;
-		ip4->ident = (ident& 0xffff);
+		ip4->ident = ip4_ident(&ip4->src, &ip4->dest, ip4->proto);
 		ip4->flags_offset = 0;
 	/* Packets > 1280 must kick back a Packet Too Big */
 	} else {
@@ -880,7 +1030,6 @@ static void xlate_header_6to4(struct pkt *p, struct ip4 *ip4,
 		ip4->flags_offset = htons(IP4_F_DF);
 	}
 	ip4->ttl = p->ip6->hop_limit;
-	ip4->proto = p->data_proto == 58 ? 1 : p->data_proto;
 	ip4->cksum = 0;
 }
 
@@ -910,7 +1059,7 @@ static int xlate_payload_6to4(struct pkt *p, struct ip4 *ip4, int em)
 	/* UDP */
 	case 17:
 		if (p->data_len < 8) {
-			if(!em) log_pkt6(LOG_OPT_DROP,p,"Insufficient UDP Header Length");
+			if(!em) log_pkt(LOG_OPT_DROP,p,R6_INSUFFICIENT_UDP_HEADER_LENGTH);
 			return ERROR_DROP;
 		}
 		tck = (uint16_t *)(p->data + 6);
@@ -920,7 +1069,7 @@ static int xlate_payload_6to4(struct pkt *p, struct ip4 *ip4, int em)
 			default:
 			case UDP_CKSUM_DROP:
 				/* Do not handle zero checksum packets */
-				if(!em) log_pkt6(LOG_OPT_DROP,p,"UDP Zero Checksum");
+				if(!em) log_pkt(LOG_OPT_DROP,p,R6_UDP_ZERO_CHECKSUM);
 				return ERROR_DROP;
 			case UDP_CKSUM_FWD:
 				/* Ignore the lack of checksum and forward anyway */
@@ -936,10 +1085,13 @@ static int xlate_payload_6to4(struct pkt *p, struct ip4 *ip4, int em)
 	/* TCP */
 	case 6:
 		if (p->data_len < 20) {
-			if(!em) log_pkt6(LOG_OPT_DROP,p,"Insufficient TCP Header Length");
+			if(!em) log_pkt(LOG_OPT_DROP,p,R6_INSUFFICIENT_TCP_HEADER_LENGTH);
 			return ERROR_DROP;
 		}
 		tck = (uint16_t *)(p->data + 16);
+		if (gcfg.tcp_mss_clamp && !em)
+			tcp_mss_clamp(p, tck, ip6_path_mtu(&p->ip6->src) - MTU_ADJ -
+					sizeof(struct ip4) - 20);
 		break;
 	/* Other */
 	default:
@@ -950,39 +1102,46 @@ static int xlate_payload_6to4(struct pkt *p, struct ip4 *ip4, int em)
 	return ERROR_NONE;
 }
 
-static void xlate_6to4_data(struct pkt *p)
+static ALWAYS_INLINE void xlate_6to4_data(struct pkt *p,
+		const int mode, const int plen)
 {
 	struct ip4_data header;
+	uint32_t mtu;
 	int ret;
 	struct iovec iov[2];
 
-	ret = map_ip6_to_ip4(&header.ip4.dest, &p->ip6->dest, 0);
+	ret = xmap_ip6_to_ip4(mode, plen, &header.ip4.dest, &p->ip6->dest, 0);
 	if (ret == ERROR_REJECT) {
-		log_pkt6(LOG_OPT_REJECT,p,"Failed to map dest addr");
+		log_pkt(LOG_OPT_REJECT,p,R6_FAILED_TO_MAP_DEST_ADDR_REJECT);
 		host_send_icmp6_error(1, 0, 0, p);
 		return;
 	}
 	else if (ret == ERROR_DROP){
 		/* Drop packet */
-		log_pkt6(LOG_OPT_DROP,p,"Failed to map dest addr");
+		log_pkt(LOG_OPT_DROP,p,R6_FAILED_TO_MAP_DEST_ADDR_DROP);
 		return;
 	}
 
-	ret = map_ip6_to_ip4(&header.ip4.src, &p->ip6->src, 1);
+	ret = xmap_ip6_to_ip4(mode, plen, &header.ip4.src, &p->ip6->src, 1);
 	if (ret == ERROR_REJECT) {
-		log_pkt6(LOG_OPT_REJECT,p,"Failed to map src addr");
+		log_pkt(LOG_OPT_REJECT,p,R6_FAILED_TO_MAP_SRC_ADDR_REJECT);
 		host_send_icmp6_error(1, 5, 0, p);
 		return;
 	}
 	else if (ret == ERROR_DROP){
 		/* Drop packet */
-		log_pkt6(LOG_OPT_DROP,p,"Failed to map src addr");
+		log_pkt(LOG_OPT_DROP,p,R6_FAILED_TO_MAP_SRC_ADDR_DROP);
 		return;
 	}
 
-	if (sizeof(struct ip6) + p->header_len + p->data_len > gcfg.mtu) {
-		log_pkt6(LOG_OPT_ICMP,p,"Packet Too Big");
-		host_send_icmp6_error(2, 0, gcfg.mtu, p);
+	/* Fragmented packets are sent without DF, so only the tun MTU
+	   applies to them. Others are held to the learned path MTU */
+	mtu = p->ip6_frag ? 0 : pmtu_get(&p->ip6->dest);
+	if (!mtu || mtu > gcfg.mtu)
+		mtu = gcfg.mtu;
+	if (sizeof(struct ip6) + p->header_len + p->data_len > mtu) {
+		log_pkt(LOG_OPT_ICMP,p,R6_PACKET_TOO_BIG);
+		host_send_icmp6_error(2, 0, mtu, p);
 		return;
 	}
 
@@ -1001,9 +1160,8 @@ static void xlate_6to4_data(struct pkt *p)
 	iov[1].iov_base = p->data;
 	iov[1].iov_len = p->data_len;
 
-	if (writev(gcfg.tun_fd, iov, 2) < 0)
-		slog(LOG_WARNING, "error writing packet to tun device: %s\n",
-			strerror(errno));
+	LAT_PATH(LAT_6TO4);
+	tun_write(iov, 2);
 }
 
 static int parse_ip6(struct pkt *p,int em)
@@ -1021,7 +1179,7 @@ static int parse_ip6(struct pkt *p,int em)
 		/* Do not log if the src or dest was multicast */
 		if(p->ip6->src.s6_addr[0] == 0xff) return ERROR_DROP;
 		if(p->ip6->dest.s6_addr[0] == 0xff) return ERROR_DROP;
-		if(!em) log_pkt6(LOG_OPT_DROP,p,"Failed to parse IPv6 Header");
+		if(!em) log_pkt(LOG_OPT_DROP,p,R6_FAILED_TO_PARSE_IPV6_HEADER);
 		return ERROR_DROP;
 	}
 
@@ -1035,12 +1193,12 @@ static int parse_ip6(struct pkt *p,int em)
 	while (p->data_proto == 0 || p->data_proto == 43 ||
 			p->data_proto == 60) {
 		if (p->data_len < 2) {
-			if(!em) log_pkt6(LOG_OPT_DROP,p,"Extension Header Invalid Length");
+			if(!em) log_pkt(LOG_OPT_DROP,p,R6_EXTENSION_HEADER_TRUNCATED);
 			return ERROR_DROP;
 		}
 		hdr_len = (p->data[1] + 1) * 8;
 		if (p->data_len < hdr_len) {
-			if(!em) log_pkt6(LOG_OPT_DROP,p,"Extension Header Invalid Length");
+			if(!em) log_pkt(LOG_OPT_DROP,p,R6_EXTENSION_HEADER_INVALID_LENGTH);
 			return ERROR_DROP;
 		}
 		/* If it's a routing header, extract segments left
@@ -1058,7 +1216,7 @@ static int parse_ip6(struct pkt *p,int em)
 
 	if (p->data_proto == 44) {
 		if (p->ip6_frag || p->data_len < sizeof(struct ip6_frag)) {
-			if(!em) log_pkt6(LOG_OPT_DROP,p,"Fragment Header Invalid Length");
+			if(!em) log_pkt(LOG_OPT_DROP,p,R6_FRAGMENT_HEADER_INVALID_LENGTH);
 			return ERROR_DROP;
 		}
 		p->ip6_frag = (struct ip6_frag *)p->data;
@@ -1069,13 +1227,13 @@ static int parse_ip6(struct pkt *p,int em)
 
 		if ((p->ip6_frag->offset_flags & htons(IP6_F_MF)) &&
 				(p->data_len & 0x7)) {
-			if(!em) log_pkt6(LOG_OPT_DROP,p,"Fragment Misaligned");
+			if(!em) log_pkt(LOG_OPT_DROP,p,R6_FRAGMENT_MISALIGNED);
 			return ERROR_DROP;
 		}
 
 		if ((uint32_t)(ntohs(p->ip6_frag->offset_flags) & IP6_F_MASK) +
 				p->data_len > 65535) {
-			if(!em) log_pkt6(LOG_OPT_DROP,p,"Fragment Reassembly exceeds max size");
+			if(!em) log_pkt(LOG_OPT_DROP,p,R6_FRAGMENT_REASSEMBLY_EXCEEDS_MAX_SIZE);
 			return ERROR_DROP;
 		}
 	}
@@ -1083,16 +1241,16 @@ static int parse_ip6(struct pkt *p,int em)
 	if (p->data_proto == 58) {
 		if (p->ip6_frag && (p->ip6_frag->offset_flags &
 					htons(IP6_F_MASK | IP6_F_MF))) {
-			if(!em) log_pkt6(LOG_OPT_DROP,p,"Fragmented ICMP");
+			if(!em) log_pkt(LOG_OPT_DROP,p,R6_FRAGMENTED_ICMP);
 			return ERROR_DROP;
 		}
 		if (p->data_len < sizeof(struct icmp)) {
-			if(!em) log_pkt6(LOG_OPT_DROP,p,"ICMP with insufficient header size");
+			if(!em) log_pkt(LOG_OPT_DROP,p,R6_ICMP_WITH_INSUFFICIENT_HEADER_SIZE);
 			return ERROR_DROP;
 		}
 		p->icmp = (struct icmp *)(p->data);
 	} else if(p->data_proto == 1) { /* ICMPv4, which is not valid to translate */
-		if(!em) log_pkt6(LOG_OPT_DROP,p,"IPv6 with IPv4-only Proto");
+		if(!em) log_pkt(LOG_OPT_DROP,p,R6_IPV6_WITH_IPV4_ONLY_PROTO);
 		return ERROR_DROP;
 	}
 
@@ -1101,7 +1259,7 @@ static int parse_ip6(struct pkt *p,int em)
 	 */
 	if(seg_left) {
 		seg_ptr += 4;
-		if(!em) log_pkt6(LOG_OPT_REJECT,p,"Routing Header with Segments Left");
+		if(!em) log_pkt(LOG_OPT_REJECT,p,R6_ROUTING_HEADER_WITH_SEGMENTS_LEFT);
 		host_send_icmp6_error(4, 0, seg_ptr, p);
 		return ERROR_DROP;
 	}
@@ -1125,7 +1283,7 @@ static void xlate_6to4_icmp_error(struct pkt *p)
 		em_len = (ntohl(p->icmp->word) >> 21) & 0x7f8;
 		if (em_len) {
 			if (p_em.data_len < em_len) {
-				log_pkt6(LOG_OPT_DROP,p,"ICMP Length Too Short");
+				log_pkt(LOG_OPT_DROP,p,R6_ICMP_LENGTH_TOO_SHORT);
 				return;
 			}
 			p_em.data_len = em_len;
@@ -1133,12 +1291,12 @@ static void xlate_6to4_icmp_error(struct pkt *p)
 	}
 
 	if (parse_ip6(&p_em,1) < 0) {
-		log_pkt6(LOG_OPT_DROP,p,"ICMP Error Parsing Embedded Packet");
+		log_pkt(LOG_OPT_DROP,p,R6_ICMP_ERROR_PARSING_EMBEDDED_PACKET);
 		return;
 	}
 
 	if (p_em.data_proto == 58 && p_em.icmp->type != 128) {
-		log_pkt6(LOG_OPT_DROP,p,"ICMP Error with ICMP Error");
+		log_pkt(LOG_OPT_DROP,p,R6_ICMP_ERROR_WITH_ICMP_ERROR);
 		return;
 	}
 
@@ -1173,11 +1331,14 @@ static void xlate_6to4_icmp_error(struct pkt *p)
 		header.icmp.code = 4; /* Fragmentation needed */
 		mtu = ntohl(p->icmp->word);
 		if (mtu < 68) {
-			log_pkt6(LOG_OPT_DROP,p,"No MTU in Packet Too Big");
+			log_pkt(LOG_OPT_DROP,p,R6_NO_MTU_IN_PACKET_TOO_BIG);
 			return;
 		}
 		if (mtu > gcfg.mtu)
 			mtu = gcfg.mtu;
+		/* Size further IPv4 to IPv6 fragments to fit this path */
+		if (mtu >= MTU_MIN)
+			pmtu_set(&p_em.ip6->dest, mtu);
 		mtu -= MTU_ADJ;
 		header.icmp.word = htonl(mtu);
 		break;
@@ -1193,7 +1354,7 @@ static void xlate_6to4_icmp_error(struct pkt *p)
 			int32_t old_ptr = ntohl(p->icmp->word);
 			int32_t new_ptr;
 			if(old_ptr > 39) {
-				log_pkt6(LOG_OPT_DROP,p,"Parameter Problem Invalid Pointer");
+				log_pkt(LOG_OPT_DROP,p,R6_PARAMETER_PROBLEM_INVALID_POINTER);
 				return;
 			} else if(old_ptr > 23) {
 				new_ptr = 16;
@@ -1203,7 +1364,7 @@ static void xlate_6to4_icmp_error(struct pkt *p)
 				new_ptr = new_ptr_tbl[old_ptr];
 			}
 			if(new_ptr < 0) {
-				log_pkt6(LOG_OPT_DROP,p,"Parameter Problem Not Translatable");
+				log_pkt(LOG_OPT_DROP,p,R6_PARAMETER_PROBLEM_NOT_TRANSLATABLE);
 				return;
 			}
 			header.icmp.type = 12;
@@ -1217,21 +1378,21 @@ static void xlate_6to4_icmp_error(struct pkt *p)
 			header.icmp.word = 0;
 			break;
 		}
-		log_pkt6(LOG_OPT_DROP,p,"Parameter Problem Unknown Code");
+		log_pkt(LOG_OPT_DROP,p,R6_PARAMETER_PROBLEM_UNKNOWN_CODE);
 		return;
 	default:
-		log_pkt6(LOG_OPT_DROP,p,"ICMP Unknown Type");
+		log_pkt(LOG_OPT_DROP,p,R6_ICMP_UNKNOWN_TYPE);
 		return;
 	}
 
 	if (map_ip6_to_ip4(&header.ip4_em.src, &p_em.ip6->src, 0) ||
 			map_ip6_to_ip4(&header.ip4_em.dest,
 						&p_em.ip6->dest, 0)) {
-		log_pkt6(LOG_OPT_DROP,p,"Failed to map em src or dest");
+		log_pkt(LOG_OPT_DROP,p,R6_FAILED_TO_MAP_EM_SRC_OR_DEST);
 		return;
 	}
 	if(xlate_payload_6to4(&p_em, &header.ip4_em,1) < 0) {
-		log_pkt6(LOG_OPT_DROP,p,"Failed to translate em payload");
+		log_pkt(LOG_OPT_DROP,p,R6_FAILED_TO_TRANSLATE_EM_PAYLOAD);
 		return;
 	}
 
@@ -1244,13 +1405,13 @@ static void xlate_6to4_icmp_error(struct pkt *p)
 	//As this is an ICMP error packet, we will not further
 	//send errors, so treat return of REJECT = DROP
 	if (map_ip6_to_ip4(&header.ip4.src, &p->ip6->src, 0)) {
-		log_pkt6(LOG_OPT_ICMP,p,"Need to rely on fake source");
+		log_pkt(LOG_OPT_ICMP,p,R6_NEED_TO_RELY_ON_FAKE_SOURCE);
 		//fake source IP is our own IP
 		header.ip4.src = gcfg.local_addr4;
 	}
 
 	if (map_ip6_to_ip4(&header.ip4.dest, &p->ip6->dest, 0)) {
-		log_pkt6(LOG_OPT_DROP,p,"Failed to map dest");
+		log_pkt(LOG_OPT_DROP,p,R6_FAILED_TO_MAP_DEST);
 		return;
 	}
 
@@ -1273,24 +1434,24 @@ static void xlate_6to4_icmp_error(struct pkt *p)
 	iov[1].iov_base = p_em.data;
 	iov[1].iov_len = p_em.data_len;
 
-	if (writev(gcfg.tun_fd, iov, 2) < 0)
-		slog(LOG_WARNING, "error writing packet to tun device: %s\n",
-			strerror(errno));
+	LAT_PATH(LAT_ICMP_ERR);
+	tun_write(iov, 2);
 }
 
-void handle_ip6(struct pkt *p)
+static ALWAYS_INLINE void xlate_ip6(struct pkt *p,
+		const int mode, const int plen)
 {
 	if (parse_ip6(p,0)) return;
 	if (p->ip6->hop_limit == 0 ||
 			p->header_len + p->data_len !=
 				ntohs(p->ip6->payload_length)) {
-		log_pkt6(LOG_OPT_DROP,p,"Insufficient Length");
+		log_pkt(LOG_OPT_DROP,p,R6_INSUFFICIENT_LENGTH);
 		return;
 	}
 
 	if (p->icmp && ones_add(ip_checksum(p->data, p->data_len),
 				ip6_checksum(p->ip6, p->data_len, 58))) {
-		log_pkt6(LOG_OPT_DROP,p,"ICMP Invalid Checksum");
+		log_pkt(LOG_OPT_DROP,p,R6_ICMP_INVALID_CHECKSUM);
 		return;
 	}
 
@@ -1298,20 +1459,107 @@ void handle_ip6(struct pkt *p)
 		if (p->data_proto == 58)
 			host_handle_icmp6(p);
 		else {
-			log_pkt6(LOG_OPT_SELF | LOG_OPT_REJECT,p,"Unknown protocol to self");
+			log_pkt(LOG_OPT_SELF | LOG_OPT_REJECT,p,R6_UNKNOWN_PROTOCOL_TO_SELF);
 			host_send_icmp6_error(4, 1, 6, p);
 		}
 	} else {
 		if (p->ip6->hop_limit == 1) {
-			log_pkt6(LOG_OPT_ICMP,p,"Time Exceeded");
+			log_pkt(LOG_OPT_ICMP,p,R6_TIME_EXCEEDED);
 			host_send_icmp6_error(3, 0, 0, p);
 			return;
 		}
 
 		if (p->data_proto != 58 || p->icmp->type == 128 ||
 				p->icmp->type == 129)
-			xlate_6to4_data(p);
+			xlate_6to4_data(p, mode, plen);
 		else
 			xlate_6to4_icmp_error(p);
 	}
 }
+
+/* Instantiate the translator variants */
+#define XLATE_VARIANT(name, mode, plen) \
+	static void handle_ip4_##name(struct pkt *p) { xlate_ip4(p, mode, plen); } \
+	static void handle_ip6_##name(struct pkt *p) { xlate_ip6(p, mode, plen); }
+
+XLATE_VARIANT(rfc6052_32, XLATE_RFC6052, 32)
+XLATE_VARIANT(rfc6052_40, XLATE_RFC6052, 40)
+XLATE_VARIANT(rfc6052_48, XLATE_RFC6052, 48)
+XLATE_VARIANT(rfc6052_56, XLATE_RFC6052, 56)
+XLATE_VARIANT(rfc6052_64, XLATE_RFC6052, 64)
+XLATE_VARIANT(rfc6052_96, XLATE_RFC6052, 96)
+XLATE_VARIANT(static, XLATE_STATIC, 0)
+XLATE_VARIANT(dynamic, XLATE_DYNAMIC, 0)
+
+/* The dynamic variant is correct for any configuration */
+void (*handle_ip4)(struct pkt *p) = handle_ip4_dynamic;
+void (*handle_ip6)(struct pkt *p) = handle_ip6_dynamic;
+
+/**
+ * @brief Select the translator variant for the running configuration
+ *
+ * Must be called after the configuration (and map-file) has been loaded,
+ * and before any packets are handled.
+ */
+void nat64_select_variant(void)
+{
+	struct map6 *m6;
+	const char *name;
+	int plen;
+
+	m6 = list_entry(gcfg.map6_list.prev, struct map6, list);
+
+	/* config_validate disables the cache when the NAT64 prefix is the
+	 * only map, and a map-file could add static maps later */
+	if (!gcfg.cache_size && !gcfg.dyn_pool_count && !gcfg.map_file[0] &&
+			m6->type == MAP_TYPE_RFC6052) {
+		plen = m6->prefix_len;
+		rfc6052.prefix = m6->addr;
+		rfc6052.mask = m6->mask;
+		rfc6052.wkpf_strict = gcfg.wkpf_strict &&
+			m6->addr.s6_addr32[0] == WKPF &&
+			!m6->addr.s6_addr32[1] &&
+			!m6->addr.s6_addr32[2];
+		m6 = list_entry(gcfg.map6_list.next, struct map6, list);
+		rfc6052.self6 = m6->type == MAP_TYPE_STATIC;
+		switch (plen) {
+		case 32:
+			handle_ip4 = handle_ip4_rfc6052_32;
+			handle_ip6 = handle_ip6_rfc6052_32;
+			break;
+		case 40:
+			handle_ip4 = handle_ip4_rfc6052_40;
+			handle_ip6 = handle_ip6_rfc6052_40;
+			break;
+		case 48:
+			handle_ip4 = handle_ip4_rfc6052_48;
+			handle_ip6 = handle_ip6_rfc6052_48;
+			break;
+		case 56:
+			handle_ip4 = handle_ip4_rfc6052_56;
+			handle_ip6 = handle_ip6_rfc6052_56;
+			break;
+		case 64:
+			handle_ip4 = handle_ip4_rfc6052_64;
+			handle_ip6 = handle_ip6_rfc6052_64;
+			break;
+		case 96:
+			handle_ip4 = handle_ip4_rfc6052_96;
+			handle_ip6 = handle_ip6_rfc6052_96;
+			break;
+		default:
+			/* Not reachable, keep the generic variant */
+			return;
+		}
+		name = "RFC6052";
+	} else if (gcfg.dyn_pool_count) {
+		handle_ip4 = handle_ip4_dynamic;
+		handle_ip6 = handle_ip6_dynamic;
+		name = "dynamic";
+	} else {
+		handle_ip4 = handle_ip4_static;
+		handle_ip6 = handle_ip6_static;
+		name = "static";
+	}
+	slog(LOG_DEBUG, "Using %s translator variant\n", name);
+}
@@ -0,0 +1,343 @@
+/*
+ *  pktlog.c - asynchronous packet event logging
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/* Packet log events are raised on the data path, where formatting and
+ * writing a log line would stall the worker. Each thread which handles
+ * packets owns a single-producer / single-consumer ring of compact binary
+ * records. A logger thread drains all rings every PKTLOG_DRAIN_MS,
+ * formats the records and hands them to slog. When a ring is full, the
+ * record is dropped and counted instead of blocking the worker.
+ */
+
+#include "tayga.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+/* Records per ring, must be a power of two */
+#define PKTLOG_RING_SIZE	1024
+
+/* Interval between logger thread passes */
+#define PKTLOG_DRAIN_MS		10
+
+/* Identical events within this window are summarized */
+#define PKTLOG_DEDUP_MS		1000
+
+/* Slots in the duplicate suppression table, must be a power of two */
+#define PKTLOG_DEDUP_SLOTS	256
+
+struct pktlog_rec {
+	int reason;
+	int arg;
+	uint8_t family;
+	uint8_t type;
+	uint8_t err;
+	uint8_t proto;
+	uint32_t len;
+	uint8_t src[16];
+	uint8_t dest[16];
+};
+
+struct pktlog_ring {
+	/* Written by the producer only */
+	uint32_t head __attribute__((aligned(64)));
+	unsigned long overflow;
+	/* Written by the consumer only */
+	uint32_t tail __attribute__((aligned(64)));
+	unsigned long overflow_seen;
+	struct pktlog_rec rec[PKTLOG_RING_SIZE] __attribute__((aligned(64)));
+};
+
+/* Last record printed for an event, and how many like it followed */
+struct pktlog_dedup {
+	struct pktlog_rec rec;
+	unsigned long count;
+	uint64_t until;
+};
+
+static struct pktlog_ring *pktlog_rings;
+static int pktlog_nrings;
+static int pktlog_running;
+static pthread_t pktlog_thread;
+static struct pktlog_dedup pktlog_dedup[PKTLOG_DEDUP_SLOTS];
+
+static const char *pktlog_type_name(int type)
+{
+	switch (type) {
+	case LOG_OPT_SELF:	return "SELF";
+	case LOG_OPT_DROP:	return "DROP";
+	case LOG_OPT_REJECT:	return "REJECT";
+	default:		return "ICMP";
+	}
+}
+
+/* Drops and rejects are notices, whichever bit the event is listed under */
+static int pktlog_severity(const struct pktlog_rec *r)
+{
+	return r->err & (LOG_OPT_DROP | LOG_OPT_REJECT) ? LOG_NOTICE : LOG_INFO;
+}
+
+/* Format the addresses and description of a record */
+static void pktlog_format(const struct pktlog_rec *r, char *saddr,
+		char *daddr, char *reason, size_t reason_len)
+{
+	int af = r->family == 4 ? AF_INET : AF_INET6;
+
+	if (!inet_ntop(af, r->src, saddr, INET6_ADDRSTRLEN))
+		sprintf(saddr, "ERROR:%d", errno);
+	if (!inet_ntop(af, r->dest, daddr, INET6_ADDRSTRLEN))
+		sprintf(daddr, "ERROR:%d", errno);
+	if (r->arg == PKTLOG_NO_ARG)
+		snprintf(reason, reason_len, "%s", pkt_reasons[r->reason].msg);
+	else
+		snprintf(reason, reason_len, "%s %d",
+				pkt_reasons[r->reason].msg, r->arg);
+}
+
+/* Format a record as a log line */
+static void pktlog_print(const struct pktlog_rec *r)
+{
+	char saddr[INET6_ADDRSTRLEN], daddr[INET6_ADDRSTRLEN];
+	char reason[96];
+
+	pktlog_format(r, saddr, daddr, reason, sizeof(reason));
+	slog(pktlog_severity(r),
+		"%s: [v%d] [%s]->[%s] (%u bytes) (proto %d) %s\n",
+		pktlog_type_name(r->type), r->family, saddr, daddr, r->len,
+		r->proto, reason);
+}
+
+/* Emit the summary of a suppression slot, if anything was suppressed */
+static void pktlog_summary(struct pktlog_dedup *d)
+{
+	char saddr[INET6_ADDRSTRLEN], daddr[INET6_ADDRSTRLEN];
+	char reason[96];
+
+	if (!d->count)
+		return;
+	pktlog_format(&d->rec, saddr, daddr, reason, sizeof(reason));
+	slog(pktlog_severity(&d->rec),
+		"%s: [v%d] [%s]->[%s] %s (%lu more like this)\n",
+		pktlog_type_name(d->rec.type), d->rec.family, saddr, daddr,
+		reason, d->count);
+	d->count = 0;
+}
+
+static uint64_t pktlog_clock_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Records describe the same event if everything but the length matches */
+static int pktlog_same(const struct pktlog_rec *a, const struct pktlog_rec *b)
+{
+	return a->reason == b->reason && a->arg == b->arg &&
+		a->type == b->type && a->err == b->err &&
+		a->proto == b->proto &&
+		!memcmp(a->src, b->src, sizeof(a->src)) &&
+		!memcmp(a->dest, b->dest, sizeof(a->dest));
+}
+
+/* Suppression slot for a record, keyed on the event and both addresses */
+static struct pktlog_dedup *pktlog_slot(const struct pktlog_rec *r)
+{
+	uint32_t h = (r->reason * 0x9e3779b1u) ^ r->arg;
+	uint32_t w;
+	int i;
+
+	for (i = 0; i < 16; i += 4) {
+		memcpy(&w, &r->src[i], 4);
+		h = (h ^ w) * 0x85ebca6bu;
+		h ^= h >> 13;
+		memcpy(&w, &r->dest[i], 4);
+		h = (h ^ w) * 0xc2b2ae35u;
+		h ^= h >> 16;
+	}
+	return &pktlog_dedup[h & (PKTLOG_DEDUP_SLOTS - 1)];
+}
+
+/* Print a record unless an identical one was printed recently */
+static void pktlog_process(const struct pktlog_rec *r, uint64_t now_ms)
+{
+	struct pktlog_dedup *d = pktlog_slot(r);
+
+	if (d->until && now_ms < d->until && pktlog_same(&d->rec, r)) {
+		d->count++;
+		return;
+	}
+	pktlog_summary(d);
+	pktlog_print(r);
+	d->rec = *r;
+	d->until = now_ms + PKTLOG_DEDUP_MS;
+}
+
+/* Drain every ring once */
+static void pktlog_drain(void)
+{
+	struct pktlog_ring *ring;
+	uint64_t now_ms = pktlog_clock_ms();
+	unsigned long overflow;
+	uint32_t head;
+	int i;
+
+	for (i = 0; i < pktlog_nrings; ++i) {
+		ring = &pktlog_rings[i];
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (ring->tail != head) {
+			pktlog_process(&ring->rec[ring->tail &
+					(PKTLOG_RING_SIZE - 1)], now_ms);
+			__atomic_store_n(&ring->tail, ring->tail + 1,
+					__ATOMIC_RELEASE);
+		}
+		overflow = __atomic_load_n(&ring->overflow, __ATOMIC_RELAXED);
+		if (overflow != ring->overflow_seen) {
+			slog(LOG_WARNING, "Packet log overflow: %lu records "
+					"dropped by thread %d\n",
+					overflow - ring->overflow_seen, i);
+			ring->overflow_seen = overflow;
+		}
+	}
+
+	/* Close suppression windows which have expired */
+	for (i = 0; i < PKTLOG_DEDUP_SLOTS; ++i)
+		if (pktlog_dedup[i].until <= now_ms)
+			pktlog_summary(&pktlog_dedup[i]);
+}
+
+static void *pktlog_worker(void *arg)
+{
+	struct timespec ts = { 0, PKTLOG_DRAIN_MS * 1000000L };
+	(void)arg;
+
+	while (__atomic_load_n(&pktlog_running, __ATOMIC_ACQUIRE)) {
+		pktlog_drain();
+		nanosleep(&ts, NULL);
+	}
+	/* Final pass, and flush all pending summaries */
+	pktlog_drain();
+	for (int i = 0; i < PKTLOG_DEDUP_SLOTS; ++i)
+		pktlog_summary(&pktlog_dedup[i]);
+	return NULL;
+}
+
+/**
+ * @brief Start the packet logger thread
+ *
+ * Allocates one ring per packet handling thread (the main thread plus
+ * each worker). Until this is called, packet logs are written inline.
+ *
+ * @param nthreads Number of threads which may log packets
+ * @returns ERROR_NONE on success, ERROR_REJECT on failure
+ */
+int pktlog_start(int nthreads)
+{
+	int ret;
+
+	pktlog_rings = aligned_alloc(64, nthreads * sizeof(struct pktlog_ring));
+	if (!pktlog_rings) {
+		slog(LOG_CRIT, "Unable to allocate packet log rings\n");
+		return ERROR_REJECT;
+	}
+	memset(pktlog_rings, 0, nthreads * sizeof(struct pktlog_ring));
+	pktlog_nrings = nthreads;
+	pktlog_running = 1;
+	ret = pthread_create(&pktlog_thread, NULL, pktlog_worker, NULL);
+	if (ret) {
+		slog(LOG_CRIT, "Failed to create packet log thread: %s\n",
+				strerror(ret));
+		pktlog_running = 0;
+		free(pktlog_rings);
+		pktlog_rings = NULL;
+		return ERROR_REJECT;
+	}
+	return ERROR_NONE;
+}
+
+/**
+ * @brief Stop the packet logger thread
+ *
+ * Records already queued are written out before this returns.
+ */
+void pktlog_stop(void)
+{
+	if (!__atomic_load_n(&pktlog_running, __ATOMIC_RELAXED))
+		return;
+	__atomic_store_n(&pktlog_running, 0, __ATOMIC_RELEASE);
+	pthread_join(pktlog_thread, NULL);
+}
+
+/**
+ * @brief Log a packet event
+ *
+ * Called on the data path. The record is queued to the calling thread's
+ * ring, so this never blocks; if the ring is full the event is counted
+ * as an overflow instead.
+ *
+ * @param type Single LOG_OPT bit this event is reported under
+ * @param err Full LOG_OPT bitmask of the event, which sets the severity
+ * @param p Packet which caused the event
+ * @param reason pkt_reason, which also selects p->ip4 or p->ip6
+ * @param arg Number appended to the description, or PKTLOG_NO_ARG
+ */
+void pktlog(int type, int err, const struct pkt *p, int reason, int arg)
+{
+	struct pktlog_ring *ring = NULL;
+	struct pktlog_rec rbuf, *r = &rbuf;
+	uint32_t head = 0;
+
+	if (pktlog_rings && worker_id < pktlog_nrings) {
+		ring = &pktlog_rings[worker_id];
+		head = ring->head;
+		if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+				PKTLOG_RING_SIZE) {
+			__atomic_store_n(&ring->overflow, ring->overflow + 1,
+					__ATOMIC_RELAXED);
+			return;
+		}
+		r = &ring->rec[head & (PKTLOG_RING_SIZE - 1)];
+	}
+
+	r->reason = reason;
+	r->arg = arg;
+	r->type = type;
+	r->err = err;
+	r->proto = p->data_proto;
+	r->len = p->header_len + p->data_len;
+	r->family = pkt_reasons[reason].family;
+	memset(r->src, 0, sizeof(r->src));
+	memset(r->dest, 0, sizeof(r->dest));
+	if (r->family == 6) {
+		memcpy(r->src, &p->ip6->src, 16);
+		memcpy(r->dest, &p->ip6->dest, 16);
+	} else {
+		memcpy(r->src, &p->ip4->src, 4);
+		memcpy(r->dest, &p->ip4->dest, 4);
+	}
+
+	if (r == &rbuf)
+		pktlog_print(r);
+	else
+		__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
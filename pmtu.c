@@ -0,0 +1,119 @@
+/*
+ *  pmtu.c -- per-destination path MTU cache
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2010  Nathan Lutchansky <lutchann@litech.org>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "tayga.h"
+
+/* Number of slots in the cache, as a power of two */
+#define PMTU_HASH_BITS	10
+
+/**
+ * Path MTU cache entry
+ *
+ * The table is direct-mapped: a new destination simply evicts whatever
+ * shared its slot. Each slot is protected by a sequence counter, so the
+ * lookup on the packet path never takes a lock. Writers (translated ICMP
+ * errors, which are rare) serialize on pmtu_mutex and make the counter
+ * odd while the slot is being updated.
+ */
+struct pmtu_entry {
+	uint32_t seq;
+	uint32_t mtu;
+	time_t expires;
+	struct in6_addr addr;
+};
+
+static struct pmtu_entry pmtu_table[1 << PMTU_HASH_BITS];
+static pthread_mutex_t pmtu_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set once the first entry is stored, so an idle cache costs one load */
+static int pmtu_active;
+
+static uint32_t pmtu_hash(const struct in6_addr *addr)
+{
+	uint32_t h;
+	h = addr->s6_addr32[0] + gcfg.rand[4];
+	h ^= addr->s6_addr32[1] + gcfg.rand[5];
+	h ^= addr->s6_addr32[2] + gcfg.rand[6];
+	h ^= addr->s6_addr32[3] + gcfg.rand[7];
+	h *= 0x9e3779b1;
+	return h >> (32 - PMTU_HASH_BITS);
+}
+
+/**
+ * @brief Look up the learned path MTU towards an IPv6 address
+ *
+ * @param addr IPv6 destination address
+ * @returns path MTU in bytes, or 0 if none is known
+ */
+uint32_t pmtu_get(const struct in6_addr *addr)
+{
+	struct pmtu_entry *e;
+	uint32_t seq, mtu, a[4];
+	time_t expires;
+	int i;
+
+	if (!__atomic_load_n(&pmtu_active, __ATOMIC_RELAXED))
+		return 0;
+
+	e = &pmtu_table[pmtu_hash(addr)];
+	do {
+		seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		/* Slot is being rewritten, treat it as a miss */
+		if (seq & 1)
+			return 0;
+		mtu = __atomic_load_n(&e->mtu, __ATOMIC_RELAXED);
+		expires = __atomic_load_n(&e->expires, __ATOMIC_RELAXED);
+		for (i = 0; i < 4; ++i)
+			a[i] = __atomic_load_n(&e->addr.s6_addr32[i],
+					__ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (seq != __atomic_load_n(&e->seq, __ATOMIC_RELAXED));
+
+	if (!mtu || expires < now || memcmp(a, addr, sizeof(a)))
+		return 0;
+	return mtu;
+}
+
+/**
+ * @brief Record the path MTU towards an IPv6 address
+ *
+ * The entry expires PMTU_TIMEOUT seconds later, after which the
+ * configured MTU is used again until another error is seen.
+ *
+ * @param addr IPv6 destination address
+ * @param mtu Path MTU in bytes
+ */
+void pmtu_set(const struct in6_addr *addr, uint32_t mtu)
+{
+	struct pmtu_entry *e = &pmtu_table[pmtu_hash(addr)];
+	uint32_t seq;
+	int i;
+
+	pthread_mutex_lock(&pmtu_mutex);
+	seq = e->seq;
+	__atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&e->mtu, mtu, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->expires, now + PMTU_TIMEOUT, __ATOMIC_RELAXED);
+	for (i = 0; i < 4; ++i)
+		__atomic_store_n(&e->addr.s6_addr32[i], addr->s6_addr32[i],
+				__ATOMIC_RELAXED);
+	__atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&pmtu_active, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pmtu_mutex);
+}
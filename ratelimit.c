@@ -0,0 +1,165 @@
+/*
+ *  ratelimit.c -- token buckets for locally generated ICMP
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "tayga.h"
+
+/* Number of per-source buckets per class, as a power of two */
+#define RL_SRC_BITS	8
+
+/* Source prefix lengths sharing a bucket */
+#define RL_PREFIX4	24
+#define RL_PREFIX6	64
+
+#define NSEC_PER_SEC	1000000000ULL
+
+/**
+ * Token bucket
+ *
+ * A bucket is kept as the time at which it would be full again, and
+ * each message pushes that time on by the interval between messages at
+ * the configured rate. A message is allowed as long as the bucket would
+ * still hold a token, i.e. the time is less than a burst ahead. This is
+ * the same as counting tokens, but needs no division on the packet path
+ * and fits in one word, so a bucket shared between threads is updated
+ * with a single compare and swap.
+ */
+struct rl_src {
+	uint64_t key;
+	uint64_t full;
+};
+
+/**
+ * Global buckets, owned by a single thread
+ *
+ * Each thread only touches its own slot, so no locking is needed. The
+ * configured global rates are for the whole daemon and are shared out
+ * evenly between the threads which translate packets.
+ */
+struct rl_worker {
+	uint64_t global[RL_CLASS_MAX];
+} __attribute__((aligned(64)));
+
+static struct rl_worker rl_workers[MAX_WORKERS + 1];
+
+/* Per-source buckets, shared by every thread. Multiqueue steers each
+ * flow to one worker, so a source kept apart per thread would only get
+ * its share of the rate. */
+static struct rl_src rl_sources[RL_CLASS_MAX][1 << RL_SRC_BITS];
+
+static uint64_t rl_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief Take a token from a bucket
+ *
+ * A bucket seen for the first time starts full.
+ *
+ * @param full Bucket, updated atomically
+ * @param c Rate and burst, a rate of zero never limits
+ * @param share Number of threads the rate and burst are divided between
+ * @param t Current time in ns
+ * @returns 1 if the message may be sent, 0 if it is suppressed
+ */
+static int rl_take(uint64_t *full, const struct rl_conf *c, int share,
+		uint64_t t)
+{
+	uint64_t cost, cap, old, next;
+
+	if (!c->rate)
+		return 1;
+	cost = NSEC_PER_SEC * share / c->rate;
+	cap = NSEC_PER_SEC * c->burst / c->rate;
+	if (cap < cost)
+		cap = cost;
+
+	old = __atomic_load_n(full, __ATOMIC_RELAXED);
+	do {
+		next = old > t ? old : t;
+		if (next - t > cap - cost)
+			return 0;
+		next += cost;
+	} while (!__atomic_compare_exchange_n(full, &old, next, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 1;
+}
+
+static int rl_check(enum rl_class cls, uint64_t key)
+{
+	struct rl_worker *w = &rl_workers[worker_id];
+	struct rl_src *s;
+	uint64_t t = rl_clock();
+	int threads = gcfg.workers > 0 ? gcfg.workers : 1;
+	uint32_t h;
+
+	h = (uint32_t)key + gcfg.rand[4];
+	h ^= (uint32_t)(key >> 32) + gcfg.rand[5];
+	h *= 0x9e3779b1;
+	s = &rl_sources[cls][h >> (32 - RL_SRC_BITS)];
+	/* A new prefix evicts whatever shared its slot. Two threads racing
+	 * here at worst hand out one bucket's burst again. */
+	if (__atomic_load_n(&s->key, __ATOMIC_RELAXED) != key) {
+		__atomic_store_n(&s->key, key, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->full, 0, __ATOMIC_RELAXED);
+	}
+
+	/* Check the source first, so one noisy prefix can't drain the
+	 * global bucket for everybody else */
+	if (!rl_take(&s->full, &gcfg.icmp_rl[cls][RL_SOURCE], 1, t) ||
+			!rl_take(&w->global[cls],
+				&gcfg.icmp_rl[cls][RL_GLOBAL], threads, t)) {
+		if (cls == RL_ERRORS)
+			STAT_INC(icmp_err_limited);
+		else
+			STAT_INC(echo_limited);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief Check whether an ICMP message may be sent to an IPv4 host
+ *
+ * @param cls Class of message
+ * @param dest Host the message would be sent to
+ * @returns 1 if it may be sent, 0 if it is suppressed
+ */
+int icmp_ratelimit4(enum rl_class cls, const struct in_addr *dest)
+{
+	/* Top bit set keeps IPv4 keys apart from IPv6 ones */
+	return rl_check(cls, (1ULL << 63) |
+			(ntohl(dest->s_addr) >> (32 - RL_PREFIX4)));
+}
+
+/**
+ * @brief Check whether an ICMP message may be sent to an IPv6 host
+ *
+ * @param cls Class of message
+ * @param dest Host the message would be sent to
+ * @returns 1 if it may be sent, 0 if it is suppressed
+ */
+int icmp_ratelimit6(enum rl_class cls, const struct in6_addr *dest)
+{
+	uint64_t key = ((uint64_t)ntohl(dest->s6_addr32[0]) << 32) |
+			ntohl(dest->s6_addr32[1]);
+
+	return rl_check(cls, (key >> (64 - RL_PREFIX6)) & ~(1ULL << 63));
+}
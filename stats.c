@@ -0,0 +1,392 @@
+/*
+ *  stats.c -- per-worker statistics counters
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2010  Nathan Lutchansky <lutchann@litech.org>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "tayga.h"
+#include <sys/mman.h>
+#include <signal.h>
+
+/* 0 for the main thread, workers from 1 */
+_Thread_local int worker_id;
+
+/* Slot 0 belongs to the main thread, slot n to worker n-1 */
+struct stats_worker stats_workers[MAX_WORKERS + 1];
+
+const struct pkt_reason_info pkt_reasons[PKT_REASON_MAX] = {
+#define X(name, family, msg) { #name, family, msg },
+	PKT_REASON_LIST
+#undef X
+};
+
+/* Counters at the last reset, only touched by the main thread */
+static struct stats_counters stats_baseline[MAX_WORKERS + 1];
+
+/* stats-shm mapping, only touched by the main thread */
+static struct stats_shm *stats_shm;
+static size_t stats_shm_size;
+
+#define STATS_NWORDS (sizeof(struct stats_counters) / sizeof(uint64_t))
+
+/**
+ * @brief Read the counters of a single thread
+ *
+ * @param id worker_id of the thread, 0 for the main thread
+ * @param[out] out Counts since the last stats_reset()
+ */
+void stats_read_worker(int id, struct stats_counters *out)
+{
+	const uint64_t *c = (const uint64_t *)&stats_workers[id].c;
+	const uint64_t *b = (const uint64_t *)&stats_baseline[id];
+	uint64_t *o = (uint64_t *)out;
+	size_t w;
+
+	for (w = 0; w < STATS_NWORDS; ++w)
+		o[w] = __atomic_load_n(&c[w], __ATOMIC_RELAXED) - b[w];
+}
+
+/**
+ * @brief Aggregate the counters of every thread
+ *
+ * The counters are not stopped while they are read, so the totals are
+ * only approximately consistent with each other.
+ *
+ * @param[out] out Totals since the last stats_reset()
+ */
+void stats_read(struct stats_counters *out)
+{
+	struct stats_counters one;
+	const uint64_t *c = (const uint64_t *)&one;
+	uint64_t *o = (uint64_t *)out;
+	size_t w;
+	int i;
+
+	memset(out, 0, sizeof(*out));
+	for (i = 0; i <= MAX_WORKERS; ++i) {
+		stats_read_worker(i, &one);
+		for (w = 0; w < STATS_NWORDS; ++w)
+			o[w] += c[w];
+	}
+}
+
+/**
+ * @brief Reset the counters to zero
+ *
+ * Workers own their counters, so rather than clearing them this records
+ * the current values and subtracts them from later reads.
+ */
+void stats_reset(void)
+{
+	const uint64_t *c;
+	uint64_t *b;
+	size_t w;
+	int i;
+
+	for (i = 0; i <= MAX_WORKERS; ++i) {
+		c = (const uint64_t *)&stats_workers[i].c;
+		b = (uint64_t *)&stats_baseline[i];
+		for (w = 0; w < STATS_NWORDS; ++w)
+			b[w] = __atomic_load_n(&c[w], __ATOMIC_RELAXED);
+	}
+#ifdef WITH_LATENCY
+	lat_reset();
+#endif
+#ifdef WITH_LOCK_STATS
+	lockstat_reset();
+#endif
+}
+
+/**
+ * @brief Write the counters to the log
+ */
+void stats_dump(void)
+{
+	struct stats_counters s;
+	int i;
+
+	stats_read(&s);
+	slog(LOG_NOTICE, "Statistics:\n");
+#define X(name, desc) \
+	slog(LOG_NOTICE, "  %-24s %llu\n", desc, (unsigned long long)s.name);
+	STATS_COUNTER_LIST
+#undef X
+	for (i = 0; i < PKT_REASON_MAX; ++i) {
+		if (!s.reason[i])
+			continue;
+		/* Several reasons share a description, so use the name */
+		slog(LOG_NOTICE, "  %-46s %llu\n", pkt_reasons[i].name,
+				(unsigned long long)s.reason[i]);
+	}
+#ifdef WITH_LATENCY
+	lat_dump();
+#endif
+#ifdef WITH_LOCK_STATS
+	lockstat_dump();
+#endif
+}
+
+/* Copy counters word by word, as the other side may be running */
+static void stats_copy(struct stats_counters *dst,
+		const struct stats_counters *src)
+{
+	const uint64_t *s = (const uint64_t *)src;
+	uint64_t *d = (uint64_t *)dst;
+	size_t w;
+
+	for (w = 0; w < STATS_NWORDS; ++w)
+		__atomic_store_n(&d[w], __atomic_load_n(&s[w], __ATOMIC_RELAXED),
+				__ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Create the stats-shm segment
+ *
+ * Called before dropping privileges. The segment is readable by anyone,
+ * so unprivileged monitoring tools can map it.
+ *
+ * @returns 0 on success, -1 on error
+ */
+int stats_shm_open(void)
+{
+	int fd, nworkers = gcfg.workers > 0 ? gcfg.workers : 0;
+	size_t size = sizeof(struct stats_shm) +
+		(nworkers + 1) * sizeof(struct stats_counters);
+	void *map;
+
+	shm_unlink(gcfg.stats_shm);
+	fd = shm_open(gcfg.stats_shm, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		slog(LOG_CRIT, "Unable to create stats-shm %s: %s\n",
+				gcfg.stats_shm, strerror(errno));
+		return -1;
+	}
+	/* Make it readable regardless of the umask */
+	if (fchmod(fd, 0644) < 0 || ftruncate(fd, size) < 0) {
+		slog(LOG_CRIT, "Unable to size stats-shm %s: %s\n",
+				gcfg.stats_shm, strerror(errno));
+		close(fd);
+		shm_unlink(gcfg.stats_shm);
+		return -1;
+	}
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		slog(LOG_CRIT, "Unable to map stats-shm %s: %s\n",
+				gcfg.stats_shm, strerror(errno));
+		shm_unlink(gcfg.stats_shm);
+		return -1;
+	}
+	stats_shm = map;
+	stats_shm_size = size;
+	stats_shm->version = STATS_SHM_VERSION;
+	stats_shm->counter_size = sizeof(struct stats_counters);
+	stats_shm->nreasons = PKT_REASON_MAX;
+	stats_shm->nworkers = nworkers + 1;
+	stats_shm->pid = getpid();
+	stats_shm_update();
+	/* Readers check the magic last, so it is set once all else is */
+	__atomic_store_n(&stats_shm->magic, STATS_SHM_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * @brief Publish the current counters to the stats-shm segment
+ */
+void stats_shm_update(void)
+{
+	struct stats_counters c;
+	uint32_t seq, i;
+
+	if (!stats_shm)
+		return;
+	seq = stats_shm->seq;
+	__atomic_store_n(&stats_shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&stats_shm->updated, (int64_t)now, __ATOMIC_RELAXED);
+	stats_read(&c);
+	stats_copy(&stats_shm->total, &c);
+	for (i = 0; i < stats_shm->nworkers; ++i) {
+		stats_read_worker(i, &c);
+		stats_copy(&stats_shm->worker[i], &c);
+	}
+	__atomic_store_n(&stats_shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Remove the stats-shm segment on exit
+ */
+void stats_shm_close(void)
+{
+	if (!stats_shm)
+		return;
+	munmap(stats_shm, stats_shm_size);
+	shm_unlink(gcfg.stats_shm);
+	stats_shm = NULL;
+}
+
+/**
+ * @brief Take a consistent snapshot of a stats-shm segment
+ *
+ * An update takes microseconds, so a segment which stays mid-update
+ * for STATS_SHM_READ_TIMEOUT ms was left behind by a daemon which died
+ * while writing it.
+ *
+ * @param shm Mapped segment
+ * @param[out] total Aggregate counters
+ * @param[out] updated Time the daemon published them
+ * @returns 0 on success, -1 if the layout is not one we understand,
+ *          -2 if no consistent snapshot could be taken
+ */
+int stats_shm_read(const struct stats_shm *shm, struct stats_counters *total,
+		int64_t *updated)
+{
+	struct timespec ts, pause = { 0, 100000 };
+	uint64_t deadline = 0, ms;
+	uint32_t seq;
+
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != STATS_SHM_MAGIC ||
+			shm->version != STATS_SHM_VERSION ||
+			shm->counter_size != sizeof(struct stats_counters) ||
+			shm->nreasons != PKT_REASON_MAX)
+		return -1;
+	for (;;) {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1)) {
+			*updated = __atomic_load_n(&shm->updated,
+					__ATOMIC_RELAXED);
+			stats_copy(total, &shm->total);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (seq == __atomic_load_n(&shm->seq, __ATOMIC_RELAXED))
+				return 0;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+		if (!deadline)
+			deadline = ms + STATS_SHM_READ_TIMEOUT;
+		else if (ms >= deadline)
+			return -2;
+		nanosleep(&pause, NULL);
+	}
+}
+
+/* Per-second difference, tolerating a reset (SIGUSR2) in between */
+static double stats_rate(uint64_t cur, uint64_t prev, int64_t secs)
+{
+	return (double)(cur >= prev ? cur - prev : cur) / secs;
+}
+
+/* Read a snapshot for stats_monitor(), reporting why none was taken */
+static int stats_monitor_read(const char *name, const struct stats_shm *shm,
+		struct stats_counters *total, int64_t *updated)
+{
+	int ret = stats_shm_read(shm, total, updated);
+
+	if (ret == -2)
+		fprintf(stderr, "stats-shm %s is stuck mid-update, "
+				"tayga (pid %lld) appears dead\n", name,
+				(long long)shm->pid);
+	else if (ret < 0)
+		fprintf(stderr, "stats-shm %s has an incompatible layout\n",
+				name);
+	return ret;
+}
+
+/**
+ * @brief Print live rates from a running daemon, like vmstat(8)
+ *
+ * Maps the stats-shm segment read-only and prints one line per update
+ * until interrupted. This never communicates with the daemon itself.
+ *
+ * @param name stats-shm name from the configuration
+ * @returns exit status
+ */
+int stats_monitor(const char *name)
+{
+	struct stats_counters cur, prev;
+	int64_t updated, prev_updated, secs;
+	const struct stats_shm *shm;
+	struct stat st;
+	uint64_t lookups;
+	int fd, lines = 0;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open stats-shm %s: %s\n", name,
+				strerror(errno));
+		return 1;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*shm)) {
+		fprintf(stderr, "stats-shm %s is not initialized\n", name);
+		close(fd);
+		return 1;
+	}
+	shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		fprintf(stderr, "Unable to map stats-shm %s: %s\n", name,
+				strerror(errno));
+		return 1;
+	}
+	if (stats_monitor_read(name, shm, &prev, &prev_updated) < 0)
+		return 1;
+
+	for (;;) {
+		sleep(STATS_SHM_INTERVAL);
+		if (stats_monitor_read(name, shm, &cur, &updated) < 0)
+			return 1;
+		secs = updated - prev_updated;
+		if (secs <= 0) {
+			/* No new update, check the daemon is still running */
+			if (kill(shm->pid, 0) < 0 && errno == ESRCH) {
+				fprintf(stderr, "tayga (pid %lld) has exited\n",
+						(long long)shm->pid);
+				return 1;
+			}
+			continue;
+		}
+		if (lines++ % 20 == 0)
+			printf("%9s %9s %9s %9s %9s %9s %8s %8s %8s %8s %5s\n",
+					"rx4/s", "rx6/s", "tx4/s", "tx6/s",
+					"rxMbit/s", "txMbit/s", "drop/s",
+					"reject/s", "icmp/s", "frag/s", "hit%");
+		lookups = (cur.cache_hit - prev.cache_hit) +
+			(cur.cache_miss - prev.cache_miss);
+		printf("%9.0f %9.0f %9.0f %9.0f %9.1f %9.1f %8.0f %8.0f %8.0f "
+				"%8.0f %5.1f\n",
+				stats_rate(cur.rx_pkts4, prev.rx_pkts4, secs),
+				stats_rate(cur.rx_pkts6, prev.rx_pkts6, secs),
+				stats_rate(cur.tx_pkts4, prev.tx_pkts4, secs),
+				stats_rate(cur.tx_pkts6, prev.tx_pkts6, secs),
+				(stats_rate(cur.rx_bytes4, prev.rx_bytes4, secs) +
+				 stats_rate(cur.rx_bytes6, prev.rx_bytes6, secs))
+					* 8 / 1e6,
+				(stats_rate(cur.tx_bytes4, prev.tx_bytes4, secs) +
+				 stats_rate(cur.tx_bytes6, prev.tx_bytes6, secs))
+					* 8 / 1e6,
+				stats_rate(cur.dropped, prev.dropped, secs),
+				stats_rate(cur.rejected, prev.rejected, secs),
+				stats_rate(cur.icmp_gen, prev.icmp_gen, secs),
+				stats_rate(cur.frags, prev.frags, secs),
+				cur.cache_hit >= prev.cache_hit && lookups &&
+				cur.cache_miss >= prev.cache_miss ?
+				100.0 * (cur.cache_hit - prev.cache_hit) /
+				lookups : 0.0);
+		fflush(stdout);
+		prev = cur;
+		prev_updated = updated;
+	}
+	return 0;
+}
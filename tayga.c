@@ -37,7 +37,8 @@ void usage(int code) {
 			"       [--syslog|--stdout|--journal]\n"
 			"%s --mktun [-c|--config CONFIGFILE]\n"
 			"%s --rmtun [-c|--config CONFIGFILE]\n"
-			"       [-u|--user USERID] [-g|--group GROUPID] [-r|--chroot] [-p|--pidfile PIDFILE]\n\n"
+			"       [-u|--user USERID] [-g|--group GROUPID] [-r|--chroot] [-p|--pidfile PIDFILE]\n"
+			"%s --stats [-c|--config CONFIGFILE]\n\n"
 			"--config FILE      : Read configuration options from FILE\n"
 			"--debug, -d        : Enable debug messages (implies --nodetach and --stdout)\n"
 			"--nodetach         : Do not fork the process\n"
@@ -50,8 +51,9 @@ void usage(int code) {
 			"--pidfile FILE     : Write process ID of daemon to FILE\n"
 			"--mktun            : Create the persistent TUN interface\n"
 			"--rmtun            : Remove the persistent TUN interface\n"
+			"--stats            : Print live rates from a running tayga (needs stats-shm)\n"
 			"--help, -h         : Show this help message\n",
-		TAYGA_VERSION, progname, progname, progname);
+		TAYGA_VERSION, progname, progname, progname, progname);
 	exit(code);
 }
 
@@ -116,15 +118,30 @@ static void signal_read(void)
 			/* Reload map-file */
 			addrmap_reload();
 			/* Dynamic map flush to file */
-			if (gcfg.dynamic_pool)
-				dynamic_maint(gcfg.dynamic_pool, 1);
+			if (gcfg.dyn_pool_count)
+				dynamic_maint(1);
+			continue;
+		}
+		/* SIGUSR1 dumps the statistics, SIGUSR2 resets them */
+		if (sig == SIGUSR1) {
+			stats_dump();
+			continue;
+		}
+		if (sig == SIGUSR2) {
+			slog(LOG_NOTICE, "Resetting statistics\n");
+			stats_reset();
 			continue;
 		}
 		/* For any other signal prepare to exit cleanly */
-		if (gcfg.dynamic_pool) {
-			dynamic_maint(gcfg.dynamic_pool, 1);
+		if (gcfg.dyn_pool_count) {
+			dynamic_async_stop();
+			dynamic_maint(1);
+			dynamic_repl_stop();
 		}
 		slog(LOG_NOTICE, "Exiting on signal %d\n", sig);
+		pktlog_stop();
+		metrics_close();
+		stats_shm_close();
 		if (gcfg.log_out == LOG_TO_SYSLOG) {
 			closelog();
 		} else if (gcfg.log_out == LOG_TO_JOURNAL) {
@@ -145,6 +162,7 @@ static void print_op_info(void)
 	static const char * map_types[] = MAP_TYPE_LIST;
 	static const char * map_origins[] = MAP_ORIGIN_LIST;
 	unsigned int type, origin;
+	int i;
 
 	inet_ntop(AF_INET, &gcfg.local_addr4, addrbuf, sizeof(addrbuf));
 	slog(LOG_INFO, "TAYGA's IPv4 address: %s\n", addrbuf);
@@ -170,11 +188,14 @@ static void print_op_info(void)
 					"IPv6 hosts to communicate with "
 					"private IPv4 addresses.\n");
 	}
-	if (gcfg.dynamic_pool) {
-		inet_ntop(AF_INET, &gcfg.dynamic_pool->map4.addr,
+	/* Shards of a pool are listed as pools of their own */
+	for (i = 0; i < gcfg.dyn_pool_count; ++i) {
+		inet_ntop(AF_INET, &gcfg.dyn_pools[i]->map4.addr,
 				addrbuf, sizeof(addrbuf));
 		slog(LOG_INFO, "Dynamic pool: %s/%d\n", addrbuf,
-				gcfg.dynamic_pool->map4.prefix_len);
+				gcfg.dyn_pools[i]->map4.prefix_len);
+	}
+	if (gcfg.dyn_pool_count) {
 		if (!gcfg.data_dir[0])
 			slog(LOG_NOTICE, "Note: dynamically-assigned mappings "
 					"will not be saved across restarts.  "
@@ -232,6 +253,7 @@ static void print_op_info(void)
 static void * worker(void * arg)
 {
 	int idx = *(int *)arg;
+	worker_id = idx + 1;
 	uint8_t * recv_buf = (uint8_t *)malloc(RECV_BUF_SIZE);
 	if (!recv_buf) {
 		slog(LOG_CRIT, "Error: unable to allocate %d bytes for "
@@ -251,7 +273,9 @@ int main(int argc, char **argv)
 {
 	int c, ret, longind;
 	int pidfd;
-	struct pollfd pollfds[2];
+	struct pollfd pollfds[3];
+	int repl_fd = -1;
+	time_t last_stats_shm = 0;
 	char addrbuf[INET6_ADDRSTRLEN];
 
 	char *conffile = TAYGA_CONF_PATH;
@@ -262,6 +286,7 @@ int main(int argc, char **argv)
 	int detach = 1;
 	int do_mktun = 0;
 	int do_rmtun = 0;
+	int do_stats = 0;
 	struct passwd *pw = NULL;
 	struct group *gr = NULL;
 	progname = argv[0];
@@ -275,6 +300,7 @@ int main(int argc, char **argv)
 		{ "syslog", 0, 0, 0 },
 		{ "stdout", 0, 0, 0 },
 		{ "journal", 0, 0, 0 },
+		{ "stats", 0, 0, 0 },
 		{ "help", 0, 0, 'h' },
 		{ "syslog", 0, 0, 0 },
 		{ "stdout", 0, 0, 0 },
@@ -322,6 +348,9 @@ int main(int argc, char **argv)
 				case 4: /* --journal */
 					gcfg.log_out = LOG_TO_JOURNAL;
 					break;
+				case 5: /* --stats */
+					do_stats = 1;
+					break;
 				default:
 					usage(1);
 			}
@@ -362,7 +391,7 @@ int main(int argc, char **argv)
 	 * This must be done before config parsing, since those rely
 	 * on logging based on log_out
 	 */
-	if(do_mktun || do_rmtun) {
+	if(do_mktun || do_rmtun || do_stats) {
 		//Force stdout for these options
 		gcfg.log_out = LOG_TO_STDOUT;
 	} else if (gcfg.log_out == LOG_TO_SYSLOG) {
@@ -378,6 +407,13 @@ int main(int argc, char **argv)
 	/* Parse config file options */
 	if(config_read(conffile) < 0) return 1;
 
+	/* Monitor a running daemon through its stats-shm */
+	if (do_stats) {
+		if (!gcfg.stats_shm[0])
+			die("Error: --stats requires stats-shm in %s", conffile);
+		return stats_monitor(gcfg.stats_shm);
+	}
+
 	/* Validate config (and load map file) */
 	if(config_validate() < 0) return 1;
 
@@ -534,6 +570,15 @@ int main(int argc, char **argv)
 
 	if(tun_setup(0, 0)) exit(1);
 
+	/* Open the sockets before any chroot or privilege drop */
+	if (gcfg.dyn_replica_listen_len &&
+			(repl_fd = dynamic_repl_listen()) < 0)
+		exit(1);
+	if (gcfg.stats_socket[0] && metrics_open() < 0)
+		exit(1);
+	if (gcfg.stats_shm[0] && stats_shm_open() < 0)
+		exit(1);
+
 	if (do_chroot) {
 		if (chroot(gcfg.data_dir) < 0) {
 			slog(LOG_CRIT, "Unable to chroot to %s: %s\n",
@@ -573,11 +618,18 @@ int main(int argc, char **argv)
 
 	/* Load dynamic maps if configured */
 	if (gcfg.data_dir[0])
-		load_dynamic(gcfg.dynamic_pool);
+		load_dynamic();
 
 	if (gcfg.cache_size)
 		create_cache();
 
+	/* Pick the translator variant for this configuration */
+	nat64_select_variant();
+
+#ifdef WITH_LATENCY
+	lat_init();
+#endif
+
 	/* Initialize mutexes */
 	if (pthread_mutex_init(&gcfg.cache_mutex, NULL) != 0) {
 		slog(LOG_CRIT, "Failed to initialize cache mutex\n");
@@ -595,11 +647,14 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	memset(pollfds, 0, 2 * sizeof(struct pollfd));
+	memset(pollfds, 0, 3 * sizeof(struct pollfd));
 	pollfds[0].fd = signalfds[0];
 	pollfds[0].events = POLLIN;
 	pollfds[1].fd = gcfg.tun_fd;
 	pollfds[1].events = POLLIN;
+	/* Negative fds are ignored by poll() */
+	pollfds[2].fd = repl_fd;
+	pollfds[2].events = POLLIN;
 
 	/* Tell systemd logger we are ready */
 	if(gcfg.log_out == LOG_TO_JOURNAL) {
@@ -610,6 +665,25 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* Packet logs are formatted off the data path */
+	if (gcfg.log_opts & (LOG_OPT_REJECT | LOG_OPT_DROP |
+				LOG_OPT_ICMP | LOG_OPT_SELF)) {
+		if (pktlog_start(gcfg.workers + 1))
+			exit(1);
+	}
+
+	/* Dynamic assignment off the packet path */
+	if (gcfg.dyn_pool_count && gcfg.dyn_assign_mode == DYN_ASSIGN_ASYNC) {
+		if (dynamic_async_start())
+			exit(1);
+	}
+	if (dynamic_repl_start())
+		exit(1);
+
+	/* Scrapers are served off the packet path */
+	if (metrics_start())
+		exit(1);
+
 #ifdef __linux__
 	/* Launch worker threads */
 	static int thread_ids[MAX_WORKERS];
@@ -626,7 +700,9 @@ int main(int argc, char **argv)
 
 	/* Main loop */
 	for (;;) {
-		ret = poll(pollfds, 2, POOL_CHECK_INTERVAL * 1000);
+		ret = poll(pollfds, 3, gcfg.stats_shm[0] ?
+				STATS_SHM_INTERVAL * 1000 :
+				POOL_CHECK_INTERVAL * 1000);
 		if (ret < 0) {
 			if (errno == EINTR)
 				continue;
@@ -639,16 +715,22 @@ int main(int argc, char **argv)
 			signal_read();
 		if (pollfds[1].revents)
 			tun_read(recv_buf,gcfg.tun_fd);
+		if (pollfds[2].revents)
+			dynamic_repl_read();
 		if (gcfg.cache_size && (gcfg.last_cache_maint +
 						CACHE_CHECK_INTERVAL < now ||
 					gcfg.last_cache_maint > now)) {
 			addrmap_maint();
 			gcfg.last_cache_maint = now;
 		}
-		if (gcfg.dynamic_pool && (gcfg.last_dynamic_maint +
+		if (gcfg.stats_shm[0] && last_stats_shm != now) {
+			stats_shm_update();
+			last_stats_shm = now;
+		}
+		if (gcfg.dyn_pool_count && (gcfg.last_dynamic_maint +
 						POOL_CHECK_INTERVAL < now ||
 					gcfg.last_dynamic_maint > now)) {
-			dynamic_maint(gcfg.dynamic_pool, 0);
+			dynamic_maint(0);
 			gcfg.last_dynamic_maint = now;
 		}
 	}
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <poll.h>
 #include <fcntl.h>
 #include <syslog.h>
@@ -54,6 +55,36 @@
 #endif
 #include "list.h"
 
+/* Vector byte shuffles for RFC6052 address embedding
+ * (build with -mssse3 or a suitable -march to use pshufb on x86) */
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define RFC6052_SSSE3
+#elif defined(__aarch64__) && defined(__ARM_NEON) && \
+	__BYTE_ORDER == __LITTLE_ENDIAN
+#include <arm_neon.h>
+#define RFC6052_NEON
+#endif
+
+/* USDT tracepoints for perf and bpftrace (see scripts/bpftrace). A probe
+ * is a single nop until a tracer attaches, so they are compiled in
+ * whenever <sys/sdt.h> is available; build with -DNO_USDT to omit them */
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT
+#endif
+#endif
+#ifdef HAVE_USDT
+#define TRACE1(name, a)		DTRACE_PROBE1(tayga, name, a)
+#define TRACE2(name, a, b)	DTRACE_PROBE2(tayga, name, a, b)
+#define TRACE3(name, a, b, c)	DTRACE_PROBE3(tayga, name, a, b, c)
+#else
+#define TRACE1(name, a)		do { } while (0)
+#define TRACE2(name, a, b)	do { } while (0)
+#define TRACE3(name, a, b, c)	do { } while (0)
+#endif
+
 #ifdef COVERAGE_TESTING
 //for coverage testing
 inline static void dummy()
@@ -95,9 +126,21 @@ struct tun_pi {
 /* Number of seconds between cache ageing passes */
 #define CACHE_CHECK_INTERVAL	5
 
+/* Log2 of the number of recent lookup misses remembered per family */
+#define NEG_CACHE_BITS		10
+
+/* Number of seconds a lookup miss is remembered */
+#define NEG_CACHE_TTL		2
+
 /* Number of seconds between dynamic pool ageing passes */
 #define POOL_CHECK_INTERVAL	45
 
+/* Number of seconds a learned path MTU is trusted (RFC 8201) */
+#define PMTU_TIMEOUT		600
+
+/* Number of seconds between stats-shm updates */
+#define STATS_SHM_INTERVAL	1
+
 /* Valid token delimiters in config file and dynamic map file */
 #define DELIM		" \t\r\n"
 
@@ -189,6 +232,9 @@ static_assert(sizeof(struct icmp) == 8,"Struct ICMP must be 8 bytes long");
 /* Maximum config arguments in parser */
 #define MAX_ARGS 10
 
+/* Maximum shards a dynamic-pool may be split into */
+#define MAX_DYN_SHARDS 256
+
 
 /* TAYGA data definitions */
 
@@ -257,32 +303,49 @@ struct map_static {
 	int origin;
 };
 
-/// Free addresses
-struct free_addr {
-	uint32_t addr; /* in-use address (host order) */
-	uint32_t count; /* num of free addresses after addr */
-	struct list_head list; /* list of struct free_addr */
-};
-
 /// Mapping entry (Dynamic Map)
 struct map_dynamic {
 	struct map4 map4;
 	struct map6 map6;
 	struct cache_entry *cache_entry;
 	time_t last_use;
-	struct list_head list; /* referenced by struct dynamic_pool */
-	struct free_addr free;
+	time_t expires;	/* when dynamic_maint() next looks at this map */
+	int heap_idx;	/* index in dynamic_pool.mapped or .dormant, or -1 */
+	struct list_head hash4; /* dynamic_pool.hash_table4 */
+	struct list_head hash6; /* dynamic_pool.hash_table6 */
+};
+
+/// Binary min-heap of dynamic maps, ordered by expires
+struct dyn_heap {
+	struct map_dynamic **v;
+	uint32_t len;
+	uint32_t cap;
 };
 
 static_assert(sizeof(time_t) == 8, "64-bit time_t is required");
 
 /// Mapping entry (Dynamic Pool)
+///
+/// One per dynamic-pool directive, or per shard of one. Each pool has
+/// its own mutex, taken before map_mutex, so hosts assigned from
+/// different pools do not wait for each other. A host's home pool is
+/// picked by a hash of its address; it only holds a lease elsewhere
+/// once its home pool is full.
 struct dynamic_pool {
 	struct map4 map4;
-	struct list_head mapped_list;  /* list of struct map_dynamic */
-	struct list_head dormant_list; /* list of struct map_dynamic */
-	struct list_head free_list;    /* list of struct free_addr */
-	struct free_addr free_head;
+	uint32_t foreign;	/* leases of hosts homed in another pool,
+				   read without the mutex */
+	pthread_mutex_t mutex;	/* guards everything below */
+	struct dyn_heap mapped;	/* active maps, by earliest dormancy */
+	struct dyn_heap dormant; /* dormant maps, oldest first */
+	uint32_t *in_use;	/* bitmap of host offsets, 1 if assigned */
+	uint32_t size;		/* addresses in the pool */
+	uint32_t free_count;	/* addresses with a clear in_use bit */
+	struct list_head *hash_table4; /* map_dynamic by IPv4 address */
+	struct list_head *hash_table6; /* map_dynamic by IPv6 address */
+	int hash_bits;
+	struct list_head retired; /* dropped active maps, by map4.list,
+				     freed by the next dynamic_maint() */
 };
 
 /// IP Cache entry
@@ -291,7 +354,6 @@ struct cache_entry {
 	struct in_addr addr4;
 	time_t last_use;
 	uint32_t flags;
-	uint16_t ip4_ident;
 	struct list_head list;  /* gcfg.cache_active or gcfg.cache_pool */
 	struct list_head hash4; /* gcfg.hash_table4 */
 	struct list_head hash6; /* gcfg.hash_table6 */
@@ -311,14 +373,75 @@ struct tun_ip6 {
 	struct list_head list; /* gcfg.tun_ip6_list and gcfg.tun_rt6_list */
 };
 
+/// Negative cache entry, an IPv4 address no map was found for
+struct neg_entry4 {
+	struct in_addr addr4;
+	uint32_t gen;		/* gcfg.neg_gen when the lookup was made */
+	time_t expires;
+};
+
+/// Negative cache entry, an IPv6 address no map was found for
+struct neg_entry6 {
+	struct in6_addr addr6;
+	uint32_t gen;		/* gcfg.neg_gen when the lookup was made */
+	int dyn_alloc;		/* nonzero if dynamic assignment failed too */
+	time_t expires;
+};
+
 /// Cache flag bits
 enum {
 	CACHE_F_SEEN_4TO6	= (1<<0),
 	CACHE_F_SEEN_6TO4	= (1<<1),
-	CACHE_F_GEN_IDENT	= (1<<2),
 	CACHE_F_REP_AGEOUT	= (1<<3),
 };
 
+/// When the dynamic lease journal is flushed to disk
+enum dyn_fsync {
+	DYN_FSYNC_INTERVAL,	/* on each pool maintenance pass */
+	DYN_FSYNC_ALWAYS,	/* after every record */
+	DYN_FSYNC_NEVER		/* left to the kernel */
+};
+
+/// How dynamic leases are stored in the data-dir
+enum dyn_format {
+	DYN_FORMAT_TEXT,	/* dynamic.map */
+	DYN_FORMAT_BINARY	/* dynamic.db */
+};
+
+/// Where new hosts are given dynamic maps
+enum dyn_assign_mode {
+	DYN_ASSIGN_INLINE,	/* by the thread translating the first packet */
+	DYN_ASSIGN_ASYNC	/* by the assignment thread, dropping packets */
+};
+
+/// Classes of locally generated ICMP which are rate limited
+enum rl_class {
+	RL_ERRORS,	/* errors about packets we could not translate */
+	RL_ECHO,	/* echo replies from our own addresses */
+	RL_CLASS_MAX
+};
+
+/// Which token bucket a limit applies to
+enum rl_scope {
+	RL_GLOBAL,	/* all destinations */
+	RL_SOURCE,	/* each source prefix of the offending packet */
+	RL_SCOPE_MAX
+};
+
+/// Token bucket parameters, in messages per second
+struct rl_conf {
+	uint32_t rate;	/* zero for no limit */
+	uint32_t burst;
+	int set;	/* given in the config file */
+};
+
+/// Defaults, following the B=10, N=10/s example of RFC 4443 2.4(f)
+/// for each source prefix
+#define ICMP_RL_GLOBAL_RATE	1000
+#define ICMP_RL_GLOBAL_BURST	50
+#define ICMP_RL_SOURCE_RATE	10
+#define ICMP_RL_SOURCE_BURST	10
+
 /// UDP Checksum options
 enum udp_cksum_mode {
 	UDP_CKSUM_DROP,
@@ -349,11 +472,26 @@ struct config {
 	int dyn_min_lease;
 	int dyn_max_lease;
 	int max_commit_delay;
-	struct dynamic_pool *dynamic_pool;
+	enum dyn_fsync dyn_fsync;
+	enum dyn_format dyn_format;
+	enum dyn_assign_mode dyn_assign_mode;
+	struct dynamic_pool **dyn_pools; /* every pool and shard */
+	int dyn_pool_count;
+	struct sockaddr_storage dyn_replica; /* standby to send leases to */
+	socklen_t dyn_replica_len;
+	struct sockaddr_storage dyn_replica_listen; /* on the standby */
+	socklen_t dyn_replica_listen_len;
+	struct in6_addr dyn_replica_peer; /* active, IPv4 as ::ffff:0:0/96 */
+	uint8_t dyn_replica_key[16];	/* SipHash key for datagrams */
+	int dyn_replica_key_set;
 
 	//Reloadable map file parameters
 	char map_file[512];
 
+	//Statistics
+	char stats_socket[108];
+	char stats_shm[64];
+
 	//Cache
 	int hash_bits;
 	int cache_size;
@@ -363,13 +501,17 @@ struct config {
 	time_t last_cache_maint;
 	struct list_head *hash_table4;
 	struct list_head *hash_table6;
+	struct neg_entry4 *neg_table4;	/* direct mapped, guarded by cache_mutex */
+	struct neg_entry6 *neg_table6;
+	uint32_t neg_gen;	/* bumped as maps change, atomic */
 	time_t last_dynamic_maint;
 	time_t last_map_write;
-	int map_write_pending;
 
 	//Other config parameters
 	uint32_t ipv6_offlink_mtu;
 	int wkpf_strict;
+	int tcp_mss_clamp;
+	struct rl_conf icmp_rl[RL_CLASS_MAX][RL_SCOPE_MAX];
 	int log_opts;
 	enum udp_cksum_mode udp_cksum_mode;	
 	enum {
@@ -396,6 +538,169 @@ enum {
 	LOG_OPT_CONFIG = (1<<15),	//Log has been configured (used in conf file validation)
 };
 
+/// Packet event reasons, for the packet log and statistics
+/// X(name, IP version, description)
+#define PKT_REASON_LIST \
+	X(R4_ECHO_REQUEST, 4, "Echo Request") \
+	X(R4_ICMP_UNKNOWN_TYPE_TO_SELF, 4, "ICMP Unknown Type") \
+	X(R4_INSUFFICIENT_PAYLOAD_LENGTH_FOR_UDP_HEADER, 4, "Insufficient payload length for UDP Header") \
+	X(R4_NOT_CONFIGURED_TO_HANDLE_ZERO_UDP_CHECKSUM, 4, "Not configured to handle Zero UDP Checksum") \
+	X(R4_INSUFFICIENT_PAYLOAD_LENGTH_FOR_TCP_HEADER, 4, "Insufficient payload length for TCP Header") \
+	X(R4_UNABLE_TO_MAP_DESTINATION_ADDRESS_REJECT, 4, "Unable to map destination address") \
+	X(R4_UNABLE_TO_MAP_DESTINATION_ADDRESS_DROP, 4, "Unable to map destination address") \
+	X(R4_UNABLE_TO_MAP_SOURCE_ADDRESS_REJECT, 4, "Unable to map source address") \
+	X(R4_UNABLE_TO_MAP_SOURCE_ADDRESS_DROP, 4, "Unable to map source address") \
+	X(R4_PACKET_TOO_BIG, 4, "Packet Too Big") \
+	X(R4_TOO_MANY_FRAGMENTS, 4, "Too many fragments") \
+	X(R4_IP_HEADER_LENGTH, 4, "IP Header Length") \
+	X(R4_IP_HEADER_INVALID, 4, "IP Header Invalid") \
+	X(R4_ICMP_FRAGMENTED, 4, "ICMP Fragmented") \
+	X(R4_ICMP_HEADER_LENGTH, 4, "ICMP Header Length") \
+	X(R4_IPV4_PACKET_WITH_IPV6_ONLY_PROTO, 4, "IPv4 Packet with IPv6-Only Proto") \
+	X(R4_FRAGMENT_MISALIGNMENT, 4, "Fragment Misalignment") \
+	X(R4_FRAGMENT_EXCEEDS_MAX_LENGTH, 4, "Fragment Exceeds Max Length") \
+	X(R4_ICMP_OPTION_LENGTH_AND_PACKET_TOO_SHORT, 4, "ICMP Option Length and Packet Too Short") \
+	X(R4_FAILED_TO_PARSE_EM_PACKET, 4, "Failed to parse em packet") \
+	X(R4_ICMP_ERROR_OF_ICMP_ERROR, 4, "ICMP Error of ICMP Error") \
+	X(R4_ICMP_FAILED_TO_MAP_EM_SRC_OR_EM_DEST, 4, "ICMP Failed to map em src or em dest") \
+	X(R4_ICMP_UNKNOWN_TYPE, 4, "ICMP Unknown Type") \
+	X(R4_ICMP_UNKNOWN_DEST_UNREACH_CODE, 4, "ICMP Unknown Dest Unreach Code") \
+	X(R4_PARAMETER_PROBLEM_INVALID_CODE, 4, "Parameter Problem Invalid Code") \
+	X(R4_PARAMETER_PROBLEM_INVALID_POINTER, 4, "Parameter Problem Invalid Pointer") \
+	X(R4_PARAMETER_PROBLEM_NOT_TRANSLATABLE, 4, "Parameter Problem Not Translatable") \
+	X(R4_UNABLE_TO_TRANSLATE_ICMP_EMBEDDED_PAYLOAD, 4, "Unable to translate ICMP embedded payload") \
+	X(R4_NEED_TO_RELY_ON_FAKE_SOURCE, 4, "Need to rely on fake source") \
+	X(R4_ICMP_UNABLE_TO_MAP_DESTINATION_ADDRESS, 4, "Unable to map destination address") \
+	X(R4_IP_HEADER_TTL_OR_CHECKSUM, 4, "IP Header Invalid") \
+	X(R4_ICMP_CHECKSUM_IS_INVALID, 4, "ICMP Checksum is invalid") \
+	X(R4_SELF_ASSIGNED_PACKET_W_INVALID_PROTO, 4, "Self-Assigned Packet w/ Invalid Proto") \
+	X(R4_TIME_EXCEEDED, 4, "Time Exceeded") \
+	X(R6_ECHO_REQUEST, 6, "Echo Request") \
+	X(R6_ICMP_UNKNOWN_TYPE_TO_SELF, 6, "ICMP Unknown Type") \
+	X(R6_INSUFFICIENT_UDP_HEADER_LENGTH, 6, "Insufficient UDP Header Length") \
+	X(R6_UDP_ZERO_CHECKSUM, 6, "UDP Zero Checksum") \
+	X(R6_INSUFFICIENT_TCP_HEADER_LENGTH, 6, "Insufficient TCP Header Length") \
+	X(R6_FAILED_TO_MAP_DEST_ADDR_REJECT, 6, "Failed to map dest addr") \
+	X(R6_FAILED_TO_MAP_DEST_ADDR_DROP, 6, "Failed to map dest addr") \
+	X(R6_FAILED_TO_MAP_SRC_ADDR_REJECT, 6, "Failed to map src addr") \
+	X(R6_FAILED_TO_MAP_SRC_ADDR_DROP, 6, "Failed to map src addr") \
+	X(R6_PACKET_TOO_BIG, 6, "Packet Too Big") \
+	X(R6_FAILED_TO_PARSE_IPV6_HEADER, 6, "Failed to parse IPv6 Header") \
+	X(R6_EXTENSION_HEADER_TRUNCATED, 6, "Extension Header Invalid Length") \
+	X(R6_EXTENSION_HEADER_INVALID_LENGTH, 6, "Extension Header Invalid Length") \
+	X(R6_FRAGMENT_HEADER_INVALID_LENGTH, 6, "Fragment Header Invalid Length") \
+	X(R6_FRAGMENT_MISALIGNED, 6, "Fragment Misaligned") \
+	X(R6_FRAGMENT_REASSEMBLY_EXCEEDS_MAX_SIZE, 6, "Fragment Reassembly exceeds max size") \
+	X(R6_FRAGMENTED_ICMP, 6, "Fragmented ICMP") \
+	X(R6_ICMP_WITH_INSUFFICIENT_HEADER_SIZE, 6, "ICMP with insufficient header size") \
+	X(R6_IPV6_WITH_IPV4_ONLY_PROTO, 6, "IPv6 with IPv4-only Proto") \
+	X(R6_ROUTING_HEADER_WITH_SEGMENTS_LEFT, 6, "Routing Header with Segments Left") \
+	X(R6_ICMP_LENGTH_TOO_SHORT, 6, "ICMP Length Too Short") \
+	X(R6_ICMP_ERROR_PARSING_EMBEDDED_PACKET, 6, "ICMP Error Parsing Embedded Packet") \
+	X(R6_ICMP_ERROR_WITH_ICMP_ERROR, 6, "ICMP Error with ICMP Error") \
+	X(R6_NO_MTU_IN_PACKET_TOO_BIG, 6, "No MTU in Packet Too Big") \
+	X(R6_PARAMETER_PROBLEM_INVALID_POINTER, 6, "Parameter Problem Invalid Pointer") \
+	X(R6_PARAMETER_PROBLEM_NOT_TRANSLATABLE, 6, "Parameter Problem Not Translatable") \
+	X(R6_PARAMETER_PROBLEM_UNKNOWN_CODE, 6, "Parameter Problem Unknown Code") \
+	X(R6_ICMP_UNKNOWN_TYPE, 6, "ICMP Unknown Type") \
+	X(R6_FAILED_TO_MAP_EM_SRC_OR_DEST, 6, "Failed to map em src or dest") \
+	X(R6_FAILED_TO_TRANSLATE_EM_PAYLOAD, 6, "Failed to translate em payload") \
+	X(R6_NEED_TO_RELY_ON_FAKE_SOURCE, 6, "Need to rely on fake source") \
+	X(R6_FAILED_TO_MAP_DEST, 6, "Failed to map dest") \
+	X(R6_INSUFFICIENT_LENGTH, 6, "Insufficient Length") \
+	X(R6_ICMP_INVALID_CHECKSUM, 6, "ICMP Invalid Checksum") \
+	X(R6_UNKNOWN_PROTOCOL_TO_SELF, 6, "Unknown protocol to self") \
+	X(R6_TIME_EXCEEDED, 6, "Time Exceeded")
+
+enum pkt_reason {
+#define X(name, family, msg) name,
+	PKT_REASON_LIST
+#undef X
+	PKT_REASON_MAX
+};
+
+struct pkt_reason_info {
+	const char *name;
+	int family;
+	const char *msg;
+};
+
+/// Statistics counters, X(name, description)
+#define STATS_COUNTER_LIST \
+	X(rx_pkts4, "IPv4 packets received") \
+	X(rx_bytes4, "IPv4 bytes received") \
+	X(rx_pkts6, "IPv6 packets received") \
+	X(rx_bytes6, "IPv6 bytes received") \
+	X(tx_pkts4, "IPv4 packets sent") \
+	X(tx_bytes4, "IPv4 bytes sent") \
+	X(tx_pkts6, "IPv6 packets sent") \
+	X(tx_bytes6, "IPv6 bytes sent") \
+	X(dropped, "Packets dropped") \
+	X(rejected, "Packets rejected") \
+	X(icmp_gen, "ICMP messages generated") \
+	X(icmp_err_limited, "ICMP errors suppressed by rate limit") \
+	X(echo_limited, "Echo replies suppressed by rate limit") \
+	X(frags, "Fragments emitted") \
+	X(cache_hit, "Address cache hits") \
+	X(cache_miss, "Address cache misses") \
+	X(cache_evict, "Address cache evictions") \
+	X(neg_hit, "Negative cache hits") \
+	X(dyn_assign, "Dynamic pool assignments") \
+	X(dyn_queued, "Hosts queued for dynamic assignment") \
+	X(dyn_queue_full, "Hosts not queued, assignment queue full") \
+	X(dyn_repl_sent, "Lease changes sent to the standby") \
+	X(dyn_repl_dropped, "Lease changes not sent, replication queue full") \
+	X(dyn_repl_recv, "Lease changes received from the active") \
+	X(dyn_repl_ignored, "Received lease changes not applied") \
+	X(dyn_repl_lost, "Replication batches missed") \
+	X(dyn_repl_rejected, "Replication datagrams rejected")
+
+struct stats_counters {
+#define X(name, desc) uint64_t name;
+	STATS_COUNTER_LIST
+#undef X
+	uint64_t reason[PKT_REASON_MAX];
+};
+
+/**
+ * Counters owned by a single thread
+ *
+ * Each thread only ever writes its own slot, so the counters are plain
+ * increments. The alignment keeps two threads from sharing a cache line.
+ */
+struct stats_worker {
+	struct stats_counters c;
+} __attribute__((aligned(64)));
+
+/// Layout of the stats-shm segment
+#define STATS_SHM_MAGIC		0x54415947	/* "TAYG" */
+#define STATS_SHM_VERSION	1
+
+/// Give up on a stats-shm segment stuck mid-update after this many ms
+#define STATS_SHM_READ_TIMEOUT	1000
+
+/**
+ * Header of the stats-shm segment
+ *
+ * Written only by the main thread of the daemon. seq is odd while an
+ * update is in progress, so readers copy what they need and retry if
+ * seq was odd or changed in the meantime. Readers must check magic,
+ * version and the sizes before trusting the layout, since counters may
+ * be added in later releases.
+ */
+struct stats_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t counter_size;	/* sizeof(struct stats_counters) */
+	uint32_t nreasons;	/* PKT_REASON_MAX */
+	uint32_t nworkers;	/* entries in worker[], main thread first */
+	int64_t pid;
+	int64_t updated;	/* time() of the last update */
+	struct stats_counters total;
+	struct stats_counters worker[];
+};
+
 /// Packet error codes
 enum {
 	ERROR_NONE = 0,
@@ -421,6 +726,19 @@ enum {
 		const typeof( ((type *)0)->field ) *__mptr = (x); \
 		(type *)( (char *)__mptr - offsetof(type, field) );})
 
+/* Force inlining of functions which are specialized on constant arguments */
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+/* One SipHash round, for the keyed hashes in ident.c and dynamic.c */
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3) do { \
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+} while (0)
+
 #define IN6_IS_IN_NET(addr,net,mask) \
 		((net)->s6_addr32[0] == ((addr)->s6_addr32[0] & \
 						(mask)->s6_addr32[0]) && \
@@ -432,9 +750,159 @@ enum {
 			 			(mask)->s6_addr32[3]))
 
 
+/// Byte layout of an RFC6052 address, per prefix length
+struct rfc6052_fmt {
+	uint8_t pos[4];		/* IPv6 byte holding each IPv4 byte */
+	uint8_t embed[16];	/* shuffle mask, IPv6 byte <- IPv4 byte */
+	uint8_t extract[16];	/* shuffle mask, IPv4 byte <- IPv6 byte */
+	uint8_t zero[16];	/* IPv6 bytes which must be zero (u, suffix) */
+};
+
+/* Out-of-range shuffle indices (bit 7 set) produce a zero byte with both
+ * pshufb and tbl, so the same masks serve SSSE3, NEON and scalar code.
+ * Each byte is given exactly once, so no initializer overrides another */
+#define RFC6052_EMBED(i, a, b, c, d) \
+	((i) == (a) ? 0 : (i) == (b) ? 1 : (i) == (c) ? 2 : (i) == (d) ? 3 : 0x80)
+#define RFC6052_ZERO(i, d) ((i) == 8 || (i) > (d) ? 0xff : 0)
+#define RFC6052_BYTES(m, ...) { \
+	m(0, __VA_ARGS__), m(1, __VA_ARGS__), m(2, __VA_ARGS__), \
+	m(3, __VA_ARGS__), m(4, __VA_ARGS__), m(5, __VA_ARGS__), \
+	m(6, __VA_ARGS__), m(7, __VA_ARGS__), m(8, __VA_ARGS__), \
+	m(9, __VA_ARGS__), m(10, __VA_ARGS__), m(11, __VA_ARGS__), \
+	m(12, __VA_ARGS__), m(13, __VA_ARGS__), m(14, __VA_ARGS__), \
+	m(15, __VA_ARGS__) }
+#define RFC6052_FMT(a, b, c, d) { \
+	.pos = { a, b, c, d }, \
+	.embed = RFC6052_BYTES(RFC6052_EMBED, a, b, c, d), \
+	.extract = { a, b, c, d, [4 ... 15] = 0x80 }, \
+	.zero = RFC6052_BYTES(RFC6052_ZERO, d), \
+}
+
+/// RFC6052 address formats, indexed by prefix length / 8
+static const struct rfc6052_fmt rfc6052_fmts[13] = {
+	[32 / 8] = RFC6052_FMT(4, 5, 6, 7),
+	[40 / 8] = RFC6052_FMT(5, 6, 7, 9),
+	[48 / 8] = RFC6052_FMT(6, 7, 9, 10),
+	[56 / 8] = RFC6052_FMT(7, 9, 10, 11),
+	[64 / 8] = RFC6052_FMT(9, 10, 11, 12),
+	[96 / 8] = {
+		.pos = { 12, 13, 14, 15 },
+		.embed = RFC6052_BYTES(RFC6052_EMBED, 12, 13, 14, 15),
+		.extract = { 12, 13, 14, 15, [4 ... 15] = 0x80 },
+	},
+};
+
+/**
+ * @brief Look up the RFC6052 address format for a prefix length
+ *
+ * @returns NULL if the prefix length is not defined by RFC6052
+ */
+static ALWAYS_INLINE const struct rfc6052_fmt *rfc6052_fmt(int prefix_len)
+{
+	if ((unsigned int)prefix_len > 96 || (prefix_len & 7) ||
+			!rfc6052_fmts[prefix_len >> 3].pos[0])
+		return NULL;
+	return &rfc6052_fmts[prefix_len >> 3];
+}
+
+/**
+ * @brief Embed an IPv4 address in an RFC6052 prefix
+ *
+ * Pure byte shuffling, no validation of the IPv4 address is performed
+ * (see append_to_prefix). The host bits of the prefix must be zero.
+ * When prefix_len is a compile-time constant, the table lookup folds
+ * away entirely.
+ *
+ * @param[out] addr6 Return IPv6 address
+ * @param[in] addr4 IPv4 address
+ * @param[in] prefix IPv6 Prefix
+ * @param[in] prefix_len IPv6 prefix length (must be defined by RFC6052)
+ * @returns ERROR_DROP on invalid prefix length
+ */
+static ALWAYS_INLINE int rfc6052_embed(struct in6_addr *addr6,
+		const struct in_addr *addr4, const struct in6_addr *prefix,
+		int prefix_len)
+{
+	const struct rfc6052_fmt *f = rfc6052_fmt(prefix_len);
+
+	if (!f)
+		return ERROR_DROP;
+#if defined(RFC6052_SSSE3)
+	__m128i v4 = _mm_cvtsi32_si128(addr4->s_addr);
+	__m128i v6 = _mm_or_si128(_mm_loadu_si128((const __m128i *)prefix),
+			_mm_shuffle_epi8(v4,
+				_mm_loadu_si128((const __m128i *)f->embed)));
+	_mm_storeu_si128((__m128i *)addr6, v6);
+#elif defined(RFC6052_NEON)
+	uint8x16_t v4 = vreinterpretq_u8_u32(
+			vsetq_lane_u32(addr4->s_addr, vdupq_n_u32(0), 0));
+	vst1q_u8(addr6->s6_addr, vorrq_u8(vld1q_u8(prefix->s6_addr),
+				vqtbl1q_u8(v4, vld1q_u8(f->embed))));
+#else
+	const uint8_t *b = (const uint8_t *)&addr4->s_addr;
+
+	*addr6 = *prefix;
+	addr6->s6_addr[f->pos[0]] = b[0];
+	addr6->s6_addr[f->pos[1]] = b[1];
+	addr6->s6_addr[f->pos[2]] = b[2];
+	addr6->s6_addr[f->pos[3]] = b[3];
+#endif
+	return ERROR_NONE;
+}
+
+/**
+ * @brief Extract an IPv4 address from an RFC6052 address
+ *
+ * Checks that the u octet and suffix are zero, but does not validate
+ * the resulting IPv4 address (see map_ip6_to_ip4).
+ *
+ * @param[out] addr4 Return IPv4 address
+ * @param[in] addr6 IPv6 address
+ * @param[in] prefix_len IPv6 prefix length (must be defined by RFC6052)
+ * @returns ERROR_DROP on invalid address or prefix length
+ */
+static ALWAYS_INLINE int rfc6052_extract(struct in_addr *addr4,
+		const struct in6_addr *addr6, int prefix_len)
+{
+	const struct rfc6052_fmt *f = rfc6052_fmt(prefix_len);
+
+	if (!f)
+		return ERROR_DROP;
+#if defined(RFC6052_SSSE3)
+	__m128i v6 = _mm_loadu_si128((const __m128i *)addr6);
+	__m128i z = _mm_and_si128(v6,
+			_mm_loadu_si128((const __m128i *)f->zero));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(z, _mm_setzero_si128())) != 0xffff)
+		return ERROR_DROP;
+	addr4->s_addr = _mm_cvtsi128_si32(_mm_shuffle_epi8(v6,
+				_mm_loadu_si128((const __m128i *)f->extract)));
+#elif defined(RFC6052_NEON)
+	uint8x16_t v6 = vld1q_u8(addr6->s6_addr);
+	if (vmaxvq_u8(vandq_u8(v6, vld1q_u8(f->zero))))
+		return ERROR_DROP;
+	addr4->s_addr = vgetq_lane_u32(vreinterpretq_u32_u8(
+				vqtbl1q_u8(v6, vld1q_u8(f->extract))), 0);
+#else
+	uint64_t w[2], z[2];
+	uint8_t *b = (uint8_t *)&addr4->s_addr;
+
+	memcpy(w, addr6, sizeof(w));
+	memcpy(z, f->zero, sizeof(z));
+	if ((w[0] & z[0]) | (w[1] & z[1]))
+		return ERROR_DROP;
+	b[0] = addr6->s6_addr[f->pos[0]];
+	b[1] = addr6->s6_addr[f->pos[1]];
+	b[2] = addr6->s6_addr[f->pos[2]];
+	b[3] = addr6->s6_addr[f->pos[3]];
+#endif
+	return ERROR_NONE;
+}
+
+
 /* TAYGA function prototypes */
 extern struct config gcfg;
 extern time_t now;
+extern _Thread_local int worker_id;
 
 /* addrmap.c */
 int validate_ip4_addr(const struct in_addr *a);
@@ -461,12 +929,31 @@ int config_validate(void);
 
 /* dynamic.c */
 struct map6 *assign_dynamic(const struct in6_addr *addr6);
-void load_dynamic(struct dynamic_pool *pool);
-void dynamic_maint(struct dynamic_pool *pool, int shutdown);
+void load_dynamic(void);
+void dynamic_maint(int shutdown);
+int dynamic_enqueue(const struct in6_addr *addr6);
+int dynamic_async_start(void);
+void dynamic_async_stop(void);
+int dynamic_repl_start(void);
+void dynamic_repl_stop(void);
+int dynamic_repl_listen(void);
+void dynamic_repl_read(void);
+
+/* metrics.c */
+void metrics_write(FILE *f);
+int metrics_open(void);
+void metrics_close(void);
+int metrics_start(void);
 
 /* nat64.c */
-void handle_ip4(struct pkt *p);
-void handle_ip6(struct pkt *p);
+extern void (*handle_ip4)(struct pkt *p);
+extern void (*handle_ip6)(struct pkt *p);
+void nat64_select_variant(void);
+
+/* ident.c */
+uint16_t ip4_ident(const struct in_addr *src, const struct in_addr *dest,
+		uint8_t proto);
+const void *ip4_ident_state(size_t *len);
 
 /* log.c */
 #define STRINGIFY_IMPL(x) #x
@@ -480,10 +967,221 @@ int journal_printv_with_location(
         int priority, const char *file, const char *line, const char *func,
         const char *format, va_list ap);
 
+/* pktlog.c */
+#define PKTLOG_NO_ARG INT_MIN
+int pktlog_start(int nthreads);
+void pktlog_stop(void);
+void pktlog(int type, int err, const struct pkt *p, int reason, int arg);
+
+/* stats.c */
+extern struct stats_worker stats_workers[MAX_WORKERS + 1];
+extern const struct pkt_reason_info pkt_reasons[PKT_REASON_MAX];
+#define STAT_ADD(field, n) (stats_workers[worker_id].c.field += (n))
+#define STAT_INC(field) STAT_ADD(field, 1)
+void stats_read_worker(int id, struct stats_counters *out);
+void stats_read(struct stats_counters *out);
+void stats_reset(void);
+void stats_dump(void);
+int stats_shm_open(void);
+void stats_shm_update(void);
+void stats_shm_close(void);
+int stats_shm_read(const struct stats_shm *shm, struct stats_counters *total,
+		int64_t *updated);
+int stats_monitor(const char *name);
+
+/**
+ * @brief Count a packet event against its reason and outcome
+ *
+ * @param err Bitmask of LOG_OPT the event is reported under
+ * @param reason pkt_reason of the event
+ */
+static inline void stats_pkt_event(int err, int reason)
+{
+	TRACE3(pkt_event, reason, pkt_reasons[reason].name, err);
+	STAT_INC(reason[reason]);
+	if (err & LOG_OPT_DROP)
+		STAT_INC(dropped);
+	else if (err & LOG_OPT_REJECT)
+		STAT_INC(rejected);
+}
+
+/* latency.c */
+/// Latency histograms, X(name, label)
+#define LAT_HIST_LIST \
+	X(LAT_4TO6, "4to6") \
+	X(LAT_6TO4, "6to4") \
+	X(LAT_ICMP_ERR, "icmp_error") \
+	X(LAT_SELF, "self") \
+	X(LAT_CACHE_HIT, "cache_hit") \
+	X(LAT_CACHE_MISS, "cache_miss")
+
+enum lat_hist {
+#define X(name, label) name,
+	LAT_HIST_LIST
+#undef X
+	LAT_HIST_MAX
+};
+
+#ifdef WITH_LATENCY
+/* Log-linear buckets: 2^LAT_SUB_BITS linear steps per power of two */
+#define LAT_SUB_BITS	4
+#define LAT_MAX_BITS	40
+#define LAT_BUCKETS	((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+/// Latency histograms owned by a single thread
+struct lat_worker {
+	uint64_t count[LAT_HIST_MAX][LAT_BUCKETS];
+	uint64_t sum[LAT_HIST_MAX];
+} __attribute__((aligned(64)));
+
+/// Timing of the packet currently being handled by this thread
+struct lat_pkt {
+	uint64_t start;
+	uint64_t end;
+	int path;
+	int cache;
+};
+
+extern struct lat_worker lat_workers[MAX_WORKERS + 1];
+extern _Thread_local struct lat_pkt lat_pkt;
+extern double lat_ns_per_tick;
+
+/**
+ * @brief Read the cycle counter, or a raw monotonic clock without one
+ *
+ * @returns timestamp in ticks, see lat_ns_per_tick
+ */
+static inline uint64_t lat_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Find the histogram bucket of a latency
+ *
+ * @param v latency in ticks
+ * @returns bucket index, values too large land in the last bucket
+ */
+static inline int lat_bucket(uint64_t v)
+{
+	int msb, shift;
+
+	if (v < (1u << LAT_SUB_BITS))
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	if (msb >= LAT_MAX_BITS)
+		return LAT_BUCKETS - 1;
+	shift = msb - LAT_SUB_BITS;
+	return ((shift + 1) << LAT_SUB_BITS) +
+		(int)((v >> shift) - (1u << LAT_SUB_BITS));
+}
+
+/* Add the packet just handled to this thread's histograms */
+static inline void lat_record(void)
+{
+	struct lat_worker *w = &lat_workers[worker_id];
+	uint64_t d;
+	int b;
+
+	if (!lat_pkt.end || lat_pkt.path < 0)
+		return;
+	d = lat_pkt.end - lat_pkt.start;
+	b = lat_bucket(d);
+	w->count[lat_pkt.path][b]++;
+	w->sum[lat_pkt.path] += d;
+	if (lat_pkt.cache >= 0) {
+		w->count[lat_pkt.cache][b]++;
+		w->sum[lat_pkt.cache] += d;
+	}
+}
+
+#define LAT_BEGIN() do { \
+	lat_pkt.start = lat_now(); \
+	lat_pkt.end = 0; \
+	lat_pkt.path = -1; \
+	lat_pkt.cache = -1; \
+} while (0)
+#define LAT_PATH(p)	(lat_pkt.path = (p))
+/* A packet counts as a cache miss if any of its lookups missed */
+#define LAT_CACHE(hit)	(lat_pkt.cache = (hit) && \
+		lat_pkt.cache != LAT_CACHE_MISS ? LAT_CACHE_HIT : LAT_CACHE_MISS)
+#define LAT_END()	(lat_pkt.end = lat_now())
+#define LAT_FINISH()	lat_record()
+
+void lat_init(void);
+uint64_t lat_bucket_value(int b);
+void lat_read(int hist, uint64_t *count, uint64_t *sum);
+double lat_quantile(const uint64_t *count, double q);
+void lat_reset(void);
+void lat_dump(void);
+#else
+#define LAT_BEGIN()	do { } while (0)
+#define LAT_PATH(p)	do { } while (0)
+#define LAT_CACHE(hit)	do { } while (0)
+#define LAT_END()	do { } while (0)
+#define LAT_FINISH()	do { } while (0)
+#endif
+
+/* lockstat.c */
+#ifdef WITH_LOCK_STATS
+/// Lock statistics for one call site, registered on first use
+struct lock_site {
+	const char *func;
+	int line;
+	int registered;
+	pthread_mutex_t *mutex;
+	uint64_t acquired;
+	uint64_t contended;
+	uint64_t wait_ns;
+	uint64_t hold_ns;
+	uint64_t max_hold_ns;
+	struct lock_site *next;
+};
+
+void lock_site_lock(struct lock_site *site, pthread_mutex_t *m);
+void lock_site_unlock(pthread_mutex_t *m);
+const char *lock_name(const pthread_mutex_t *m);
+struct lock_site *lock_sites(void);
+void lockstat_reset(void);
+void lockstat_dump(void);
+
+/* Each LOCK() expansion owns its own static lock_site, shared by every
+ * mutex taken there */
+#define LOCK(m) do { \
+	static struct lock_site lock_site_ = { \
+		.func = __func__, .line = __LINE__ }; \
+	lock_site_lock(&lock_site_, (m)); \
+} while (0)
+#define UNLOCK(m)	lock_site_unlock(m)
+#else
+#define LOCK(m)		pthread_mutex_lock(m)
+#define UNLOCK(m)	pthread_mutex_unlock(m)
+#endif
+
+/* pmtu.c */
+uint32_t pmtu_get(const struct in6_addr *addr);
+void pmtu_set(const struct in6_addr *addr, uint32_t mtu);
+
+/* ratelimit.c */
+int icmp_ratelimit4(enum rl_class cls, const struct in_addr *dest);
+int icmp_ratelimit6(enum rl_class cls, const struct in6_addr *dest);
+
 /* tun.c */
 int tun_setup(int do_mktun, int do_rmtun);
 int set_nonblock(int fd);
 void tun_read(uint8_t * recv_buf,int tun_fd);
+int tun_write(const struct iovec *iov, int iovcnt);
+int tun_write_batch(const struct iovec *iov, int iovcnt, int count);
 
 
 #endif /* #ifndef __TAYGA_H__ */
\ No newline at end of file
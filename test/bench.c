@@ -0,0 +1,175 @@
+/*
+ *  bench.c - general utilities for benchmarks
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include "test/bench.h"
+
+/* Global vars */
+time_t now;
+int bench_verbose = 0;
+
+/* Configuration errors always go to stderr, the rest only if verbose */
+void slog_impl(int priority, const char *file, const char *line, const char *func, const char *format, ...)
+{
+    va_list ap;
+
+    (void)file;
+    (void)line;
+    (void)func;
+    if(priority > LOG_ERR && !bench_verbose) return;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+}
+
+uint64_t bench_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t bench_rand(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+int bench_parse_threads(const char *arg, int *threads, int max) {
+    int n = 0, lo, hi;
+    char *end;
+
+    while(*arg) {
+        lo = hi = strtol(arg, &end, 10);
+        if(end == arg) return -1;
+        if(*end == '-') {
+            arg = end + 1;
+            hi = strtol(arg, &end, 10);
+            if(end == arg) return -1;
+        }
+        if(lo < 1 || hi < lo) return -1;
+        for(int t = lo; t <= hi; t++) {
+            if(n == max) return -1;
+            threads[n++] = t;
+        }
+        arg = end;
+        if(*arg == ',') arg++;
+        else if(*arg) return -1;
+    }
+    return n;
+}
+
+struct bench_thread {
+    pthread_t tid;
+    int index;
+    void (*fn)(void *arg, int index);
+    void *arg;
+    pthread_barrier_t *start;
+};
+
+static void *bench_thread_main(void *p) {
+    struct bench_thread *t = p;
+
+    pthread_barrier_wait(t->start);
+    t->fn(t->arg, t->index);
+    return NULL;
+}
+
+uint64_t bench_run_threads(int n, void (*fn)(void *arg, int index), void *arg) {
+    struct bench_thread *t = calloc(n, sizeof(*t));
+    pthread_barrier_t start;
+    uint64_t t0;
+
+    if(!t) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    pthread_barrier_init(&start, NULL, n + 1);
+    for(int i = 0; i < n; i++) {
+        t[i].index = i;
+        t[i].fn = fn;
+        t[i].arg = arg;
+        t[i].start = &start;
+        if(pthread_create(&t[i].tid, NULL, bench_thread_main, &t[i])) {
+            fprintf(stderr, "unable to create thread %d\n", i);
+            exit(1);
+        }
+    }
+    t0 = bench_ns();
+    pthread_barrier_wait(&start);
+    for(int i = 0; i < n; i++)
+        pthread_join(t[i].tid, NULL);
+    t0 = bench_ns() - t0;
+    pthread_barrier_destroy(&start);
+    free(t);
+    return t0;
+}
+
+/* JSON writer state: whether a comma is needed before the next item */
+static int json_runs, json_fields;
+
+void bench_json_begin(const char *name) {
+    printf("{\n  \"benchmark\": \"%s\",\n  \"runs\": [", name);
+    json_runs = 0;
+}
+
+void bench_json_run_begin(void) {
+    printf("%s\n    {", json_runs++ ? "," : "");
+    json_fields = 0;
+}
+
+static void json_key(const char *key) {
+    printf("%s\"%s\": ", json_fields++ ? ", " : "", key);
+}
+
+void bench_json_str(const char *key, const char *value) {
+    json_key(key);
+    putchar('"');
+    for(; *value; value++) {
+        if(*value == '"' || *value == '\\') putchar('\\');
+        if((unsigned char)*value < 0x20) printf("\\u%04x", *value);
+        else putchar(*value);
+    }
+    putchar('"');
+}
+
+void bench_json_u64(const char *key, uint64_t value) {
+    json_key(key);
+    printf("%llu", (unsigned long long)value);
+}
+
+void bench_json_double(const char *key, double value) {
+    json_key(key);
+    printf("%.6g", value);
+}
+
+void bench_json_run_end(void) {
+    printf("}");
+    fflush(stdout);
+}
+
+void bench_json_end(void) {
+    printf("\n  ]\n}\n");
+}
@@ -0,0 +1,39 @@
+/*
+ *  bench.h - general utilities for benchmarks
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+#include <stdint.h>
+
+/* Print slog messages below LOG_ERR as well */
+extern int bench_verbose;
+
+void slog_impl(int priority, const char *file, const char *line, const char *func, const char *format, ...);
+/* Monotonic time in nanoseconds */
+uint64_t bench_ns(void);
+/* Deterministic pseudo-random numbers (xorshift64) */
+uint64_t bench_rand(uint64_t *state);
+/* Parse a list of thread counts such as "1,2,4" or "1-8" */
+int bench_parse_threads(const char *arg, int *threads, int max);
+/* Run fn(arg, index) on n threads, released together, and return the
+ * elapsed time in nanoseconds from release to the last thread finishing */
+uint64_t bench_run_threads(int n, void (*fn)(void *arg, int index), void *arg);
+/* JSON output: one object per run inside a top-level array */
+void bench_json_begin(const char *name);
+void bench_json_run_begin(void);
+void bench_json_str(const char *key, const char *value);
+void bench_json_u64(const char *key, uint64_t value);
+void bench_json_double(const char *key, double value);
+void bench_json_run_end(void);
+void bench_json_end(void);
@@ -0,0 +1,558 @@
+/*
+ *  bench_addrmap.c - Address mapping microbenchmarks
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  Each map count gets a table of N static /32 <-> /128 maps behind an
+ *  RFC 6052 prefix, then every function is timed against it:
+ *    insert   - insert_map4/insert_map6 while building the table
+ *    reload   - addrmap_reload of an N line map-file, first and unchanged
+ *    lookup   - find_map4/6 and map_ip4_to_ip6/map_ip6_to_ip4 for each
+ *               cache size, hash size, key distribution, hit ratio and
+ *               thread count
+ *    maint    - addrmap_maint over a full cache, with and without expiry
+ */
+
+#include "test/bench.h"
+#include "tayga.h"
+#include <getopt.h>
+#include <math.h>
+
+/* Longest list accepted for any sweep option */
+#define MAX_LIST 16
+
+/* Lookup keys generated per thread */
+#define KEYS_PER_THREAD 16384
+
+/* Configuration shared by every table */
+static const char *bench_conf =
+    "tun-device bench0\n"
+    "ipv4-addr 192.168.255.1\n"
+    "prefix 2001:db8:64::/96\n";
+
+/* A lookup key, usable in either direction */
+struct key {
+    struct in_addr a4;
+    struct in6_addr a6;
+};
+
+/* Functions timed by the lookup suite */
+enum lookup_op { OP_MAP4TO6, OP_MAP6TO4, OP_FIND4, OP_FIND6, OP_MAX };
+static const char *op_names[OP_MAX] = {
+    "map_ip4_to_ip6", "map_ip6_to_ip4", "find_map4", "find_map6"
+};
+
+/* Parameters of one timed lookup run */
+struct lookup_job {
+    enum lookup_op op;
+    struct key *keys[MAX_WORKERS];
+    uint64_t duration;
+    uint64_t ops[MAX_WORKERS];
+};
+
+/* Sweep settings */
+static int n_maps = 4, n_cache = 2, n_hash = 2, n_dist = 2, n_hit = 2, n_threads = 2;
+static int maps_list[MAX_LIST] = { 1, 100, 1000, 10000 };
+static int cache_list[MAX_LIST] = { 0, 8192 };
+static int hash_list[MAX_LIST] = { 7, 12 };
+static double zipf_list[MAX_LIST] = { 0.0, 1.0 };   /* 0 means uniform */
+static double hit_list[MAX_LIST] = { 1.0, 0.5 };
+static int threads_list[MAX_LIST] = { 1, 2 };
+static uint64_t duration_ns = 30000000;
+static uint64_t budget_ns = 10000000000ull;
+
+static void map_key(struct key *k, uint32_t i) {
+    k->a4.s_addr = htonl(0x0a000000 + i);               /* 10.0.0.0 + i */
+    inet_pton(AF_INET6, "2001:db8:1::", &k->a6);
+    k->a6.s6_addr32[3] = htonl(i);
+}
+
+/* A key matched by no static map: the IPv4 side falls through to the
+ * RFC 6052 prefix, the IPv6 side is rejected */
+static void miss_key(struct key *k, uint64_t r) {
+    k->a4.s_addr = htonl(0xc6336400 + (r & 0x3ff));     /* 198.51.100.0/22 */
+    inet_pton(AF_INET6, "2001:db8:ffff::", &k->a6);
+    k->a6.s6_addr32[3] = r;
+}
+
+static void *xmalloc(size_t len) {
+    void *p = malloc(len);
+
+    if(!p) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void new_config(void) {
+    char tmp[] = "/tmp/tayga-bench-XXXXXX";
+    int fd = mkstemp(tmp);
+
+    if(fd < 0 || write(fd, bench_conf, strlen(bench_conf)) < 0) {
+        fprintf(stderr, "unable to write %s\n", tmp);
+        exit(1);
+    }
+    close(fd);
+    config_init();
+    if(config_read(tmp) < 0 || config_validate() < 0) {
+        fprintf(stderr, "unable to load configuration\n");
+        exit(1);
+    }
+    unlink(tmp);
+    for(int i = 0; i < 8; i++) gcfg.rand[i] = 0x9e3779b9 * (i + 1);
+    gcfg.rand[0] |= 1;
+    pthread_mutex_init(&gcfg.cache_mutex, NULL);
+    pthread_mutex_init(&gcfg.map_mutex, NULL);
+}
+
+/* Replace the address cache with an empty one of the given geometry */
+static void reset_cache(int size, int hash_bits) {
+    struct list_head *entry, *next;
+    struct cache_entry *c;
+
+    list_for_each_safe(entry, next, &gcfg.cache_active) {
+        c = list_entry(entry, struct cache_entry, list);
+        list_del(&c->hash4);
+        list_del(&c->hash6);
+        list_add(&c->list, &gcfg.cache_pool);
+    }
+    if(size != gcfg.cache_size) {
+        /* The old entries are one allocation we no longer know the
+         * start of, so they are simply dropped */
+        INIT_LIST_HEAD(&gcfg.cache_pool);
+        INIT_LIST_HEAD(&gcfg.cache_active);
+    }
+    gcfg.cache_size = size;
+    gcfg.hash_bits = hash_bits;
+    if(size) create_cache();
+}
+
+static struct map_static *alloc_map(uint32_t i) {
+    struct map_static *m = xmalloc(sizeof(*m));
+    struct key k;
+
+    memset(m, 0, sizeof(*m));
+    map_key(&k, i);
+    m->map4.type = MAP_TYPE_STATIC;
+    m->map4.prefix_len = 32;
+    m->map4.addr = k.a4;
+    calc_ip4_mask(&m->map4.mask, NULL, 32);
+    INIT_LIST_HEAD(&m->map4.list);
+    m->map6.type = MAP_TYPE_STATIC;
+    m->map6.prefix_len = 128;
+    m->map6.addr = k.a6;
+    calc_ip6_mask(&m->map6.mask, NULL, 128);
+    INIT_LIST_HEAD(&m->map6.list);
+    m->origin = MAP_ORIGIN_CONFFILE;
+    return m;
+}
+
+static void report_op(const char *suite, const char *op, int maps,
+        uint64_t ops, uint64_t ns) {
+    bench_json_run_begin();
+    bench_json_str("suite", suite);
+    bench_json_str("op", op);
+    bench_json_u64("maps", maps);
+    bench_json_u64("ops", ops);
+    bench_json_double("seconds", ns / 1e9);
+    bench_json_double("ns_per_op", ops ? (double)ns / ops : 0.0);
+    bench_json_run_end();
+}
+
+static void report_timeout(const char *suite, int maps, int done) {
+    bench_json_run_begin();
+    bench_json_str("suite", suite);
+    bench_json_u64("maps", maps);
+    bench_json_str("status", "timeout");
+    bench_json_u64("completed", done);
+    bench_json_double("budget_seconds", budget_ns / 1e9);
+    bench_json_run_end();
+}
+
+/*
+ * insert suite: build the table, timing each half separately.
+ * Returns the number of maps inserted, which is short of n if the
+ * time budget ran out.
+ */
+static int suite_insert(int n) {
+    struct map_static **m = xmalloc(n * sizeof(*m));
+    uint64_t t4 = 0, t6 = 0, t;
+    int i, done = 0;
+
+    for(i = 0; i < n; i++) m[i] = alloc_map(i);
+    /* Insert in blocks so a slow table cannot blow the budget by much */
+    for(i = 0; i < n; i += 1024) {
+        int end = i + 1024 < n ? i + 1024 : n;
+
+        t = bench_ns();
+        for(int j = i; j < end; j++)
+            if(insert_map4(&m[j]->map4, NULL) < 0) abort();
+        t4 += bench_ns() - t;
+        t = bench_ns();
+        for(int j = i; j < end; j++)
+            if(insert_map6(&m[j]->map6, NULL) < 0) abort();
+        t6 += bench_ns() - t;
+        done = end;
+        if(t4 + t6 > budget_ns) break;
+    }
+    free(m);
+    if(done < n) {
+        report_timeout("insert", n, done);
+        return done;
+    }
+    report_op("insert", "insert_map4", n, n, t4);
+    report_op("insert", "insert_map6", n, n, t6);
+    return n;
+}
+
+/* reload suite: load an n line map-file, then reload it unchanged */
+static void suite_reload(int n) {
+    char tmp[] = "/tmp/tayga-bench-map-XXXXXX";
+    char a4[INET_ADDRSTRLEN], a6[INET6_ADDRSTRLEN];
+    int fd = mkstemp(tmp);
+    FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+    uint64_t t;
+    struct key k;
+
+    if(!f) {
+        fprintf(stderr, "unable to write %s\n", tmp);
+        exit(1);
+    }
+    for(int i = 0; i < n; i++) {
+        map_key(&k, i);
+        inet_ntop(AF_INET, &k.a4, a4, sizeof(a4));
+        inet_ntop(AF_INET6, &k.a6, a6, sizeof(a6));
+        fprintf(f, "map %s %s\n", a4, a6);
+    }
+    fclose(f);
+
+    new_config();
+    strcpy(gcfg.map_file, tmp);
+    t = bench_ns();
+    addrmap_reload();
+    report_op("reload", "addrmap_reload_initial", n, n, bench_ns() - t);
+    t = bench_ns();
+    addrmap_reload();
+    report_op("reload", "addrmap_reload_unchanged", n, n, bench_ns() - t);
+    unlink(tmp);
+}
+
+/* Zipf sampling by inverse CDF over n ranks */
+static double *zipf_cdf(int n, double s) {
+    double *cdf = xmalloc(n * sizeof(*cdf)), sum = 0;
+
+    for(int i = 0; i < n; i++) cdf[i] = sum += 1.0 / pow(i + 1, s);
+    for(int i = 0; i < n; i++) cdf[i] /= sum;
+    return cdf;
+}
+
+static int zipf_sample(const double *cdf, int n, double u) {
+    int lo = 0, hi = n - 1;
+
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Generate lookup keys over n maps, popular ranks scattered over the table
+ * so the most used maps are not simply the first ones in the list */
+static void make_keys(struct key *keys, int n, double zipf, double hit,
+        const double *cdf, const uint32_t *perm, uint64_t seed) {
+    uint64_t rs = seed | 1;
+
+    for(int i = 0; i < KEYS_PER_THREAD; i++) {
+        uint64_t r = bench_rand(&rs);
+        double u = (r >> 11) * (1.0 / 9007199254740992.0);
+
+        if(u >= hit) {
+            miss_key(&keys[i], bench_rand(&rs));
+        } else if(zipf > 0) {
+            u = (bench_rand(&rs) >> 11) * (1.0 / 9007199254740992.0);
+            map_key(&keys[i], perm[zipf_sample(cdf, n, u)]);
+        } else {
+            map_key(&keys[i], perm[bench_rand(&rs) % n]);
+        }
+    }
+}
+
+static uint64_t do_lookups(enum lookup_op op, const struct key *keys,
+        uint64_t start, uint64_t count) {
+    struct in6_addr a6;
+    struct in_addr a4;
+    uint64_t found = 0;
+
+    for(uint64_t i = start; i < start + count; i++) {
+        const struct key *k = &keys[i % KEYS_PER_THREAD];
+
+        switch(op) {
+        case OP_MAP4TO6: found += !map_ip4_to_ip6(&a6, &k->a4); break;
+        case OP_MAP6TO4: found += !map_ip6_to_ip4(&a4, &k->a6, 0); break;
+        case OP_FIND4: found += !!find_map4(&k->a4); break;
+        case OP_FIND6: found += !!find_map6(&k->a6); break;
+        default: break;
+        }
+    }
+    return found;
+}
+
+static void lookup_thread(void *arg, int index) {
+    struct lookup_job *job = arg;
+    uint64_t deadline = bench_ns() + job->duration, ops = 0;
+    volatile uint64_t sink;
+
+    worker_id = index + 1;
+    /* Check the clock every 256 lookups */
+    while(bench_ns() < deadline) {
+        sink = do_lookups(job->op, job->keys[index], ops, 256);
+        (void)sink;
+        ops += 256;
+    }
+    job->ops[index] = ops;
+}
+
+static void run_lookup(struct lookup_job *job, int maps, int threads,
+        double zipf, double hit) {
+    struct stats_counters c;
+    uint64_t ops = 0, ns;
+
+    /* Untimed pass to reach the steady state of the cache */
+    worker_id = 0;
+    for(int t = 0; t < threads; t++)
+        do_lookups(job->op, job->keys[t], 0, KEYS_PER_THREAD);
+    stats_reset();
+
+    ns = bench_run_threads(threads, lookup_thread, job);
+    for(int t = 0; t < threads; t++) ops += job->ops[t];
+    stats_read(&c);
+
+    bench_json_run_begin();
+    bench_json_str("suite", "lookup");
+    bench_json_str("op", op_names[job->op]);
+    bench_json_u64("maps", maps);
+    bench_json_u64("cache_size", gcfg.cache_size);
+    bench_json_u64("hash_bits", gcfg.cache_size ? gcfg.hash_bits : 0);
+    bench_json_str("dist", zipf > 0 ? "zipf" : "uniform");
+    if(zipf > 0) bench_json_double("zipf_s", zipf);
+    bench_json_double("hit_ratio", hit);
+    bench_json_u64("threads", threads);
+    bench_json_u64("ops", ops);
+    bench_json_double("seconds", ns / 1e9);
+    bench_json_double("mops", ops / (ns / 1e3));
+    bench_json_double("ns_per_op", (double)ns * threads / ops);
+    if(job->op == OP_MAP4TO6 || job->op == OP_MAP6TO4)
+        bench_json_double("cache_hit_ratio", c.cache_hit + c.cache_miss ?
+                (double)c.cache_hit / (c.cache_hit + c.cache_miss) : 0.0);
+    bench_json_run_end();
+}
+
+/* lookup suite over every combination of the sweep settings */
+static void suite_lookup(int n) {
+    struct lookup_job job;
+    uint32_t *perm = xmalloc(n * sizeof(*perm));
+    uint64_t rs = 0x5eed;
+    double *cdf;
+
+    for(int i = 0; i < n; i++) perm[i] = i;
+    for(int i = n - 1; i > 0; i--) {
+        int j = bench_rand(&rs) % (i + 1);
+        uint32_t t = perm[i];
+        perm[i] = perm[j];
+        perm[j] = t;
+    }
+    for(int t = 0; t < MAX_WORKERS; t++) job.keys[t] = NULL;
+    job.duration = duration_ns;
+
+    for(int d = 0; d < n_dist; d++) {
+        cdf = zipf_list[d] > 0 ? zipf_cdf(n, zipf_list[d]) : NULL;
+        for(int h = 0; h < n_hit; h++) {
+            int max_threads = 0;
+
+            for(int t = 0; t < n_threads; t++)
+                if(threads_list[t] > max_threads) max_threads = threads_list[t];
+            for(int t = 0; t < max_threads; t++) {
+                if(!job.keys[t])
+                    job.keys[t] = xmalloc(KEYS_PER_THREAD * sizeof(struct key));
+                make_keys(job.keys[t], n, zipf_list[d], hit_list[h], cdf, perm,
+                        0x1234567 * (t + 1));
+            }
+
+            /* find_map* do not touch the cache */
+            for(job.op = OP_FIND4; job.op <= OP_FIND6; job.op++)
+                for(int t = 0; t < n_threads; t++)
+                    run_lookup(&job, n, threads_list[t], zipf_list[d],
+                            hit_list[h]);
+
+            for(int c = 0; c < n_cache; c++) {
+                for(int b = 0; b < n_hash; b++) {
+                    /* Hash size means nothing without a cache */
+                    if(!cache_list[c] && b) break;
+                    for(job.op = OP_MAP4TO6; job.op <= OP_MAP6TO4; job.op++) {
+                        for(int t = 0; t < n_threads; t++) {
+                            reset_cache(cache_list[c], hash_list[b]);
+                            run_lookup(&job, n, threads_list[t],
+                                    zipf_list[d], hit_list[h]);
+                        }
+                    }
+                }
+            }
+        }
+        free(cdf);
+    }
+    for(int t = 0; t < MAX_WORKERS; t++) free(job.keys[t]);
+    free(perm);
+}
+
+/* maint suite: addrmap_maint over a full cache */
+static void suite_maint(int n) {
+    struct in6_addr a6;
+    struct key k;
+    time_t saved = now;
+    uint64_t t;
+    int entries;
+
+    for(int c = 0; c < n_cache; c++) {
+        if(!cache_list[c]) continue;
+        reset_cache(cache_list[c], hash_list[0]);
+        entries = n < cache_list[c] ? n : cache_list[c];
+        for(int i = 0; i < entries; i++) {
+            map_key(&k, i);
+            map_ip4_to_ip6(&a6, &k.a4);
+        }
+        t = bench_ns();
+        addrmap_maint();
+        t = bench_ns() - t;
+        bench_json_run_begin();
+        bench_json_str("suite", "maint");
+        bench_json_str("op", "addrmap_maint_scan");
+        bench_json_u64("maps", n);
+        bench_json_u64("cache_size", cache_list[c]);
+        bench_json_u64("entries", entries);
+        bench_json_double("ns_per_entry", (double)t / entries);
+        bench_json_run_end();
+
+        now += CACHE_MAX_AGE + 1;
+        t = bench_ns();
+        addrmap_maint();
+        t = bench_ns() - t;
+        now = saved;
+        bench_json_run_begin();
+        bench_json_str("suite", "maint");
+        bench_json_str("op", "addrmap_maint_expire");
+        bench_json_u64("maps", n);
+        bench_json_u64("cache_size", cache_list[c]);
+        bench_json_u64("entries", entries);
+        bench_json_double("ns_per_entry", (double)t / entries);
+        bench_json_run_end();
+    }
+}
+
+static int parse_ints(const char *arg, int *list) {
+    int n = 0;
+    char *end;
+
+    while(*arg && n < MAX_LIST) {
+        list[n++] = strtol(arg, &end, 10);
+        if(end == arg || list[n - 1] < 0) return -1;
+        arg = *end == ',' ? end + 1 : end;
+        if(*end && *end != ',') return -1;
+    }
+    return *arg ? -1 : n;
+}
+
+static int parse_doubles(const char *arg, double *list) {
+    int n = 0;
+    char *end;
+
+    while(*arg && n < MAX_LIST) {
+        if(!strncmp(arg, "uniform", 7)) {
+            list[n++] = 0;
+            end = (char *)arg + 7;
+        } else if(!strncmp(arg, "zipf", 4)) {
+            list[n++] = arg[4] == ':' ? strtod(arg + 5, &end) : 1.0;
+            if(arg[4] != ':') end = (char *)arg + 4;
+        } else {
+            list[n++] = strtod(arg, &end);
+            if(end == arg) return -1;
+        }
+        if(*end && *end != ',') return -1;
+        arg = *end ? end + 1 : end;
+    }
+    return *arg ? -1 : n;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -m LIST    map counts (default 1,100,1000,10000, up to 1000000)\n"
+        "  -c LIST    cache sizes, 0 for no cache (default 0,8192)\n"
+        "  -b LIST    cache hash bits (default 7,12)\n"
+        "  -d LIST    key distributions: uniform, zipf or zipf:S\n"
+        "             (default uniform,zipf)\n"
+        "  -r LIST    fraction of lookups for mapped addresses (default 1,0.5)\n"
+        "  -t LIST    thread counts (default 1,2)\n"
+        "  -D MS      duration of each lookup run (default 30)\n"
+        "  -T SEC     give up building a table after this long (default 10)\n"
+        "  -s LIST    suites: insert,reload,lookup,maint (default all)\n"
+        "  -v         show log messages\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *suites = "insert,reload,lookup,maint";
+    int opt, built;
+
+    while((opt = getopt(argc, argv, "m:c:b:d:r:t:D:T:s:v")) != -1) {
+        switch(opt) {
+        case 'm': n_maps = parse_ints(optarg, maps_list); break;
+        case 'c': n_cache = parse_ints(optarg, cache_list); break;
+        case 'b': n_hash = parse_ints(optarg, hash_list); break;
+        case 'd': n_dist = parse_doubles(optarg, zipf_list); break;
+        case 'r': n_hit = parse_doubles(optarg, hit_list); break;
+        case 't': n_threads = bench_parse_threads(optarg, threads_list, MAX_LIST); break;
+        case 'D': duration_ns = strtoull(optarg, NULL, 10) * 1000000; break;
+        case 'T': budget_ns = strtoull(optarg, NULL, 10) * 1000000000ull; break;
+        case 's': suites = optarg; break;
+        case 'v': bench_verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind != argc || n_maps < 1 || n_cache < 1 || n_hash < 1 ||
+            n_dist < 1 || n_hit < 1 || n_threads < 1 || !duration_ns)
+        usage(argv[0]);
+    for(int i = 0; i < n_maps; i++)
+        if(maps_list[i] < 1 || maps_list[i] > 1000000) usage(argv[0]);
+    for(int i = 0; i < n_hash; i++)
+        if(hash_list[i] < 1 || hash_list[i] > 24) usage(argv[0]);
+    for(int i = 0; i < n_threads; i++)
+        if(threads_list[i] > MAX_WORKERS) usage(argv[0]);
+    time(&now);
+
+    bench_json_begin("addrmap");
+    for(int m = 0; m < n_maps; m++) {
+        int n = maps_list[m];
+
+        if(strstr(suites, "reload")) suite_reload(n);
+        new_config();
+        built = suite_insert(n);
+        if(built < n) continue;
+        if(strstr(suites, "lookup")) suite_lookup(n);
+        if(strstr(suites, "maint")) suite_maint(n);
+    }
+    bench_json_end();
+    return 0;
+}
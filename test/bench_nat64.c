@@ -0,0 +1,668 @@
+/*
+ *  bench_nat64.c - Offline translation benchmark
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  Packets are handed straight to handle_ip4/handle_ip6 and whatever the
+ *  translator writes is counted (or captured) by the tun_write stubs
+ *  below, so no tun device, netns or root is needed.
+ */
+
+#include "test/bench.h"
+#include "tayga.h"
+#include <getopt.h>
+
+/* Largest thread list accepted by -t */
+#define MAX_RUNS 64
+
+/* Number of packets made by the synthetic generator */
+#define SYNTH_PKTS 4096
+
+/* Distinct IPv6 clients and IPv4 servers in the synthetic traffic */
+#define SYNTH_CLIENTS 200
+#define SYNTH_SERVERS 250
+
+/* Link types understood when reading pcap files */
+#define LINKTYPE_ETHERNET	1
+#define LINKTYPE_RAW		101
+#define LINKTYPE_LINUX_SLL	113
+#define LINKTYPE_IPV4		228
+#define LINKTYPE_IPV6		229
+
+/* Built-in configurations, matching the addresses used by synth_*() */
+static const struct {
+    const char *name;
+    const char *conf;
+} bench_configs[] = {
+    { "rfc6052",
+        "tun-device bench0\n"
+        "ipv4-addr 192.168.255.1\n"
+        "prefix 2001:db8:64::/96\n" },
+    { "eam",
+        "tun-device bench0\n"
+        "ipv4-addr 192.168.255.1\n"
+        "prefix 2001:db8:64::/96\n"
+        "map 192.0.2.0/24 2001:db8:1::/120\n" },
+    { "dynamic",
+        "tun-device bench0\n"
+        "ipv4-addr 192.168.255.1\n"
+        "prefix 2001:db8:64::/96\n"
+        "dynamic-pool 192.0.2.0/24\n" },
+};
+#define NUM_CONFIGS (int)(sizeof(bench_configs) / sizeof(bench_configs[0]))
+
+/* A set of input packets, stored back to back */
+struct bench_pkt {
+    uint32_t off;
+    uint32_t len;
+    int family;
+};
+
+struct pktset {
+    uint8_t *buf;
+    size_t buf_len, buf_size;
+    struct bench_pkt *pkts;
+    int count, size;
+};
+
+/* Output of the tun_write stubs, per thread */
+static _Thread_local uint64_t tx_pkts, tx_bytes;
+static uint64_t tx_total_pkts, tx_total_bytes;
+static pthread_mutex_t tx_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Translated packets are written here during the first pass with -w */
+static FILE *capture;
+
+/* Parameters of one timed run */
+struct bench_job {
+    const struct pktset *set;
+    uint64_t per_thread;
+};
+
+/*
+ * Stubs for tun.c and log.c
+ */
+static void capture_pkt(const struct iovec *iov, int iovcnt, uint32_t len) {
+    uint32_t hdr[4];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr[0] = ts.tv_sec;
+    hdr[1] = ts.tv_nsec / 1000;
+    hdr[2] = hdr[3] = len;
+    fwrite(hdr, sizeof(hdr), 1, capture);
+    /* Skip the tun_pi header at the start of the first iovec */
+    fwrite((uint8_t *)iov[0].iov_base + sizeof(struct tun_pi),
+            iov[0].iov_len - sizeof(struct tun_pi), 1, capture);
+    for(int i = 1; i < iovcnt; i++)
+        fwrite(iov[i].iov_base, iov[i].iov_len, 1, capture);
+}
+
+static void count_tx(const struct iovec *iov, int iovcnt) {
+    uint32_t len = 0;
+
+    for(int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+    len -= sizeof(struct tun_pi);
+    tx_pkts++;
+    tx_bytes += len;
+    if(capture) capture_pkt(iov, iovcnt, len);
+}
+
+int tun_write(const struct iovec *iov, int iovcnt) {
+    count_tx(iov, iovcnt);
+    return ERROR_NONE;
+}
+
+int tun_write_batch(const struct iovec *iov, int iovcnt, int count) {
+    for(int i = 0; i < count; i++)
+        count_tx(&iov[i * iovcnt], iovcnt);
+    return count;
+}
+
+void pktlog(int type, int err, const struct pkt *p, int reason, int arg) {
+    (void)type;
+    (void)err;
+    (void)p;
+    (void)reason;
+    (void)arg;
+}
+
+/*
+ * Packet sets
+ */
+static uint8_t *pktset_add(struct pktset *s, uint32_t len, int family) {
+    if(s->count == s->size) {
+        s->size = s->size ? s->size * 2 : 1024;
+        s->pkts = realloc(s->pkts, s->size * sizeof(*s->pkts));
+    }
+    /* Keep every packet 8-byte aligned, like the tun receive buffer */
+    while(s->buf_len + len + 8 > s->buf_size) {
+        s->buf_size = s->buf_size ? s->buf_size * 2 : 1 << 20;
+        s->buf = realloc(s->buf, s->buf_size);
+    }
+    if(!s->pkts || !s->buf) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    s->pkts[s->count].off = s->buf_len;
+    s->pkts[s->count].len = len;
+    s->pkts[s->count].family = family;
+    s->count++;
+    s->buf_len = (s->buf_len + len + 7) & ~(size_t)7;
+    return s->buf + s->pkts[s->count - 1].off;
+}
+
+/*
+ * Synthetic traffic
+ */
+static uint32_t csum_add(uint32_t sum, const void *data, uint32_t len) {
+    const uint8_t *b = data;
+
+    for(; len > 1; b += 2, len -= 2) sum += (b[0] << 8) | b[1];
+    if(len) sum += b[0] << 8;
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum) {
+    while(sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return htons(~sum & 0xffff);
+}
+
+static void client_addr4(struct in_addr *a, int c) {
+    a->s_addr = htonl(0xc0000201 + c);                 /* 192.0.2.1 + c */
+}
+
+static void server_addr4(struct in_addr *a, int s) {
+    a->s_addr = htonl(0xc6336401 + s);                 /* 198.51.100.1 + s */
+}
+
+static void client_addr6(struct in6_addr *a, int c, int mode) {
+    struct in_addr a4;
+
+    inet_pton(AF_INET6, "2001:db8:1::", a);
+    if(mode == 0) {
+        /* rfc6052 only: clients are translatable too */
+        inet_pton(AF_INET6, "2001:db8:64::", a);
+        client_addr4(&a4, c);
+        a->s6_addr32[3] = a4.s_addr;
+    } else {
+        a->s6_addr32[3] = htonl(1 + c);
+    }
+}
+
+static void server_addr6(struct in6_addr *a, int s) {
+    struct in_addr a4;
+
+    inet_pton(AF_INET6, "2001:db8:64::", a);
+    server_addr4(&a4, s);
+    a->s6_addr32[3] = a4.s_addr;
+}
+
+/* Fill in a TCP, UDP or ICMP header and payload of len bytes at l4 */
+static void synth_l4(uint8_t *l4, uint32_t len, int proto, uint32_t pseudo,
+        uint64_t *rs) {
+    for(uint32_t i = 0; i < len; i++) l4[i] = bench_rand(rs);
+    switch(proto) {
+    case 6:
+        l4[12] = 0x50;          /* data offset 5 */
+        l4[13] = 0x10;          /* ACK */
+        l4[16] = l4[17] = 0;
+        *(uint16_t *)(l4 + 16) = csum_fold(csum_add(pseudo, l4, len));
+        break;
+    case 17:
+        *(uint16_t *)(l4 + 4) = htons(len);
+        l4[6] = l4[7] = 0;
+        *(uint16_t *)(l4 + 6) = csum_fold(csum_add(pseudo, l4, len));
+        if(!*(uint16_t *)(l4 + 6)) *(uint16_t *)(l4 + 6) = 0xffff;
+        break;
+    case 1:
+    case 58:
+        l4[0] = proto == 1 ? 8 : 128;  /* echo request */
+        l4[1] = 0;
+        l4[2] = l4[3] = 0;
+        *(uint16_t *)(l4 + 2) = csum_fold(csum_add(pseudo, l4, len));
+        break;
+    }
+}
+
+static uint8_t *synth_ip4(struct pktset *s, const struct in_addr *src,
+        const struct in_addr *dst, int proto, uint32_t len, int ttl,
+        uint16_t flags_offset, uint64_t *rs) {
+    uint8_t *b = pktset_add(s, sizeof(struct ip4) + len, 4);
+    struct ip4 *ip4 = (struct ip4 *)b;
+    uint32_t pseudo = 0;
+
+    memset(ip4, 0, sizeof(*ip4));
+    ip4->ver_ihl = 0x45;
+    ip4->length = htons(sizeof(*ip4) + len);
+    ip4->ident = bench_rand(rs);
+    ip4->flags_offset = htons(flags_offset);
+    ip4->ttl = ttl;
+    ip4->proto = proto;
+    ip4->src = *src;
+    ip4->dest = *dst;
+    ip4->cksum = csum_fold(csum_add(0, ip4, sizeof(*ip4)));
+    if(proto != 1) {
+        pseudo = csum_add(0, &ip4->src, 8);
+        pseudo += proto + len;
+    }
+    /* Only the first fragment carries a transport header */
+    if(flags_offset & IP4_F_MASK)
+        for(uint32_t i = 0; i < len; i++) b[sizeof(*ip4) + i] = i;
+    else
+        synth_l4(b + sizeof(*ip4), len, proto, pseudo, rs);
+    return b;
+}
+
+static uint8_t *synth_ip6(struct pktset *s, const struct in6_addr *src,
+        const struct in6_addr *dst, int proto, uint32_t len, int hops,
+        int frag, uint16_t offset_flags, uint64_t *rs) {
+    uint32_t hlen = sizeof(struct ip6) + (frag ? sizeof(struct ip6_frag) : 0);
+    uint8_t *b = pktset_add(s, hlen + len, 6);
+    struct ip6 *ip6 = (struct ip6 *)b;
+    struct ip6_frag *fh = (struct ip6_frag *)(b + sizeof(*ip6));
+    uint32_t pseudo;
+
+    memset(ip6, 0, sizeof(*ip6));
+    ip6->ver_tc_fl = htonl(0x60000000);
+    ip6->payload_length = htons(hlen - sizeof(*ip6) + len);
+    ip6->next_header = frag ? 44 : proto;
+    ip6->hop_limit = hops;
+    ip6->src = *src;
+    ip6->dest = *dst;
+    if(frag) {
+        fh->next_header = proto;
+        fh->reserved = 0;
+        fh->offset_flags = htons(offset_flags);
+        fh->ident = bench_rand(rs);
+    }
+    pseudo = csum_add(0, &ip6->src, 32) + proto + len;
+    if(offset_flags & IP6_F_MASK)
+        for(uint32_t i = 0; i < len; i++) b[hlen + i] = i;
+    else
+        synth_l4(b + hlen, len, proto, pseudo, rs);
+    return b;
+}
+
+/* An ICMP error from an IPv4 router about a packet the client sent */
+static void synth_icmp4_error(struct pktset *s, const struct in_addr *client,
+        const struct in_addr *server, uint64_t *rs) {
+    uint32_t len = sizeof(struct icmp) + sizeof(struct ip4) + 8;
+    struct in_addr router;
+    struct ip4 *inner;
+    uint8_t *b, *l4;
+
+    server_addr4(&router, SYNTH_SERVERS);
+    b = synth_ip4(s, &router, client, 1, len, 64, 0, rs);
+    l4 = b + sizeof(struct ip4);
+    memset(l4, 0, len);
+    l4[0] = 3;              /* destination unreachable */
+    l4[1] = 1;              /* host unreachable */
+    inner = (struct ip4 *)(l4 + sizeof(struct icmp));
+    inner->ver_ihl = 0x45;
+    inner->length = htons(sizeof(*inner) + 8);
+    inner->ttl = 1;
+    inner->proto = 17;
+    inner->src = *client;
+    inner->dest = *server;
+    inner->cksum = csum_fold(csum_add(0, inner, sizeof(*inner)));
+    *(uint16_t *)(l4 + 2) = csum_fold(csum_add(0, l4, len));
+}
+
+/**
+ * Generate a mix of traffic in both directions for built-in config mode:
+ * 35% TCP, 25% UDP, 10% ICMP echo, 15% fragments (including IPv4 packets
+ * too large for the IPv6 side) and 15% errors (expired TTL, unmapped
+ * destinations, bad checksums, ICMP errors from the network, DF set on
+ * a packet which must be fragmented).
+ */
+static void synth_traffic(struct pktset *s, int mode, uint64_t seed) {
+    static const uint32_t tcp_sizes[] = { 20, 20, 60, 556, 1220, 1420 };
+    uint64_t rs = seed;
+    struct in_addr c4, s4;
+    struct in6_addr c6, s6;
+    uint8_t *b;
+    int r, to6;
+
+    for(int i = 0; i < SYNTH_PKTS; i++) {
+        int c = bench_rand(&rs) % SYNTH_CLIENTS;
+        int srv = bench_rand(&rs) % SYNTH_SERVERS;
+
+        client_addr4(&c4, c);
+        client_addr6(&c6, c, mode);
+        server_addr4(&s4, srv);
+        server_addr6(&s6, srv);
+        r = bench_rand(&rs) % 100;
+        to6 = bench_rand(&rs) & 1;
+
+        if(r < 35) {
+            uint32_t len = tcp_sizes[bench_rand(&rs) % 6];
+            if(to6) synth_ip4(s, &s4, &c4, 6, len, 64, IP4_F_DF, &rs);
+            else synth_ip6(s, &c6, &s6, 6, len, 64, 0, 0, &rs);
+        } else if(r < 60) {
+            uint32_t len = 8 + bench_rand(&rs) % 1200;
+            if(to6) synth_ip4(s, &s4, &c4, 17, len, 64, 0, &rs);
+            else synth_ip6(s, &c6, &s6, 17, len, 64, 0, 0, &rs);
+        } else if(r < 70) {
+            if(to6) synth_ip4(s, &s4, &c4, 1, 64, 64, 0, &rs);
+            else synth_ip6(s, &c6, &s6, 58, 64, 64, 0, 0, &rs);
+        } else if(r < 75) {
+            /* Needs to be split into two IPv6 fragments */
+            synth_ip4(s, &s4, &c4, 17, 1480, 64, 0, &rs);
+        } else if(r < 80) {
+            /* IPv4 first or later fragment */
+            synth_ip4(s, &s4, &c4, 17, 520, 64,
+                    (to6 ? 0 : 65) | IP4_F_MF, &rs);
+        } else if(r < 85) {
+            /* IPv6 first or later fragment */
+            synth_ip6(s, &c6, &s6, 17, 520, 64, 1,
+                    (to6 ? 0 : 520) | IP6_F_MF, &rs);
+        } else if(r < 88) {
+            if(to6) synth_ip4(s, &s4, &c4, 17, 100, 1, 0, &rs);
+            else synth_ip6(s, &c6, &s6, 17, 100, 1, 0, 0, &rs);
+        } else if(r < 91) {
+            /* Destination outside every map */
+            inet_pton(AF_INET6, "2001:db8:ffff::1", &s6);
+            inet_pton(AF_INET, "203.0.113.1", &c4);
+            if(to6 && mode != 0) synth_ip4(s, &s4, &c4, 17, 100, 64, 0, &rs);
+            else synth_ip6(s, &c6, &s6, 17, 100, 64, 0, 0, &rs);
+        } else if(r < 94) {
+            b = synth_ip4(s, &s4, &c4, 17, 100, 64, 0, &rs);
+            ((struct ip4 *)b)->cksum ^= 0x1234;
+        } else if(r < 97) {
+            synth_icmp4_error(s, &c4, &s4, &rs);
+        } else {
+            synth_ip4(s, &s4, &c4, 6, 1480, 64, IP4_F_DF, &rs);
+        }
+    }
+}
+
+/*
+ * pcap input and output
+ */
+static uint32_t swap32(uint32_t v, int swap) {
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static int load_pcap(struct pktset *s, const char *path) {
+    uint32_t hdr[6], rec[4], len, caplen, skip;
+    uint8_t *data = NULL;
+    int swap, linktype, family, n = 0;
+    FILE *f = fopen(path, "rb");
+
+    if(!f) {
+        fprintf(stderr, "unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if(fread(hdr, sizeof(hdr), 1, f) != 1) goto bad;
+    if(hdr[0] == 0xa1b2c3d4 || hdr[0] == 0xa1b23c4d) swap = 0;
+    else if(hdr[0] == 0xd4c3b2a1 || hdr[0] == 0x4d3cb2a1) swap = 1;
+    else goto bad;
+    linktype = swap32(hdr[5], swap) & 0xffff;
+    data = malloc(0x40000);
+    if(!data) goto bad;
+
+    while(fread(rec, sizeof(rec), 1, f) == 1) {
+        caplen = swap32(rec[2], swap);
+        len = swap32(rec[3], swap);
+        if(caplen > 0x40000 || fread(data, caplen, 1, f) != 1) goto bad;
+        /* Truncated captures cannot be translated faithfully */
+        if(caplen < len) continue;
+        switch(linktype) {
+        case LINKTYPE_ETHERNET:
+            skip = 14;
+            while(caplen >= skip && (data[skip - 2] << 8 |
+                        data[skip - 1]) == 0x8100)
+                skip += 4;
+            break;
+        case LINKTYPE_LINUX_SLL:
+            skip = 16;
+            break;
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+        case LINKTYPE_IPV6:
+            skip = 0;
+            break;
+        default:
+            fprintf(stderr, "%s: unsupported link type %d\n", path, linktype);
+            goto fail;
+        }
+        if(caplen <= skip) continue;
+        family = data[skip] >> 4;
+        if(family != 4 && family != 6) continue;
+        memcpy(pktset_add(s, caplen - skip, family), data + skip,
+                caplen - skip);
+        n++;
+    }
+    free(data);
+    fclose(f);
+    return n;
+bad:
+    fprintf(stderr, "%s: not a pcap file\n", path);
+fail:
+    free(data);
+    fclose(f);
+    return -1;
+}
+
+static FILE *capture_open(const char *path) {
+    uint32_t hdr[6] = { 0xa1b2c3d4, 0x00040002, 0, 0, 0x40000, LINKTYPE_RAW };
+    FILE *f = fopen(path, "wb");
+
+    if(!f) {
+        fprintf(stderr, "unable to create %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    fwrite(hdr, sizeof(hdr), 1, f);
+    return f;
+}
+
+/*
+ * Benchmark
+ */
+static int load_config(const char *path, const char *text) {
+    char tmp[] = "/tmp/tayga-bench-XXXXXX";
+    int fd, ret;
+
+    config_init();
+    if(!path) {
+        fd = mkstemp(tmp);
+        if(fd < 0 || write(fd, text, strlen(text)) != (ssize_t)strlen(text)) {
+            fprintf(stderr, "unable to write %s\n", tmp);
+            return -1;
+        }
+        close(fd);
+        path = tmp;
+    }
+    ret = config_read((char *)path);
+    if(path == tmp) unlink(tmp);
+    if(ret < 0 || config_validate() < 0) return -1;
+
+    /* The token buckets refill at a few messages per second, so nearly
+     * every ICMP packet in a run would only measure icmp_limited. Lift
+     * the limits the config file does not set, so the ICMP path builds
+     * and sends real replies and errors. */
+    for(int i = 0; i < RL_CLASS_MAX; i++)
+        for(int j = 0; j < RL_SCOPE_MAX; j++)
+            if(!gcfg.icmp_rl[i][j].set) gcfg.icmp_rl[i][j].rate = 0;
+
+    /* What tayga.c and tun_setup() would otherwise do */
+    gcfg.mtu = 1500;
+    for(int i = 0; i < 8; i++) gcfg.rand[i] = 0x9e3779b9 * (i + 1);
+    gcfg.rand[0] |= 1;
+    if(gcfg.cache_size) create_cache();
+    nat64_select_variant();
+    pthread_mutex_init(&gcfg.cache_mutex, NULL);
+    pthread_mutex_init(&gcfg.map_mutex, NULL);
+    return 0;
+}
+
+static void replay(const struct pktset *set, uint64_t start, uint64_t count) {
+    static _Thread_local uint8_t *buf;
+    const struct bench_pkt *bp;
+    struct pkt p;
+
+    if(!buf && posix_memalign((void **)&buf, 64, RECV_BUF_SIZE)) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for(uint64_t i = 0; i < count; i++) {
+        bp = &set->pkts[(start + i) % set->count];
+        /* The translator may rewrite the packet in place */
+        memcpy(buf, set->buf + bp->off, bp->len);
+        memset(&p, 0, sizeof(p));
+        p.data = buf;
+        p.data_len = bp->len;
+        if(bp->family == 4) handle_ip4(&p);
+        else handle_ip6(&p);
+    }
+}
+
+static void bench_thread(void *arg, int index) {
+    struct bench_job *job = arg;
+
+    worker_id = index + 1;
+    tx_pkts = tx_bytes = 0;
+    /* Start each thread at a different point so they are not in lockstep */
+    replay(job->set, (uint64_t)index * job->set->count / 8, job->per_thread);
+    pthread_mutex_lock(&tx_mutex);
+    tx_total_pkts += tx_pkts;
+    tx_total_bytes += tx_bytes;
+    pthread_mutex_unlock(&tx_mutex);
+}
+
+static void report(const char *config, const char *source, int threads,
+        uint64_t packets, uint64_t ns) {
+    struct stats_counters c;
+    double sec = ns / 1e9;
+
+    stats_read(&c);
+    bench_json_run_begin();
+    bench_json_str("config", config);
+    bench_json_str("source", source);
+    bench_json_u64("threads", threads);
+    bench_json_u64("packets", packets);
+    bench_json_double("seconds", sec);
+    bench_json_double("mpps", packets / sec / 1e6);
+    bench_json_double("ns_per_packet", (double)ns * threads / packets);
+    bench_json_u64("tx_packets", tx_total_pkts);
+    bench_json_u64("tx_bytes", tx_total_bytes);
+    bench_json_u64("dropped", c.dropped);
+    bench_json_u64("rejected", c.rejected);
+    bench_json_u64("icmp_gen", c.icmp_gen);
+    bench_json_u64("icmp_limited", c.icmp_err_limited + c.echo_limited);
+    bench_json_u64("frags", c.frags);
+    bench_json_u64("cache_hit", c.cache_hit);
+    bench_json_u64("cache_miss", c.cache_miss);
+    bench_json_u64("cache_evict", c.cache_evict);
+    bench_json_u64("dyn_assign", c.dyn_assign);
+    bench_json_double("cache_hit_ratio", c.cache_hit + c.cache_miss ?
+            (double)c.cache_hit / (c.cache_hit + c.cache_miss) : 0.0);
+    bench_json_run_end();
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -c NAME    built-in config: rfc6052, eam, dynamic or all (default all)\n"
+        "  -f FILE    use a tayga.conf instead of a built-in config\n"
+        "  -r FILE    replay IPv4/IPv6 packets from a pcap file (repeatable)\n"
+        "             instead of the synthetic mix\n"
+        "  -t LIST    thread counts, e.g. 1,2,4 or 1-8 (default 1,2,4)\n"
+        "  -n COUNT   packets per run (default 2000000)\n"
+        "  -s SEED    seed for the synthetic mix\n"
+        "  -w FILE    write the translated output of the first pass to a pcap\n"
+        "  -v         show log messages\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *config = "all", *conffile = NULL, *pcaps[16], *outfile = NULL;
+    int threads[MAX_RUNS] = { 1, 2, 4 }, nthreads = 3, npcaps = 0, opt;
+    uint64_t count = 2000000, seed = 0x7a79a;
+    struct bench_job job;
+    uint64_t ns;
+
+    while((opt = getopt(argc, argv, "c:f:r:t:n:s:w:v")) != -1) {
+        switch(opt) {
+        case 'c': config = optarg; break;
+        case 'f': conffile = optarg; config = "file"; break;
+        case 'r':
+            if(npcaps == 16) usage(argv[0]);
+            pcaps[npcaps++] = optarg;
+            break;
+        case 't':
+            nthreads = bench_parse_threads(optarg, threads, MAX_RUNS);
+            if(nthreads < 1) usage(argv[0]);
+            break;
+        case 'n': count = strtoull(optarg, NULL, 0); break;
+        case 's': seed = strtoull(optarg, NULL, 0) | 1; break;
+        case 'w': outfile = optarg; break;
+        case 'v': bench_verbose = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind != argc || !count) usage(argv[0]);
+    for(int i = 0; i < nthreads; i++) {
+        if(threads[i] > MAX_WORKERS) {
+            fprintf(stderr, "at most %d threads\n", MAX_WORKERS);
+            return 2;
+        }
+    }
+    time(&now);
+
+    bench_json_begin("nat64");
+    for(int m = 0; m < NUM_CONFIGS || (conffile && m == 0); m++) {
+        struct pktset set = { 0 };
+        const char *name = conffile ? "file" : bench_configs[m].name;
+
+        if(!conffile && strcmp(config, "all") && strcmp(config, name))
+            continue;
+        if(load_config(conffile, conffile ? NULL : bench_configs[m].conf)) {
+            fprintf(stderr, "unable to load %s configuration\n", name);
+            return 1;
+        }
+        for(int i = 0; i < npcaps; i++)
+            if(load_pcap(&set, pcaps[i]) < 0) return 1;
+        if(!npcaps) synth_traffic(&set, m, seed);
+        if(!set.count) {
+            fprintf(stderr, "no IPv4 or IPv6 packets to replay\n");
+            return 1;
+        }
+
+        /* One untimed pass to fill the caches and the dynamic pool */
+        if(outfile) capture = capture_open(outfile);
+        worker_id = 1;
+        replay(&set, 0, set.count);
+        if(capture) {
+            fclose(capture);
+            capture = NULL;
+            outfile = NULL;
+        }
+
+        for(int i = 0; i < nthreads; i++) {
+            stats_reset();
+            tx_total_pkts = tx_total_bytes = 0;
+            job.set = &set;
+            job.per_thread = count / threads[i];
+            ns = bench_run_threads(threads[i], bench_thread, &job);
+            report(name, npcaps ? "pcap" : "synthetic", threads[i],
+                    job.per_thread * threads[i], ns);
+        }
+        free(set.buf);
+        free(set.pkts);
+    }
+    bench_json_end();
+    return 0;
+}
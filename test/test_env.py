@@ -131,6 +131,7 @@ class confgen:
         self.log = "drop reject icmp self"
         self.offlink_mtu = 0
         self.udp_cksum_mode = None
+        self.tcp_mss_clamp = False
         self.map_file_entries = []
         self.map_file_path = "test/tayga.map"
         self.map_file_created = False
@@ -165,6 +166,8 @@ class confgen:
                 conf_file.write("offlink-mtu "+str(self.offlink_mtu)+"\n")
             if self.udp_cksum_mode is not None:
                 conf_file.write("udp-cksum-mode "+self.udp_cksum_mode+"\n")
+            if self.tcp_mss_clamp:
+                conf_file.write("tcp-mss-clamp yes\n")
 
 
 
@@ -1888,7 +1888,69 @@ def sec_5_5():
     # No other protocols are required, but we may want to test them   
     test.section("Transport-Layer Header (RFC 7915 5.5)")
 
-    
+
+#############################################
+# TCP MSS Clamping (tcp-mss-clamp)
+#############################################
+expect_mss = -1
+def tcp_mss_val(pkt):
+    res = test_result()
+    # layer 0 is LinuxTunInfo
+    ip = pkt.getlayer(1)
+    res.check("Contains IP",isinstance(ip,IP) or isinstance(ip,IPv6))
+    res.check("Contains TCP",pkt.haslayer(TCP))
+    #Bail early so we don't get derefrence errors
+    if res.has_fail:
+        return res
+    res.compare("Src",ip.src,str(expect_sa))
+    res.compare("Dest",ip.dst,str(expect_da))
+    res.compare("MSS",dict(pkt[TCP].options).get("MSS"),expect_mss)
+    #Recalculate the checksum from scratch
+    ref = ip.copy()
+    del ref[TCP].chksum
+    ref = ref.__class__(bytes(ref))
+    res.compare("Checksum TCP",pkt[TCP].chksum,ref[TCP].chksum)
+    return res
+
+def tcp_mss_clamp():
+    global test
+    global expect_sa
+    global expect_da
+    global expect_mss
+    # Setup config for this section
+    test.tayga_conf.default()
+    test.tayga_conf.tcp_mss_clamp = True
+    test.reload()
+
+    # Default offlink-mtu is 1280, so the largest MSS is 1280-20-20-20
+    expect_sa = test.public_ipv4_xlate
+    expect_da = test.public_ipv6
+    expect_mss = 1220
+    send_pkt = IP(dst=str(test.public_ipv6_xlate),src=str(test.public_ipv4)) \
+        / TCP(sport=666,dport=667,flags="S",seq=420,options=[("MSS",1460)])
+    test.send_and_check(send_pkt,tcp_mss_val, "4->6 SYN MSS clamped")
+
+    # MSS option at an odd offset
+    send_pkt = IP(dst=str(test.public_ipv6_xlate),src=str(test.public_ipv4)) \
+        / TCP(sport=666,dport=667,flags="S",seq=420,options=[("NOP",None),("MSS",1460),("NOP",None),("NOP",None),("NOP",None)])
+    test.send_and_check(send_pkt,tcp_mss_val, "4->6 SYN MSS clamped odd offset")
+
+    # Small MSS is left alone
+    expect_mss = 536
+    send_pkt = IP(dst=str(test.public_ipv6_xlate),src=str(test.public_ipv4)) \
+        / TCP(sport=666,dport=667,flags="S",seq=420,options=[("MSS",536)])
+    test.send_and_check(send_pkt,tcp_mss_val, "4->6 SYN small MSS unchanged")
+
+    # 6->4 direction
+    expect_sa = test.public_ipv6_xlate
+    expect_da = test.public_ipv4
+    expect_mss = 1220
+    send_pkt = IPv6(dst=str(test.public_ipv4_xlate),src=str(test.public_ipv6)) \
+        / TCP(sport=666,dport=667,flags="SA",seq=420,ack=1,options=[("MSS",1440)])
+    test.send_and_check(send_pkt,tcp_mss_val, "6->4 SYN-ACK MSS clamped")
+
+    test.section("TCP MSS Clamping")
+
 #############################################
 # Jumbo Frames Test
 #############################################
@@ -1940,11 +2002,12 @@ sec_5_2()
 sec_5_3()
 sec_5_4()
 sec_5_5()
+tcp_mss_clamp()
 #jumbograms()
 
 time.sleep(1)
 
 test.cleanup()
 #Print test report (expected pass/fail count)
-test.report(246,1)
+test.report(250,1)
 
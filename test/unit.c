@@ -31,6 +31,7 @@ int at_end = 0;
 /* Capture slog to the output */
 int has_slogged = 0;
 int print_slog = 0;
+void (*slog_hook)(int priority, const char *msg) = NULL;
 void slog_impl(int priority, const char *file, const char *line, const char *func, const char *format, ...)
 {
     (void)file;
@@ -46,6 +47,16 @@ void slog_impl(int priority, const char *file, const char *line, const char *fun
             vprintf(format, ap);
         va_end(ap);
     }
+    //Optionally, hand the formatted line to the test
+    if(slog_hook) {
+        va_list ap;
+        char msg[512];
+
+        va_start(ap, format);
+            vsnprintf(msg, sizeof(msg), format, ap);
+        va_end(ap);
+        slog_hook(priority, msg);
+    }
 }
 
 /* Capture exit events */
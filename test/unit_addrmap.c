@@ -0,0 +1,375 @@
+/*
+ *  unit_addrmap.c - Unit test for addrmap.c
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "test/unit.h"
+#include "tayga.h"
+
+/* Number of random addresses to test per prefix length */
+#define RAND_ITER 1000000
+
+/* assign_dynamic
+ * required for addrmap.c to link, returns with map_mutex held
+ */
+struct map6 *assign_dynamic(const struct in6_addr *addr6) {
+    (void)addr6;
+    LOCK(&gcfg.map_mutex);
+    return NULL;
+}
+
+/* dynamic_enqueue
+ * required for addrmap.c to link
+ */
+int dynamic_enqueue(const struct in6_addr *addr6) {
+    (void)addr6;
+    return -1;
+}
+
+/* Reference implementation of RFC6052 embedding
+ * (the switch-based implementation which predates the lookup tables)
+ */
+static int ref_embed(struct in6_addr *addr6, const struct in_addr *addr4,
+        const struct in6_addr *prefix, int prefix_len)
+{
+    switch (prefix_len) {
+    case 32:
+        addr6->s6_addr32[0] = prefix->s6_addr32[0];
+        addr6->s6_addr32[1] = addr4->s_addr;
+        addr6->s6_addr32[2] = 0;
+        addr6->s6_addr32[3] = 0;
+        return ERROR_NONE;
+    case 40:
+        addr6->s6_addr32[0] = prefix->s6_addr32[0];
+        addr6->s6_addr32[1] = BIG_LITTLE(
+                prefix->s6_addr32[1] | (addr4->s_addr >> 8),
+                prefix->s6_addr32[1] | (addr4->s_addr << 8));
+        addr6->s6_addr32[2] = BIG_LITTLE(
+                (addr4->s_addr << 16) & 0x00ff0000,
+                (addr4->s_addr >> 16) & 0x0000ff00);
+        addr6->s6_addr32[3] = 0;
+        return ERROR_NONE;
+    case 48:
+        addr6->s6_addr32[0] = prefix->s6_addr32[0];
+        addr6->s6_addr32[1] = BIG_LITTLE(
+                prefix->s6_addr32[1] | (addr4->s_addr >> 16),
+                prefix->s6_addr32[1] | (addr4->s_addr << 16));
+        addr6->s6_addr32[2] = BIG_LITTLE(
+                (addr4->s_addr << 8) & 0x00ffff00,
+                (addr4->s_addr >> 8) & 0x00ffff00);
+        addr6->s6_addr32[3] = 0;
+        return ERROR_NONE;
+    case 56:
+        addr6->s6_addr32[0] = prefix->s6_addr32[0];
+        addr6->s6_addr32[1] = BIG_LITTLE(
+                prefix->s6_addr32[1] | (addr4->s_addr >> 24),
+                prefix->s6_addr32[1] | (addr4->s_addr << 24));
+        addr6->s6_addr32[2] = BIG_LITTLE(
+                addr4->s_addr & 0x00ffffff,
+                addr4->s_addr & 0xffffff00);
+        addr6->s6_addr32[3] = 0;
+        return ERROR_NONE;
+    case 64:
+        addr6->s6_addr32[0] = prefix->s6_addr32[0];
+        addr6->s6_addr32[1] = prefix->s6_addr32[1];
+        addr6->s6_addr32[2] = BIG_LITTLE(
+                addr4->s_addr >> 8,
+                addr4->s_addr << 8);
+        addr6->s6_addr32[3] = BIG_LITTLE(
+                addr4->s_addr << 24,
+                addr4->s_addr >> 24);
+        return ERROR_NONE;
+    case 96:
+        addr6->s6_addr32[0] = prefix->s6_addr32[0];
+        addr6->s6_addr32[1] = prefix->s6_addr32[1];
+        addr6->s6_addr32[2] = prefix->s6_addr32[2];
+        addr6->s6_addr32[3] = addr4->s_addr;
+        return ERROR_NONE;
+    default:
+        return ERROR_DROP;
+    }
+}
+
+/* Reference implementation of RFC6052 extraction */
+static int ref_extract(struct in_addr *addr4, const struct in6_addr *addr6,
+        int prefix_len)
+{
+    switch (prefix_len) {
+    case 32:
+        if (addr6->s6_addr32[2] || addr6->s6_addr32[3])
+            return ERROR_DROP;
+        addr4->s_addr = addr6->s6_addr32[1];
+        break;
+    case 40:
+        if (addr6->s6_addr32[2] & htonl(0xff00ffff) ||
+                addr6->s6_addr32[3])
+            return ERROR_DROP;
+        addr4->s_addr = BIG_LITTLE(
+                (addr6->s6_addr32[1] << 8) | addr6->s6_addr[9],
+                (addr6->s6_addr32[1] >> 8) | (addr6->s6_addr32[2] << 16));
+        break;
+    case 48:
+        if (addr6->s6_addr32[2] & htonl(0xff0000ff) ||
+                addr6->s6_addr32[3])
+            return ERROR_DROP;
+        addr4->s_addr = BIG_LITTLE(
+            (addr6->s6_addr16[3] << 16) | (addr6->s6_addr32[2] >> 8),
+            (addr6->s6_addr16[3]      ) | (addr6->s6_addr32[2] << 8));
+        break;
+    case 56:
+        if (addr6->s6_addr[8] || addr6->s6_addr32[3])
+            return ERROR_DROP;
+        addr4->s_addr = BIG_LITTLE(
+                (addr6->s6_addr[7] << 24) | addr6->s6_addr32[2],
+                addr6->s6_addr[7] | addr6->s6_addr32[2]);
+        break;
+    case 64:
+        if (addr6->s6_addr[8] ||
+                addr6->s6_addr32[3] & htonl(0x00ffffff))
+            return ERROR_DROP;
+        addr4->s_addr = BIG_LITTLE(
+                (addr6->s6_addr32[2] << 8) | addr6->s6_addr[12],
+                (addr6->s6_addr32[2] >> 8) | (addr6->s6_addr32[3] << 24));
+        break;
+    case 96:
+        addr4->s_addr = addr6->s6_addr32[3];
+        break;
+    default:
+        return ERROR_DROP;
+    }
+    return ERROR_NONE;
+}
+
+/* Small deterministic PRNG (xorshift32) so failures are reproducible */
+static uint32_t rng_state = 0x7a79a64;
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void rand_addr6(struct in6_addr *a) {
+    for(int i = 0; i < 4; i++) a->s6_addr32[i] = rng();
+}
+
+/* Build a random prefix with the host bits cleared */
+static void rand_prefix(struct in6_addr *p, int len) {
+    struct in6_addr mask;
+    rand_addr6(p);
+    calc_ip6_mask(&mask, NULL, len);
+    for(int i = 0; i < 4; i++) p->s6_addr32[i] &= mask.s6_addr32[i];
+}
+
+/* Test the embed function against the reference */
+void test_rfc6052_embed(void) {
+    static const int lens[] = {32, 40, 48, 56, 64, 96};
+    struct in6_addr prefix, a, b;
+    struct in_addr addr4;
+    char msg[64];
+    long fail;
+
+    for(unsigned int l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        fail = 0;
+        for(long i = 0; i < RAND_ITER; i++) {
+            rand_prefix(&prefix, lens[l]);
+            addr4.s_addr = rng();
+            memset(&a, 0x5a, sizeof(a));
+            memset(&b, 0xa5, sizeof(b));
+            if(rfc6052_embed(&a, &addr4, &prefix, lens[l]) !=
+                    ref_embed(&b, &addr4, &prefix, lens[l]) ||
+                    memcmp(&a, &b, sizeof(a)))
+                fail++;
+        }
+        sprintf(msg, "Embed /%d matches reference", lens[l]);
+        expectl(fail, 0, msg);
+    }
+
+    /* Lengths not defined by RFC6052 are rejected */
+    fail = 0;
+    for(int len = -8; len <= 136; len++) {
+        if(rfc6052_embed(&a, &addr4, &prefix, len) !=
+                ref_embed(&b, &addr4, &prefix, len))
+            fail++;
+    }
+    expectl(fail, 0, "Embed invalid lengths match reference");
+}
+
+/* Test the extract function against the reference */
+void test_rfc6052_extract(void) {
+    static const int lens[] = {32, 40, 48, 56, 64, 96};
+    struct in6_addr prefix, addr6;
+    struct in_addr a, b;
+    char msg[64];
+    long fail, valid;
+
+    for(unsigned int l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        fail = 0;
+        valid = 0;
+        for(long i = 0; i < RAND_ITER; i++) {
+            /* Half of the addresses are embedded (valid), the other half
+             * are embedded and then have a random byte corrupted */
+            rand_prefix(&prefix, lens[l]);
+            a.s_addr = rng();
+            ref_embed(&addr6, &a, &prefix, lens[l]);
+            if(i & 1) addr6.s6_addr[rng() & 15] ^= (rng() & 0xff) | 1;
+            a.s_addr = 0x5a5a5a5a;
+            b.s_addr = 0xa5a5a5a5;
+            int ra = rfc6052_extract(&a, &addr6, lens[l]);
+            int rb = ref_extract(&b, &addr6, lens[l]);
+            if(ra != rb || (ra == ERROR_NONE && a.s_addr != b.s_addr))
+                fail++;
+            if(rb == ERROR_NONE) valid++;
+        }
+        sprintf(msg, "Extract /%d matches reference", lens[l]);
+        expectl(fail, 0, msg);
+        sprintf(msg, "Extract /%d exercised valid addresses", lens[l]);
+        expect(valid > RAND_ITER / 2, msg);
+        sprintf(msg, "Extract /%d exercised invalid addresses", lens[l]);
+        expect(lens[l] == 96 || valid < RAND_ITER, msg);
+    }
+
+    /* Every single bit of the u octet and suffix is checked */
+    for(unsigned int l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        fail = 0;
+        for(int bit = 0; bit < 128; bit++) {
+            memset(&addr6, 0, sizeof(addr6));
+            addr6.s6_addr[bit / 8] = 0x80 >> (bit % 8);
+            int ra = rfc6052_extract(&a, &addr6, lens[l]);
+            int rb = ref_extract(&b, &addr6, lens[l]);
+            if(ra != rb || (ra == ERROR_NONE && a.s_addr != b.s_addr))
+                fail++;
+        }
+        sprintf(msg, "Extract /%d single bits match reference", lens[l]);
+        expectl(fail, 0, msg);
+    }
+}
+
+/* Test append_to_prefix, which wraps the embed function */
+void test_append_to_prefix(void) {
+    struct in6_addr prefix, addr6;
+    struct in_addr addr4;
+
+    inet_pton(AF_INET6, "64:ff9b::", &prefix);
+    gcfg.wkpf_strict = 1;
+
+    inet_pton(AF_INET, "192.0.2.1", &addr4);
+    expectl(append_to_prefix(&addr6, &addr4, &prefix, 96), ERROR_REJECT,
+        "WKPF private address rejected");
+    inet_pton(AF_INET, "8.8.8.8", &addr4);
+    expectl(append_to_prefix(&addr6, &addr4, &prefix, 96), ERROR_NONE,
+        "WKPF public address");
+    expectl(addr6.s6_addr32[3], addr4.s_addr, "WKPF public address value");
+    inet_pton(AF_INET, "127.0.0.1", &addr4);
+    expectl(append_to_prefix(&addr6, &addr4, &prefix, 96), ERROR_DROP,
+        "Loopback address dropped");
+    inet_pton(AF_INET, "8.8.8.8", &addr4);
+    expectl(append_to_prefix(&addr6, &addr4, &prefix, 72), ERROR_DROP,
+        "Invalid prefix length dropped");
+    gcfg.wkpf_strict = 0;
+}
+
+/* Test that lookup misses are remembered until the maps change */
+void test_negative_cache(void) {
+    char tmp[] = "/tmp/unit_addrmap-XXXXXX";
+    struct in_addr addr4, out4;
+    struct in6_addr addr6, out6;
+    struct map_static *m;
+    uint64_t hits;
+    FILE *f;
+    int fd;
+
+    fd = mkstemp(tmp);
+    if(fd < 0) {
+        expect(0, "Create configuration");
+        return;
+    }
+    f = fdopen(fd, "w");
+    fprintf(f, "tun-device unit0\n"
+            "ipv4-addr 192.168.255.1\n"
+            "ipv6-addr 2001:db8::1\n"
+            "map 192.0.2.1 2001:db8:1::1\n");
+    fclose(f);
+    config_init();
+    expect(!config_read(tmp), "Read configuration");
+    unlink(tmp);
+    expect(!config_validate(), "Validate configuration");
+    pthread_mutex_init(&gcfg.map_mutex, NULL);
+    pthread_mutex_init(&gcfg.cache_mutex, NULL);
+    create_cache();
+    now = time(NULL);
+    hits = stats_workers[0].c.neg_hit;
+
+    /* Only the first miss is rejected */
+    inet_pton(AF_INET, "198.51.100.7", &addr4);
+    expectl(map_ip4_to_ip6(&out6, &addr4), ERROR_REJECT, "IPv4 miss");
+    expectl(map_ip4_to_ip6(&out6, &addr4), ERROR_DROP, "IPv4 miss again");
+    inet_pton(AF_INET6, "2001:db8:2::7", &addr6);
+    expectl(map_ip6_to_ip4(&out4, &addr6, 0), ERROR_REJECT, "IPv6 miss");
+    expectl(map_ip6_to_ip4(&out4, &addr6, 0), ERROR_DROP, "IPv6 miss again");
+    expectl(stats_workers[0].c.neg_hit - hits, 2, "Hits counted");
+
+    /* A miss without dynamic assignment does not stand for one with */
+    expectl(map_ip6_to_ip4(&out4, &addr6, 1), ERROR_REJECT, "Assignment tried");
+    expectl(map_ip6_to_ip4(&out4, &addr6, 1), ERROR_DROP, "Assignment failed");
+    expectl(map_ip6_to_ip4(&out4, &addr6, 0), ERROR_DROP, "Covers lookups");
+
+    /* A new map is found straight away */
+    m = calloc(1, sizeof(*m));
+    INIT_LIST_HEAD(&m->map4.list);
+    INIT_LIST_HEAD(&m->map6.list);
+    m->map4.type = MAP_TYPE_STATIC;
+    m->map4.addr = addr4;
+    m->map4.prefix_len = 32;
+    calc_ip4_mask(&m->map4.mask, NULL, 32);
+    m->map6.type = MAP_TYPE_STATIC;
+    m->map6.addr = addr6;
+    m->map6.prefix_len = 128;
+    calc_ip6_mask(&m->map6.mask, NULL, 128);
+    LOCK(&gcfg.map_mutex);
+    expect(!insert_map4(&m->map4, NULL) && !insert_map6(&m->map6, NULL),
+            "Insert map");
+    UNLOCK(&gcfg.map_mutex);
+    expectl(map_ip4_to_ip6(&out6, &addr4), ERROR_NONE, "IPv4 mapped");
+    expect(IN6_ARE_ADDR_EQUAL(&out6, &addr6), "IPv4 maps to new map");
+    expectl(map_ip6_to_ip4(&out4, &addr6, 0), ERROR_NONE, "IPv6 mapped");
+    expectl(out4.s_addr, addr4.s_addr, "IPv6 maps to new map");
+
+    /* Misses are forgotten after NEG_CACHE_TTL */
+    inet_pton(AF_INET, "198.51.100.8", &addr4);
+    expectl(map_ip4_to_ip6(&out6, &addr4), ERROR_REJECT, "Miss");
+    expectl(map_ip4_to_ip6(&out6, &addr4), ERROR_DROP, "Remembered");
+    now += NEG_CACHE_TTL + 1;
+    expectl(map_ip4_to_ip6(&out6, &addr4), ERROR_REJECT, "Forgotten");
+}
+
+int main(void) {
+    print_fail_only = 0;
+
+    /* Test the table-driven RFC6052 embed */
+    test_rfc6052_embed();
+
+    /* Test the table-driven RFC6052 extract */
+    test_rfc6052_extract();
+
+    /* Test append_to_prefix */
+    test_append_to_prefix();
+
+    /* Test the negative cache */
+    test_negative_cache();
+
+    /* Return final status */
+    return overall();
+}
@@ -35,9 +35,18 @@ static char *tun_route[100] = {0};
  * but do not need dyanmic
  */
 struct map6 *assign_dynamic(const struct in6_addr *addr6) {
+    LOCK(&gcfg.map_mutex);
     return NULL;
 }
 
+/* dynamic_enqueue
+ * required for addrmap.c to link
+ */
+int dynamic_enqueue(const struct in6_addr *addr6) {
+    (void)addr6;
+    return -1;
+}
+
 
 /* Function to simulate getenv
  * set getenv_case to a nonzero number to change the return
@@ -78,6 +87,8 @@ void test_config_compare(void) {
     expects(gcfg.tundev, tcfg.tundev, IFNAMSIZ, "tundev");
     expects(gcfg.data_dir, tcfg.data_dir, 512, "data_dir");
     expects(gcfg.map_file, tcfg.map_file, 512, "map_file");
+    expects(gcfg.stats_socket, tcfg.stats_socket, 108, "stats_socket");
+    expects(gcfg.stats_shm, tcfg.stats_shm, 64, "stats_shm");
     expectl(gcfg.local_addr4.s_addr, tcfg.local_addr4.s_addr, "local_addr4");
     expectl(gcfg.local_addr6.s6_addr32[0],tcfg.local_addr6.s6_addr32[0], "local_addr6[0]");
     expectl(gcfg.local_addr6.s6_addr32[1],tcfg.local_addr6.s6_addr32[1], "local_addr6[1]");
@@ -86,12 +97,40 @@ void test_config_compare(void) {
     expectl(gcfg.dyn_min_lease, tcfg.dyn_min_lease, "dyn_min_lease");
     expectl(gcfg.dyn_max_lease, tcfg.dyn_max_lease, "dyn_max_lease");
     expectl(gcfg.max_commit_delay, tcfg.max_commit_delay, "max_commit_delay");
+    expectl(gcfg.dyn_fsync, tcfg.dyn_fsync, "dyn_fsync");
+    expectl(gcfg.dyn_format, tcfg.dyn_format, "dyn_format");
+    expectl(gcfg.dyn_pool_count, tcfg.dyn_pool_count, "dyn_pool_count");
+    expectl(gcfg.dyn_assign_mode, tcfg.dyn_assign_mode, "dyn_assign_mode");
+    expectl(gcfg.dyn_replica_len, tcfg.dyn_replica_len, "dyn_replica_len");
+    expect(!memcmp(&gcfg.dyn_replica, &tcfg.dyn_replica,
+                tcfg.dyn_replica_len), "dyn_replica");
+    expectl(gcfg.dyn_replica_listen_len, tcfg.dyn_replica_listen_len,
+            "dyn_replica_listen_len");
+    expect(!memcmp(&gcfg.dyn_replica_listen, &tcfg.dyn_replica_listen,
+                tcfg.dyn_replica_listen_len), "dyn_replica_listen");
+    expect(IN6_ARE_ADDR_EQUAL(&gcfg.dyn_replica_peer, &tcfg.dyn_replica_peer),
+            "dyn_replica_peer");
+    expect(!memcmp(gcfg.dyn_replica_key, tcfg.dyn_replica_key,
+                sizeof(tcfg.dyn_replica_key)), "dyn_replica_key");
+    expectl(gcfg.dyn_replica_key_set, tcfg.dyn_replica_key_set,
+            "dyn_replica_key_set");
     expectl(gcfg.hash_bits,tcfg.hash_bits, "hash_bits");
     expectl(gcfg.cache_size,tcfg.cache_size, "cache_size");
     expectl(gcfg.ipv6_offlink_mtu,tcfg.ipv6_offlink_mtu, "ipv6_offlink_mtu");
     expectl(gcfg.workers,tcfg.workers, "workers");
+    for(int i = 0; i < RL_CLASS_MAX; i++) {
+        for(int j = 0; j < RL_SCOPE_MAX; j++) {
+            expectl(gcfg.icmp_rl[i][j].rate, tcfg.icmp_rl[i][j].rate,
+                    "icmp_rl rate");
+            expectl(gcfg.icmp_rl[i][j].burst, tcfg.icmp_rl[i][j].burst,
+                    "icmp_rl burst");
+            expectl(gcfg.icmp_rl[i][j].set, tcfg.icmp_rl[i][j].set,
+                    "icmp_rl set");
+        }
+    }
     expectl(gcfg.mtu,tcfg.mtu, "mtu");
     expectl(gcfg.wkpf_strict, tcfg.wkpf_strict, "wkpf_strict");
+    expectl(gcfg.tcp_mss_clamp, tcfg.tcp_mss_clamp, "tcp_mss_clamp");
     expectl(gcfg.log_opts, tcfg.log_opts, "log_opts");
     expectl(gcfg.udp_cksum_mode, tcfg.udp_cksum_mode, "udp_cksum_mode");
     expectl(gcfg.tun_up, tcfg.tun_up, "tun_up");
@@ -235,7 +274,7 @@ void test_config_compare(void) {
     /* Structs */
     //expect(gcfg.map6_list == tcfg.map6_list, "map6_list");
     //expect(gcfg.map4_list == tcfg.map4_list, "map4_list");
-    //expect(gcfg.dynamic_pool == tcfg.dynamic_pool, "dynamic_pool");
+    //expect(gcfg.dyn_pools == tcfg.dyn_pools, "dyn_pools");
     //expect(gcfg.hash_table4 == tcfg.hash_table4, "hash_table4");
     //expect(gcfg.hash_table6 == tcfg.hash_table6, "hash_table6");
 
@@ -260,6 +299,12 @@ void test_config_init(void) {
     tcfg.cache_size = 1<<13;
     tcfg.wkpf_strict = 1;
     tcfg.workers = -1;
+    for(int i = 0; i < RL_CLASS_MAX; i++) {
+        tcfg.icmp_rl[i][RL_GLOBAL].rate = 1000;
+        tcfg.icmp_rl[i][RL_GLOBAL].burst = 50;
+        tcfg.icmp_rl[i][RL_SOURCE].rate = 10;
+        tcfg.icmp_rl[i][RL_SOURCE].burst = 10;
+    }
     tcfg.tun_up = 0;
 
     /* Make sure config is the size we expect
@@ -269,7 +314,7 @@ void test_config_init(void) {
      */
 #if defined(__amd64__) && defined(__linux__)
     if(!print_fail_only) printf("TEST CASE: config struct size\n");
-    expectl(sizeof(struct config),2192,"sizeof");
+    expectl(sizeof(struct config),2760,"sizeof");
 #endif
 
     /* Compare to our initialized tcfg */
@@ -301,6 +346,7 @@ void test_config_read(void) {
     tcfg.wkpf_strict = 0;
     strcpy(tcfg.tundev,"nat64");
     tcfg.local_addr4.s_addr = htonl(0xc0a8ff01);
+    tcfg.dyn_pool_count = 1;
     /* Two map4 entries */
     tmap4[0] = "192.168.255.0/24 type 2 mask 255.255.255.0";
     tmap4[1] = "0.0.0.0/0 type 1 mask 0.0.0.0";
@@ -326,6 +372,7 @@ void test_config_read(void) {
     tcfg.tundev[0] = 0;
     tcfg.local_addr4.s_addr = 0;
     tcfg.wkpf_strict = 1;
+    tcfg.dyn_pool_count = 0;
     tmap4[0] = 0;
     tmap6[0] = 0;
     test_config_compare();
@@ -474,6 +521,18 @@ void test_config_read(void) {
     config_init();
     expect(config_read(conffile),"Failed");
 
+    /* Test Case - tcp mss clamp not a known string */
+    if(!print_fail_only) printf("TEST CASE: tcp mss clamp invalid\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "tcp-mss-clamp hello\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
     /* Test Case - udp cksum mode invalid */
     if(!print_fail_only) printf("TEST CASE: udp cksum mode invalid\n");
     fd = fopen(conffile,"w");
@@ -486,6 +545,102 @@ void test_config_read(void) {
     config_init();
     expect(config_read(conffile),"Failed");
 
+    /* Test Case - dynamic fsync invalid */
+    if(!print_fail_only) printf("TEST CASE: dynamic fsync invalid\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "dynamic-fsync sometimes\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - dynamic format invalid */
+    if(!print_fail_only) printf("TEST CASE: dynamic format invalid\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "dynamic-format csv\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - dynamic assign invalid */
+    if(!print_fail_only) printf("TEST CASE: dynamic assign invalid\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "dynamic-assign later\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - dynamic replica invalid port */
+    if(!print_fail_only) printf("TEST CASE: dynamic replica invalid port\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "dynamic-replica 192.0.2.2 65536\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - dynamic replica invalid address */
+    if(!print_fail_only) printf("TEST CASE: dynamic replica invalid address\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "dynamic-replica-listen standby.example 5353\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - dynamic replica peer invalid address */
+    if(!print_fail_only) printf("TEST CASE: dynamic replica peer invalid address\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "dynamic-replica-peer ::\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - dynamic replica key too short */
+    if(!print_fail_only) printf("TEST CASE: dynamic replica key too short\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "dynamic-replica-key 000102030405060708090a0b0c0d0e\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - dynamic replica key not hex */
+    if(!print_fail_only) printf("TEST CASE: dynamic replica key not hex\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "dynamic-replica-key 000102030405060708090a0b0c0d0e0g\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
     /* Test Case - map invalid v4 addr */
     if(!print_fail_only) printf("TEST CASE: map invalid v4\n");
     fd = fopen(conffile,"w");
@@ -570,12 +725,60 @@ void test_config_read(void) {
     config_init();
     expect(config_read(conffile),"Failed");
 
-    /* Test Case - dyn pool duplicate */
-    if(!print_fail_only) printf("TEST CASE: dynamic pool duplicate\n");
+    /* Test Case - dyn pool overlap */
+    if(!print_fail_only) printf("TEST CASE: dynamic pool overlap\n");
     fd = fopen(conffile,"w");
     expect((long)fd,"fopen");
     if(!fd) return;
-    testcase = "dynamic-pool 192.168.255.0/24\ndynamic-pool 192.168.254.0/24\n";
+    testcase = "dynamic-pool 192.168.255.0/24\ndynamic-pool 192.168.255.128/25\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - dyn pool shards not a power of two */
+    if(!print_fail_only) printf("TEST CASE: dynamic pool shards invalid\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "dynamic-pool 192.168.255.0/24 shards 3\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - dyn pool too many shards */
+    if(!print_fail_only) printf("TEST CASE: dynamic pool too many shards\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "dynamic-pool 10.0.0.0/8 shards 512\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - dyn pool shards too small */
+    if(!print_fail_only) printf("TEST CASE: dynamic pool shards too small\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "dynamic-pool 192.168.255.0/30 shards 4\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - dyn pool unknown option */
+    if(!print_fail_only) printf("TEST CASE: dynamic pool unknown option\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "dynamic-pool 192.168.255.0/24 shard 4\n";
     fwrite(testcase,strlen(testcase),1,fd);
     fclose(fd);
     
@@ -654,6 +857,77 @@ void test_config_read(void) {
     config_init();
     expect(config_read(conffile),"Failed");
 
+    /* Test Case - stats socket duplicate */
+    if(!print_fail_only) printf("TEST CASE: stats socket duplicate\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "stats-socket /run/tayga.sock\nstats-socket /run/other.sock\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - stats socket relative path */
+    if(!print_fail_only) printf("TEST CASE: stats socket relative\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "stats-socket tayga.sock\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - stats shm duplicate */
+    if(!print_fail_only) printf("TEST CASE: stats shm duplicate\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "stats-shm /tayga\nstats-shm /other\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - stats shm invalid names */
+    if(!print_fail_only) printf("TEST CASE: stats shm invalid\n");
+    static const char *bad_shm[] = {
+        "stats-shm tayga\n",
+        "stats-shm /\n",
+        "stats-shm /run/tayga\n",
+        "stats-shm /0123456789012345678901234567890123456789"
+            "0123456789012345678901234\n",
+    };
+    for(unsigned int i = 0; i < sizeof(bad_shm) / sizeof(bad_shm[0]); i++) {
+        fd = fopen(conffile,"w");
+        expect((long)fd,"fopen");
+        if(!fd) return;
+        fwrite(bad_shm[i],strlen(bad_shm[i]),1,fd);
+        fclose(fd);
+
+        config_init();
+        expect(config_read(conffile),"Failed");
+    }
+
+    /* Test Case - stats socket path too long */
+    if(!print_fail_only) printf("TEST CASE: stats socket too long\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "stats-socket /run/tayga/"
+        "0123456789012345678901234567890123456789"
+        "0123456789012345678901234567890123456789"
+        "0123456789012345678901234567890123456789.sock\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
     /* Test Case - offlink mtu  */
     if(!print_fail_only) printf("TEST CASE: offlink mtu duplicate\n");
     fd = fopen(conffile,"w");
@@ -766,6 +1040,102 @@ void test_config_read(void) {
     config_init();
     expect(config_read(conffile),"Failed");
 
+    /* Test Case - icmp-ratelimit */
+    if(!print_fail_only) printf("TEST CASE: icmp-ratelimit duplicate\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "icmp-ratelimit errors global 100\nicmp-ratelimit errors global 200\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - icmp-ratelimit */
+    if(!print_fail_only) printf("TEST CASE: icmp-ratelimit invalid class\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "icmp-ratelimit redirect global 100\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - icmp-ratelimit */
+    if(!print_fail_only) printf("TEST CASE: icmp-ratelimit invalid scope\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "icmp-ratelimit echo prefix 100\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - icmp-ratelimit */
+    if(!print_fail_only) printf("TEST CASE: icmp-ratelimit rate not a number\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "icmp-ratelimit errors source 10/s\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - icmp-ratelimit */
+    if(!print_fail_only) printf("TEST CASE: icmp-ratelimit negative rate\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "icmp-ratelimit errors source -1\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - icmp-ratelimit */
+    if(!print_fail_only) printf("TEST CASE: icmp-ratelimit zero burst\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "icmp-ratelimit errors source 10 0\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - icmp-ratelimit */
+    if(!print_fail_only) printf("TEST CASE: icmp-ratelimit missing rate\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "icmp-ratelimit errors source\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
+    /* Test Case - icmp-ratelimit */
+    if(!print_fail_only) printf("TEST CASE: icmp-ratelimit too many arguments\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "icmp-ratelimit errors source 10 10 10\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    expect(config_read(conffile),"Failed");
+
     /* Test Case - log duplicate*/
     if(!print_fail_only) printf("TEST CASE: log duplicate\n");
     fd = fopen(conffile,"w");
@@ -1065,13 +1435,26 @@ void test_config_read(void) {
         "prefix 64:ff9b::/96\n"
         "wkpf-strict yes\n"
         "dynamic-pool 192.168.255.0/24\n"
+        "dynamic-pool 10.64.0.0/16 shards 4\n"
         "data-dir /var/lib/tayga\n"
+        "dynamic-fsync always\n"
+        "dynamic-format binary\n"
+        "dynamic-assign async\n"
+        "dynamic-replica 2001:db8::2 5353\n"
+        "dynamic-replica-listen 192.0.2.9 5354\n"
+        "dynamic-replica-peer 192.0.2.8\n"
+        "dynamic-replica-key 00112233445566778899aabbccddeeff\n"
         "map-file static.map\n"
+        "stats-socket /run/tayga.sock\n"
+        "stats-shm /tayga\n"
         "map 192.168.5.42 2001:db8:1:4444::1\n"
         "map 192.168.6.0/24 2001:db8:1:4445::/120\n"
         "udp-cksum-mode drop\n"
+        "tcp-mss-clamp on\n"
         "log drop reject icmp self dyn \n"
         "offlink-mtu 1492\n"
+        "icmp-ratelimit errors global 500 20\n"
+        "icmp-ratelimit echo source 0\n"
 #if MAX_WORKERS > 0
         "workers 7\n"
 #endif
@@ -1092,11 +1475,37 @@ void test_config_read(void) {
     strcpy(tcfg.data_dir,"/var/lib/tayga");
     strcpy(tcfg.tundev,"nat64");
     strcpy(tcfg.map_file,"static.map");
+    strcpy(tcfg.stats_socket,"/run/tayga.sock");
+    strcpy(tcfg.stats_shm,"/tayga");
     tcfg.local_addr4.s_addr = htonl(0xc0a8ff01);
     tcfg.local_addr6.s6_addr32[0] = htonl(0x20010db8);
     tcfg.local_addr6.s6_addr32[1] = htonl(0x00010000);
     tcfg.local_addr6.s6_addr32[3] = htonl(0x00000002);
     tcfg.ipv6_offlink_mtu = 1492;
+    tcfg.tcp_mss_clamp = 1;
+    tcfg.dyn_fsync = DYN_FSYNC_ALWAYS;
+    tcfg.dyn_format = DYN_FORMAT_BINARY;
+    tcfg.dyn_assign_mode = DYN_ASSIGN_ASYNC;
+    struct sockaddr_in6 *replica = (struct sockaddr_in6 *)&tcfg.dyn_replica;
+    replica->sin6_family = AF_INET6;
+    replica->sin6_port = htons(5353);
+    inet_pton(AF_INET6, "2001:db8::2", &replica->sin6_addr);
+    tcfg.dyn_replica_len = sizeof(*replica);
+    struct sockaddr_in *listen4 = (struct sockaddr_in *)&tcfg.dyn_replica_listen;
+    listen4->sin_family = AF_INET;
+    listen4->sin_port = htons(5354);
+    inet_pton(AF_INET, "192.0.2.9", &listen4->sin_addr);
+    tcfg.dyn_replica_listen_len = sizeof(*listen4);
+    inet_pton(AF_INET6, "::ffff:192.0.2.8", &tcfg.dyn_replica_peer);
+    for(int i = 0; i < 16; i++) tcfg.dyn_replica_key[i] = 0x11 * i;
+    tcfg.dyn_replica_key_set = 1;
+    tcfg.dyn_pool_count = 5;
+    tcfg.icmp_rl[RL_ERRORS][RL_GLOBAL].rate = 500;
+    tcfg.icmp_rl[RL_ERRORS][RL_GLOBAL].burst = 20;
+    tcfg.icmp_rl[RL_ERRORS][RL_GLOBAL].set = 1;
+    tcfg.icmp_rl[RL_ECHO][RL_SOURCE].rate = 0;
+    tcfg.icmp_rl[RL_ECHO][RL_SOURCE].burst = 0;
+    tcfg.icmp_rl[RL_ECHO][RL_SOURCE].set = 1;
 #if MAX_WORKERS > 0
     tcfg.workers = 7;
 #else
@@ -1107,8 +1516,12 @@ void test_config_read(void) {
     tmap4[0] = "192.168.5.42/32 type 0 mask 255.255.255.255";
     tmap4[1] = "192.168.255.0/24 type 2 mask 255.255.255.0";
     tmap4[2] = "192.168.6.0/24 type 0 mask 255.255.255.0";
-    tmap4[3] = "0.0.0.0/0 type 1 mask 0.0.0.0";
-    tmap4[4] = 0;
+    tmap4[3] = "10.64.0.0/18 type 2 mask 255.255.192.0";
+    tmap4[4] = "10.64.64.0/18 type 2 mask 255.255.192.0";
+    tmap4[5] = "10.64.128.0/18 type 2 mask 255.255.192.0";
+    tmap4[6] = "10.64.192.0/18 type 2 mask 255.255.192.0";
+    tmap4[7] = "0.0.0.0/0 type 1 mask 0.0.0.0";
+    tmap4[8] = 0;
     tmap6[0] = "2001:db8:1:4444::1/128 type 0 mask ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff";
     tmap6[1] = "2001:db8:1:4445::/120 type 0 mask ffff:ffff:ffff:ffff:ffff:ffff:ffff:ff00";
     tmap6[2] = "64:ff9b::/96 type 1 mask ffff:ffff:ffff:ffff:ffff:ffff::";
@@ -1275,6 +1688,45 @@ void test_config_validate() {
     expect(config_validate(),"Validate Failed");
     expectl(getenv_case,0,"Getenv Called");
 
+    /* replica without a dynamic pool */
+    if(!print_fail_only) printf("TEST CASE: dynamic-replica no dynamic-pool\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "prefix 64:ff9b::/96\n"
+        "ipv4-addr 192.168.255.1\n"
+        "ipv6-addr 2001:db8::1\n"
+        "dynamic-replica 192.0.2.2 5353\n"
+        "tun-device nat64\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    getenv_case = 1;
+    expect(!config_read(conffile),"Read Passed");
+    expect(config_validate(),"Validate Failed");
+    expectl(getenv_case,0,"Getenv Called");
+
+    /* replica listener without a peer */
+    if(!print_fail_only) printf("TEST CASE: dynamic-replica-listen no peer\n");
+    fd = fopen(conffile,"w");
+    expect((long)fd,"fopen");
+    if(!fd) return;
+    testcase = "prefix 64:ff9b::/96\n"
+        "ipv4-addr 192.168.255.1\n"
+        "ipv6-addr 2001:db8::1\n"
+        "dynamic-pool 192.168.255.0/24\n"
+        "dynamic-replica-listen 192.0.2.9 5353\n"
+        "tun-device nat64\n";
+    fwrite(testcase,strlen(testcase),1,fd);
+    fclose(fd);
+    
+    config_init();
+    getenv_case = 1;
+    expect(!config_read(conffile),"Read Passed");
+    expect(config_validate(),"Validate Failed");
+    expectl(getenv_case,0,"Getenv Called");
+
     /* no tun device */
     if(!print_fail_only) printf("TEST CASE: no tun-device\n");
     fd = fopen(conffile,"w");
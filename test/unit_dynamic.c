@@ -0,0 +1,1230 @@
+/*
+ *  unit_dynamic.c - Unit test for dynamic.c
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "test/unit.h"
+#include "tayga.h"
+
+/* Addresses in the test pool, less the network address */
+#define POOL_FREE 15
+
+/* Leases in the large map file test */
+#define LARGE_LEASES 60000
+
+/* Load a configuration with the given dynamic pool and no address cache */
+static int load_pool_config(const char *prefix, const char *extra) {
+    char tmp[] = "/tmp/unit_dynamic-XXXXXX";
+    int fd = mkstemp(tmp);
+    FILE *f;
+    int ret;
+
+    if(fd < 0) return -1;
+    f = fdopen(fd, "w");
+    fprintf(f, "tun-device unit0\n"
+            "ipv4-addr 192.168.255.1\n"
+            "prefix 2001:db8:64::/96\n"
+            "dynamic-pool %s\n%s", prefix, extra);
+    fclose(f);
+    config_init();
+    ret = config_read(tmp);
+    unlink(tmp);
+    if(ret < 0 || config_validate() < 0) return -1;
+    gcfg.cache_size = 0;
+    pthread_mutex_init(&gcfg.map_mutex, NULL);
+    pthread_mutex_init(&gcfg.cache_mutex, NULL);
+    return 0;
+}
+
+/* Load a configuration with a /28 dynamic pool */
+static int load_config(const char *extra) {
+    return load_pool_config("192.0.2.0/28", extra);
+}
+
+static void host(struct in6_addr *addr6, int n) {
+    inet_pton(AF_INET6, "2001:db8:1::", addr6);
+    addr6->s6_addr32[3] = htonl(0x1000 + n);
+}
+
+/* Map a host through map_ip6_to_ip4, as a packet from it would be */
+static int map_host(int n, struct in_addr *addr4) {
+    struct in6_addr addr6;
+
+    host(&addr6, n);
+    return map_ip6_to_ip4(addr4, &addr6, 1);
+}
+
+/* Test that every free address is handed out exactly once */
+void test_dynamic_assign(void) {
+    struct in_addr addr4, seen[POOL_FREE];
+    int dup = 0, outside = 0;
+
+    if(load_config("") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    expectl(gcfg.dyn_pools[0]->free_count, POOL_FREE, "Free addresses");
+    for(int i = 0; i < POOL_FREE; i++) {
+        expectl(map_host(i, &addr4), ERROR_NONE, "Assign");
+        if((ntohl(addr4.s_addr) & ~0xfU) != 0xc0000200 ||
+                (ntohl(addr4.s_addr) & 0xf) == 0)
+            outside++;
+        for(int j = 0; j < i; j++)
+            if(seen[j].s_addr == addr4.s_addr) dup++;
+        seen[i] = addr4;
+    }
+    expectl(outside, 0, "Assigned within the pool, not the network address");
+    expectl(dup, 0, "No address assigned twice");
+    expectl(gcfg.dyn_pools[0]->free_count, 0, "Pool exhausted");
+
+    /* Known hosts keep their address */
+    expectl(map_host(3, &addr4), ERROR_NONE, "Existing host");
+    expectl(addr4.s_addr, seen[3].s_addr, "Same address");
+
+    /* Nothing is dormant, so a new host is refused */
+    expectl(map_host(POOL_FREE, &addr4), ERROR_REJECT, "Full pool");
+}
+
+/* Test that addresses covered by a static map are skipped */
+void test_dynamic_static(void) {
+    struct in_addr addr4;
+    int n = 0, inside = 0;
+
+    if(load_config("map 192.0.2.4/30 2001:db8:2::/126\n") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    while(map_host(n, &addr4) == ERROR_NONE && n < 16) {
+        if((ntohl(addr4.s_addr) & 0xc) == 0x4) inside++;
+        n++;
+    }
+    expectl(n, POOL_FREE - 4, "Assigned around the static map");
+    expectl(inside, 0, "None inside the static map");
+}
+
+/* Test dormancy, reactivation, reassignment and expiry */
+void test_dynamic_lifecycle(void) {
+    struct dynamic_pool *pool;
+    struct in_addr addr4, first, reassigned;
+    struct in6_addr addr6;
+    struct map6 *m6;
+
+    if(load_config("") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    pool = gcfg.dyn_pools[0];
+    now = 1000000;
+    map_host(0, &first);
+    for(int i = 1; i < POOL_FREE; i++) {
+        now++;
+        map_host(i, &addr4);
+    }
+
+    /* Every lease goes dormant */
+    now += gcfg.dyn_min_lease + 1;
+    dynamic_maint(0);
+    expectl(pool->mapped.len, 0, "All leases dormant");
+    host(&addr6, 0);
+    expect(find_map6(&addr6) == NULL, "Dormant host unmapped");
+
+    /* The first host returns to its old address */
+    expectl(map_host(0, &addr4), ERROR_NONE, "Reactivate");
+    expectl(addr4.s_addr, first.s_addr, "Same address after dormancy");
+
+    /* A new host takes the oldest dormant lease, host 1's */
+    m6 = find_map6(&addr6);
+    expect(m6 != NULL, "Reactivated host mapped");
+    expectl(map_host(100, &reassigned), ERROR_NONE, "Reassign");
+    host(&addr6, 1);
+    expectl(map_host(1, &addr4), ERROR_NONE, "Host 1 gets another lease");
+    expect(addr4.s_addr != reassigned.s_addr, "Host 1 lost its old lease");
+    host(&addr6, 100);
+    m6 = find_map6(&addr6);
+    expect(m6 != NULL, "New host mapped");
+
+    /* The reassigned lease is found again by its new IPv6 address */
+    now += gcfg.dyn_min_lease + 1;
+    dynamic_maint(0);
+    expect(find_map6(&addr6) == NULL, "New host dormant");
+    expectl(map_host(100, &addr4), ERROR_NONE, "Reactivate new host");
+    expectl(addr4.s_addr, reassigned.s_addr, "Same address after dormancy");
+    expectl(map_host(1, &addr4), ERROR_NONE, "Reactivate host 1");
+    expect(addr4.s_addr != reassigned.s_addr, "Host 1 kept apart");
+
+    /* Dormant leases expire and their addresses are freed */
+    now += gcfg.dyn_max_lease + 1;
+    dynamic_maint(0);
+    dynamic_maint(0);
+    expectl(pool->free_count, POOL_FREE, "All addresses free again");
+    expectl(pool->dormant.len, 0, "No dormant leases");
+    expectl(map_host(2, &addr4), ERROR_NONE, "Assign after expiry");
+}
+
+/* Test that leases go dormant and expire in order of last use */
+void test_dynamic_ageing(void) {
+    struct dynamic_pool *pool;
+    struct in_addr addr4;
+    struct in6_addr addr6;
+    time_t start = 2000000;
+    int mapped = 0;
+
+    if(load_config("") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    pool = gcfg.dyn_pools[0];
+
+    /* Host i is first seen at start + 100 * i, in a scrambled order */
+    for(int i = 0; i < POOL_FREE; i++) {
+        int h = (i * 7) % POOL_FREE;
+        now = start + 100 * h;
+        map_host(h, &addr4);
+    }
+    /* The even hosts are seen again much later */
+    now = start + 5000;
+    for(int h = 0; h < POOL_FREE; h += 2)
+        map_host(h, &addr4);
+
+    /* Odd hosts below 9 have run out, the rest were seen too recently */
+    now = start + 900 + gcfg.dyn_min_lease;
+    dynamic_maint(0);
+    for(int h = 0; h < POOL_FREE; h++) {
+        host(&addr6, h);
+        if(find_map6(&addr6)) mapped++;
+        else if(!(h & 1) || h >= 9) expect(0, "Recent host still mapped");
+    }
+    expectl(mapped, POOL_FREE - 4, "Oldest leases dormant");
+    expectl(pool->mapped.len, POOL_FREE - 4, "Mapped heap size");
+    expectl(pool->dormant.len, 4, "Dormant heap size");
+
+    /* Heap order holds after rescheduling */
+    for(uint32_t i = 1; i < pool->mapped.len; i++)
+        expect(pool->mapped.v[(i - 1) / 2]->expires <=
+                pool->mapped.v[i]->expires, "Mapped heap ordered");
+    for(uint32_t i = 0; i < pool->dormant.len; i++)
+        expectl(pool->dormant.v[i]->heap_idx, i, "Heap index kept");
+
+    /* Dormant leases expire oldest first, hosts 1 and 3 here. Every
+     * other lease has gone dormant by now. */
+    now = start + 400 + gcfg.dyn_max_lease;
+    dynamic_maint(0);
+    expectl(pool->mapped.len, 0, "Rest dormant");
+    expectl(pool->dormant.len, POOL_FREE - 2, "Two oldest expired");
+    expectl(pool->free_count, 2, "Their addresses freed");
+    expect(pool->dormant.v[0]->last_use == start + 500, "Host 5 oldest left");
+}
+
+/* Check the pool against the addresses handed out before a restart */
+static void check_restored(const struct in_addr *before, const char *what) {
+    struct dynamic_pool *pool = gcfg.dyn_pools[0];
+    struct dyn_heap *heaps[2] = { &pool->mapped, &pool->dormant };
+    struct map_dynamic *d;
+    char msg[128];
+    int same = 0;
+
+    snprintf(msg, sizeof(msg), "%s: recent leases active", what);
+    expectl(pool->mapped.len, (POOL_FREE + 1) / 2, msg);
+    snprintf(msg, sizeof(msg), "%s: old leases dormant", what);
+    expectl(pool->dormant.len, POOL_FREE / 2, msg);
+    snprintf(msg, sizeof(msg), "%s: dormant heap ordered", what);
+    for(uint32_t i = 1; i < pool->dormant.len; i++)
+        expect(pool->dormant.v[(i - 1) / 2]->expires <=
+                pool->dormant.v[i]->expires, msg);
+    for(int k = 0; k < 2; k++) {
+        for(uint32_t i = 0; i < heaps[k]->len; i++) {
+            d = heaps[k]->v[i];
+            int h = ntohl(d->map6.addr.s6_addr32[3]) - 0x1000;
+            if(h >= 0 && h < POOL_FREE &&
+                    d->map4.addr.s_addr == before[h].s_addr)
+                same++;
+        }
+    }
+    snprintf(msg, sizeof(msg), "%s: hosts keep their addresses", what);
+    expectl(same, POOL_FREE, msg);
+}
+
+static long file_size(const char *path) {
+    struct stat st;
+
+    return stat(path, &st) < 0 ? -1 : st.st_size;
+}
+
+/* Test that leases survive a restart, through the journal alone and
+ * then through the map file */
+void test_dynamic_reload(void) {
+    char dir[] = "/tmp/unit_dynamic-XXXXXX";
+    struct in_addr before[POOL_FREE];
+    char cwd[512];
+
+    if(!getcwd(cwd, sizeof(cwd)) || !mkdtemp(dir) || chdir(dir) < 0) {
+        expect(0, "Create data directory");
+        return;
+    }
+    if(load_config("") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    expectl(file_size("dynamic.journal"), 0, "Empty journal");
+
+    /* load_dynamic() reads the clock, so these are relative to it.
+     * The odd hosts were last seen long enough ago to load dormant. */
+    for(int h = 0; h < POOL_FREE; h++) {
+        now = time(NULL) - 10 - (h & 1) * gcfg.dyn_min_lease * 2;
+        map_host(h, &before[h]);
+    }
+    expect(file_size("dynamic.journal") > 0, "Assignments journaled");
+
+    /* Stop without writing the map file */
+    if(load_config("") < 0) {
+        expect(0, "Reload configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    expectl(file_size("dynamic.journal"), 0, "Journal folded into map file");
+    check_restored(before, "Journal");
+
+    /* A rewrite in the background, then a clean stop waits for it */
+    gcfg.last_map_write = 1;
+    dynamic_maint(0);
+    dynamic_maint(1);
+    expectl(file_size("dynamic.journal~"), -1, "Old journal removed");
+    if(load_config("") < 0) {
+        expect(0, "Reload configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    check_restored(before, "Map file");
+
+    /* An expiry in the journal frees the address */
+    gcfg.max_commit_delay = gcfg.dyn_max_lease * 4;
+    now = time(NULL) + gcfg.dyn_max_lease * 2;
+    dynamic_maint(0);
+    expect(file_size("dynamic.journal") > 0, "Expiry journaled");
+    if(load_config("") < 0) {
+        expect(0, "Reload configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    expectl(gcfg.dyn_pools[0]->mapped.len + gcfg.dyn_pools[0]->dormant.len,
+            0, "Expired leases not restored");
+
+    unlink("dynamic.map");
+    unlink("dynamic.journal");
+    if(chdir(cwd) < 0 || rmdir(dir) < 0) expect(0, "Remove data directory");
+}
+
+/* Test that the journal survives a map file rewrite which fails at
+ * startup */
+void test_dynamic_fold_fail(void) {
+    char dir[] = "/tmp/unit_dynamic-XXXXXX";
+    struct in_addr before[POOL_FREE];
+    char cwd[512];
+
+    if(!getcwd(cwd, sizeof(cwd)) || !mkdtemp(dir) || chdir(dir) < 0) {
+        expect(0, "Create data directory");
+        return;
+    }
+    if(load_config("") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    for(int h = 0; h < POOL_FREE; h++) {
+        now = time(NULL) - 10 - (h & 1) * gcfg.dyn_min_lease * 2;
+        map_host(h, &before[h]);
+    }
+
+    /* The temporary map file cannot be created */
+    if(mkdir("dynamic.map~~", 0755) < 0) {
+        expect(0, "Block map file");
+        return;
+    }
+    for(int i = 0; i < 2; i++) {
+        if(load_config("") < 0) {
+            expect(0, "Reload configuration");
+            return;
+        }
+        strcpy(gcfg.data_dir, dir);
+        load_dynamic();
+        check_restored(before, i ? "Second failed fold" : "Failed fold");
+        expect(file_size("dynamic.journal~") > 0, "Replayed journal kept");
+    }
+
+    /* The next fold which succeeds has every lease */
+    rmdir("dynamic.map~~");
+    if(load_config("") < 0) {
+        expect(0, "Reload configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    check_restored(before, "Fold after failure");
+    expectl(file_size("dynamic.journal~"), -1, "Old journal removed");
+    if(load_config("") < 0) {
+        expect(0, "Reload configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    unlink("dynamic.journal");
+    load_dynamic();
+    check_restored(before, "Map file after failure");
+
+    unlink("dynamic.map");
+    unlink("dynamic.journal");
+    if(chdir(cwd) < 0 || rmdir(dir) < 0) expect(0, "Remove data directory");
+}
+
+/* Create and enter a data directory */
+static int enter_data_dir(char *dir, char *cwd, size_t len) {
+    if(!getcwd(cwd, len) || !mkdtemp(dir) || chdir(dir) < 0) return -1;
+    return 0;
+}
+
+static void leave_data_dir(const char *dir, const char *cwd) {
+    unlink("dynamic.map");
+    unlink("dynamic.db");
+    unlink("dynamic.db.bad");
+    unlink("dynamic.journal");
+    if(chdir(cwd) < 0 || rmdir(dir) < 0) expect(0, "Remove data directory");
+}
+
+/* Test the binary lease database, and conversion to and from it */
+void test_dynamic_db(void) {
+    char dir[] = "/tmp/unit_dynamic-XXXXXX";
+    struct in_addr before[POOL_FREE];
+    char cwd[512], magic[8];
+    FILE *f;
+
+    if(enter_data_dir(dir, cwd, sizeof(cwd)) < 0) {
+        expect(0, "Create data directory");
+        return;
+    }
+    if(load_config("dynamic-format binary\n") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    expectl(file_size("dynamic.db"), 32, "Empty database written");
+    for(int h = 0; h < POOL_FREE; h++) {
+        now = time(NULL) - 10 - (h & 1) * gcfg.dyn_min_lease * 2;
+        map_host(h, &before[h]);
+    }
+
+    /* Restart through the journal, then cleanly */
+    if(load_config("dynamic-format binary\n") < 0) {
+        expect(0, "Reload configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    check_restored(before, "Database journal");
+    dynamic_maint(1);
+    if(load_config("dynamic-format binary\n") < 0) {
+        expect(0, "Reload configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    check_restored(before, "Database");
+    expectl(file_size("dynamic.db"), 32 + 32 * POOL_FREE, "Database size");
+    expectl(file_size("dynamic.map"), -1, "No text map file");
+    f = fopen("dynamic.db", "r");
+    expect(f && fread(magic, 1, 8, f) == 8 && !memcmp(magic, "TAYGALDB", 8),
+            "Database magic");
+    if(f) fclose(f);
+
+    /* Convert to text and back */
+    if(load_config("") < 0) {
+        expect(0, "Reload configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    check_restored(before, "Converted to text");
+    expectl(file_size("dynamic.db"), -1, "Database removed");
+    if(load_config("dynamic-format binary\n") < 0) {
+        expect(0, "Reload configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    check_restored(before, "Converted to binary");
+    expectl(file_size("dynamic.map"), -1, "Text map file removed");
+
+    /* A damaged database is set aside rather than trusted */
+    f = fopen("dynamic.db", "r+");
+    if(f) {
+        fseek(f, 40, SEEK_SET);
+        fputc(0x5a, f);
+        fclose(f);
+    }
+    if(load_config("dynamic-format binary\n") < 0) {
+        expect(0, "Reload configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    expectl(gcfg.dyn_pools[0]->mapped.len + gcfg.dyn_pools[0]->dormant.len,
+            0, "Damaged database ignored");
+    expectl(file_size("dynamic.db.bad"), 32 + 32 * POOL_FREE,
+            "Damaged database kept");
+    leave_data_dir(dir, cwd);
+}
+
+/* Test that bad map file lines are skipped and good ones kept */
+void test_dynamic_load(void) {
+    char dir[] = "/tmp/unit_dynamic-XXXXXX";
+    struct dynamic_pool *pool;
+    struct in_addr addr4;
+    struct map4 *m4;
+    char cwd[512];
+    long recent, old;
+    FILE *f;
+
+    if(enter_data_dir(dir, cwd, sizeof(cwd)) < 0) {
+        expect(0, "Create data directory");
+        return;
+    }
+    if(load_config("map 192.0.2.4 2001:db8:2::4\n") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    pool = gcfg.dyn_pools[0];
+    recent = time(NULL) - 10;
+    old = time(NULL) - gcfg.dyn_min_lease * 2;
+    f = fopen("dynamic.map", "w");
+    fprintf(f, "# comment\n\n"
+            "192.0.2.1\t2001:db8:1::1001\t%ld\n"
+            "  192.0.2.2 2001:db8:1::1002   %ld\r\n"
+            "192.0.2.3\t2001:db8:1::1003\t%ld\textra\n"
+            "192.0.2.4\t2001:db8:1::1004\t%ld\n"
+            "192.0.2.5\t2001:db8:2::4\t%ld\n"
+            "192.0.2.6\t2001:db8:64::1\t%ld\n"
+            "192.0.2.7\t2001:db8:1::1001\t%ld\n"
+            "192.0.2.08\t2001:db8:1::1008\t%ld\n"
+            "192.0.2.256\t2001:db8:1::1008\t%ld\n"
+            "192.0.2.9\t2001:db8:1::1009\t-5\n"
+            "192.0.2.11\t2001:db8:1::100b\t99999999999999999999\n"
+            "198.51.100.1\t2001:db8:1::100c\t%ld\n"
+            "192.0.2.10\t2001:db8:1::100a\t%ld",
+            recent, old, old, old, old, old, old, old, old, old, old);
+    fclose(f);
+    load_dynamic();
+
+    expectl(pool->mapped.len, 1, "Recent lease active");
+    expectl(pool->dormant.len, 2, "Old leases dormant");
+    expectl(pool->free_count, POOL_FREE - 3, "Only good leases use addresses");
+    addr4.s_addr = htonl(0xc0000201);
+    m4 = find_map4(&addr4);
+    expect(m4 && m4->type == MAP_TYPE_DYNAMIC_HOST, "Active lease mapped");
+    expect(map_host(0xa, &addr4) == ERROR_NONE &&
+            addr4.s_addr == htonl(0xc000020a), "Last line without newline");
+    expect(map_host(2, &addr4) == ERROR_NONE &&
+            addr4.s_addr == htonl(0xc0000202), "Spaces and CRLF accepted");
+    leave_data_dir(dir, cwd);
+}
+
+/* Test loading a map file which fills a /16 */
+void test_dynamic_load_large(void) {
+    char dir[] = "/tmp/unit_dynamic-XXXXXX";
+    struct dynamic_pool *pool;
+    struct timespec t0, t1;
+    struct in6_addr addr6;
+    char a6[INET6_ADDRSTRLEN], line[256], cwd[512];
+    long recent, old;
+    uint32_t i, n;
+    FILE *f;
+
+    if(enter_data_dir(dir, cwd, sizeof(cwd)) < 0) {
+        expect(0, "Create data directory");
+        return;
+    }
+    if(load_pool_config("10.64.0.0/16", "") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    pool = gcfg.dyn_pools[0];
+    recent = time(NULL) - 10;
+    old = time(NULL) - gcfg.dyn_min_lease * 2;
+    f = fopen("dynamic.map", "w");
+    /* Written out of order, alternately recent and old, with runs of
+     * zeros all over the IPv6 addresses */
+    for(i = LARGE_LEASES; i > 0; i--) {
+        fprintf(f, "10.64.%u.%u\t2001:0db8", i >> 8, i & 0xff);
+        for(int g = 2; g < 7; g++)
+            fprintf(f, ":%04x", i & (1 << (g * 2)) ? i : 0);
+        fprintf(f, ":%04x\t%ld\n", i, i & 1 ? recent - (i & 0x3ff) : old - i);
+    }
+    /* The network address is refused, so the file is rewritten */
+    fprintf(f, "10.64.0.0\t2001:db8::ffff:1\t%ld\n", old);
+    fclose(f);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    load_dynamic();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("Loaded %u leases in %.1f ms\n", LARGE_LEASES,
+            (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+    expectl(pool->mapped.len, LARGE_LEASES / 2, "Recent leases active");
+    expectl(pool->dormant.len, LARGE_LEASES / 2, "Old leases dormant");
+    for(i = 1; i < pool->dormant.len; i++)
+        if(pool->dormant.v[(i - 1) / 2]->expires > pool->dormant.v[i]->expires)
+            break;
+    expectl(i, pool->dormant.len, "Dormant heap ordered");
+    for(i = 1; i < pool->mapped.len; i++)
+        if(pool->mapped.v[(i - 1) / 2]->expires > pool->mapped.v[i]->expires)
+            break;
+    expectl(i, pool->mapped.len, "Mapped heap ordered");
+    for(i = 0; i < pool->dormant.len; i++)
+        if(pool->dormant.v[i]->heap_idx != (int)i) break;
+    expectl(i, pool->dormant.len, "Heap indexes kept");
+    expect(pool->dormant.v[0]->last_use == old - (LARGE_LEASES & ~1U),
+            "Oldest lease at the top");
+
+    /* The map file is written back as inet_ntop() would */
+    f = fopen("dynamic.map", "r");
+    n = 0;
+    while(f && fgets(line, sizeof(line), f)) {
+        char *tok, *save;
+
+        if(line[0] == '#' || line[0] == '\n') continue;
+        strtok_r(line, "\t", &save);
+        tok = strtok_r(NULL, "\t", &save);
+        if(!tok || !inet_pton(AF_INET6, tok, &addr6)) break;
+        inet_ntop(AF_INET6, &addr6, a6, sizeof(a6));
+        if(strcmp(a6, tok)) break;
+        n++;
+    }
+    if(f) fclose(f);
+    expectl(n, LARGE_LEASES, "Map file rewritten");
+
+    /* Convert to the binary database, then load from it */
+    for(int pass = 0; pass < 2; pass++) {
+        if(load_pool_config("10.64.0.0/16", "dynamic-format binary\n") < 0) {
+            expect(0, "Load configuration");
+            break;
+        }
+        strcpy(gcfg.data_dir, dir);
+        pool = gcfg.dyn_pools[0];
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        load_dynamic();
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    }
+    printf("Loaded %u leases from the database in %.1f ms\n", LARGE_LEASES,
+            (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    expectl(pool->mapped.len + pool->dormant.len, LARGE_LEASES,
+            "Database restored");
+    expectl(file_size("dynamic.db"), 32 + 32 * LARGE_LEASES, "Database size");
+    leave_data_dir(dir, cwd);
+}
+
+/* Total leases held by every pool */
+static uint32_t pool_leases(void) {
+    uint32_t n = 0;
+
+    for(int k = 0; k < gcfg.dyn_pool_count; k++)
+        n += gcfg.dyn_pools[k]->mapped.len + gcfg.dyn_pools[k]->dormant.len;
+    return n;
+}
+
+/* Test that several pools are used, and their leases kept apart */
+void test_dynamic_pools(void) {
+    char dir[] = "/tmp/unit_dynamic-XXXXXX";
+    struct in_addr addr4, seen[POOL_FREE + 7];
+    uint32_t in_second = 0;
+    char cwd[512];
+    int dup = 0, outside = 0;
+
+    if(enter_data_dir(dir, cwd, sizeof(cwd)) < 0) {
+        expect(0, "Create data directory");
+        return;
+    }
+    if(load_config("dynamic-pool 198.51.100.0/29\n") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    expectl(gcfg.dyn_pool_count, 2, "Two pools");
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    now = time(NULL);
+
+    /* The /29 keeps its network address, the pools are separate */
+    for(int i = 0; i < POOL_FREE + 7; i++) {
+        expectl(map_host(i, &addr4), ERROR_NONE, "Assign");
+        uint32_t a = ntohl(addr4.s_addr);
+        if((a & ~0x7U) == 0xc6336400) in_second++;
+        else if((a & ~0xfU) != 0xc0000200 || !(a & 0xf)) outside++;
+        for(int j = 0; j < i; j++)
+            if(seen[j].s_addr == addr4.s_addr) dup++;
+        seen[i] = addr4;
+    }
+    expectl(outside, 0, "Assigned within the pools");
+    expectl(in_second, 7, "Second pool used in full");
+    expectl(dup, 0, "No address assigned twice");
+    expectl(map_host(POOL_FREE + 7, &addr4), ERROR_REJECT, "All pools full");
+
+    /* Each lease goes back to its own pool after a restart */
+    if(load_config("dynamic-pool 198.51.100.0/29\n") < 0) {
+        expect(0, "Reload configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    expectl(gcfg.dyn_pools[0]->mapped.len, POOL_FREE, "First pool restored");
+    expectl(gcfg.dyn_pools[1]->mapped.len, 7, "Second pool restored");
+    expectl(map_host(7, &addr4), ERROR_NONE, "Restored host");
+    expectl(addr4.s_addr, seen[7].s_addr, "Same address after restart");
+    leave_data_dir(dir, cwd);
+
+    /* Pools may not overlap */
+    expectl(load_config("dynamic-pool 192.0.2.8/29\n"), -1, "Nested pool");
+    expectl(load_config("dynamic-pool 192.0.0.0/16\n"), -1, "Enclosing pool");
+}
+
+/* Test that a sharded pool hands out every address once */
+void test_dynamic_shards(void) {
+    struct in_addr addr4, seen[POOL_FREE];
+    int dup = 0, outside = 0, used = 0, moved = 0;
+    uint32_t foreign = 0;
+
+    if(load_pool_config("192.0.2.0/28 shards 4", "") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    expectl(gcfg.dyn_pool_count, 4, "Four shards");
+    for(int k = 0; k < gcfg.dyn_pool_count; k++) {
+        expectl(gcfg.dyn_pools[k]->map4.prefix_len, 30, "Shard length");
+        expectl(ntohl(gcfg.dyn_pools[k]->map4.addr.s_addr),
+                0xc0000200 + 4 * k, "Shard address");
+    }
+    expectl(gcfg.dyn_pools[0]->free_count, 3, "First shard reserves one");
+    expectl(gcfg.dyn_pools[1]->free_count, 4, "Other shards reserve none");
+
+    /* The first few hosts spread over the shards */
+    for(int i = 0; i < 4; i++)
+        map_host(i, &seen[i]);
+    for(int k = 0; k < gcfg.dyn_pool_count; k++)
+        if(gcfg.dyn_pools[k]->mapped.len) used++;
+    expect(used > 1, "Hosts spread over shards");
+
+    /* Full shards pass hosts on to the others */
+    for(int i = 4; i < POOL_FREE; i++)
+        expectl(map_host(i, &seen[i]), ERROR_NONE, "Assign");
+    for(int i = 0; i < POOL_FREE; i++) {
+        if((ntohl(seen[i].s_addr) & ~0xfU) != 0xc0000200 ||
+                (ntohl(seen[i].s_addr) & 0xf) == 0)
+            outside++;
+        for(int j = 0; j < i; j++)
+            if(seen[j].s_addr == seen[i].s_addr) dup++;
+    }
+    expectl(outside, 0, "Assigned within the pool, not the network address");
+    expectl(dup, 0, "No address assigned twice");
+    expectl(pool_leases(), POOL_FREE, "Every address leased");
+    expectl(map_host(3, &addr4), ERROR_NONE, "Existing host");
+    expectl(addr4.s_addr, seen[3].s_addr, "Same address");
+    expectl(map_host(POOL_FREE, &addr4), ERROR_REJECT, "Full pool");
+    for(int k = 0; k < gcfg.dyn_pool_count; k++)
+        foreign += gcfg.dyn_pools[k]->foreign;
+    expect(foreign > 0, "Hosts with a full home shard counted");
+
+    /* Dormant leases are found whichever shard holds them */
+    now += gcfg.dyn_min_lease + 1;
+    dynamic_maint(0);
+    for(int i = 0; i < POOL_FREE; i++) {
+        map_host(i, &addr4);
+        if(addr4.s_addr != seen[i].s_addr) moved++;
+    }
+    expectl(moved, 0, "Dormant hosts keep their address");
+
+    /* Every lease goes dormant, then the oldest is taken over */
+    now += gcfg.dyn_min_lease + 1;
+    dynamic_maint(0);
+    expectl(map_host(POOL_FREE, &addr4), ERROR_NONE, "Reassign");
+    expectl(pool_leases(), POOL_FREE, "Lease taken over");
+
+    /* Expired leases no longer count as held away from home */
+    now += gcfg.dyn_max_lease + 1;
+    dynamic_maint(0);
+    dynamic_maint(0);
+    foreign = 0;
+    for(int k = 0; k < gcfg.dyn_pool_count; k++)
+        foreign += gcfg.dyn_pools[k]->foreign;
+    expectl(pool_leases(), 0, "Every lease expired");
+    expectl(foreign, 0, "No hosts counted away from home");
+}
+
+/* Hosts each thread assigns, and hosts every thread maps */
+#define THREAD_HOSTS 30
+#define SHARED_HOSTS 10
+#define NUM_THREADS 8
+
+static struct in_addr thread_addr[NUM_THREADS][THREAD_HOSTS + SHARED_HOSTS];
+static pthread_barrier_t barrier;
+
+static void *assign_thread(void *arg) {
+    int t = (int)(intptr_t)arg;
+
+    pthread_barrier_wait(&barrier);
+    for(int i = 0; i < THREAD_HOSTS + SHARED_HOSTS; i++) {
+        /* Shared hosts come first, so the threads race for them */
+        int h = i < SHARED_HOSTS ? 10000 + i :
+            t * THREAD_HOSTS + i - SHARED_HOSTS;
+        if(map_host(h, &thread_addr[t][i]) < 0)
+            thread_addr[t][i].s_addr = 0;
+    }
+    return NULL;
+}
+
+/* Test assignment from many threads at once */
+void test_dynamic_threads(void) {
+    char dir[] = "/tmp/unit_dynamic-XXXXXX";
+    pthread_t th[NUM_THREADS];
+    struct in_addr *all;
+    uint32_t n = NUM_THREADS * THREAD_HOSTS + SHARED_HOSTS, free_count = 0;
+    char cwd[512];
+    int dup = 0, failed = 0, differ = 0, k = 0;
+
+    if(enter_data_dir(dir, cwd, sizeof(cwd)) < 0) {
+        expect(0, "Create data directory");
+        return;
+    }
+    if(load_pool_config("192.0.2.0/24 shards 8", "") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    now = time(NULL);
+
+    pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+    for(int t = 0; t < NUM_THREADS; t++)
+        pthread_create(&th[t], NULL, assign_thread, (void *)(intptr_t)t);
+    for(int t = 0; t < NUM_THREADS; t++)
+        pthread_join(th[t], NULL);
+    pthread_barrier_destroy(&barrier);
+
+    all = calloc(n, sizeof(*all));
+    for(int t = 0; t < NUM_THREADS; t++) {
+        for(int i = 0; i < THREAD_HOSTS + SHARED_HOSTS; i++) {
+            if(!thread_addr[t][i].s_addr) failed++;
+            if(i < SHARED_HOSTS) {
+                if(thread_addr[t][i].s_addr != thread_addr[0][i].s_addr)
+                    differ++;
+                if(t) continue;
+            }
+            if(all) all[k++] = thread_addr[t][i];
+        }
+    }
+    for(int i = 0; all && i < k; i++)
+        for(int j = 0; j < i; j++)
+            if(all[i].s_addr == all[j].s_addr) dup++;
+    free(all);
+    for(int p = 0; p < gcfg.dyn_pool_count; p++)
+        free_count += gcfg.dyn_pools[p]->free_count;
+    expectl(failed, 0, "Every host assigned");
+    expectl(differ, 0, "Shared hosts got one address");
+    expectl(dup, 0, "No address assigned twice");
+    expectl(pool_leases(), n, "One lease per host");
+    expectl(free_count, 255 - n, "Free addresses counted");
+
+    /* Every assignment was journaled */
+    if(load_pool_config("192.0.2.0/24 shards 8", "") < 0) {
+        expect(0, "Reload configuration");
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    expectl(pool_leases(), n, "Leases restored");
+    leave_data_dir(dir, cwd);
+}
+
+/* Test assignment by the assignment thread */
+void test_dynamic_async(void) {
+    struct in_addr addr4, seen[POOL_FREE];
+    uint64_t queued;
+    int dup = 0, mapped = 0;
+
+    if(load_config("dynamic-assign async\n") < 0) {
+        expect(0, "Load configuration");
+        return;
+    }
+    expectl(gcfg.dyn_assign_mode, DYN_ASSIGN_ASYNC, "Async mode");
+
+    /* A host waits in the queue until the thread starts */
+    queued = stats_workers[0].c.dyn_queued;
+    expectl(map_host(0, &addr4), ERROR_DROP, "First packet dropped");
+    expectl(map_host(0, &addr4), ERROR_DROP, "Retry dropped");
+    expectl(stats_workers[0].c.dyn_queued - queued, 1, "Queued once");
+    expectl(pool_leases(), 0, "Not assigned on the packet path");
+
+    expectl(dynamic_async_start(), 0, "Start thread");
+    for(int i = 1; i < POOL_FREE; i++)
+        map_host(i, &addr4);
+
+    /* Hosts retry until the thread has mapped them */
+    for(int tries = 0; tries < 1000 && mapped < POOL_FREE; tries++) {
+        usleep(1000);
+        mapped = 0;
+        for(int i = 0; i < POOL_FREE; i++)
+            if(map_host(i, &seen[i]) == ERROR_NONE) mapped++;
+    }
+    expectl(mapped, POOL_FREE, "Retries mapped");
+    for(int i = 0; i < POOL_FREE; i++)
+        for(int j = 0; j < i; j++)
+            if(seen[j].s_addr == seen[i].s_addr) dup++;
+    expectl(dup, 0, "No address assigned twice");
+
+    /* A full pool drops rather than rejects */
+    expectl(map_host(POOL_FREE, &addr4), ERROR_DROP, "Full pool");
+    dynamic_async_stop();
+    expectl(pool_leases(), POOL_FREE, "One lease per host");
+}
+
+/* Open a UDP socket on an unused loopback port */
+static int udp_socket(int *port) {
+    struct sockaddr_in sin = { .sin_family = AF_INET };
+    socklen_t len = sizeof(sin);
+    struct timeval tv = { .tv_sec = 2 };
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(fd < 0 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+            getsockname(fd, (struct sockaddr *)&sin, &len) < 0) {
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    *port = ntohs(sin.sin_port);
+    return fd;
+}
+
+/* Datagrams sent by the active, as the standby is to receive them */
+#define REPL_HOSTS 8
+#define REPL_MAX_PKTS 16
+
+static uint8_t repl_pkt[REPL_MAX_PKTS][1500];
+static ssize_t repl_len[REPL_MAX_PKTS];
+
+/* Send the saved datagrams to the standby from a loopback address */
+static void repl_send_from(const char *src, int port, int first, int n) {
+    struct sockaddr_in from = { .sin_family = AF_INET };
+    struct sockaddr_in to = { .sin_family = AF_INET };
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    inet_pton(AF_INET, src, &from.sin_addr);
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    to.sin_port = htons(port);
+    if(fd < 0 || bind(fd, (struct sockaddr *)&from, sizeof(from)) < 0) {
+        expect(0, "Open sender");
+        if(fd >= 0) close(fd);
+        return;
+    }
+    for(int i = first; i < first + n; i++)
+        sendto(fd, repl_pkt[i], repl_len[i], 0, (struct sockaddr *)&to,
+                sizeof(to));
+    close(fd);
+}
+
+/* Test lease replication from an active to a standby */
+void test_dynamic_repl(void) {
+    struct sockaddr_in to = { .sin_family = AF_INET };
+    struct in_addr addr4, seen[REPL_HOSTS];
+    uint64_t received, ignored, lost, assigned, rejected;
+    char dir[] = "/tmp/unit_dynamic-XXXXXX";
+    char extra[128], cwd[512];
+    int rx, tx, port, npkts = 0, records = 0, same = 0;
+    long journal;
+    uint32_t seq;
+    uint16_t count;
+
+    /* The active sends a full copy as it starts, then each change */
+    rx = udp_socket(&port);
+    expect(rx >= 0, "Open receiver");
+    if(rx < 0) return;
+    snprintf(extra, sizeof(extra), "dynamic-replica 127.0.0.1 %d\n", port);
+    if(load_config(extra) < 0) {
+        expect(0, "Load configuration");
+        close(rx);
+        return;
+    }
+    now = time(NULL);
+    for(int i = 0; i < REPL_HOSTS / 2; i++)
+        map_host(i, &seen[i]);
+    expectl(dynamic_repl_start(), 0, "Start replication");
+    repl_len[0] = recv(rx, repl_pkt[0], sizeof(repl_pkt[0]), 0);
+    expectl(repl_len[0], 32 + 32 * REPL_HOSTS / 2, "Full copy length");
+    if(repl_len[0] > 0) {
+        records = REPL_HOSTS / 2;
+        npkts = 1;
+    }
+    for(int i = REPL_HOSTS / 2; i < REPL_HOSTS; i++)
+        map_host(i, &seen[i]);
+    while(records < REPL_HOSTS && npkts < REPL_MAX_PKTS) {
+        repl_len[npkts] = recv(rx, repl_pkt[npkts], sizeof(repl_pkt[0]), 0);
+        if(repl_len[npkts] < 32) break;
+        memcpy(&count, &repl_pkt[npkts][8], sizeof(count));
+        records += ntohs(count);
+        npkts++;
+    }
+    dynamic_repl_stop();
+    close(rx);
+    expectl(records, REPL_HOSTS, "Every lease sent");
+    expect(npkts >= 2 && npkts < REPL_HOSTS, "Changes sent in batches");
+    expect(!memcmp(repl_pkt[0], "TYRL", 4), "Magic");
+
+    /* The standby takes them on as active leases */
+    tx = udp_socket(&port);
+    close(tx);
+    if(enter_data_dir(dir, cwd, sizeof(cwd)) < 0) {
+        expect(0, "Create data directory");
+        return;
+    }
+    snprintf(extra, sizeof(extra), "dynamic-replica-listen 127.0.0.1 %d\n"
+            "dynamic-replica-peer 127.0.0.1\n", port);
+    if(load_config(extra) < 0) {
+        expect(0, "Load standby configuration");
+        leave_data_dir(dir, cwd);
+        return;
+    }
+    strcpy(gcfg.data_dir, dir);
+    load_dynamic();
+    expect(dynamic_repl_listen() >= 0, "Listen");
+    tx = socket(AF_INET, SOCK_DGRAM, 0);
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    to.sin_port = htons(port);
+    received = stats_workers[0].c.dyn_repl_recv;
+    ignored = stats_workers[0].c.dyn_repl_ignored;
+    lost = stats_workers[0].c.dyn_repl_lost;
+    assigned = stats_workers[0].c.dyn_assign;
+    for(int i = 0; i < npkts; i++)
+        sendto(tx, repl_pkt[i], repl_len[i], 0, (struct sockaddr *)&to,
+                sizeof(to));
+    dynamic_repl_read();
+    expectl(stats_workers[0].c.dyn_repl_recv - received, REPL_HOSTS,
+            "Changes received");
+    expectl(stats_workers[0].c.dyn_repl_ignored - ignored, 0,
+            "Changes applied");
+    expectl(pool_leases(), REPL_HOSTS, "Leases replicated");
+
+    /* A datagram sent again is dropped */
+    journal = file_size("dynamic.journal");
+    expect(journal > 0, "Replicated leases journaled");
+    rejected = stats_workers[0].c.dyn_repl_rejected;
+    repl_send_from("127.0.0.1", port, npkts - 1, 1);
+    dynamic_repl_read();
+    expectl(stats_workers[0].c.dyn_repl_rejected - rejected, 1,
+            "Resent datagram rejected");
+    expectl(stats_workers[0].c.dyn_repl_recv - received, REPL_HOSTS,
+            "Nothing taken from a resent datagram");
+
+    /* A second full copy with nothing new is not journaled again */
+    for(int i = 0; i < npkts; i++) {
+        memcpy(&seq, &repl_pkt[i][12], sizeof(seq));
+        seq = htonl(ntohl(seq) + npkts);
+        memcpy(&repl_pkt[i][12], &seq, sizeof(seq));
+    }
+    repl_send_from("127.0.0.1", port, 0, npkts);
+    dynamic_repl_read();
+    expectl(stats_workers[0].c.dyn_repl_recv - received, 2 * REPL_HOSTS,
+            "Second copy received");
+    expectl(file_size("dynamic.journal"), journal,
+            "Unchanged leases not journaled");
+    received = stats_workers[0].c.dyn_repl_recv - REPL_HOSTS;
+
+    /* Only the peer is listened to */
+    rejected = stats_workers[0].c.dyn_repl_rejected;
+    repl_send_from("127.0.0.2", port, 0, 1);
+    dynamic_repl_read();
+    expectl(stats_workers[0].c.dyn_repl_rejected - rejected, 1,
+            "Datagram from another host rejected");
+    expectl(stats_workers[0].c.dyn_repl_recv - received, REPL_HOSTS,
+            "Nothing taken from another host");
+    for(int i = 0; i < REPL_HOSTS; i++)
+        if(map_host(i, &addr4) == ERROR_NONE &&
+                addr4.s_addr == seen[i].s_addr)
+            same++;
+    expectl(same, REPL_HOSTS, "Hosts keep their addresses");
+    expectl(stats_workers[0].c.dyn_assign - assigned, 0, "No new assignment");
+
+    /* An expiry, after two datagrams went missing */
+    memcpy(&seq, &repl_pkt[npkts - 1][12], sizeof(seq));
+    seq = htonl(ntohl(seq) + 3);
+    memcpy(&repl_pkt[0][12], &seq, sizeof(seq));
+    count = htons(1);
+    memcpy(&repl_pkt[0][8], &count, sizeof(count));
+    repl_pkt[0][32 + 31] = 2;
+    sendto(tx, repl_pkt[0], 32 + 32, 0, (struct sockaddr *)&to, sizeof(to));
+
+    /* And a datagram which is not ours */
+    memcpy(repl_pkt[1], "XXXX", 4);
+    sendto(tx, repl_pkt[1], repl_len[1], 0, (struct sockaddr *)&to,
+            sizeof(to));
+    dynamic_repl_read();
+    expectl(pool_leases(), REPL_HOSTS - 1, "Lease expired");
+    expect(!list_empty(&gcfg.dyn_pools[0]->retired),
+            "Active lease freed later");
+    dynamic_maint(1);
+    expect(list_empty(&gcfg.dyn_pools[0]->retired),
+            "Active lease freed by maintenance");
+    expectl(stats_workers[0].c.dyn_repl_lost - lost, 2, "Losses counted");
+    expectl(stats_workers[0].c.dyn_repl_recv - received, REPL_HOSTS + 1,
+            "Foreign datagram ignored");
+    close(tx);
+    dynamic_repl_stop();
+    leave_data_dir(dir, cwd);
+}
+
+#define REPL_KEY "000102030405060708090a0b0c0d0e0f"
+
+/* Test that datagrams are authenticated with dynamic-replica-key */
+void test_dynamic_repl_key(void) {
+    struct in_addr seen[REPL_HOSTS];
+    uint64_t received, rejected;
+    char extra[192];
+    int rx, port;
+    uint16_t flags;
+
+    /* The active tags each datagram */
+    rx = udp_socket(&port);
+    expect(rx >= 0, "Open receiver");
+    if(rx < 0) return;
+    snprintf(extra, sizeof(extra), "dynamic-replica 127.0.0.1 %d\n"
+            "dynamic-replica-key " REPL_KEY "\n", port);
+    if(load_config(extra) < 0) {
+        expect(0, "Load configuration");
+        close(rx);
+        return;
+    }
+    now = time(NULL) - 100;
+    for(int i = 0; i < REPL_HOSTS; i++)
+        map_host(i, &seen[i]);
+    expectl(dynamic_repl_start(), 0, "Start replication");
+    repl_len[3] = recv(rx, repl_pkt[3], sizeof(repl_pkt[3]), 0);
+    dynamic_repl_stop();
+
+    /* And again after a restart */
+    now = time(NULL);
+    expectl(dynamic_repl_start(), 0, "Restart replication");
+    repl_len[0] = recv(rx, repl_pkt[0], sizeof(repl_pkt[0]), 0);
+    dynamic_repl_stop();
+    close(rx);
+    expectl(repl_len[0], 32 + 32 * REPL_HOSTS + 8, "Tagged length");
+    expect(memcmp(&repl_pkt[0][16], &repl_pkt[3][16], 8),
+            "New session after a restart");
+    memcpy(&flags, &repl_pkt[0][10], sizeof(flags));
+    expectl(ntohs(flags), 3, "Full copy, tagged");
+
+    /* The standby checks the tag */
+    rx = udp_socket(&port);
+    close(rx);
+    snprintf(extra, sizeof(extra), "dynamic-replica-listen 127.0.0.1 %d\n"
+            "dynamic-replica-peer 127.0.0.1\n"
+            "dynamic-replica-key " REPL_KEY "\n", port);
+    if(load_config(extra) < 0) {
+        expect(0, "Load standby configuration");
+        return;
+    }
+    expect(dynamic_repl_listen() >= 0, "Listen");
+    received = stats_workers[0].c.dyn_repl_recv;
+    rejected = stats_workers[0].c.dyn_repl_rejected;
+
+    /* A changed record, then one without a tag */
+    memcpy(repl_pkt[1], repl_pkt[0], repl_len[0]);
+    repl_len[1] = repl_len[0];
+    repl_pkt[1][32 + 8] ^= 1;
+    memcpy(repl_pkt[2], repl_pkt[0], repl_len[0]);
+    repl_len[2] = repl_len[0] - 8;
+    repl_pkt[2][11] &= ~2;
+    repl_send_from("127.0.0.1", port, 1, 2);
+    dynamic_repl_read();
+    expectl(stats_workers[0].c.dyn_repl_rejected - rejected, 2,
+            "Forged datagrams rejected");
+    expectl(pool_leases(), 0, "Nothing taken from forged datagrams");
+
+    repl_send_from("127.0.0.1", port, 0, 1);
+    dynamic_repl_read();
+    expectl(stats_workers[0].c.dyn_repl_recv - received, REPL_HOSTS,
+            "Tagged datagram received");
+    expectl(pool_leases(), REPL_HOSTS, "Leases replicated");
+
+    /* Neither a resent datagram nor one from the earlier run is taken */
+    rejected = stats_workers[0].c.dyn_repl_rejected;
+    repl_send_from("127.0.0.1", port, 0, 1);
+    repl_send_from("127.0.0.1", port, 3, 1);
+    dynamic_repl_read();
+    expectl(stats_workers[0].c.dyn_repl_rejected - rejected, 2,
+            "Replayed datagrams rejected");
+    expectl(stats_workers[0].c.dyn_repl_recv - received, REPL_HOSTS,
+            "Nothing taken from replayed datagrams");
+    dynamic_repl_stop();
+}
+
+int main(void) {
+    print_fail_only = 0;
+
+    /* Test assignment */
+    test_dynamic_assign();
+
+    /* Test static maps inside the pool */
+    test_dynamic_static();
+
+    /* Test the life of a lease */
+    test_dynamic_lifecycle();
+
+    /* Test lease ordering */
+    test_dynamic_ageing();
+
+    /* Test the map file */
+    test_dynamic_reload();
+    test_dynamic_fold_fail();
+
+    /* Test map file parsing and checks */
+    test_dynamic_load();
+
+    /* Test the binary lease database */
+    test_dynamic_db();
+
+    /* Test several pools */
+    test_dynamic_pools();
+
+    /* Test a sharded pool */
+    test_dynamic_shards();
+
+    /* Test assignment from several threads */
+    test_dynamic_threads();
+
+    /* Test the assignment thread */
+    test_dynamic_async();
+
+    /* Test lease replication */
+    test_dynamic_repl();
+    test_dynamic_repl_key();
+
+    /* Test a large map file */
+    test_dynamic_load_large();
+
+    /* Return final status */
+    return overall();
+}
@@ -0,0 +1,138 @@
+/*
+ *  unit_ident.c - Unit test for ident.c
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "test/unit.h"
+#include "tayga.h"
+
+/* Number of worker threads to emulate */
+#define NUM_THREADS 8
+
+/* Number of distinct tuples to sample per thread */
+#define NUM_TUPLES 4096
+
+/* Cache line size the ident state must not share */
+#define CACHE_LINE 64
+
+struct thread_result {
+    uintptr_t state;
+    size_t state_len;
+    long dups;
+    long wrapped;
+    long distinct;
+    uint16_t first[16];
+};
+
+static struct thread_result results[NUM_THREADS];
+static pthread_barrier_t barrier;
+
+static void *ident_thread(void *arg) {
+    struct thread_result *r = arg;
+    static _Thread_local uint8_t seen[65536];
+    struct in_addr src, dest;
+    uint16_t id, start = 0;
+    const void *state;
+
+    /* All threads hammer their generators at the same time */
+    pthread_barrier_wait(&barrier);
+
+    inet_pton(AF_INET, "192.0.2.1", &src);
+    inet_pton(AF_INET, "198.51.100.7", &dest);
+
+    /* The same tuple does not repeat for a full 65536 datagrams */
+    memset(seen, 0, sizeof(seen));
+    for(long i = 0; i < 65536; i++) {
+        id = ip4_ident(&src, &dest, 17);
+        if(i < 16) r->first[i] = id;
+        if(!i) start = id;
+        if(seen[id]++) r->dups++;
+    }
+    /* ...and then the sequence wraps around */
+    r->wrapped = ip4_ident(&src, &dest, 17) == start;
+
+    /* Different tuples start at unrelated points in the sequence space */
+    memset(seen, 0, sizeof(seen));
+    for(long i = 0; i < NUM_TUPLES; i++) {
+        dest.s_addr = htonl(0xc6336400 + i);
+        id = ip4_ident(&src, &dest, 6);
+        if(!seen[id]++) r->distinct++;
+    }
+
+    state = ip4_ident_state(&r->state_len);
+    r->state = (uintptr_t)state;
+    return NULL;
+}
+
+/* Generate idents concurrently and check the per-thread properties */
+void test_ident_threads(void) {
+    pthread_t threads[NUM_THREADS];
+    char msg[80];
+
+    pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+    for(int t = 0; t < NUM_THREADS; t++)
+        pthread_create(&threads[t], NULL, ident_thread, &results[t]);
+    for(int t = 0; t < NUM_THREADS; t++)
+        pthread_join(threads[t], NULL);
+    pthread_barrier_destroy(&barrier);
+
+    for(int t = 0; t < NUM_THREADS; t++) {
+        sprintf(msg, "Thread %d same tuple has no repeats", t);
+        expectl(results[t].dups, 0, msg);
+        sprintf(msg, "Thread %d same tuple wraps after 65536", t);
+        expect(results[t].wrapped, msg);
+        /* Birthday bound for 4096 draws from 65536 is ~3970 distinct */
+        sprintf(msg, "Thread %d different tuples are spread out", t);
+        expect(results[t].distinct > NUM_TUPLES * 9 / 10, msg);
+    }
+}
+
+/* Check that no two threads write to the same cache line */
+void test_ident_isolation(void) {
+    char msg[80];
+    int shared = 0, equal = 0;
+
+    for(int a = 0; a < NUM_THREADS; a++) {
+        uintptr_t a_lo = results[a].state / CACHE_LINE;
+        uintptr_t a_hi = (results[a].state + results[a].state_len - 1) /
+            CACHE_LINE;
+        sprintf(msg, "Thread %d state is cache line aligned", a);
+        expectl(results[a].state % CACHE_LINE, 0, msg);
+        for(int b = a + 1; b < NUM_THREADS; b++) {
+            uintptr_t b_lo = results[b].state / CACHE_LINE;
+            uintptr_t b_hi = (results[b].state + results[b].state_len - 1) /
+                CACHE_LINE;
+            if(a_lo <= b_hi && b_lo <= a_hi) shared++;
+            if(!memcmp(results[a].first, results[b].first,
+                        sizeof(results[a].first)))
+                equal++;
+        }
+    }
+    expectl(shared, 0, "No cache line is shared between threads");
+    expectl(equal, 0, "Each thread uses an independent key");
+}
+
+int main(void) {
+    print_fail_only = 0;
+
+    /* Test concurrent generation */
+    test_ident_threads();
+
+    /* Test that the state is private to each thread */
+    test_ident_isolation();
+
+    /* Return final status */
+    return overall();
+}
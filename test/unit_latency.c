@@ -0,0 +1,170 @@
+/*
+ *  unit_latency.c - Unit test for latency.c
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "test/unit.h"
+#include "tayga.h"
+
+/* stats.c (for worker_id) needs the configuration */
+struct config gcfg;
+
+/* Number of worker threads to emulate */
+#define NUM_THREADS 4
+
+/* Each thread records latencies 1..NUM_SAMPLES ticks */
+#define NUM_SAMPLES 10000
+
+/* Record one packet as if it had passed through tun_read */
+static void fake_packet(uint64_t ticks, int path, int cache) {
+    lat_pkt.start = 1000;
+    lat_pkt.end = 1000 + ticks;
+    lat_pkt.path = path;
+    lat_pkt.cache = cache;
+    lat_record();
+}
+
+/* Check the log-linear bucket layout */
+void test_lat_buckets(void) {
+    long wrong = 0, wide = 0, order = 0;
+    int prev = -1, b;
+
+    for(uint64_t v = 0; v < ((uint64_t)1 << 36); v += v / 7 + 1) {
+        b = lat_bucket(v);
+        if(b < prev) order++;
+        prev = b;
+        if(lat_bucket_value(b) > v || (b < LAT_BUCKETS - 1 &&
+                    lat_bucket_value(b + 1) <= v))
+            wrong++;
+        /* Bucket width is at most 1/16 of its lower bound */
+        if(b >= 16 && (lat_bucket_value(b + 1) - lat_bucket_value(b)) * 16 >
+                lat_bucket_value(b))
+            wide++;
+    }
+    expectl(order, 0, "Buckets are monotonic");
+    expectl(wrong, 0, "Values fall inside their bucket");
+    expectl(wide, 0, "Bucket width within 1/16");
+    for(b = 0; b < 16; b++)
+        if(lat_bucket(b) != b) wrong++;
+    expectl(wrong, 0, "Small values are exact");
+    expectl(lat_bucket(~(uint64_t)0), LAT_BUCKETS - 1, "Huge values clamp");
+}
+
+static pthread_barrier_t barrier;
+
+static void *lat_thread(void *arg) {
+    worker_id = (int)(intptr_t)arg;
+    pthread_barrier_wait(&barrier);
+    for(uint64_t i = 1; i <= NUM_SAMPLES; i++)
+        fake_packet(i, LAT_4TO6, (i & 1) ? LAT_CACHE_HIT : LAT_CACHE_MISS);
+    return NULL;
+}
+
+/* Record from several workers and check the aggregate quantiles */
+void test_lat_quantiles(void) {
+    pthread_t threads[NUM_THREADS];
+    uint64_t count[LAT_BUCKETS], n = 0, sum;
+    double p50, p99, p999;
+
+    lat_ns_per_tick = 1.0;
+    pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+    for(int t = 0; t < NUM_THREADS; t++)
+        pthread_create(&threads[t], NULL, lat_thread,
+                (void *)(intptr_t)(t + 1));
+    for(int t = 0; t < NUM_THREADS; t++)
+        pthread_join(threads[t], NULL);
+    pthread_barrier_destroy(&barrier);
+
+    lat_read(LAT_4TO6, count, &sum);
+    for(int b = 0; b < LAT_BUCKETS; b++) n += count[b];
+    expectl(n, NUM_THREADS * NUM_SAMPLES, "All samples counted");
+    expectl(sum, NUM_THREADS * ((long)NUM_SAMPLES * (NUM_SAMPLES + 1) / 2),
+        "Sum of latencies");
+
+    p50 = lat_quantile(count, 0.5);
+    p99 = lat_quantile(count, 0.99);
+    p999 = lat_quantile(count, 0.999);
+    expect(p50 > NUM_SAMPLES * 0.5 * 0.95 && p50 < NUM_SAMPLES * 0.5 * 1.05,
+        "p50 within 5%");
+    expect(p99 > NUM_SAMPLES * 0.99 * 0.95 && p99 < NUM_SAMPLES * 0.99 * 1.05,
+        "p99 within 5%");
+    expect(p999 > NUM_SAMPLES * 0.999 * 0.95 &&
+        p999 < NUM_SAMPLES * 0.999 * 1.05, "p999 within 5%");
+    expect(p50 <= p99 && p99 <= p999, "Quantiles are ordered");
+
+    lat_read(LAT_CACHE_HIT, count, &sum);
+    n = 0;
+    for(int b = 0; b < LAT_BUCKETS; b++) n += count[b];
+    expectl(n, NUM_THREADS * NUM_SAMPLES / 2, "Cache hits counted");
+    /* Hits are the odd latencies, which sum to (NUM_SAMPLES / 2)^2 */
+    expectl(sum, NUM_THREADS * ((long)NUM_SAMPLES / 2) * (NUM_SAMPLES / 2),
+        "Sum of cache hit latencies");
+    lat_read(LAT_6TO4, count, NULL);
+    expect(lat_quantile(count, 0.5) == 0.0, "Empty histogram");
+}
+
+/* Check which packets are recorded and how cache lookups combine */
+void test_lat_record(void) {
+    uint64_t count[LAT_BUCKETS], n;
+
+    lat_reset();
+    worker_id = 0;
+
+    /* A packet which was never written is not recorded */
+    LAT_BEGIN();
+    LAT_PATH(LAT_6TO4);
+    LAT_FINISH();
+    /* Neither is one which was written without a known path */
+    LAT_BEGIN();
+    LAT_END();
+    LAT_FINISH();
+    /* A hit followed by a miss counts as a miss */
+    LAT_BEGIN();
+    LAT_CACHE(1);
+    LAT_CACHE(0);
+    LAT_CACHE(1);
+    LAT_PATH(LAT_6TO4);
+    LAT_END();
+    LAT_FINISH();
+
+    lat_read(LAT_6TO4, count, NULL);
+    n = 0;
+    for(int b = 0; b < LAT_BUCKETS; b++) n += count[b];
+    expectl(n, 1, "Only the written packet is recorded");
+    lat_read(LAT_CACHE_MISS, count, NULL);
+    n = 0;
+    for(int b = 0; b < LAT_BUCKETS; b++) n += count[b];
+    expectl(n, 1, "Any miss makes the packet a miss");
+    lat_read(LAT_4TO6, count, NULL);
+    n = 0;
+    for(int b = 0; b < LAT_BUCKETS; b++) n += count[b];
+    expectl(n, 0, "Reset clears other histograms");
+}
+
+int main(void) {
+    print_fail_only = 0;
+
+    /* Test the bucket layout */
+    test_lat_buckets();
+
+    /* Test recording and quantiles */
+    test_lat_quantiles();
+
+    /* Test the per-packet macros */
+    test_lat_record();
+
+    /* Return final status */
+    return overall();
+}
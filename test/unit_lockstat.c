@@ -0,0 +1,227 @@
+/*
+ *  unit_lockstat.c - Unit test for lockstat.c
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "test/unit.h"
+#include "tayga.h"
+
+/* lockstat.c names the mutexes in the configuration */
+struct config gcfg;
+
+/* Number of threads in the counting test */
+#define NUM_THREADS 4
+
+/* Acquisitions made by each thread */
+#define THREAD_ITER 10000
+
+/* How long the holder keeps the lock in the contention test, in ns */
+#define HOLD_NS 20000000
+
+static void sleep_ns(long ns) {
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = ns };
+    nanosleep(&ts, NULL);
+}
+
+/* Find the site registered by a function for a mutex */
+static struct lock_site *find_site(const char *func, const pthread_mutex_t *m) {
+    for(struct lock_site *s = lock_sites(); s; s = s->next)
+        if(!strcmp(s->func, func) && s->mutex == m) return s;
+    return NULL;
+}
+
+/* Test counting and hold time from a single thread */
+void test_lockstat_basic(void) {
+    struct lock_site *s;
+
+    for(int i = 0; i < 3; i++) {
+        LOCK(&gcfg.map_mutex);
+        UNLOCK(&gcfg.map_mutex);
+    }
+    LOCK(&gcfg.cache_mutex);
+    sleep_ns(HOLD_NS);
+    UNLOCK(&gcfg.cache_mutex);
+
+    s = find_site(__func__, &gcfg.map_mutex);
+    expect(s != NULL, "map_mutex site registered");
+    if(!s) return;
+    expectl(s->acquired, 3, "Acquisitions counted");
+    expectl(s->contended, 0, "Uncontended");
+    expects(lock_name(s->mutex), "map_mutex", 32, "Lock name");
+
+    s = find_site(__func__, &gcfg.cache_mutex);
+    expect(s != NULL, "cache_mutex site registered");
+    if(!s) return;
+    expectl(s->acquired, 1, "Acquisitions counted");
+    expect(s->hold_ns >= HOLD_NS, "Hold time measured");
+    expect(s->max_hold_ns >= HOLD_NS, "Max hold time measured");
+}
+
+/* Helper for the nesting test, so the locks are taken at another site */
+static void take_both(void) {
+    LOCK(&gcfg.map_mutex);
+    LOCK(&gcfg.cache_mutex);
+}
+
+/* Test that holds are charged to the acquiring site when nested */
+void test_lockstat_nested(void) {
+    struct lock_site *map, *cache;
+
+    take_both();
+    sleep_ns(HOLD_NS);
+    /* Release out of order, then hold cache_mutex alone a while longer */
+    UNLOCK(&gcfg.map_mutex);
+    sleep_ns(HOLD_NS);
+    UNLOCK(&gcfg.cache_mutex);
+
+    map = find_site("take_both", &gcfg.map_mutex);
+    cache = find_site("take_both", &gcfg.cache_mutex);
+    expect(map && cache, "Both sites registered");
+    if(!map || !cache) return;
+    expect(map->hold_ns >= HOLD_NS, "map_mutex hold measured");
+    expect(cache->hold_ns >= 2 * HOLD_NS, "cache_mutex hold measured");
+    expect(cache->hold_ns > map->hold_ns, "Holds are kept apart");
+}
+
+static pthread_barrier_t barrier;
+
+static void *holder_thread(void *arg) {
+    (void)arg;
+    LOCK(&gcfg.map_mutex);
+    pthread_barrier_wait(&barrier);
+    sleep_ns(HOLD_NS);
+    UNLOCK(&gcfg.map_mutex);
+    return NULL;
+}
+
+/* Test that waiting on a held lock is recorded */
+void test_lockstat_contended(void) {
+    struct lock_site *s;
+    pthread_t t;
+
+    pthread_barrier_init(&barrier, NULL, 2);
+    pthread_create(&t, NULL, holder_thread, NULL);
+    pthread_barrier_wait(&barrier);
+    LOCK(&gcfg.map_mutex);
+    UNLOCK(&gcfg.map_mutex);
+    pthread_join(t, NULL);
+    pthread_barrier_destroy(&barrier);
+
+    s = find_site(__func__, &gcfg.map_mutex);
+    expect(s != NULL, "Site registered");
+    if(!s) return;
+    expectl(s->contended, 1, "Contention counted");
+    expect(s->wait_ns >= HOLD_NS / 2, "Wait time measured");
+    s = find_site("holder_thread", &gcfg.map_mutex);
+    expect(s && s->max_hold_ns >= HOLD_NS, "Holder's hold measured");
+}
+
+static void *count_thread(void *arg) {
+    (void)arg;
+    for(int i = 0; i < THREAD_ITER; i++) {
+        LOCK(&gcfg.cache_mutex);
+        UNLOCK(&gcfg.cache_mutex);
+    }
+    return NULL;
+}
+
+/* Test that counts are exact under contention, and reset */
+void test_lockstat_threads(void) {
+    pthread_t t[NUM_THREADS];
+    struct lock_site *s;
+    int n = 0;
+
+    for(int i = 0; i < NUM_THREADS; i++)
+        pthread_create(&t[i], NULL, count_thread, NULL);
+    for(int i = 0; i < NUM_THREADS; i++)
+        pthread_join(t[i], NULL);
+
+    s = find_site("count_thread", &gcfg.cache_mutex);
+    expect(s != NULL, "Site registered once");
+    if(!s) return;
+    expectl(s->acquired, NUM_THREADS * THREAD_ITER, "No lost updates");
+    expect(s->contended <= s->acquired, "Contended within acquired");
+    for(struct lock_site *p = lock_sites(); p; p = p->next)
+        if(p == s) n++;
+    expectl(n, 1, "Site listed once");
+
+    lockstat_dump();
+    lockstat_reset();
+    expectl(s->acquired, 0, "Reset clears acquisitions");
+    expectl(s->contended, 0, "Reset clears contention");
+    expectl(s->max_hold_ns, 0, "Reset clears max hold");
+}
+
+static pthread_mutex_t pool_mutex[NUM_THREADS];
+
+static void *pool_thread(void *arg) {
+    pthread_mutex_t *m = arg;
+
+    pthread_barrier_wait(&barrier);
+    for(int i = 0; i < THREAD_ITER; i++) {
+        LOCK(m);
+        UNLOCK(m);
+    }
+    return NULL;
+}
+
+/* Test one site taking a different mutex in each thread, as the pool
+ * sites do: the counters are not protected by any one mutex */
+void test_lockstat_shared_site(void) {
+    pthread_t t[NUM_THREADS];
+    struct lock_site *s = NULL;
+    int n = 0;
+
+    pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+    for(int i = 0; i < NUM_THREADS; i++) {
+        pthread_mutex_init(&pool_mutex[i], NULL);
+        pthread_create(&t[i], NULL, pool_thread, &pool_mutex[i]);
+    }
+    for(int i = 0; i < NUM_THREADS; i++)
+        pthread_join(t[i], NULL);
+    pthread_barrier_destroy(&barrier);
+
+    for(struct lock_site *p = lock_sites(); p; p = p->next)
+        if(!strcmp(p->func, "pool_thread")) {
+            s = p;
+            n++;
+        }
+    expectl(n, 1, "Shared site listed once");
+    if(!s) return;
+    expectl(s->acquired, NUM_THREADS * THREAD_ITER,
+        "No lost updates across mutexes");
+}
+
+int main(void) {
+    print_fail_only = 0;
+    pthread_mutex_init(&gcfg.map_mutex, NULL);
+    pthread_mutex_init(&gcfg.cache_mutex, NULL);
+
+    /* Test single-threaded counting */
+    test_lockstat_basic();
+
+    /* Test nested locks */
+    test_lockstat_nested();
+
+    /* Test contention */
+    test_lockstat_contended();
+
+    /* Test many threads */
+    test_lockstat_threads();
+    test_lockstat_shared_site();
+
+    /* Return final status */
+    return overall();
+}
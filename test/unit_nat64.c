@@ -0,0 +1,263 @@
+/*
+ *  unit_nat64.c - Unit test for IPv4 to IPv6 fragmentation in nat64.c
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "test/unit.h"
+#include "tayga.h"
+
+/* Fragments kept by the tun_write stubs */
+#define MAX_OUT 64
+
+/* Largest fragment payload with offlink-mtu 1500:
+ * 1500 - IPv6 header - fragment header, rounded down to 8 bytes */
+#define FRAG_PAYLOAD ((1500 - 40 - 8) & ~7)
+
+struct out_pkt {
+    struct ip6 ip6;
+    struct ip6_frag frag;
+    int has_frag;
+    uint8_t data[2048];
+    uint32_t data_len;
+};
+
+static struct out_pkt out[MAX_OUT];
+static int nout, nbatch;
+
+/*
+ * Stubs for tun.c and log.c
+ */
+static void capture(const struct iovec *iov, int iovcnt) {
+    struct out_pkt *o;
+    const uint8_t *h = (const uint8_t *)iov[0].iov_base + sizeof(struct tun_pi);
+
+    if(nout == MAX_OUT) return;
+    o = &out[nout++];
+    memcpy(&o->ip6, h, sizeof(o->ip6));
+    o->has_frag = o->ip6.next_header == 44;
+    if(o->has_frag)
+        memcpy(&o->frag, h + sizeof(struct ip6), sizeof(o->frag));
+    o->data_len = 0;
+    for(int i = 1; i < iovcnt; i++) {
+        memcpy(o->data + o->data_len, iov[i].iov_base, iov[i].iov_len);
+        o->data_len += iov[i].iov_len;
+    }
+}
+
+int tun_write(const struct iovec *iov, int iovcnt) {
+    capture(iov, iovcnt);
+    return ERROR_NONE;
+}
+
+int tun_write_batch(const struct iovec *iov, int iovcnt, int count) {
+    nbatch++;
+    for(int i = 0; i < count; i++)
+        capture(&iov[i * iovcnt], iovcnt);
+    return count;
+}
+
+void pktlog(int type, int err, const struct pkt *p, int reason, int arg) {
+    (void)type;
+    (void)err;
+    (void)p;
+    (void)reason;
+    (void)arg;
+}
+
+/* Stubs for the dynamic pool, which is not configured here */
+struct map6 *assign_dynamic(const struct in6_addr *addr6) {
+    (void)addr6;
+    return NULL;
+}
+
+int dynamic_enqueue(const struct in6_addr *addr6) {
+    (void)addr6;
+    return -1;
+}
+
+static int load_config(void) {
+    char tmp[] = "/tmp/unit_nat64-XXXXXX";
+    int fd = mkstemp(tmp);
+    FILE *f;
+    int ret;
+
+    if(fd < 0) return -1;
+    f = fdopen(fd, "w");
+    fprintf(f, "tun-device unit0\n"
+            "ipv4-addr 192.0.2.1\n"
+            "prefix 2001:db8:64::/96\n"
+            "offlink-mtu 1500\n");
+    fclose(f);
+    config_init();
+    ret = config_read(tmp);
+    unlink(tmp);
+    if(ret < 0 || config_validate() < 0) return -1;
+    gcfg.mtu = 1500;
+    gcfg.cache_size = 0;
+    nat64_select_variant();
+    pthread_mutex_init(&gcfg.map_mutex, NULL);
+    pthread_mutex_init(&gcfg.cache_mutex, NULL);
+    return 0;
+}
+
+static uint16_t ip4_cksum(const struct ip4 *ip4) {
+    const uint16_t *w = (const uint16_t *)ip4;
+    uint32_t sum = 0;
+
+    for(unsigned int i = 0; i < sizeof(*ip4) / 2; i++) sum += w[i];
+    while(sum > 0xffff) sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* Translate a UDP datagram (or IPv4 fragment of one) with len bytes of
+ * IPv4 payload, each byte set from its offset in the datagram */
+static void send_udp4(uint32_t len, uint16_t frag_off, int mf) {
+    static uint8_t buf[65536] __attribute__((aligned(8)));
+    struct ip4 *ip4 = (struct ip4 *)buf;
+    struct pkt p;
+
+    memset(buf, 0, sizeof(struct ip4) + len);
+    ip4->ver_ihl = 0x45;
+    ip4->length = htons(sizeof(struct ip4) + len);
+    ip4->ident = htons(0x1234);
+    ip4->flags_offset = htons(frag_off / 8 | (mf ? IP4_F_MF : 0));
+    ip4->ttl = 64;
+    ip4->proto = 17;
+    inet_pton(AF_INET, "198.51.100.7", &ip4->src);
+    inet_pton(AF_INET, "203.0.113.9", &ip4->dest);
+    ip4->cksum = ip4_cksum(ip4);
+    for(uint32_t i = 0; i < len; i++)
+        buf[sizeof(struct ip4) + i] = (uint8_t)(frag_off + i);
+    if(frag_off == 0 && len >= 8) {
+        /* UDP header; the checksum is adjusted, never verified */
+        buf[20] = 0x30;
+        buf[21] = 0x39;
+        buf[22] = 0x00;
+        buf[23] = 0x35;
+        buf[24] = (len >> 8) & 0xff;
+        buf[25] = len & 0xff;
+        buf[26] = 0x12;
+        buf[27] = 0x34;
+    }
+    memset(&p, 0, sizeof(p));
+    p.data = buf;
+    p.data_len = sizeof(struct ip4) + len;
+    nout = nbatch = 0;
+    handle_ip4(&p);
+}
+
+/* Check the fragments in out[] cover [start, start + len) of the original
+ * datagram in order, and return the number of problems found */
+static int check_frags(uint32_t start, uint32_t len, int last_mf,
+        uint32_t max_payload, const char *name) {
+    uint32_t off = start;
+    int bad = 0;
+    char msg[128];
+
+    for(int i = 0; i < nout; i++) {
+        struct out_pkt *o = &out[i];
+        uint16_t of = ntohs(o->frag.offset_flags);
+        int last = i == nout - 1;
+
+        if(!o->has_frag) { bad++; continue; }
+        if(o->frag.next_header != 17) bad++;
+        if(ntohl(o->frag.ident) != 0x1234) bad++;
+        if(ntohs(o->ip6.payload_length) != sizeof(struct ip6_frag) +
+                o->data_len) bad++;
+        if((of & ~7) != off) bad++;
+        if(!!(of & IP6_F_MF) != (last ? last_mf : 1)) bad++;
+        if(o->data_len > max_payload) bad++;
+        if(!last && (o->data_len & 7)) bad++;
+        /* Bytes past the UDP header still carry their offset */
+        for(uint32_t j = 0; j < o->data_len; j++)
+            if(off + j >= 8 && o->data[j] != (uint8_t)(off + j)) {
+                bad++;
+                break;
+            }
+        off += o->data_len;
+    }
+    snprintf(msg, sizeof(msg), "%s covers the datagram", name);
+    expectl(off - start, len, msg);
+    return bad;
+}
+
+/* Test a datagram which does not need fragmenting */
+void test_frag_none(void) {
+    send_udp4(1000, 0, 0);
+    expectl(nout, 1, "Small datagram sent whole");
+    expectl(nbatch, 0, "No batch for one packet");
+    expect(!out[0].has_frag, "No fragment header");
+    expectl(ntohs(out[0].ip6.payload_length), 1000, "Payload length");
+}
+
+/* Test splitting a large datagram */
+void test_frag_split(void) {
+    send_udp4(3008, 0, 0);
+    expectl(nbatch, 1, "Fragments written as one batch");
+    expectl(nout, 3, "Three fragments");
+    expectl(out[0].data_len, FRAG_PAYLOAD, "First fragment full size");
+    expectl(out[2].data_len, 3008 - 2 * FRAG_PAYLOAD, "Last fragment rest");
+    expectl(check_frags(0, 3008, 0, FRAG_PAYLOAD, "Split"), 0,
+            "Offsets, MF bits and lengths");
+}
+
+/* Test an IPv4 fragment from the middle of a datagram */
+void test_frag_middle(void) {
+    send_udp4(2000, 1480, 1);
+    expectl(nout, 2, "Two fragments");
+    expectl(check_frags(1480, 2000, 1, FRAG_PAYLOAD, "Middle"), 0,
+            "Offsets continue and MF stays set");
+
+    /* A small trailing fragment still needs a fragment header */
+    send_udp4(200, 2960, 0);
+    expectl(nout, 1, "One fragment");
+    expectl(check_frags(2960, 200, 0, FRAG_PAYLOAD, "Tail"), 0,
+            "Trailing fragment kept as a fragment");
+}
+
+/* Test that a learned path MTU shrinks the fragments */
+void test_frag_pmtu(void) {
+    struct in6_addr dest;
+    uint32_t max = (1300 - 40 - 8) & ~7;
+
+    inet_pton(AF_INET6, "2001:db8:64::cb00:7109", &dest);
+    now = 1000;
+    pmtu_set(&dest, 1300);
+    send_udp4(3008, 0, 0);
+    expectl(nout, 3, "Three fragments");
+    expectl(out[0].data_len, max, "Sized to the path MTU");
+    expectl(check_frags(0, 3008, 0, max, "Path MTU"), 0,
+            "Offsets, MF bits and lengths");
+}
+
+int main(void) {
+    print_fail_only = 0;
+
+    if(load_config() < 0) {
+        expect(0, "Load configuration");
+        return overall();
+    }
+
+    /* Test unfragmented output */
+    test_frag_none();
+
+    /* Test fragmenting */
+    test_frag_split();
+    test_frag_middle();
+    test_frag_pmtu();
+
+    /* Return final status */
+    return overall();
+}
@@ -0,0 +1,218 @@
+/*
+ *  unit_pktlog.c - Unit test for pktlog.c
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "test/unit.h"
+#include "tayga.h"
+
+/* Each test logs under its own reason, and the lines are checked once
+ * pktlog_stop has flushed the logger thread */
+
+/* Records per ring in pktlog.c */
+#define RING_SIZE 1024
+
+#define MAX_LINES 4096
+
+struct config gcfg;
+
+struct line {
+    int prio;
+    char msg[256];
+};
+
+static struct line lines[MAX_LINES];
+static int nlines;
+
+/* The logger thread blocks in the first slog call while stalled */
+static pthread_mutex_t hook_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hook_cond = PTHREAD_COND_INITIALIZER;
+static int stalled, entered;
+
+static void capture(int priority, const char *msg) {
+    pthread_mutex_lock(&hook_mutex);
+    entered = 1;
+    pthread_cond_broadcast(&hook_cond);
+    while(stalled) pthread_cond_wait(&hook_cond, &hook_mutex);
+    if(nlines < MAX_LINES) {
+        lines[nlines].prio = priority;
+        snprintf(lines[nlines].msg, sizeof(lines[nlines].msg), "%s", msg);
+        nlines++;
+    }
+    pthread_mutex_unlock(&hook_mutex);
+}
+
+static struct ip4 hdr4;
+static struct ip6 hdr6;
+
+static void log4(int type, int err, int reason, int arg,
+        const char *src, const char *dest) {
+    struct pkt p;
+
+    memset(&p, 0, sizeof(p));
+    inet_pton(AF_INET, src, &hdr4.src);
+    inet_pton(AF_INET, dest, &hdr4.dest);
+    p.ip4 = &hdr4;
+    p.data_proto = 17;
+    p.header_len = sizeof(hdr4);
+    p.data_len = 100;
+    pktlog(type, err, &p, reason, arg);
+}
+
+static void log6(int type, int err, int reason, const char *src,
+        const char *dest) {
+    struct pkt p;
+
+    memset(&p, 0, sizeof(p));
+    inet_pton(AF_INET6, src, &hdr6.src);
+    inet_pton(AF_INET6, dest, &hdr6.dest);
+    p.ip6 = &hdr6;
+    p.data_proto = 58;
+    p.header_len = sizeof(hdr6);
+    p.data_len = 100;
+    pktlog(type, err, &p, reason, PKTLOG_NO_ARG);
+}
+
+/* Count lines containing all of the given strings (up to three) */
+static int count_lines(const char *a, const char *b, const char *c,
+        int *prio) {
+    int n = 0;
+
+    for(int i = 0; i < nlines; i++) {
+        if(!strstr(lines[i].msg, a)) continue;
+        if(b && !strstr(lines[i].msg, b)) continue;
+        if(c && !strstr(lines[i].msg, c)) continue;
+        if(prio) *prio = lines[i].prio;
+        n++;
+    }
+    return n;
+}
+
+/* Fill the ring while the logger thread is stuck on the first record */
+static void fill_ring(void) {
+    char src[INET_ADDRSTRLEN];
+
+    pthread_mutex_lock(&hook_mutex);
+    stalled = 1;
+    entered = 0;
+    pthread_mutex_unlock(&hook_mutex);
+
+    log4(LOG_OPT_DROP, LOG_OPT_DROP, R4_TOO_MANY_FRAGMENTS, PKTLOG_NO_ARG,
+            "10.0.0.1", "192.0.2.1");
+    pthread_mutex_lock(&hook_mutex);
+    while(!entered) pthread_cond_wait(&hook_cond, &hook_mutex);
+    pthread_mutex_unlock(&hook_mutex);
+
+    /* The record being printed still holds its slot */
+    for(int i = 0; i < RING_SIZE + 99; i++) {
+        snprintf(src, sizeof(src), "10.1.%d.%d", i / 256, i % 256);
+        log4(LOG_OPT_DROP, LOG_OPT_DROP, R4_TOO_MANY_FRAGMENTS,
+                PKTLOG_NO_ARG, src, "192.0.2.1");
+    }
+
+    /* Wait for every queued record and the overflow warning */
+    pthread_mutex_lock(&hook_mutex);
+    stalled = 0;
+    pthread_cond_broadcast(&hook_cond);
+    while(nlines < RING_SIZE + 1) pthread_cond_wait(&hook_cond, &hook_mutex);
+    pthread_mutex_unlock(&hook_mutex);
+}
+
+/* Log a run of identical events, and the same event between other hosts */
+static void log_repeats(void) {
+    for(int i = 0; i < 100; i++)
+        log4(LOG_OPT_SELF, LOG_OPT_SELF | LOG_OPT_DROP,
+                R4_FRAGMENT_MISALIGNMENT, 13, "192.0.2.7", "198.51.100.1");
+    for(int i = 0; i < 5; i++) {
+        log6(LOG_OPT_DROP, LOG_OPT_DROP, R6_ICMP_INVALID_CHECKSUM,
+                "2001:db8::1", "64:ff9b::c000:201");
+        log6(LOG_OPT_DROP, LOG_OPT_DROP, R6_ICMP_INVALID_CHECKSUM,
+                "2001:db8::2", "64:ff9b::c000:201");
+    }
+    log4(LOG_OPT_ICMP, LOG_OPT_ICMP, R4_TIME_EXCEEDED, PKTLOG_NO_ARG,
+            "192.0.2.8", "198.51.100.2");
+}
+
+/* Test that a full ring drops and counts records instead of blocking */
+void test_overflow(void) {
+    long dropped = 0;
+    const char *p;
+
+    expectl(count_lines("Too many fragments", NULL, NULL, NULL), RING_SIZE,
+            "Ring holds RING_SIZE records");
+    for(int i = 0; i < nlines; i++)
+        if((p = strstr(lines[i].msg, "Packet log overflow: ")))
+            dropped += atol(p + strlen("Packet log overflow: "));
+    expectl(dropped, 100, "Overflowed records counted");
+}
+
+/* Test duplicate suppression */
+void test_dedup(void) {
+    int prio = -1;
+
+    expectl(count_lines("Fragment Misalignment 13", "(proto 17)", NULL, &prio),
+            1, "Repeated event printed once");
+    expectl(prio, LOG_NOTICE, "SELF and DROP event logged as a notice");
+    prio = -1;
+    expectl(count_lines("[192.0.2.7]->[198.51.100.1]",
+                "Fragment Misalignment 13", "(99 more like this)", &prio),
+            1, "Summary names the hosts and count");
+    expectl(prio, LOG_NOTICE, "Summary keeps the severity");
+}
+
+/* Test that the same event between other hosts is not folded together */
+void test_dedup_hosts(void) {
+    expectl(count_lines("[2001:db8::1]->[64:ff9b::c000:201]",
+                "(proto 58)", NULL, NULL), 1, "First host printed");
+    expectl(count_lines("[2001:db8::2]->[64:ff9b::c000:201]",
+                "(proto 58)", NULL, NULL), 1, "Second host printed");
+    expectl(count_lines("[2001:db8::1]", "(4 more like this)", NULL, NULL),
+            1, "First host summarized");
+    expectl(count_lines("[2001:db8::2]", "(4 more like this)", NULL, NULL),
+            1, "Second host summarized");
+}
+
+/* Test the severity of events which are neither drops nor rejects */
+void test_severity(void) {
+    int prio = -1;
+
+    expectl(count_lines("ICMP: [v4]", "Time Exceeded", NULL, &prio), 1,
+            "ICMP event printed");
+    expectl(prio, LOG_INFO, "ICMP event logged as info");
+}
+
+int main(void) {
+    print_fail_only = 0;
+    slog_hook = capture;
+
+    if(pktlog_start(1) != ERROR_NONE) {
+        expect(0, "Start the packet logger");
+        return overall();
+    }
+    fill_ring();
+    log_repeats();
+    pktlog_stop();
+
+    /* Test the ring */
+    test_overflow();
+
+    /* Test duplicate suppression */
+    test_dedup();
+    test_dedup_hosts();
+    test_severity();
+
+    /* Return final status */
+    return overall();
+}
@@ -0,0 +1,151 @@
+/*
+ *  unit_pmtu.c - Unit test for pmtu.c
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "test/unit.h"
+#include "tayga.h"
+
+/* pmtu.c only needs the hash seed from the configuration */
+struct config gcfg;
+
+/* Number of distinct destinations used by the bulk tests */
+#define NUM_ADDRS 16384
+
+/* Number of concurrent readers */
+#define NUM_READERS 4
+
+/* Number of updates made by the writer */
+#define WRITER_ITER 200000
+
+static void make_addr(struct in6_addr *a, uint32_t i) {
+    inet_pton(AF_INET6, "2001:db8::", a);
+    a->s6_addr32[3] = htonl(i);
+}
+
+/* The MTU stored for each address is derived from it, so a reader can
+ * tell if it ever sees an MTU paired with the wrong address */
+static uint32_t addr_mtu(uint32_t i, uint32_t gen) {
+    return MTU_MIN + ((i * 7 + gen) & 0xfff);
+}
+
+/* Test basic store, lookup and expiry */
+void test_pmtu_basic(void) {
+    struct in6_addr a, b;
+
+    make_addr(&a, 1);
+    make_addr(&b, 2);
+    now = 1000;
+
+    expectl(pmtu_get(&a), 0, "Empty cache misses");
+
+    pmtu_set(&a, 1400);
+    expectl(pmtu_get(&a), 1400, "Stored MTU is returned");
+    expectl(pmtu_get(&b), 0, "Other destination misses");
+
+    pmtu_set(&a, 1300);
+    expectl(pmtu_get(&a), 1300, "Stored MTU is updated");
+
+    now += PMTU_TIMEOUT;
+    expectl(pmtu_get(&a), 1300, "Entry valid until timeout");
+    now += 1;
+    expectl(pmtu_get(&a), 0, "Entry expires after timeout");
+
+    pmtu_set(&a, 1450);
+    expectl(pmtu_get(&a), 1450, "Expired entry is replaced");
+}
+
+/* Test that the table stays bounded and never returns a stale pairing */
+void test_pmtu_bounded(void) {
+    struct in6_addr a;
+    long wrong = 0, hits = 0;
+
+    now = 5000;
+    for(uint32_t i = 0; i < NUM_ADDRS; i++) {
+        make_addr(&a, i + 100);
+        pmtu_set(&a, addr_mtu(i, 0));
+    }
+    for(uint32_t i = 0; i < NUM_ADDRS; i++) {
+        make_addr(&a, i + 100);
+        uint32_t mtu = pmtu_get(&a);
+        if(mtu) hits++;
+        if(mtu && mtu != addr_mtu(i, 0)) wrong++;
+    }
+    expectl(wrong, 0, "Lookups never return another destination's MTU");
+    expect(hits > 0, "Recent destinations are cached");
+    expect(hits < NUM_ADDRS, "Cache size is bounded");
+
+    /* The most recent destination always survives */
+    make_addr(&a, NUM_ADDRS - 1 + 100);
+    expectl(pmtu_get(&a), addr_mtu(NUM_ADDRS - 1, 0), "Last insert present");
+}
+
+static volatile int writer_done;
+
+static void *reader_thread(void *arg) {
+    long *wrong = arg;
+    struct in6_addr a;
+    uint32_t i = 0, mtu;
+
+    while(!__atomic_load_n(&writer_done, __ATOMIC_ACQUIRE)) {
+        i = (i + 1) % NUM_ADDRS;
+        make_addr(&a, i + 100);
+        mtu = pmtu_get(&a);
+        /* Any generation is fine, but it must belong to this address */
+        if(mtu && ((mtu - MTU_MIN - i * 7) & 0xfff) > 0xff)
+            (*wrong)++;
+    }
+    return NULL;
+}
+
+/* Test lock-free readers against a concurrent writer */
+void test_pmtu_concurrent(void) {
+    pthread_t readers[NUM_READERS];
+    long wrong[NUM_READERS] = {0};
+    struct in6_addr a;
+    long total = 0;
+
+    now = 9000;
+    writer_done = 0;
+    for(int t = 0; t < NUM_READERS; t++)
+        pthread_create(&readers[t], NULL, reader_thread, &wrong[t]);
+    for(uint32_t n = 0; n < WRITER_ITER; n++) {
+        uint32_t i = (n * 2654435761u) % NUM_ADDRS;
+        make_addr(&a, i + 100);
+        pmtu_set(&a, addr_mtu(i, n & 0xff));
+    }
+    __atomic_store_n(&writer_done, 1, __ATOMIC_RELEASE);
+    for(int t = 0; t < NUM_READERS; t++) {
+        pthread_join(readers[t], NULL);
+        total += wrong[t];
+    }
+    expectl(total, 0, "Readers never see a torn entry");
+}
+
+int main(void) {
+    print_fail_only = 0;
+
+    /* Test store, lookup and expiry */
+    test_pmtu_basic();
+
+    /* Test the table bound */
+    test_pmtu_bounded();
+
+    /* Test concurrent readers and writer */
+    test_pmtu_concurrent();
+
+    /* Return final status */
+    return overall();
+}
@@ -0,0 +1,250 @@
+/*
+ *  unit_ratelimit.c - Unit test for ratelimit.c
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "test/unit.h"
+#include "tayga.h"
+
+/* ratelimit.c reads the limits and hash seed from the configuration */
+struct config gcfg;
+
+/* Buckets are kept between tests. Global buckets are per thread, so
+ * each test poses as a different worker; source buckets are shared, so
+ * each test limits sources of its own. */
+
+/* Threads, and messages each tries, in the shared source test */
+#define NUM_THREADS 4
+#define THREAD_MSGS 1000
+
+static void set_limit(enum rl_class cls, enum rl_scope scope,
+        uint32_t rate, uint32_t burst) {
+    gcfg.icmp_rl[cls][scope].rate = rate;
+    gcfg.icmp_rl[cls][scope].burst = burst;
+}
+
+static void clear_limits(void) {
+    memset(gcfg.icmp_rl, 0, sizeof(gcfg.icmp_rl));
+}
+
+static struct in_addr addr4(const char *s) {
+    struct in_addr a;
+    inet_pton(AF_INET, s, &a);
+    return a;
+}
+
+static struct in6_addr addr6(const char *s) {
+    struct in6_addr a;
+    inet_pton(AF_INET6, s, &a);
+    return a;
+}
+
+/* Send n messages to a host, returning how many were allowed */
+static int burst4(enum rl_class cls, const char *host, int n) {
+    struct in_addr a = addr4(host);
+    int sent = 0;
+    for(int i = 0; i < n; i++)
+        sent += icmp_ratelimit4(cls, &a);
+    return sent;
+}
+
+static int burst6(enum rl_class cls, const char *host, int n) {
+    struct in6_addr a = addr6(host);
+    int sent = 0;
+    for(int i = 0; i < n; i++)
+        sent += icmp_ratelimit6(cls, &a);
+    return sent;
+}
+
+/* Test the per-source bucket for IPv4 */
+void test_rl_source4(void) {
+    worker_id = 1;
+    clear_limits();
+    set_limit(RL_ERRORS, RL_SOURCE, 10, 10);
+
+    expectl(burst4(RL_ERRORS, "192.0.2.1", 15), 10, "Burst allowed");
+    expectl(burst4(RL_ERRORS, "192.0.2.200", 1), 0, "Same /24 limited");
+    expectl(burst4(RL_ERRORS, "198.51.100.1", 1), 1, "Other /24 allowed");
+    expectl(stats_workers[1].c.icmp_err_limited, 6, "Suppression counted");
+    expectl(stats_workers[1].c.echo_limited, 0, "Echo not counted");
+}
+
+/* Test the per-source bucket for IPv6 */
+void test_rl_source6(void) {
+    worker_id = 2;
+    clear_limits();
+    set_limit(RL_ERRORS, RL_SOURCE, 10, 4);
+
+    expectl(burst6(RL_ERRORS, "2001:db8:1:2::1", 8), 4, "Burst allowed");
+    expectl(burst6(RL_ERRORS, "2001:db8:1:2:ffff::1", 1), 0,
+            "Same /64 limited");
+    expectl(burst6(RL_ERRORS, "2001:db8:1:3::1", 1), 1, "Other /64 allowed");
+    expectl(burst4(RL_ERRORS, "32.1.13.184", 1), 1,
+            "IPv4 kept apart from IPv6");
+}
+
+/* Test that tokens come back over time */
+void test_rl_refill(void) {
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 20000000 };
+
+    worker_id = 3;
+    clear_limits();
+    set_limit(RL_ERRORS, RL_SOURCE, 1000, 1);
+
+    expectl(burst4(RL_ERRORS, "203.0.113.1", 2), 1, "One token");
+    nanosleep(&ts, NULL);
+    expectl(burst4(RL_ERRORS, "203.0.113.1", 2), 1, "Refilled to burst");
+}
+
+/* Test the global bucket across sources */
+void test_rl_global(void) {
+    char host[32];
+    int sent = 0;
+
+    worker_id = 4;
+    clear_limits();
+    set_limit(RL_ERRORS, RL_GLOBAL, 10, 5);
+
+    for(int i = 0; i < 8; i++) {
+        snprintf(host, sizeof(host), "10.%d.0.1", i);
+        sent += burst4(RL_ERRORS, host, 1);
+    }
+    expectl(sent, 5, "Global burst shared");
+    expectl(stats_workers[4].c.icmp_err_limited, 3, "Suppression counted");
+}
+
+/* Test that a noisy source does not drain the global bucket */
+void test_rl_noisy(void) {
+    worker_id = 5;
+    clear_limits();
+    set_limit(RL_ERRORS, RL_GLOBAL, 10, 10);
+    set_limit(RL_ERRORS, RL_SOURCE, 10, 2);
+
+    expectl(burst4(RL_ERRORS, "100.64.1.1", 20), 2, "Source limited");
+    expectl(burst4(RL_ERRORS, "100.64.2.1", 20), 2, "Other source limited");
+    expectl(burst4(RL_ERRORS, "100.64.3.1", 2), 2, "Global not drained");
+}
+
+/* Test that the classes have their own buckets */
+void test_rl_classes(void) {
+    worker_id = 6;
+    clear_limits();
+    set_limit(RL_ERRORS, RL_GLOBAL, 10, 3);
+    set_limit(RL_ECHO, RL_GLOBAL, 10, 2);
+
+    expectl(burst4(RL_ERRORS, "192.0.2.1", 5), 3, "Errors limited");
+    expectl(burst6(RL_ECHO, "2001:db8::1", 5), 2, "Echo has its own bucket");
+    expectl(stats_workers[6].c.icmp_err_limited, 2, "Errors counted");
+    expectl(stats_workers[6].c.echo_limited, 3, "Echo counted");
+}
+
+/* Test that the global limit is shared out between workers */
+void test_rl_workers(void) {
+    clear_limits();
+    set_limit(RL_ECHO, RL_GLOBAL, 100, 100);
+    gcfg.workers = 4;
+
+    worker_id = 7;
+    expectl(burst4(RL_ECHO, "192.0.2.1", 50), 25, "First worker's share");
+    worker_id = 8;
+    expectl(burst4(RL_ECHO, "192.0.2.1", 50), 25, "Second worker's share");
+    gcfg.workers = -1;
+}
+
+/* Test that a source keeps its full rate, whichever worker sees it */
+void test_rl_source_workers(void) {
+    clear_limits();
+    set_limit(RL_ECHO, RL_SOURCE, 10, 10);
+    gcfg.workers = 4;
+
+    worker_id = 10;
+    expectl(burst4(RL_ECHO, "100.64.4.1", 20), 10, "Full burst on one worker");
+    worker_id = 11;
+    expectl(burst4(RL_ECHO, "100.64.4.1", 1), 0, "Shared with other workers");
+    gcfg.workers = -1;
+}
+
+struct source_job {
+    int worker;
+    int sent;
+};
+
+static void *source_thread(void *arg) {
+    struct source_job *job = arg;
+
+    worker_id = job->worker;
+    job->sent = burst6(RL_ERRORS, "2001:db8:5::1", THREAD_MSGS);
+    return NULL;
+}
+
+/* Test that threads racing on a source bucket never exceed its burst */
+void test_rl_source_threads(void) {
+    struct source_job jobs[NUM_THREADS];
+    pthread_t threads[NUM_THREADS];
+    int sent = 0;
+
+    clear_limits();
+    set_limit(RL_ERRORS, RL_SOURCE, 1, 100);
+    gcfg.workers = NUM_THREADS;
+
+    for(int i = 0; i < NUM_THREADS; i++) {
+        jobs[i].worker = 12 + i;
+        pthread_create(&threads[i], NULL, source_thread, &jobs[i]);
+    }
+    for(int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        sent += jobs[i].sent;
+    }
+    expectl(sent, 100, "Burst handed out once across threads");
+    gcfg.workers = -1;
+}
+
+/* Test that a zero rate disables limiting */
+void test_rl_unlimited(void) {
+    worker_id = 9;
+    clear_limits();
+
+    expectl(burst4(RL_ERRORS, "192.0.2.1", 1000), 1000, "IPv4 unlimited");
+    expectl(burst6(RL_ECHO, "2001:db8::1", 1000), 1000, "IPv6 unlimited");
+    expectl(stats_workers[9].c.icmp_err_limited, 0, "Nothing suppressed");
+}
+
+int main(void) {
+    print_fail_only = 0;
+    gcfg.workers = -1;
+
+    /* Test per-source limits */
+    test_rl_source4();
+    test_rl_source6();
+
+    /* Test refill */
+    test_rl_refill();
+
+    /* Test the global limit */
+    test_rl_global();
+    test_rl_noisy();
+
+    /* Test classes and workers */
+    test_rl_classes();
+    test_rl_workers();
+    test_rl_source_workers();
+    test_rl_source_threads();
+
+    /* Test disabled limits */
+    test_rl_unlimited();
+
+    /* Return final status */
+    return overall();
+}
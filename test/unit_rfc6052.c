@@ -0,0 +1,175 @@
+/*
+ *  unit_rfc6052.c - Unit test for the RFC6052 embed and extract helpers
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "test/unit.h"
+#include "tayga.h"
+
+/* The helpers are header-only, so this file is built once for each code
+ * path (scalar, and SSSE3 on x86) and checked against the bit-by-bit
+ * layout of RFC6052 section 2.2 below */
+
+/* Random addresses tried per prefix length */
+#define NUM_ITER 20000
+
+struct config gcfg;
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static int get_bit(const uint8_t *b, int i) {
+    return (b[i / 8] >> (7 - i % 8)) & 1;
+}
+
+static void set_bit(uint8_t *b, int i, int v) {
+    if(v) b[i / 8] |= 0x80 >> (i % 8);
+    else b[i / 8] &= ~(0x80 >> (i % 8));
+}
+
+static int valid_len(int len) {
+    return len == 32 || len == 40 || len == 48 || len == 56 || len == 64 ||
+        len == 96;
+}
+
+/* IPv6 bit holding IPv4 bit i, skipping the u octet (bits 64 to 71) */
+static int ref_bit(int len, int i) {
+    int pos = len + i;
+    return pos >= 64 && len <= 64 ? pos + 8 : pos;
+}
+
+static void ref_embed(struct in6_addr *addr6, const struct in_addr *addr4,
+        const struct in6_addr *prefix, int len) {
+    *addr6 = *prefix;
+    for(int i = 0; i < 32; i++)
+        set_bit(addr6->s6_addr, ref_bit(len, i),
+                get_bit((const uint8_t *)&addr4->s_addr, i));
+}
+
+static int ref_extract(struct in_addr *addr4, const struct in6_addr *addr6,
+        int len) {
+    uint8_t used[16] = { 0 };
+
+    addr4->s_addr = 0;
+    for(int i = 0; i < 32; i++) {
+        set_bit((uint8_t *)&addr4->s_addr, i,
+                get_bit(addr6->s6_addr, ref_bit(len, i)));
+        set_bit(used, ref_bit(len, i), 1);
+    }
+    /* The u octet and the suffix must be zero */
+    if(len < 96) {
+        for(int i = 64; i < 128; i++)
+            if(!get_bit(used, i) && get_bit(addr6->s6_addr, i))
+                return ERROR_DROP;
+    }
+    return ERROR_NONE;
+}
+
+static void random_addr6(struct in6_addr *a) {
+    for(int i = 0; i < 4; i++) a->s6_addr32[i] = rng();
+}
+
+/* Test embedding against the reference for every prefix length */
+void test_embed(void) {
+    struct in6_addr prefix, got, want;
+    struct in_addr addr4;
+    int bad_ret = 0, bad_addr = 0;
+
+    for(int len = 0; len <= 128; len++) {
+        for(int n = 0; n < NUM_ITER; n++) {
+            random_addr6(&prefix);
+            addr4.s_addr = rng();
+            if(valid_len(len)) {
+                /* Host bits of the prefix must be zero */
+                for(int i = len; i < 128; i++)
+                    set_bit(prefix.s6_addr, i, 0);
+            }
+            int ret = rfc6052_embed(&got, &addr4, &prefix, len);
+            if(!valid_len(len)) {
+                if(ret != ERROR_DROP) bad_ret++;
+                continue;
+            }
+            if(ret != ERROR_NONE) bad_ret++;
+            ref_embed(&want, &addr4, &prefix, len);
+            if(memcmp(&got, &want, sizeof(got))) bad_addr++;
+        }
+    }
+    expectl(bad_ret, 0, "Embed accepts exactly the RFC6052 lengths");
+    expectl(bad_addr, 0, "Embed matches the reference");
+}
+
+/* Test extraction against the reference for every prefix length */
+void test_extract(void) {
+    struct in6_addr addr6;
+    struct in_addr got, want;
+    int bad_ret = 0, bad_addr = 0, rejected = 0;
+
+    for(int len = 0; len <= 128; len++) {
+        for(int n = 0; n < NUM_ITER; n++) {
+            random_addr6(&addr6);
+            /* Clear the u octet and suffix most of the time, so both
+             * outcomes are exercised */
+            if(n % 4) {
+                addr6.s6_addr[8] = 0;
+                if(len < 96)
+                    for(int i = len / 8 + 5; i < 16; i++)
+                        addr6.s6_addr[i] = 0;
+            }
+            int ret = rfc6052_extract(&got, &addr6, len);
+            if(!valid_len(len)) {
+                if(ret != ERROR_DROP) bad_ret++;
+                continue;
+            }
+            int want_ret = ref_extract(&want, &addr6, len);
+            if(ret != want_ret) bad_ret++;
+            else if(ret == ERROR_NONE && got.s_addr != want.s_addr) bad_addr++;
+            if(want_ret != ERROR_NONE) rejected++;
+        }
+    }
+    expectl(bad_ret, 0, "Extract accepts and rejects as the reference");
+    expectl(bad_addr, 0, "Extract matches the reference");
+    expect(rejected > 0, "Non-zero u octet or suffix seen");
+}
+
+int main(void) {
+    print_fail_only = 0;
+
+#if defined(RFC6052_SSSE3)
+    if(!__builtin_cpu_supports("ssse3")) {
+        printf("SKIP: CPU does not support SSSE3\n");
+        return 0;
+    }
+    printf("Testing the SSSE3 path\n");
+#elif defined(RFC6052_NEON)
+    printf("Testing the NEON path\n");
+#else
+    printf("Testing the scalar path\n");
+#endif
+
+    /* Test embedding */
+    test_embed();
+
+    /* Test extraction */
+    test_extract();
+
+    /* Return final status */
+    return overall();
+}
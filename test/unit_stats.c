@@ -0,0 +1,384 @@
+/*
+ *  unit_stats.c - Unit test for stats.c
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include "test/unit.h"
+#include "tayga.h"
+#include <sys/mman.h>
+#include <sys/un.h>
+
+/* metrics.c reads the maps, cache and pool from the configuration */
+struct config gcfg;
+
+/* Number of worker threads to emulate */
+#define NUM_THREADS 8
+
+/* Number of packets counted per thread */
+#define NUM_PKTS 100000
+
+/* Cache line size the per-worker counters must not share */
+#define CACHE_LINE 64
+
+static pthread_barrier_t barrier;
+
+static void *stats_thread(void *arg) {
+    worker_id = (int)(intptr_t)arg;
+    pthread_barrier_wait(&barrier);
+    for(long i = 0; i < NUM_PKTS; i++) {
+        STAT_INC(rx_pkts4);
+        STAT_ADD(rx_bytes4, 100);
+        if(i & 1) stats_pkt_event(LOG_OPT_DROP, R4_IP_HEADER_LENGTH);
+        else stats_pkt_event(LOG_OPT_SELF | LOG_OPT_REJECT,
+                R6_UNKNOWN_PROTOCOL_TO_SELF);
+    }
+    return NULL;
+}
+
+/* Count from several workers at once and check the totals */
+void test_stats_aggregate(void) {
+    pthread_t threads[NUM_THREADS];
+    struct stats_counters s;
+
+    pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+    for(int t = 0; t < NUM_THREADS; t++)
+        pthread_create(&threads[t], NULL, stats_thread,
+                (void *)(intptr_t)(t + 1));
+    for(int t = 0; t < NUM_THREADS; t++)
+        pthread_join(threads[t], NULL);
+    pthread_barrier_destroy(&barrier);
+
+    stats_read(&s);
+    expectl(s.rx_pkts4, NUM_THREADS * NUM_PKTS, "Packets summed over workers");
+    expectl(s.rx_bytes4, NUM_THREADS * NUM_PKTS * 100L,
+        "Bytes summed over workers");
+    expectl(s.dropped, NUM_THREADS * NUM_PKTS / 2, "Drops counted");
+    expectl(s.rejected, NUM_THREADS * NUM_PKTS / 2, "Rejects counted");
+    expectl(s.reason[R4_IP_HEADER_LENGTH], NUM_THREADS * NUM_PKTS / 2,
+        "Drop reason counted");
+    expectl(s.reason[R6_UNKNOWN_PROTOCOL_TO_SELF], NUM_THREADS * NUM_PKTS / 2,
+        "Reject reason counted");
+    expectl(s.reason[R4_ECHO_REQUEST], 0, "Unused reason is zero");
+    expectl(s.tx_pkts4, 0, "Untouched counter is zero");
+}
+
+/* Reset zeroes the totals without touching the workers' counters */
+void test_stats_reset(void) {
+    struct stats_counters s;
+
+    stats_reset();
+    stats_read(&s);
+    expectl(s.rx_pkts4, 0, "Reset clears packets");
+    expectl(s.reason[R4_IP_HEADER_LENGTH], 0, "Reset clears reasons");
+
+    worker_id = 3;
+    STAT_INC(rx_pkts4);
+    stats_pkt_event(LOG_OPT_ICMP, R4_TIME_EXCEEDED);
+    worker_id = 0;
+    stats_read(&s);
+    expectl(s.rx_pkts4, 1, "Counting resumes after reset");
+    expectl(s.reason[R4_TIME_EXCEEDED], 1, "Reason counted after reset");
+    expectl(s.dropped + s.rejected, 0, "ICMP event is not a drop");
+    expect(stats_workers[3].c.rx_pkts4 > NUM_PKTS,
+        "Worker counters are not cleared");
+}
+
+/* Check the reason table and the counter layout */
+void test_stats_layout(void) {
+    expectl((uintptr_t)&stats_workers[0] % CACHE_LINE, 0,
+        "Counters are cache line aligned");
+    expectl(sizeof(struct stats_worker) % CACHE_LINE, 0,
+        "Counters are padded to a cache line");
+    expects(pkt_reasons[R4_ECHO_REQUEST].name, "R4_ECHO_REQUEST", 16,
+        "Reason name");
+    expects(pkt_reasons[R6_TIME_EXCEEDED].msg, "Time Exceeded", 14,
+        "Reason message");
+    expectl(pkt_reasons[R4_TIME_EXCEEDED].family, 4, "Reason family v4");
+    expectl(pkt_reasons[R6_TIME_EXCEEDED].family, 6, "Reason family v6");
+}
+
+/* Check that the metrics text contains a complete line */
+static void expect_metric(const char *text, const char *line) {
+    char want[160], msg[160];
+    snprintf(want, sizeof(want), "\n%s\n", line);
+    snprintf(msg, sizeof(msg), "Metric %s", line);
+    expect(strstr(text, want) != NULL, msg);
+}
+
+/* Render the Prometheus text for a small configuration */
+void test_stats_metrics(void) {
+    struct map_static s[2];
+    struct dynamic_pool pool[2];
+    struct dynamic_pool *pools[2] = { &pool[0], &pool[1] };
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *fp;
+
+    memset(&gcfg, 0, sizeof(gcfg));
+    INIT_LIST_HEAD(&gcfg.map4_list);
+    INIT_LIST_HEAD(&gcfg.map6_list);
+    pthread_mutex_init(&gcfg.map_mutex, NULL);
+    pthread_mutex_init(&gcfg.cache_mutex, NULL);
+    gcfg.workers = 2;
+
+    memset(s, 0, sizeof(s));
+    s[0].map4.type = MAP_TYPE_STATIC;
+    s[0].origin = MAP_ORIGIN_CONFFILE;
+    s[1].map4.type = MAP_TYPE_STATIC;
+    s[1].origin = MAP_ORIGIN_MAPFILE;
+    INIT_LIST_HEAD(&s[0].map4.list);
+    INIT_LIST_HEAD(&s[1].map4.list);
+    list_add(&s[0].map4.list, &gcfg.map4_list);
+    list_add(&s[1].map4.list, &gcfg.map4_list);
+
+    /* Pool totals are summed over every pool */
+    memset(pool, 0, sizeof(pool));
+    for(int i = 0; i < 2; i++) {
+        pool[i].map4.type = MAP_TYPE_DYNAMIC_POOL;
+        pthread_mutex_init(&pool[i].mutex, NULL);
+        INIT_LIST_HEAD(&pool[i].map4.list);
+        list_add(&pool[i].map4.list, &gcfg.map4_list);
+    }
+    pool[0].mapped.len = 1;
+    pool[0].free_count = 250;
+    pool[1].dormant.len = 2;
+    pool[1].free_count = 3;
+    gcfg.dyn_pools = pools;
+    gcfg.dyn_pool_count = 2;
+
+    stats_reset();
+    worker_id = 2;
+    STAT_INC(tx_pkts6);
+    STAT_INC(cache_hit);
+    STAT_INC(cache_hit);
+    STAT_INC(cache_hit);
+    STAT_INC(cache_miss);
+    stats_pkt_event(LOG_OPT_DROP, R6_FRAGMENT_MISALIGNED);
+    worker_id = 0;
+
+    fp = open_memstream(&buf, &len);
+    expect(fp != NULL, "open_memstream");
+    if(!fp) return;
+    metrics_write(fp);
+    fclose(fp);
+
+    expect_metric(buf, "# TYPE tayga_tx_pkts6_total counter");
+    expect_metric(buf, "tayga_tx_pkts6_total 1");
+    expect_metric(buf, "tayga_worker_tx_pkts6_total{worker=\"0\"} 0");
+    expect_metric(buf, "tayga_worker_tx_pkts6_total{worker=\"2\"} 1");
+    expect(strstr(buf, "worker=\"3\"") == NULL, "Only configured workers");
+    expect_metric(buf, "tayga_packet_events_total{family=\"ipv6\","
+        "reason=\"R6_FRAGMENT_MISALIGNED\"} 1");
+    expect_metric(buf, "tayga_dropped_total 1");
+    expect_metric(buf, "tayga_cache_hit_ratio 0.75");
+    expect_metric(buf, "tayga_cache_entries 0");
+    expect_metric(buf, "tayga_maps{type=\"STATIC\",origin=\"CONF-FILE\"} 1");
+    expect_metric(buf, "tayga_maps{type=\"STATIC\",origin=\"MAP-FILE\"} 1");
+    expect_metric(buf, "tayga_maps{type=\"DYNAMIC_POOL\",origin=\"UNKNOWN\"} 2");
+    expect_metric(buf, "tayga_dynamic_pool_addresses{state=\"mapped\"} 1");
+    expect_metric(buf, "tayga_dynamic_pool_addresses{state=\"dormant\"} 2");
+    expect_metric(buf, "tayga_dynamic_pool_addresses{state=\"free\"} 253");
+    gcfg.dyn_pool_count = 0;
+    free(buf);
+}
+
+static int connect_socket(const char *path) {
+    struct sockaddr_un sun;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+    if(fd >= 0 && connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/* Serve scrapers from the stats-socket thread while one client stalls */
+void test_stats_socket(void) {
+    struct pollfd pfd;
+    char buf[65536];
+    size_t len = 0;
+    ssize_t ret;
+    int idle, fd;
+
+    memset(&gcfg, 0, sizeof(gcfg));
+    INIT_LIST_HEAD(&gcfg.map4_list);
+    INIT_LIST_HEAD(&gcfg.map6_list);
+    pthread_mutex_init(&gcfg.map_mutex, NULL);
+    pthread_mutex_init(&gcfg.cache_mutex, NULL);
+    snprintf(gcfg.stats_socket, sizeof(gcfg.stats_socket),
+        "/tmp/tayga-unit-%d.sock", (int)getpid());
+
+    expect(metrics_open() >= 0, "metrics_open");
+    expectl(metrics_start(), ERROR_NONE, "metrics_start");
+
+    /* A client which never sends a request */
+    idle = connect_socket(gcfg.stats_socket);
+    expect(idle >= 0, "Idle client connects");
+
+    fd = connect_socket(gcfg.stats_socket);
+    expect(fd >= 0, "Scraper connects");
+    if(fd >= 0) {
+        send(fd, "GET /metrics HTTP/1.0\r\n\r\n", 27, 0);
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        while(len < sizeof(buf) - 1 && poll(&pfd, 1, 5000) > 0 &&
+                (ret = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) > 0)
+            len += ret;
+        buf[len] = 0;
+        close(fd);
+    }
+    expect(!strncmp(buf, "HTTP/1.0 200 OK\r\n", 17), "HTTP response");
+    expect(strstr(buf, "\ntayga_tx_pkts6_total ") != NULL, "Metrics sent");
+
+    if(idle >= 0) close(idle);
+    metrics_close();
+    expect(access(gcfg.stats_socket, F_OK) < 0, "Socket removed");
+}
+
+static volatile int shm_done;
+
+static void *shm_reader(void *arg) {
+    const struct stats_shm *shm = arg;
+    struct stats_counters c;
+    int64_t updated;
+    long torn = 0;
+
+    while(!__atomic_load_n(&shm_done, __ATOMIC_ACQUIRE)) {
+        if(stats_shm_read(shm, &c, &updated) < 0) return (void *)-1L;
+        /* The writer keeps these three in step */
+        if(c.rx_pkts6 != c.tx_pkts4 || c.rx_bytes6 != c.rx_pkts6 * 60)
+            torn++;
+    }
+    return (void *)torn;
+}
+
+/* Publish counters through a real segment and read them back */
+void test_stats_shm(void) {
+    struct stats_counters c;
+    const struct stats_shm *shm;
+    pthread_t reader;
+    void *torn;
+    int64_t updated;
+    int fd;
+
+    memset(&gcfg, 0, sizeof(gcfg));
+    gcfg.workers = 2;
+    snprintf(gcfg.stats_shm, sizeof(gcfg.stats_shm), "/tayga-unit-%d",
+        (int)getpid());
+    stats_reset();
+
+    expectl(stats_shm_open(), 0, "stats_shm_open");
+    fd = shm_open(gcfg.stats_shm, O_RDONLY, 0);
+    expect(fd >= 0, "Segment can be opened read-only");
+    if(fd < 0) return;
+    shm = mmap(NULL, sizeof(*shm) + 3 * sizeof(struct stats_counters),
+        PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    expect(shm != MAP_FAILED, "Segment can be mapped read-only");
+    if(shm == MAP_FAILED) return;
+    expectl(shm->magic, STATS_SHM_MAGIC, "Magic");
+    expectl(shm->version, STATS_SHM_VERSION, "Version");
+    expectl(shm->nworkers, 3, "Main thread and workers");
+    expectl(shm->pid, getpid(), "Owner pid");
+
+    now = 4242;
+    worker_id = 1;
+    STAT_ADD(rx_pkts6, 5);
+    STAT_ADD(rx_bytes6, 300);
+    STAT_ADD(tx_pkts4, 5);
+    worker_id = 0;
+    expectl(stats_shm_read(shm, &c, &updated), 0, "Read before update");
+    expectl(c.rx_pkts6, 0, "Not visible before update");
+    stats_shm_update();
+    expectl(stats_shm_read(shm, &c, &updated), 0, "Read after update");
+    expectl(c.rx_pkts6, 5, "Visible after update");
+    expectl(updated, 4242, "Update time");
+    expectl(shm->worker[1].rx_pkts6, 5, "Per-worker counter");
+    expectl(shm->worker[2].rx_pkts6, 0, "Other worker counter");
+
+    /* A concurrent reader never sees a half-written update */
+    shm_done = 0;
+    pthread_create(&reader, NULL, shm_reader, (void *)shm);
+    worker_id = 1;
+    for(int i = 0; i < 20000; i++) {
+        STAT_INC(rx_pkts6);
+        STAT_ADD(rx_bytes6, 60);
+        STAT_INC(tx_pkts4);
+        stats_shm_update();
+    }
+    worker_id = 0;
+    __atomic_store_n(&shm_done, 1, __ATOMIC_RELEASE);
+    pthread_join(reader, &torn);
+    expectl((long)torn, 0, "Reader never sees a torn update");
+
+    stats_shm_close();
+    munmap((void *)shm, sizeof(*shm) + 3 * sizeof(struct stats_counters));
+    expect(shm_open(gcfg.stats_shm, O_RDONLY, 0) < 0, "Segment removed");
+}
+
+/* A segment left mid-update by a dead daemon must not hang the reader */
+void test_stats_shm_dead(void) {
+    struct stats_shm *shm = calloc(1, sizeof(*shm));
+    struct stats_counters c;
+    struct timespec t0, t1;
+    int64_t updated;
+    long ms;
+
+    shm->magic = STATS_SHM_MAGIC;
+    shm->version = STATS_SHM_VERSION;
+    shm->counter_size = sizeof(struct stats_counters);
+    shm->nreasons = PKT_REASON_MAX;
+    shm->seq = 3;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    expectl(stats_shm_read(shm, &c, &updated), -2, "Stuck segment reported");
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+    expect(ms >= STATS_SHM_READ_TIMEOUT && ms < 5 * STATS_SHM_READ_TIMEOUT,
+        "Reader gives up after the timeout");
+
+    shm->seq = 4;
+    expectl(stats_shm_read(shm, &c, &updated), 0, "Finished update read");
+    free(shm);
+}
+
+int main(void) {
+    print_fail_only = 0;
+
+    /* Test aggregation across workers */
+    test_stats_aggregate();
+
+    /* Test reset */
+    test_stats_reset();
+
+    /* Test layout and reason table */
+    test_stats_layout();
+
+    /* Test the Prometheus text */
+    test_stats_metrics();
+
+    /* Test the stats-socket thread */
+    test_stats_socket();
+
+    /* Test the shared memory segment */
+    test_stats_shm();
+    test_stats_shm_dead();
+
+    /* Return final status */
+    return overall();
+}
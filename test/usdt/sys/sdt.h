@@ -0,0 +1,56 @@
+/*
+ *  sys/sdt.h - stand-in for the systemtap header, for `make usdt-check`
+ *
+ *  part of TAYGA <https://github.com/apalrd/tayga>
+ *  Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/* Probe arguments are evaluated and held to the same size limit as the
+ * real macros, so they are compiled even without systemtap-sdt. Each
+ * probe site also records "name arity" in the .tayga_probes section,
+ * which test/usdt_check.py compares with scripts/bpftrace. */
+
+#ifndef __TAYGA_TEST_SDT_H__
+#define __TAYGA_TEST_SDT_H__
+
+#define _SDT_ARG(x) \
+	do { \
+		_Static_assert(sizeof(x) <= 8, "USDT argument too large"); \
+		__typeof__(x) _sdt_arg __attribute__((unused)) = (x); \
+	} while (0)
+
+#define _SDT_NOTE(provider, name, n) \
+	__asm__ __volatile__(".pushsection .tayga_probes,\"\",%progbits\n" \
+			".asciz \"" #provider " " #name " " #n "\"\n" \
+			".popsection")
+
+#define DTRACE_PROBE1(provider, name, a) \
+	do { \
+		_SDT_ARG(a); \
+		_SDT_NOTE(provider, name, 1); \
+	} while (0)
+#define DTRACE_PROBE2(provider, name, a, b) \
+	do { \
+		_SDT_ARG(a); \
+		_SDT_ARG(b); \
+		_SDT_NOTE(provider, name, 2); \
+	} while (0)
+#define DTRACE_PROBE3(provider, name, a, b, c) \
+	do { \
+		_SDT_ARG(a); \
+		_SDT_ARG(b); \
+		_SDT_ARG(c); \
+		_SDT_NOTE(provider, name, 3); \
+	} while (0)
+
+#endif /* __TAYGA_TEST_SDT_H__ */
@@ -0,0 +1,87 @@
+#
+#   part of TAYGA <https://github.com/apalrd/tayga> test suite
+#   Copyright (C) 2025  Andrew Palardy <andrew@apalrd.net>
+#
+#   test/usdt_check.py
+#   Check that every USDT probe used by a bpftrace script exists in the
+#   binary and passes at least as many arguments as the script reads
+#
+#   Usage: usdt_check.py <tayga binary> <script.bt>...
+#
+#   Probes are read from the .note.stapsdt notes of a build with the real
+#   <sys/sdt.h>, or from the .tayga_probes section of a build with the
+#   stand-in test/usdt/sys/sdt.h (make usdt-check).
+#
+import re
+import subprocess
+import sys
+
+
+def binary_probes(path):
+    """Return {name: arity} for the tayga provider"""
+    probes = {}
+    errors = []
+
+    def add(name, arity):
+        if name in probes and probes[name] != arity:
+            errors.append(f"probe {name} has {probes[name]} and {arity} "
+                          "arguments at different sites")
+        probes[name] = arity
+
+    notes = subprocess.run(["readelf", "-n", path], capture_output=True,
+                           text=True, check=True).stdout
+    provider = name = None
+    for line in notes.splitlines():
+        line = line.strip()
+        if line.startswith("Provider:"):
+            provider = line.split(":", 1)[1].strip()
+        elif line.startswith("Name:"):
+            name = line.split(":", 1)[1].strip()
+        elif line.startswith("Arguments:") and provider == "tayga":
+            add(name, len(line.split(":", 1)[1].split()))
+
+    if not probes:
+        dump = subprocess.run(["readelf", "-p", ".tayga_probes", path],
+                              capture_output=True, text=True).stdout
+        for m in re.finditer(r"\]\s+tayga (\w+) (\d+)$", dump, re.M):
+            add(m.group(1), int(m.group(2)))
+    return probes, errors
+
+
+def script_uses(path):
+    """Return {name: highest argN read} for the probes a script attaches to"""
+    uses = {}
+    text = open(path).read()
+    # A block is one or more probe specs, then a { body }
+    for m in re.finditer(r"((?:usdt:\$1:tayga:\w+\s*,?\s*)+)\{(.*?)\n\}",
+                         text, re.S):
+        args = [int(a) for a in re.findall(r"\barg(\d+)\b", m.group(2))]
+        for name in re.findall(r"usdt:\$1:tayga:(\w+)", m.group(1)):
+            uses[name] = max([uses.get(name, -1)] + args)
+    return uses
+
+
+def main():
+    if len(sys.argv) < 3:
+        print("usage: usdt_check.py <binary> <script.bt>...")
+        return 2
+    probes, errors = binary_probes(sys.argv[1])
+    if not probes:
+        errors.append(f"{sys.argv[1]} has no tayga USDT probes")
+    for script in sys.argv[2:]:
+        for name, top in sorted(script_uses(script).items()):
+            if name not in probes:
+                errors.append(f"{script}: probe {name} does not exist")
+            elif top >= probes[name]:
+                errors.append(f"{script}: probe {name} reads arg{top} but "
+                              f"only has {probes[name]} arguments")
+    for e in errors:
+        print("FAIL: " + e)
+    if errors:
+        return 1
+    print(f"PASS: {len(probes)} probes match {len(sys.argv) - 2} scripts")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
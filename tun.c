@@ -565,6 +565,7 @@ void tun_read(uint8_t * recv_buf,int tun_fd)
 	struct tun_pi *pi = (struct tun_pi *)recv_buf;
 	struct pkt pbuf, *p = &pbuf;
 
+	LAT_BEGIN();
 	ret = read(tun_fd, recv_buf, RECV_BUF_SIZE);
 	if (ret < 0) {
 		if (errno == EAGAIN)
@@ -587,9 +588,15 @@ void tun_read(uint8_t * recv_buf,int tun_fd)
 	p->data_len = ret - sizeof(struct tun_pi);
 	switch (TUN_GET_PROTO(pi)) {
 	case ETH_P_IP:
+		STAT_INC(rx_pkts4);
+		STAT_ADD(rx_bytes4, p->data_len);
+		TRACE2(pkt_recv, 4, p->data_len);
 		handle_ip4(p);
 		break;
 	case ETH_P_IPV6:
+		STAT_INC(rx_pkts6);
+		STAT_ADD(rx_bytes6, p->data_len);
+		TRACE2(pkt_recv, 6, p->data_len);
 		handle_ip6(p);
 		break;
 	default:
@@ -597,4 +604,73 @@ void tun_read(uint8_t * recv_buf,int tun_fd)
 				"tun device\n", ntohs(pi->proto));
 		break;
 	}
-}
\ No newline at end of file
+	LAT_FINISH();
+}
+
+/* Count a packet written to the tun device */
+static void tun_count_tx(const struct iovec *iov, ssize_t len)
+{
+	const struct tun_pi *pi = iov[0].iov_base;
+
+	len -= sizeof(struct tun_pi);
+	if (TUN_GET_PROTO(pi) == ETH_P_IP) {
+		STAT_INC(tx_pkts4);
+		STAT_ADD(tx_bytes4, len);
+	} else {
+		STAT_INC(tx_pkts6);
+		STAT_ADD(tx_bytes6, len);
+	}
+}
+
+/**
+ * @brief Write a single packet to the tun device
+ *
+ * @param iov Packet buffers, starting with the tun_pi header
+ * @param iovcnt Number of buffers in iov
+ * @returns ERROR_NONE on success, ERROR_DROP if the write failed
+ */
+int tun_write(const struct iovec *iov, int iovcnt)
+{
+	ssize_t ret = writev(gcfg.tun_fd, iov, iovcnt);
+
+	if (ret < 0) {
+		slog(LOG_WARNING, "error writing packet to tun device: %s\n",
+				strerror(errno));
+		return ERROR_DROP;
+	}
+	LAT_END();
+	tun_count_tx(iov, ret);
+	return ERROR_NONE;
+}
+
+/**
+ * @brief Write a batch of packets to the tun device
+ *
+ * The tun driver accepts exactly one packet per write, so the batch is
+ * submitted as back-to-back writev() calls with no work in between. The
+ * batch is abandoned at the first failure, since the remaining packets
+ * (typically fragments of the same datagram) are useless on their own.
+ *
+ * @param iov Buffers for all packets, iovcnt consecutive entries each
+ * @param iovcnt Number of buffers per packet
+ * @param count Number of packets
+ * @returns number of packets written
+ */
+int tun_write_batch(const struct iovec *iov, int iovcnt, int count)
+{
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < count; ++i, iov += iovcnt) {
+		ret = writev(gcfg.tun_fd, iov, iovcnt);
+		if (ret < 0) {
+			slog(LOG_WARNING, "error writing packet %d of %d to tun "
+					"device: %s\n", i + 1, count,
+					strerror(errno));
+			break;
+		}
+		tun_count_tx(iov, ret);
+	}
+	LAT_END();
+	return i;
+}